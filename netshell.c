@@ -1,3 +1,7 @@
+#ifndef MORPHOS
+#define _GNU_SOURCE   // copy_file_range()
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,76 +18,1944 @@
 #include <sys/select.h>
 #include <sys/stat.h>
 
-#ifdef MORPHOS
-#include <sys/time.h>
-#include <sys/ioctl.h>
-// Define missing constants for MorphOS
-#ifndef INET_ADDRSTRLEN
-#define INET_ADDRSTRLEN 16
-#endif
-#endif
+#ifdef MORPHOS
+#include <sys/time.h>
+#include <sys/ioctl.h>
+// Define missing constants for MorphOS
+#ifndef INET_ADDRSTRLEN
+#define INET_ADDRSTRLEN 16
+#endif
+#endif
+
+#include <sys/time.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "netshell_common.h"
+#include "netshell_block.h"
+#include "netshell_crc32c.h"
+#include "netshell_stat.h"
+#include "netshell_walk.h"
+#include "netshell_watch.h"
+#include "netshell_filter.h"
+#include "netshell_exec.h"
+#include "netshell_jobs.h"
+#include "netshell_session.h"
+#include "netshell_metrics.h"
+#include "netshell_trace.h"
+#include "netshell_log.h"
+#include "netshell_warm.h"
+#include "netshell_cache.h"
+
+#define DEFAULT_PORT 2324
+#define BACKLOG 10
+#define BUFFER_SIZE 1024
+#define MAX_PATH 512
+#define EXTENDED_PROTOCOL_MAGIC "NETSHELL_EXTENDED_V1\n"
+#define EXTENDED_ACK "EXTENDED_ACK\n"
+#define COPY_CHUNK_SIZE (8 * 1024 * 1024)
+#define PROGRESS_INTERVAL_MS 250
+#define STAT_MANY_MAX 65536
+#define FOLLOW_CHUNK (1024 * 1024)     // Largest DATA frame, so busy logs take turns
+#define FOLLOW_RECHECK_MS 1000         // Safety recheck for filesystems without inotify events
+#define EXEC_COMMAND_MAX 8192
+#define EXEC_SCRIPT_MAX (1024 * 1024)
+#define EXEC_FRAME_SIZE (64 * 1024)
+#define EXEC_WARM 1
+#define EXEC_WARM_RESET 2
+#define BATCH_MAX 1024
+#define BATCH_MAX_PARALLEL 32
+#define JOB_LINE_MAX 256               // Command shown in JOB status lines
+#define JOB_POLL_MS 200                // JOB_OUTPUT follow checks for new output this often
+
+volatile sig_atomic_t server_running = 1;
+
+// Job spool shared by every connection, and the manager running its jobs
+const char *job_dir = JOB_DEFAULT_DIR;
+pid_t job_manager_pid = -1;
+
+// Persistent shell sessions, and whether this connection was handed to one
+const char *session_dir = SESSION_DEFAULT_DIR;
+int connection_handed_off = 0;
+
+// The shell EXEC warm runs commands on, one per connection
+struct warm_shell warm_shell;
+
+// Dead peer detection: TCP keepalive on every connection, an idle limit
+// between extended commands (0: none), and the silence after which a
+// client that announced HEARTBEAT counts as gone (0: not announced)
+int keepalive_idle = KEEPALIVE_IDLE;
+int keepalive_interval = KEEPALIVE_INTERVAL;
+int keepalive_count = KEEPALIVE_COUNT;
+int idle_timeout = 0;
+int heartbeat_timeout = 0;
+
+// Optional metrics file, rewritten every metrics_interval seconds
+const char *metrics_file = NULL;
+int metrics_interval = METRICS_DEFAULT_INTERVAL;
+
+// Phase timings of the connection this process serves
+const char *trace_file = NULL;
+struct trace_conn connection_trace;
+
+// Result cache for EXEC cache=, in megabytes (0: none)
+int cache_megabytes = CACHE_DEFAULT_MB;
+
+// Event log: the flusher draining it, and its file (NULL: text on stdout)
+const char *log_file = NULL;
+pid_t log_flusher_pid = -1;
+
+// Signal handler for graceful shutdown
+void signal_handler(int sig) {
+    server_running = 0;
+    // Reinstall the signal handler (needed for some systems)
+    signal(sig, signal_handler);
+}
+
+// Define socklen_t if not available on MorphOS
+#ifdef MORPHOS
+#ifndef socklen_t
+typedef unsigned int socklen_t;
+#endif
+#endif
+
+// Check if the connection should use extended protocol
+int check_extended_protocol(int socket_fd) {
+    char buffer[BUFFER_SIZE];
+    fd_set read_fds;
+    struct timeval timeout;
+
+    // Set up timeout for 2 seconds to receive the magic string
+    FD_ZERO(&read_fds);
+    FD_SET(socket_fd, &read_fds);
+    timeout.tv_sec = 2;
+    timeout.tv_usec = 0;
+
+    if (select(socket_fd + 1, &read_fds, NULL, NULL, &timeout) > 0) {
+        // Check if data is available
+        if (FD_ISSET(socket_fd, &read_fds)) {
+            // Peek at the data first to see if it matches the magic string
+            ssize_t bytes_read = recv(socket_fd, buffer, strlen(EXTENDED_PROTOCOL_MAGIC), MSG_PEEK);
+            
+            if (bytes_read >= (ssize_t)strlen(EXTENDED_PROTOCOL_MAGIC) - 1) {
+                // Now actually read the data
+                bytes_read = recv(socket_fd, buffer, strlen(EXTENDED_PROTOCOL_MAGIC), 0);
+                
+                if (bytes_read >= (ssize_t)strlen(EXTENDED_PROTOCOL_MAGIC) - 1) {
+                    buffer[bytes_read] = '\0';
+                    
+                    if (strncmp(buffer, EXTENDED_PROTOCOL_MAGIC, strlen(EXTENDED_PROTOCOL_MAGIC) - 1) == 0) {
+                        // Send ACK for extended protocol
+                        send(socket_fd, EXTENDED_ACK, strlen(EXTENDED_ACK), 0);
+                        return 1; // Extended protocol active
+                    }
+                }
+            }
+        }
+    }
+    
+    return 0; // Basic protocol
+}
+
+// GET_FILE_BLOCKS <filename> [block_size]
+// Stream a file as compressed, checksummed blocks built on a worker pool
+void handle_get_file_blocks(int socket_fd, const char* command) {
+    char filename[MAX_PATH];
+    char response[BUFFER_SIZE];
+    long block_size = BLOCK_DEFAULT_SIZE;
+    struct stat file_stat;
+    int fd;
+
+    if (sscanf(command, "%*s %511s %ld", filename, &block_size) < 1) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    if (block_size < BLOCK_MIN_SIZE || block_size > BLOCK_MAX_SIZE) {
+        block_size = BLOCK_DEFAULT_SIZE;
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        if (fd >= 0) close(fd);
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+        return;
+    }
+
+    snprintf(response, sizeof(response), "BLOCKS %ld %ld\n", (long)file_stat.st_size, block_size);
+    if (send_all(socket_fd, response, strlen(response)) >= 0) {
+        block_send_file(socket_fd, fd, file_stat.st_size, block_size, default_worker_threads());
+    }
+    close(fd);
+}
+
+// SEND_FILE_BLOCKS <filename> <size> [block_size]
+// Receive a block stream, decoding and writing blocks in parallel. The blocks
+// go to <filename>.netshell-tmp, renamed over filename once every one has
+// verified, so a failed transfer leaves an existing file as it was.
+void handle_send_file_blocks(int socket_fd, const char* command) {
+    char filename[MAX_PATH];
+    char temp_name[MAX_PATH + 16];
+    struct stat file_stat;
+    long file_size = -1;
+    long block_size = BLOCK_DEFAULT_SIZE;
+    off_t received = 0;
+    int result;
+    int fd;
+
+    if (sscanf(command, "%*s %511s %ld %ld", filename, &file_size, &block_size) < 2 ||
+        file_size < 0 || block_size < BLOCK_MIN_SIZE || block_size > BLOCK_MAX_SIZE) {
+        send(socket_fd, "DENY\n", 5, 0);
+        return;
+    }
+
+    snprintf(temp_name, sizeof(temp_name), "%s.netshell-tmp", filename);
+    fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        send(socket_fd, "DENY\n", 5, 0);
+        return;
+    }
+    // A replaced file keeps its permissions
+    if (stat(filename, &file_stat) == 0) fchmod(fd, file_stat.st_mode & 07777);
+
+    send(socket_fd, "READY\n", 6, 0);
+    result = block_receive_file(socket_fd, fd, block_size, default_worker_threads(), &received);
+    if (close(fd) != 0 && result > 0) result = 0;
+    if (result > 0 && received == file_size && rename(temp_name, filename) == 0) {
+        send(socket_fd, "OK\n", 3, 0);
+        return;
+    }
+    unlink(temp_name);
+    if (result < 0) {
+        log_event(LOG_CRC_MISMATCH, 0, 0, filename);
+        send(socket_fd, "CHECKSUM_MISMATCH\n", 18, 0);
+    } else {
+        send(socket_fd, "ERROR\n", 6, 0);
+    }
+}
+
+// GET_FILE_RANGE <filename> <offset> <length>
+// Send one byte range of a file; parallel clients fetch disjoint ranges over
+// several connections. A zero length only reports the file size.
+void handle_get_file_range(int socket_fd, const char* command) {
+    char filename[MAX_PATH];
+    char response[BUFFER_SIZE];
+    long long offset = 0, length = 0;
+    struct stat file_stat;
+    int fd;
+
+    if (sscanf(command, "%*s %511s %lld %lld", filename, &offset, &length) != 3 ||
+        offset < 0 || length < 0) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        if (fd >= 0) close(fd);
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+        return;
+    }
+
+    // Clip the range to the end of the file
+    if (offset > (long long)file_stat.st_size) offset = file_stat.st_size;
+    if (length > (long long)file_stat.st_size - offset) length = file_stat.st_size - offset;
+
+    snprintf(response, sizeof(response), "RANGE %lld %lld %lld\n",
+             offset, length, (long long)file_stat.st_size);
+    if (send_all(socket_fd, response, strlen(response)) >= 0 && length > 0) {
+        send_file_range(socket_fd, fd, offset, length);
+    }
+    close(fd);
+}
+
+// SEND_FILE_RANGE <filename> <offset> <length> <total_size>
+// Receive one byte range and pwrite() it into <filename>.netshell-tmp. Every
+// range sizes that file to total_size, so ranges may arrive in any order on
+// any connection; SEND_FILE_COMMIT moves it over filename once it verifies.
+void handle_send_file_range(int socket_fd, const char* command) {
+    char filename[MAX_PATH];
+    char temp_name[MAX_PATH + 16];
+    long long offset = 0, length = 0, total_size = 0;
+    struct stat file_stat;
+    int fd;
+
+    if (sscanf(command, "%*s %511s %lld %lld %lld", filename, &offset, &length, &total_size) != 4 ||
+        offset < 0 || length < 0 || total_size < 0 || offset > total_size - length) {
+        send(socket_fd, "DENY\n", 5, 0);
+        return;
+    }
+
+    snprintf(temp_name, sizeof(temp_name), "%s.netshell-tmp", filename);
+    fd = open(temp_name, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0 || fstat(fd, &file_stat) != 0 ||
+        (file_stat.st_size != total_size && ftruncate(fd, total_size) != 0)) {
+        if (fd >= 0) close(fd);
+        send(socket_fd, "DENY\n", 5, 0);
+        return;
+    }
+
+    send(socket_fd, "READY\n", 6, 0);
+    if (recv_file_range(socket_fd, fd, offset, length) == 0) {
+        send(socket_fd, "OK\n", 3, 0);
+    } else {
+        send(socket_fd, "ERROR\n", 6, 0);
+    }
+    close(fd);
+}
+
+// SEND_FILE_COMMIT <filename> <size> <crc32c>
+// End a ranged upload: rename <filename>.netshell-tmp over filename if it has
+// that size and CRC32C. On a mismatch it is kept, so the client can find and
+// resend the bad ranges; SEND_FILE_ABORT <filename> removes it.
+void handle_send_file_commit(int socket_fd, const char* command) {
+    char filename[MAX_PATH];
+    char temp_name[MAX_PATH + 16];
+    struct stat file_stat;
+    long long size = 0;
+    unsigned int expected = 0;
+    uint32_t checksum;
+    int fd;
+
+    if (sscanf(command, "%*s %511s %lld %x", filename, &size, &expected) != 3) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    snprintf(temp_name, sizeof(temp_name), "%s.netshell-tmp", filename);
+    fd = open(temp_name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        if (fd >= 0) close(fd);
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+        return;
+    }
+    if (crc32c_file(fd, 0, -1, &checksum) != 0) {
+        send(socket_fd, "ERROR\n", 6, 0);
+    } else if ((long long)file_stat.st_size != size || checksum != expected) {
+        log_event(LOG_CRC_MISMATCH, 0, 0, filename);
+        send(socket_fd, "CHECKSUM_MISMATCH\n", 18, 0);
+    } else {
+        // A replaced file keeps its permissions
+        struct stat old_stat;
+        if (stat(filename, &old_stat) == 0) fchmod(fd, old_stat.st_mode & 07777);
+        if (rename(temp_name, filename) == 0) {
+            send(socket_fd, "OK\n", 3, 0);
+        } else {
+            send(socket_fd, "ERROR\n", 6, 0);
+        }
+    }
+    close(fd);
+}
+
+// SEND_FILE_ABORT <filename>
+// Drop what a ranged upload staged for filename
+void handle_send_file_abort(int socket_fd, const char* command) {
+    char filename[MAX_PATH];
+    char temp_name[MAX_PATH + 16];
+
+    if (sscanf(command, "%*s %511s", filename) != 1) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    snprintf(temp_name, sizeof(temp_name), "%s.netshell-tmp", filename);
+    if (unlink(temp_name) == 0 || errno == ENOENT) {
+        send(socket_fd, "OK\n", 3, 0);
+    } else {
+        send(socket_fd, "DENY\n", 5, 0);
+    }
+}
+
+// CHECKSUM <filename> [offset length] [staged]
+// CRC32C of a whole file or one range of it, used as the final integrity
+// check of ranged transfers and to find which ranges need resending. With
+// staged it is the file a ranged upload is writing, before SEND_FILE_COMMIT.
+void handle_checksum(int socket_fd, const char* command) {
+    char filename[MAX_PATH + 16];
+    char response[BUFFER_SIZE];
+    char word[16] = "";
+    long long offset = 0, length = -1;
+    struct stat file_stat;
+    uint32_t checksum;
+    int fields;
+    int fd;
+
+    fields = sscanf(command, "%*s %511s %lld %lld %15s", filename, &offset, &length, word);
+    if (fields == 1) sscanf(command, "%*s %*s %15s", word);
+    if (word[0] && strcmp(word, "staged") != 0) fields = 0;
+    if ((fields != 1 && fields != 3 && fields != 4) || offset < 0) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    if (word[0]) strcat(filename, ".netshell-tmp");
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        if (fd >= 0) close(fd);
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+        return;
+    }
+
+    if (crc32c_file(fd, offset, length, &checksum) == 0) {
+        snprintf(response, sizeof(response), "CHECKSUM %lld %08x\n",
+                 (long long)file_stat.st_size, (unsigned int)checksum);
+        send_all(socket_fd, response, strlen(response));
+    } else {
+        send(socket_fd, "ERROR\n", 6, 0);
+    }
+    close(fd);
+}
+
+// Milliseconds elapsed since *since
+long elapsed_ms(const struct timeval *since) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_usec - since->tv_usec) / 1000;
+}
+
+// Copy src_fd into dst_fd on the server without the data crossing the
+// network: a reflink (FICLONE) where the filesystem shares extents, otherwise
+// copy_file_range() in the kernel, and read/write as the last resort.
+// Sends "PROGRESS <done> <total>" lines while it works.
+// Returns the method used, or NULL on failure.
+const char* copy_file_local(int socket_fd, int src_fd, int dst_fd, off_t total) {
+    char response[BUFFER_SIZE];
+    struct timeval last_progress;
+    off_t done = 0;
+    char *buffer;
+#ifdef __linux__
+    int err = 0;
+#endif
+
+#ifdef FICLONE
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        return "reflink";
+    }
+#endif
+
+    gettimeofday(&last_progress, NULL);
+
+#ifdef __linux__
+    while (done < total) {
+        size_t chunk = total - done > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : (size_t)(total - done);
+        ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL, chunk, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            err = n < 0 ? errno : 0;   // 0: src ended early
+            break;
+        }
+        done += n;
+        if (elapsed_ms(&last_progress) >= PROGRESS_INTERVAL_MS) {
+            snprintf(response, sizeof(response), "PROGRESS %lld %lld\n", (long long)done, (long long)total);
+            send_all(socket_fd, response, strlen(response));
+            gettimeofday(&last_progress, NULL);
+        }
+    }
+    if (done == total) {
+        return "copy_file_range";
+    }
+    // Not supported between these filesystems; finish with plain I/O
+    if (done > 0 && err != EXDEV && err != EINVAL && err != ENOSYS && err != EOPNOTSUPP) {
+        return NULL;
+    }
+#endif
+
+    buffer = malloc(COPY_CHUNK_SIZE);
+    if (!buffer) return NULL;
+    while (done < total) {
+        size_t chunk = total - done > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : (size_t)(total - done);
+        if (pread_all(src_fd, buffer, chunk, done) < 0 || pwrite_all(dst_fd, buffer, chunk, done) < 0) {
+            free(buffer);
+            return NULL;
+        }
+        done += chunk;
+        if (elapsed_ms(&last_progress) >= PROGRESS_INTERVAL_MS) {
+            snprintf(response, sizeof(response), "PROGRESS %lld %lld\n", (long long)done, (long long)total);
+            send_all(socket_fd, response, strlen(response));
+            gettimeofday(&last_progress, NULL);
+        }
+    }
+    free(buffer);
+    return "read_write";
+}
+
+// Copy src to dst on the server, replying "OK <bytes> <method>" on success,
+// or DENY when dst is src itself (the same name or a hard link to it).
+// A regular dst is replaced by renaming a finished copy over it, so a failed
+// copy leaves it as it was; it keeps its permissions unless move is set, in
+// which case it takes src's, as a rename would. Anything else dst names (a
+// device, a FIFO) is written in place.
+// Returns 1 if the copy succeeded; the reply has already been sent either way.
+int copy_path_local(int socket_fd, const char* src, const char* dst, int move) {
+    char response[BUFFER_SIZE];
+    char target[PATH_MAX];
+    char temp_name[PATH_MAX + 16];
+    struct stat file_stat, dst_stat;
+    const char *method;
+    int src_fd, dst_fd;
+    int exists, in_place;
+
+    src_fd = open(src, O_RDONLY);
+    if (src_fd < 0 || fstat(src_fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        if (src_fd >= 0) close(src_fd);
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+        return 0;
+    }
+
+    // A copy goes through a symlink to the file it names; a move replaces
+    // the symlink itself, as rename() does
+    exists = (move ? lstat(dst, &dst_stat) : stat(dst, &dst_stat)) == 0;
+    if (move || !exists || !realpath(dst, target)) snprintf(target, sizeof(target), "%s", dst);
+    in_place = exists && !S_ISREG(dst_stat.st_mode) && !S_ISLNK(dst_stat.st_mode);
+    if (exists && dst_stat.st_dev == file_stat.st_dev && dst_stat.st_ino == file_stat.st_ino) {
+        close(src_fd);
+        send(socket_fd, "DENY\n", 5, 0);
+        return 0;
+    }
+
+    snprintf(temp_name, sizeof(temp_name), "%s.netshell-tmp", target);
+    if (in_place) {
+        dst_fd = open(target, O_WRONLY);
+    } else {
+        // O_EXCL: a leftover temp file could be a hard link to anything
+        unlink(temp_name);
+        dst_fd = open(temp_name, O_WRONLY | O_CREAT | O_EXCL,
+                      (exists && !move ? dst_stat.st_mode : file_stat.st_mode) & 07777);
+    }
+    if (dst_fd < 0) {
+        close(src_fd);
+        send(socket_fd, "DENY\n", 5, 0);
+        return 0;
+    }
+
+    method = copy_file_local(socket_fd, src_fd, dst_fd, file_stat.st_size);
+    close(src_fd);
+    if (close(dst_fd) != 0) method = NULL;
+    if (method && !in_place && rename(temp_name, target) != 0) method = NULL;
+
+    if (!method) {
+        if (!in_place) unlink(temp_name);
+        send(socket_fd, "ERROR\n", 6, 0);
+        return 0;
+    }
+    log_event(LOG_COPY, (long long)file_stat.st_size, 0, dst);
+    snprintf(response, sizeof(response), "OK %lld %s\n", (long long)file_stat.st_size, method);
+    send_all(socket_fd, response, strlen(response));
+    return 1;
+}
+
+// Recreate the symlink src as dst, replacing what dst names, for a MOVE
+// across filesystems. Returns 0, or -1.
+int move_symlink(const char* src, const char* dst) {
+    char link_target[PATH_MAX];
+    char temp_name[MAX_PATH + 16];
+    ssize_t n = readlink(src, link_target, sizeof(link_target) - 1);
+
+    if (n < 0) return -1;
+    link_target[n] = '\0';
+    snprintf(temp_name, sizeof(temp_name), "%s.netshell-tmp", dst);
+    unlink(temp_name);
+    if (symlink(link_target, temp_name) != 0) return -1;
+    if (rename(temp_name, dst) != 0) {
+        unlink(temp_name);
+        return -1;
+    }
+    return 0;
+}
+
+// COPY <src> <dst>
+void handle_copy(int socket_fd, const char* command) {
+    char src[MAX_PATH], dst[MAX_PATH];
+
+    if (sscanf(command, "%*s %511s %511s", src, dst) != 2) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    copy_path_local(socket_fd, src, dst, 0);
+}
+
+// MOVE <src> <dst>
+// rename() when both paths are on one filesystem, otherwise copy and unlink.
+// Across filesystems a symlink is recreated rather than followed, and other
+// special files are refused.
+void handle_move(int socket_fd, const char* command) {
+    char src[MAX_PATH], dst[MAX_PATH];
+    char response[BUFFER_SIZE];
+    struct stat file_stat;
+
+    if (sscanf(command, "%*s %511s %511s", src, dst) != 2) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    if (lstat(src, &file_stat) != 0) {
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+        return;
+    }
+
+    if (rename(src, dst) == 0) {
+        snprintf(response, sizeof(response), "OK %lld rename\n", (long long)file_stat.st_size);
+        send_all(socket_fd, response, strlen(response));
+    } else if (errno != EXDEV) {
+        send(socket_fd, "DENY\n", 5, 0);
+    } else if (S_ISLNK(file_stat.st_mode)) {
+        if (move_symlink(src, dst) == 0 && unlink(src) == 0) {
+            snprintf(response, sizeof(response), "OK %lld symlink\n", (long long)file_stat.st_size);
+            send_all(socket_fd, response, strlen(response));
+        } else {
+            send(socket_fd, "DENY\n", 5, 0);
+        }
+    } else if (!S_ISREG(file_stat.st_mode)) {
+        send(socket_fd, "DENY\n", 5, 0);
+    } else if (copy_path_local(socket_fd, src, dst, 1)) {
+        unlink(src);
+    }
+}
+
+// LINK <src> <dst> / SYMLINK <target> <linkpath>
+void handle_link(int socket_fd, const char* command, int symbolic) {
+    char src[MAX_PATH], dst[MAX_PATH];
+    int result;
+
+    if (sscanf(command, "%*s %511s %511s", src, dst) != 2) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    result = symbolic ? symlink(src, dst) : link(src, dst);
+    if (result == 0) {
+        send(socket_fd, "OK\n", 3, 0);
+    } else if (errno == ENOENT) {
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+    } else {
+        send(socket_fd, "DENY\n", 5, 0);
+    }
+}
+
+// Page of binary stat records waiting to be sent as
+// "ENTRIES <count> <bytes>" followed by the records
+struct StatPage {
+    unsigned char *buffer;
+    size_t used;
+    int count;
+    int max_count;
+    long long total;
+};
+
+int stat_page_flush(int socket_fd, struct StatPage *page) {
+    char header[64];
+
+    if (page->count == 0) return 0;
+    snprintf(header, sizeof(header), "ENTRIES %d %lu\n", page->count, (unsigned long)page->used);
+    if (send_all(socket_fd, header, strlen(header)) < 0 ||
+        send_all(socket_fd, page->buffer, page->used) < 0) {
+        return -1;
+    }
+    page->total += page->count;
+    page->used = 0;
+    page->count = 0;
+    return 0;
+}
+
+// Append a record, sending the page first if it is full
+int stat_page_add(int socket_fd, struct StatPage *page, const struct stat_record *record) {
+    if (page->count >= page->max_count ||
+        page->used + STAT_RECORD_HEADER_SIZE + record->name_len > STAT_PAGE_BYTES) {
+        if (stat_page_flush(socket_fd, page) < 0) return -1;
+    }
+    page->used += stat_record_encode(record, page->buffer + page->used);
+    page->count++;
+    return 0;
+}
+
+// Reply for a path that could not be opened
+void send_path_error(int socket_fd, int error) {
+    if (error == ENOENT) {
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+    } else if (error == EACCES || error == EPERM) {
+        send(socket_fd, "DENY\n", 5, 0);
+    } else {
+        send(socket_fd, "ERROR\n", 6, 0);
+    }
+}
+
+// LIST_DIR <path> [page_entries] [NOSTAT]
+// Streams one binary record per directory entry, in directory order, as
+// pages of at most page_entries records, then "END <total>". NOSTAT skips
+// the per-entry stat and reports only names and file types.
+void handle_list_dir(int socket_fd, const char* command) {
+    char path[MAX_PATH], option[16] = "";
+    char response[BUFFER_SIZE];
+    struct StatPage page;
+    struct dir_reader reader;
+    struct stat_record record;
+    const char *name;
+    uint32_t mode;
+    int page_entries = STAT_PAGE_ENTRIES;
+    int result;
+
+    if (sscanf(command, "%*s %511s %d %15s", path, &page_entries, option) < 1) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    if (page_entries <= 0) page_entries = STAT_PAGE_ENTRIES;
+
+    if (dir_reader_open(&reader, path) != 0) {
+        send_path_error(socket_fd, errno);
+        return;
+    }
+
+    memset(&page, 0, sizeof(page));
+    page.max_count = page_entries;
+    page.buffer = malloc(STAT_PAGE_BYTES);
+    if (!page.buffer) {
+        dir_reader_close(&reader);
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    while ((result = dir_reader_next(&reader, &name, &mode)) > 0) {
+        if (strcmp(option, "NOSTAT") == 0) {
+            memset(&record, 0, sizeof(record));
+            record.name = name;
+            record.name_len = strlen(name);
+            record.mode = mode;
+            record.flags = STAT_NOSTAT;
+        } else {
+            stat_record_fill(&record, &reader, name);
+        }
+        if (stat_page_add(socket_fd, &page, &record) < 0) break;
+    }
+
+    if (result == 0 && stat_page_flush(socket_fd, &page) == 0) {
+        snprintf(response, sizeof(response), "END %lld\n", page.total);
+        send_all(socket_fd, response, strlen(response));
+    } else {
+        send(socket_fd, "ERROR\n", 6, 0);
+    }
+    free(page.buffer);
+    dir_reader_close(&reader);
+}
+
+// STAT_MANY <count>, followed by count lines holding one path each
+// Replies with one record per path, in request order, in the same paged
+// format as LIST_DIR. Paths that cannot be stat'ed carry STAT_MISSING.
+// All paths are read before replying so a large batch cannot deadlock
+// against a client that is still sending.
+void handle_stat_many(int socket_fd, const char* command) {
+    char response[BUFFER_SIZE];
+    char line[MAX_PATH];
+    struct StatPage page;
+    struct stat_record record;
+    char **paths;
+    int count = 0, i, received = 0;
+    int ok = 1;
+
+    if (sscanf(command, "%*s %d", &count) != 1 || count < 0 || count > STAT_MANY_MAX) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    // A path too long for a line is an error, but the rest of the batch is
+    // still consumed so the stream stays in sync
+    paths = calloc(count ? count : 1, sizeof(char *));
+    for (i = 0; i < count; i++) {
+        if (recv_line(socket_fd, line, sizeof(line)) < 0) {
+            if (skip_line(socket_fd) < 0) break;
+            ok = 0;
+        } else if (paths && !(paths[i] = strdup(line))) {
+            ok = 0;
+        }
+        received++;
+    }
+
+    memset(&page, 0, sizeof(page));
+    page.max_count = STAT_PAGE_ENTRIES;
+    page.buffer = malloc(STAT_PAGE_BYTES);
+
+    if (received < count || !paths || !page.buffer || !ok) {
+        send(socket_fd, "ERROR\n", 6, 0);
+    } else {
+        for (i = 0; i < count && ok; i++) {
+            stat_record_fill(&record, NULL, paths[i]);
+            if (stat_page_add(socket_fd, &page, &record) < 0) ok = 0;
+        }
+        if (ok && stat_page_flush(socket_fd, &page) == 0) {
+            snprintf(response, sizeof(response), "END %lld\n", page.total);
+            send_all(socket_fd, response, strlen(response));
+        }
+    }
+
+    if (paths) {
+        for (i = 0; i < received; i++) free(paths[i]);
+        free(paths);
+    }
+    free(page.buffer);
+}
+
+struct WalkOutput {
+    int socket_fd;
+    struct StatPage page;
+};
+
+int walk_emit_record(void *ctx, const struct stat_record *record) {
+    struct WalkOutput *output = ctx;
+    return stat_page_add(output->socket_fd, &output->page, record) < 0;
+}
+
+// WALK <root> [name=<glob>] [type=f|d|l] [min_size=N] [max_size=N]
+//      [newer=T] [older=T] [depth=N] [threads=N] [summary]
+// Walks the tree on a work-stealing thread pool, filtering on the server.
+// Streams matching entries as LIST_DIR style pages (names relative to root)
+// ending with "END <matched> <bytes> <dirs> <errors>", or with summary only
+// "SUMMARY <matched> <bytes> <dirs> <errors>".
+void handle_walk(int socket_fd, const char* command) {
+    char buffer[BUFFER_SIZE];
+    char root[MAX_PATH];
+    char glob[MAX_PATH];
+    char response[BUFFER_SIZE];
+    struct walk_filter filter;
+    struct walk_totals totals;
+    struct WalkOutput output;
+    char *token, *saveptr;
+    int threads = walk_default_threads();
+    int summary = 0;
+    int result;
+
+    memset(&filter, 0, sizeof(filter));
+    filter.max_depth = -1;
+
+    snprintf(buffer, sizeof(buffer), "%s", command);
+    strtok_r(buffer, " ", &saveptr);
+    token = strtok_r(NULL, " ", &saveptr);
+    if (!token) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    snprintf(root, sizeof(root), "%s", token);
+
+    while ((token = strtok_r(NULL, " ", &saveptr))) {
+        if (strncmp(token, "name=", 5) == 0) {
+            snprintf(glob, sizeof(glob), "%s", token + 5);
+            filter.name_glob = glob;
+        } else if (strncmp(token, "type=", 5) == 0) {
+            filter.type = strcmp(token + 5, "f") == 0 ? S_IFREG : strcmp(token + 5, "d") == 0 ? S_IFDIR :
+                          strcmp(token + 5, "l") == 0 ? S_IFLNK : 0;
+            if (!filter.type) {
+                send(socket_fd, "ERROR\n", 6, 0);
+                return;
+            }
+        } else if (strncmp(token, "min_size=", 9) == 0) {
+            filter.min_size = strtoull(token + 9, NULL, 10);
+        } else if (strncmp(token, "max_size=", 9) == 0) {
+            filter.max_size = strtoull(token + 9, NULL, 10);
+        } else if (strncmp(token, "newer=", 6) == 0) {
+            filter.newer = strtoll(token + 6, NULL, 10);
+        } else if (strncmp(token, "older=", 6) == 0) {
+            filter.older = strtoll(token + 6, NULL, 10);
+        } else if (strncmp(token, "depth=", 6) == 0) {
+            filter.max_depth = atoi(token + 6);
+        } else if (strncmp(token, "threads=", 8) == 0) {
+            threads = atoi(token + 8);
+        } else if (strcmp(token, "summary") == 0) {
+            summary = 1;
+        } else {
+            send(socket_fd, "ERROR\n", 6, 0);
+            return;
+        }
+    }
+
+    memset(&output, 0, sizeof(output));
+    output.socket_fd = socket_fd;
+    output.page.max_count = STAT_PAGE_ENTRIES;
+    if (!summary && !(output.page.buffer = malloc(STAT_PAGE_BYTES))) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    result = walk_tree(root, &filter, threads, summary ? NULL : walk_emit_record, &output, &totals);
+    if (result < 0 && totals.dirs == 0) {
+        send_path_error(socket_fd, errno);
+    } else if (summary) {
+        snprintf(response, sizeof(response), "SUMMARY %llu %llu %llu %llu\n",
+                 (unsigned long long)totals.matched, (unsigned long long)totals.bytes,
+                 (unsigned long long)totals.dirs, (unsigned long long)totals.errors);
+        send_all(socket_fd, response, strlen(response));
+    } else if (result == 0 && stat_page_flush(socket_fd, &output.page) == 0) {
+        snprintf(response, sizeof(response), "END %llu %llu %llu %llu\n",
+                 (unsigned long long)totals.matched, (unsigned long long)totals.bytes,
+                 (unsigned long long)totals.dirs, (unsigned long long)totals.errors);
+        send_all(socket_fd, response, strlen(response));
+    } else {
+        send(socket_fd, "ERROR\n", 6, 0);
+    }
+    free(output.page.buffer);
+}
+
+struct WatchOutput {
+    int socket_fd;
+    long events;
+    int failed;
+};
+
+void watch_send_event(void *ctx, int index, unsigned int event, const char *name) {
+    struct WatchOutput *output = ctx;
+    char line[BUFFER_SIZE];
+
+    snprintf(line, sizeof(line), "EVENT %s %d %s\n", watch_event_name(event), index, name);
+    if (send_all(output->socket_fd, line, strlen(line)) < 0) output->failed = 1;
+    output->events++;
+}
+
+// WATCH <path> [path...]
+// Replies "WATCHING <count> <inotify|poll>", then pushes
+// "EVENT <type> <index> <name>" lines as the paths change until the client
+// sends "UNWATCH", which is answered with "END <events>".
+void handle_watch(int socket_fd, const char* command) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    struct watch_set *set;
+    struct WatchOutput output;
+    char *token, *saveptr;
+    int error;
+
+    set = malloc(sizeof(*set));
+    if (!set) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    watch_init(set);
+
+    snprintf(buffer, sizeof(buffer), "%s", command);
+    strtok_r(buffer, " ", &saveptr);
+    while ((token = strtok_r(NULL, " ", &saveptr))) {
+        if (watch_add(set, token) < 0) {
+            error = errno;
+            watch_close(set);
+            free(set);
+            send_path_error(socket_fd, error);
+            return;
+        }
+    }
+    if (set->count == 0) {
+        watch_close(set);
+        free(set);
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    snprintf(response, sizeof(response), "WATCHING %d %s\n", set->count,
+             watch_fd(set) >= 0 ? "inotify" : "poll");
+    send_all(socket_fd, response, strlen(response));
+
+    memset(&output, 0, sizeof(output));
+    output.socket_fd = socket_fd;
+
+    while (!output.failed && server_running) {
+        fd_set read_fds;
+        struct timeval timeout;
+        int timeout_ms = watch_timeout_ms(set);
+        int max_fd = socket_fd;
+        int ready;
+
+        FD_ZERO(&read_fds);
+        FD_SET(socket_fd, &read_fds);
+        if (watch_fd(set) >= 0) {
+            FD_SET(watch_fd(set), &read_fds);
+            if (watch_fd(set) > max_fd) max_fd = watch_fd(set);
+        }
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+        ready = select(max_fd + 1, &read_fds, NULL, NULL, timeout_ms >= 0 ? &timeout : NULL);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (ready == 0 || (watch_fd(set) >= 0 && FD_ISSET(watch_fd(set), &read_fds))) {
+            if (watch_process(set, watch_send_event, &output) < 0) break;
+        }
+
+        if (FD_ISSET(socket_fd, &read_fds)) {
+            if (recv_line(socket_fd, buffer, sizeof(buffer)) < 0) break;
+            if (strcmp(buffer, "UNWATCH") == 0) {
+                snprintf(response, sizeof(response), "END %ld\n", output.events);
+                send_all(socket_fd, response, strlen(response));
+                break;
+            }
+            send(socket_fd, "ERROR\n", 6, 0);
+        }
+    }
+
+    watch_close(set);
+    free(set);
+}
+
+// One file followed by FOLLOW_FILE
+struct Follower {
+    char path[MAX_PATH];
+    int fd;
+    off_t offset;
+    struct stat opened;    // Identity of the file behind fd
+};
+
+void follow_note_event(void *ctx, int index, unsigned int event, const char *name) {
+    (void)ctx;
+    (void)index;
+    (void)event;
+    (void)name;
+}
+
+// Send what has been appended to one followed file since the last call, at
+// most FOLLOW_CHUNK bytes, and reopen the path once the old file is drained
+// and a new one has taken its place.
+// Returns 1 if more data is ready, 0 if caught up, -1 if the stream broke.
+int follow_pump(int socket_fd, struct Follower *follower, int index) {
+    char header[BUFFER_SIZE];
+    struct stat current, latest;
+    off_t length;
+
+    if (fstat(follower->fd, &current) != 0) return -1;
+
+    if (current.st_size < follower->offset) {
+        // Truncated in place (copytruncate style rotation)
+        follower->offset = 0;
+        snprintf(header, sizeof(header), "TRUNCATED %d\n", index);
+        if (send_all(socket_fd, header, strlen(header)) < 0) return -1;
+    }
+
+    if (current.st_size > follower->offset) {
+        length = current.st_size - follower->offset;
+        if (length > FOLLOW_CHUNK) length = FOLLOW_CHUNK;
+        snprintf(header, sizeof(header), "DATA %d %lld %lld\n", index,
+                 (long long)follower->offset, (long long)length);
+        if (send_all(socket_fd, header, strlen(header)) < 0 ||
+            send_file_range(socket_fd, follower->fd, follower->offset, length) < 0) {
+            return -1;
+        }
+        follower->offset += length;
+        return current.st_size > follower->offset;
+    }
+
+    // Caught up: has the path been rotated to a new file?
+    if (stat(follower->path, &latest) == 0 &&
+        (latest.st_ino != follower->opened.st_ino || latest.st_dev != follower->opened.st_dev)) {
+        int fd = open(follower->path, O_RDONLY);
+        if (fd < 0) return 0;
+        close(follower->fd);
+        follower->fd = fd;
+        follower->offset = 0;
+        fstat(fd, &follower->opened);
+        snprintf(header, sizeof(header), "ROTATED %d\n", index);
+        if (send_all(socket_fd, header, strlen(header)) < 0) return -1;
+        return 1;
+    }
+    return 0;
+}
+
+// FOLLOW_FILE <offset> <path> [<offset> <path>...]
+// Streams bytes appended to each file as "DATA <index> <offset> <length>"
+// frames sent with sendfile(). An offset may be absolute, negative (bytes
+// back from the end) or "end". The parent directories are watched so
+// appends wake the server at once and rotated files are picked up.
+// Runs until the client sends "UNFOLLOW", answered with "END".
+void handle_follow_file(int socket_fd, const char* command) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    struct Follower *followers;
+    struct watch_set *set;
+    char *offset_token, *path_token, *saveptr;
+    int count = 0, i, j, pending = 0, broken = 0;
+    int error = 0;
+
+    followers = calloc(WATCH_MAX_PATHS, sizeof(*followers));
+    set = malloc(sizeof(*set));
+    if (!followers || !set) {
+        free(followers);
+        free(set);
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    watch_init(set);
+
+    snprintf(buffer, sizeof(buffer), "%s", command);
+    strtok_r(buffer, " ", &saveptr);
+    while ((offset_token = strtok_r(NULL, " ", &saveptr)) && (path_token = strtok_r(NULL, " ", &saveptr))) {
+        struct Follower *follower = &followers[count];
+        char directory[MAX_PATH];
+        char *slash;
+        int watched = 0;
+
+        if (count >= WATCH_MAX_PATHS) {
+            error = ENOSPC;
+            break;
+        }
+        snprintf(follower->path, sizeof(follower->path), "%s", path_token);
+        follower->fd = open(follower->path, O_RDONLY);
+        if (follower->fd < 0 || fstat(follower->fd, &follower->opened) != 0) {
+            error = errno;
+            if (follower->fd >= 0) close(follower->fd);
+            break;
+        }
+        count++;
+
+        if (strcmp(offset_token, "end") == 0) {
+            follower->offset = follower->opened.st_size;
+        } else {
+            follower->offset = strtoll(offset_token, NULL, 10);
+            if (follower->offset < 0) follower->offset += follower->opened.st_size;
+            if (follower->offset < 0) follower->offset = 0;
+        }
+
+        // Watch the directory rather than the file, which also sees the
+        // replacement file appear after a rotation
+        snprintf(directory, sizeof(directory), "%s", follower->path);
+        slash = strrchr(directory, '/');
+        if (slash == directory) {
+            directory[1] = '\0';
+        } else if (slash) {
+            *slash = '\0';
+        } else {
+            strcpy(directory, ".");
+        }
+        for (j = 0; j < set->count; j++) {
+            if (strcmp(set->entries[j].path, directory) == 0) watched = 1;
+        }
+        if (!watched) watch_add(set, directory);
+    }
+
+    if (error || count == 0) {
+        for (i = 0; i < count; i++) close(followers[i].fd);
+        watch_close(set);
+        free(set);
+        free(followers);
+        if (error) {
+            send_path_error(socket_fd, error);
+        } else {
+            send(socket_fd, "ERROR\n", 6, 0);
+        }
+        return;
+    }
+
+    snprintf(response, sizeof(response), "FOLLOWING %d %s\n", count,
+             watch_fd(set) >= 0 ? "inotify" : "poll");
+    send_all(socket_fd, response, strlen(response));
+
+    while (server_running) {
+        fd_set read_fds;
+        struct timeval timeout;
+        int timeout_ms = watch_timeout_ms(set);
+        int max_fd = socket_fd;
+        int ready;
+
+        // Round robin so one busy log cannot starve the others
+        pending = 0;
+        for (i = 0; i < count && !broken; i++) {
+            int result = follow_pump(socket_fd, &followers[i], i);
+            if (result < 0) broken = 1;
+            if (result > 0) pending = 1;
+        }
+        if (broken) break;
+
+        if (timeout_ms < 0) timeout_ms = FOLLOW_RECHECK_MS;
+        if (pending) timeout_ms = 0;
+
+        FD_ZERO(&read_fds);
+        FD_SET(socket_fd, &read_fds);
+        if (watch_fd(set) >= 0) {
+            FD_SET(watch_fd(set), &read_fds);
+            if (watch_fd(set) > max_fd) max_fd = watch_fd(set);
+        }
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+        ready = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (ready == 0) continue;
+
+        if (watch_fd(set) >= 0 && FD_ISSET(watch_fd(set), &read_fds)) {
+            // The events only wake us; every file is checked on the next pass
+            watch_process(set, follow_note_event, NULL);
+        }
+
+        if (FD_ISSET(socket_fd, &read_fds)) {
+            if (recv_line(socket_fd, buffer, sizeof(buffer)) < 0) break;
+            if (strcmp(buffer, "UNFOLLOW") == 0) {
+                send(socket_fd, "END\n", 4, 0);
+                break;
+            }
+            send(socket_fd, "ERROR\n", 6, 0);
+        }
+    }
+
+    // A half-sent DATA frame leaves the stream out of sync; drop the connection
+    if (broken) shutdown(socket_fd, SHUT_RDWR);
+
+    for (i = 0; i < count; i++) close(followers[i].fd);
+    watch_close(set);
+    free(set);
+    free(followers);
+}
+
+// Filtered command output waiting to go out as an "OUTPUT <n>" frame
+struct ExecOutput {
+    int socket_fd;
+    int tag;             // Batch index, or -1 for a single EXEC
+    char *buffer;
+    size_t used;
+    long long sent;
+};
+
+int exec_flush(struct ExecOutput *output) {
+    char header[64];
+
+    if (output->used == 0) return 0;
+    if (output->tag >= 0) {
+        snprintf(header, sizeof(header), "OUTPUT %d %lu\n", output->tag, (unsigned long)output->used);
+    } else {
+        snprintf(header, sizeof(header), "OUTPUT %lu\n", (unsigned long)output->used);
+    }
+    if (send_all(output->socket_fd, header, strlen(header)) < 0 ||
+        send_all(output->socket_fd, output->buffer, output->used) < 0) {
+        return -1;
+    }
+    output->sent += output->used;
+    output->used = 0;
+    return 0;
+}
+
+int exec_emit(void *ctx, const char *data, size_t len) {
+    struct ExecOutput *output = ctx;
+
+    while (len > 0) {
+        size_t take = EXEC_FRAME_SIZE - output->used;
+        if (take > len) take = len;
+        memcpy(output->buffer + output->used, data, take);
+        output->used += take;
+        data += take;
+        len -= take;
+        if (output->used == EXEC_FRAME_SIZE && exec_flush(output) < 0) return -1;
+    }
+    return 0;
+}
+
+// Parse EXEC options into a filter, the length of a script= body, whether
+// to use the warm shell (EXEC_WARM, or EXEC_WARM_RESET for a fresh one) and
+// which one (warm_name, WARM_NAME_MAX + 1 bytes, "" for the connection's),
+// and the cache request; with warm or cache NULL those options are accepted
+// and ignored. Returns 0, or -1 on a bad option.
+int parse_exec_options(const char* command, struct output_filter *filter, long *script_len, int *warm,
+                       char* warm_name, struct cache_request *cache) {
+    char buffer[BUFFER_SIZE];
+    char *token, *saveptr;
+
+    snprintf(buffer, sizeof(buffer), "%s", command);
+    strtok_r(buffer, " ", &saveptr);
+    while ((token = strtok_r(NULL, " ", &saveptr))) {
+        if (strncmp(token, "grep=", 5) == 0 || strncmp(token, "regex=", 6) == 0) {
+            int regex = token[0] == 'r';
+            filter->match = regex ? FILTER_MATCH_REGEX : FILTER_MATCH_FIXED;
+            filter->pattern_len = percent_decode(token + (regex ? 6 : 5), filter->pattern, sizeof(filter->pattern));
+            if (filter->pattern_len == 0 || memchr(filter->pattern, '\n', filter->pattern_len)) return -1;
+        } else if (strcmp(token, "invert") == 0) {
+            filter->invert = 1;
+        } else if (strcmp(token, "warm") == 0) {
+            if (warm && *warm == 0) *warm = EXEC_WARM;
+        } else if (strncmp(token, "warm=", 5) == 0) {
+            if (!warm_name_valid(token + 5)) return -1;
+            if (warm) {
+                if (*warm == 0) *warm = EXEC_WARM;
+                snprintf(warm_name, WARM_NAME_MAX + 1, "%s", token + 5);
+            }
+        } else if (strcmp(token, "reset") == 0) {
+            if (warm) *warm = EXEC_WARM_RESET;
+        } else if (strncmp(token, "cache=", 6) == 0) {
+            int ttl = atoi(token + 6);
+            if (ttl <= 0 || ttl > CACHE_TTL_MAX) return -1;
+            if (cache) cache->ttl = ttl;
+        } else if (strncmp(token, "dep=", 4) == 0) {
+            if (cache) {
+                if (cache->dep_count == CACHE_DEPS_MAX) return -1;
+                if (percent_decode(token + 4, cache->deps[cache->dep_count], CACHE_PATH_MAX) == 0) return -1;
+                cache->dep_count++;
+            }
+        } else if (strncmp(token, "script=", 7) == 0) {
+            *script_len = atol(token + 7);
+            if (*script_len <= 0 || *script_len > EXEC_SCRIPT_MAX) return -1;
+        } else if (strncmp(token, "head=", 5) == 0) {
+            filter->head = atoll(token + 5);
+        } else if (strncmp(token, "tail=", 5) == 0) {
+            filter->tail = atoll(token + 5);
+        } else if (strncmp(token, "bytes=", 6) == 0) {
+            char *dash;
+            filter->byte_start = strtoll(token + 6, &dash, 10);
+            filter->byte_end = (*dash == '-' && dash[1]) ? strtoll(dash + 1, NULL, 10) : -1;
+            if (*dash != '-' || filter->byte_start < 0) return -1;
+        } else {
+            return -1;
+        }
+    }
+    if (cache && cache->dep_count > 0 && cache->ttl == 0) return -1;
+    return 0;
+}
+
+// EXEC [grep=<text>|regex=<re>] [invert] [head=N] [tail=N] [bytes=A-B] [script=N]
+// [warm|warm=<name>] [reset] [cache=<ttl> [dep=<path>]...]
+// followed by one line holding the command, or with script= by N raw bytes
+// of a multi-line shell script
+// Runs the command through the shell with stdout and stderr captured, filters
+// the output on the server and sends what is left as "OUTPUT <n>" frames,
+// ending with "EXIT <code> <ms> <output_bytes> <sent_bytes>". Once head or
+// the byte range is satisfied the command is stopped, like a pipe into head.
+// With warm it runs on the connection's warm shell instead (see
+// netshell_warm.h), and with warm=<name> on that named shell, which
+// outlives the connection; reset replaces the shell with a fresh one first,
+// and stopping such a command ends the warm shell.
+// With cache the result comes from the server's result cache when it holds
+// one that is current (see netshell_cache.h), and the EXIT line ends with
+// "cached"; otherwise the command runs without the warm shell, and a
+// complete run is stored for the next query.
+void handle_exec(int socket_fd, const char* command) {
+    char *line;
+    char response[BUFFER_SIZE];
+    struct output_filter filter;
+    struct ExecOutput output;
+    struct timeval started;
+    char *chunk = NULL;
+    int output_fd = -1;
+    int status = 0, stopped = 0, ok = 1;
+    int code = -1;       // Warm shell: the command's exit code, when it got to report one
+    long long produced = 0;
+    long script_len = 0;
+    int bad_options;
+    int warm = 0;
+    char warm_name[WARM_NAME_MAX + 1] = "";   // Empty: the connection's warm shell
+    struct warm_link link;
+    struct cache_request cache;
+    char *cached = NULL;        // Output from the cache on a hit
+    size_t cached_len = 0;
+    char *capture = NULL;       // The raw output of a run, for the cache
+    size_t capture_size = EXEC_FRAME_SIZE, capture_max = 0;
+    pid_t pid = -1;
+
+    output_filter_init(&filter);
+    cache_request_init(&cache);
+    bad_options = parse_exec_options(command, &filter, &script_len, &warm, warm_name, &cache) < 0;
+
+    // Always consume the command so the stream stays in sync
+    line = malloc(script_len > 0 ? script_len + 1 : EXEC_COMMAND_MAX);
+    if (!line) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    if (script_len > 0) {
+        if (recv_all(socket_fd, line, script_len) <= 0) ok = 0;
+        line[script_len] = '\0';
+    } else if (recv_line(socket_fd, line, EXEC_COMMAND_MAX) <= 0) {
+        ok = 0;
+    }
+    if (bad_options || !ok) {
+        free(line);
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    memset(&output, 0, sizeof(output));
+    output.socket_fd = socket_fd;
+    output.tag = -1;
+    output.buffer = malloc(EXEC_FRAME_SIZE);
+    chunk = malloc(EXEC_FRAME_SIZE);
+    gettimeofday(&started, NULL);
+    if (cache.ttl > 0) {
+        // What a connection's shell was left with must not end up in a shared result
+        warm = 0;
+        cached = cache_lookup(&cache, line, &cached_len, &code);
+        capture_max = cache_max_output();
+        if (!cached && capture_max > 0) capture = malloc(capture_size);
+    }
+    if (warm == EXEC_WARM_RESET && !warm_name[0]) warm_stop(&warm_shell);
+    if (!output.buffer || !chunk || output_filter_start(&filter, exec_emit, &output) < 0 ||
+        (!cached && (warm && warm_name[0] ? warm_remote_run(&link, session_dir, warm_name, warm == EXEC_WARM_RESET, line)
+                     : warm ? warm_run(&warm_shell, socket_fd, line)
+                     : (pid = spawn_shell_command(socket_fd, line, &output_fd))) < 0)) {
+        output_filter_free(&filter);
+        free(output.buffer);
+        free(chunk);
+        free(line);
+        free(cached);
+        free(capture);
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    if (cached) {
+        int result = output_filter_feed(&filter, cached, cached_len);
+        produced = cached_len;
+        if (result < 0 || exec_flush(&output) < 0) ok = 0;
+        if (result > 0) stopped = 1;
+    }
+    while (!cached) {
+        ssize_t n;
+        int result;
+        if (warm && warm_name[0]) {
+            n = warm_remote_read(&link, chunk, EXEC_FRAME_SIZE, &code, &status);
+        } else if (warm) {
+            n = warm_read(&warm_shell, chunk, EXEC_FRAME_SIZE, &code, &status);
+        } else {
+            n = read(output_fd, chunk, EXEC_FRAME_SIZE);
+            if (n < 0 && errno == EINTR) continue;
+        }
+        if (n <= 0) break;
+        if (capture) {
+            // Kept while it could still fit in the cache
+            if (produced + n > (long long)capture_max) {
+                free(capture);
+                capture = NULL;
+            } else {
+                if (produced + n > (long long)capture_size) {
+                    char *grown = realloc(capture, capture_size * 2);
+                    if (!grown) free(capture);
+                    capture = grown;
+                    capture_size *= 2;
+                }
+                if (capture) memcpy(capture + produced, chunk, n);
+            }
+        }
+        produced += n;
+        result = output_filter_feed(&filter, chunk, n);
+        if (result < 0 || exec_flush(&output) < 0) {
+            ok = 0;
+            break;
+        }
+        if (result > 0) {
+            stopped = 1;
+            break;
+        }
+    }
+    if (cached) {
+        // Nothing was started
+    } else if (warm) {
+        if (warm_name[0]) {
+            warm_remote_close(&link, !ok || stopped);
+        } else if (!ok || stopped) {
+            warm_stop(&warm_shell);
+        }
+        metrics_add(METRIC_WARM_RUNS, 1);
+    } else {
+        if (!ok || stopped) stop_command(pid, SIGTERM);
+        close(output_fd);
+        waitpid(pid, &status, 0);
+        // Only a run that finished on its own has the whole output
+        if (capture && !stopped && WIFEXITED(status)) {
+            cache_store(&cache, line, capture, produced, WEXITSTATUS(status));
+        }
+    }
+
+    if (ok && (output_filter_finish(&filter) < 0 || exec_flush(&output) < 0)) ok = 0;
+
+    if (ok) {
+        snprintf(response, sizeof(response), "EXIT %d %ld %lld %lld%s\n",
+                 code >= 0 ? code : command_exit_code(status, stopped), elapsed_ms(&started),
+                 produced, output.sent, cached ? " cached" : "");
+        send_all(socket_fd, response, strlen(response));
+    }
+
+    output_filter_free(&filter);
+    free(output.buffer);
+    free(chunk);
+    free(line);
+    free(cached);
+    free(capture);
+}
+
+// One command of a BATCH
+struct BatchJob {
+    char *command;
+    pid_t pid;
+    int fd;              // Output pipe while running, -1 otherwise
+    int stopped;
+    long long produced;
+    struct timeval started;
+    struct output_filter filter;
+    struct ExecOutput output;
+};
+
+// Reap a job whose output has ended and report "EXIT <tag> ...".
+// Returns the exit code, or -1 if the connection failed.
+int batch_finish_job(int socket_fd, struct BatchJob *job, int tag, int ok) {
+    char response[BUFFER_SIZE];
+    int status = 0, code;
+
+    if (job->stopped) stop_command(job->pid, SIGTERM);
+    close(job->fd);
+    job->fd = -1;
+    waitpid(job->pid, &status, 0);
+    code = command_exit_code(status, job->stopped);
+
+    if (ok && (output_filter_finish(&job->filter) < 0 || exec_flush(&job->output) < 0)) ok = 0;
+    if (ok) {
+        snprintf(response, sizeof(response), "EXIT %d %d %ld %lld %lld\n", tag, code,
+                 elapsed_ms(&job->started), job->produced, job->output.sent);
+        if (send_all(socket_fd, response, strlen(response)) < 0) ok = 0;
+    }
+    output_filter_free(&job->filter);
+    free(job->output.buffer);
+    job->output.buffer = NULL;
+    return ok ? code : -1;
+}
+
+// BATCH <count> [parallel=N] [EXEC filter options], followed by count lines
+// holding one command each
+// Runs the commands with at most N (default 1) at a time. Output frames and
+// exit reports carry the command's index: "OUTPUT <tag> <n>" and
+// "EXIT <tag> <code> <ms> <output_bytes> <sent_bytes>". The batch ends with
+// "BATCH_END <count> <failed> <ms>", counting non-zero exit codes.
+void handle_batch(int socket_fd, const char* command) {
+    char options[BUFFER_SIZE];
+    char line[EXEC_COMMAND_MAX];
+    char response[BUFFER_SIZE];
+    char buffer[BUFFER_SIZE];
+    struct output_filter template;
+    struct BatchJob *jobs;
+    struct timeval started;
+    char *chunk;
+    char *token, *saveptr;
+    int count = 0, parallel = 1, received = 0;
+    int next = 0, active = 0, finished = 0, failures = 0;
+    int bad = 0, ok = 1, i;
+    long script_len = 0;
+    size_t used;
+
+    // Split off parallel=; the rest are EXEC options shared by every command
+    snprintf(buffer, sizeof(buffer), "%s", command);
+    used = snprintf(options, sizeof(options), "EXEC");
+    strtok_r(buffer, " ", &saveptr);
+    token = strtok_r(NULL, " ", &saveptr);
+    if (token) count = atoi(token);
+    while ((token = strtok_r(NULL, " ", &saveptr))) {
+        if (strncmp(token, "parallel=", 9) == 0) {
+            parallel = atoi(token + 9);
+        } else if (used < sizeof(options)) {
+            used += snprintf(options + used, sizeof(options) - used, " %s", token);
+        }
+    }
+    if (count <= 0 || count > BATCH_MAX) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    if (parallel < 1) parallel = 1;
+    if (parallel > BATCH_MAX_PARALLEL) parallel = BATCH_MAX_PARALLEL;
+    output_filter_init(&template);
+    if (parse_exec_options(options, &template, &script_len, NULL, NULL, NULL) < 0 || script_len > 0) bad = 1;
+
+    // Read every command before starting, as with STAT_MANY
+    jobs = calloc(count, sizeof(*jobs));
+    chunk = malloc(EXEC_FRAME_SIZE);
+    for (i = 0; i < count; i++) {
+        if (recv_line(socket_fd, line, sizeof(line)) < 0) break;
+        received++;
+        if (jobs && !(jobs[i].command = strdup(line))) bad = 1;
+    }
+    if (bad || !jobs || !chunk || received < count) {
+        if (jobs) {
+            for (i = 0; i < received; i++) free(jobs[i].command);
+        }
+        free(jobs);
+        free(chunk);
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
 
-#include <sys/time.h>
+    gettimeofday(&started, NULL);
+    while (finished < count && ok) {
+        fd_set read_fds;
+        int max_fd = -1;
 
-#define DEFAULT_PORT 2324
-#define BACKLOG 10
-#define BUFFER_SIZE 1024
-#define MAX_PATH 512
-#define EXTENDED_PROTOCOL_MAGIC "NETSHELL_EXTENDED_V1\n"
-#define EXTENDED_ACK "EXTENDED_ACK\n"
+        // Keep up to parallel commands running
+        while (active < parallel && next < count) {
+            struct BatchJob *job = &jobs[next];
+            job->filter = template;
+            job->output.socket_fd = socket_fd;
+            job->output.tag = next;
+            job->output.buffer = malloc(EXEC_FRAME_SIZE);
+            job->fd = -1;
+            gettimeofday(&job->started, NULL);
+            if (!job->output.buffer || output_filter_start(&job->filter, exec_emit, &job->output) < 0 ||
+                (job->pid = spawn_shell_command(socket_fd, job->command, &job->fd)) < 0) {
+                output_filter_free(&job->filter);
+                free(job->output.buffer);
+                job->output.buffer = NULL;
+                snprintf(response, sizeof(response), "EXIT %d 127 0 0 0\n", next);
+                if (send_all(socket_fd, response, strlen(response)) < 0) ok = 0;
+                failures++;
+                finished++;
+            } else {
+                active++;
+            }
+            next++;
+        }
 
-volatile sig_atomic_t server_running = 1;
+        FD_ZERO(&read_fds);
+        for (i = 0; i < next; i++) {
+            if (jobs[i].fd >= 0) {
+                FD_SET(jobs[i].fd, &read_fds);
+                if (jobs[i].fd > max_fd) max_fd = jobs[i].fd;
+            }
+        }
+        if (max_fd < 0) continue;
+        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR) continue;
+            ok = 0;
+            break;
+        }
 
-// Signal handler for graceful shutdown
-void signal_handler(int sig) {
-    server_running = 0;
-    // Reinstall the signal handler (needed for some systems)
-    signal(sig, signal_handler);
+        for (i = 0; i < next && ok; i++) {
+            struct BatchJob *job = &jobs[i];
+            ssize_t n;
+            int result = 0;
+
+            if (job->fd < 0 || !FD_ISSET(job->fd, &read_fds)) continue;
+            n = read(job->fd, chunk, EXEC_FRAME_SIZE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n > 0) {
+                job->produced += n;
+                result = output_filter_feed(&job->filter, chunk, n);
+                if (result < 0 || exec_flush(&job->output) < 0) {
+                    ok = 0;
+                    break;
+                }
+                if (result > 0) job->stopped = 1;
+            }
+            if (n <= 0 || job->stopped) {
+                int code = batch_finish_job(socket_fd, job, i, ok);
+                if (code < 0) ok = 0;
+                if (code != 0) failures++;
+                active--;
+                finished++;
+            }
+        }
+    }
+
+    // On a broken connection stop whatever is still running
+    for (i = 0; i < next; i++) {
+        if (jobs[i].fd >= 0) {
+            jobs[i].stopped = 1;
+            batch_finish_job(socket_fd, &jobs[i], i, 0);
+        }
+    }
+    if (ok) {
+        snprintf(response, sizeof(response), "BATCH_END %d %d %ld\n", count, failures, elapsed_ms(&started));
+        send_all(socket_fd, response, strlen(response));
+    }
+
+    for (i = 0; i < count; i++) free(jobs[i].command);
+    free(jobs);
+    free(chunk);
 }
 
-// Define socklen_t if not available on MorphOS
-#ifdef MORPHOS
-#ifndef socklen_t
-typedef unsigned int socklen_t;
-#endif
-#endif
+// Send the status line of a job: "JOB <id> <state> <exit_code> <output_bytes>
+// <submitted> <started> <finished> <command>" with the command's first line
+int send_job_status(int socket_fd, long id) {
+    struct job_info info;
+    char line[JOB_LINE_MAX];
+    char response[BUFFER_SIZE];
 
-// Check if the connection should use extended protocol
-int check_extended_protocol(int socket_fd) {
-    char buffer[BUFFER_SIZE];
-    fd_set read_fds;
-    struct timeval timeout;
+    if (job_read_info(job_dir, id, &info) != 0) return -1;
+    job_read_command(job_dir, id, line, sizeof(line));
+    snprintf(response, sizeof(response), "JOB %ld %s %d %lld %lld %lld %lld %s\n", id,
+             job_state_name(info.state), info.state == JOB_DONE ? info.exit_code : -1,
+             info.output_bytes, info.submitted, info.started, info.finished, line);
+    return send_all(socket_fd, response, strlen(response)) < 0 ? -1 : 0;
+}
 
-    // Set up timeout for 2 seconds to receive the magic string
-    FD_ZERO(&read_fds);
-    FD_SET(socket_fd, &read_fds);
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
+// JOB_SUBMIT [script=N], followed by one line holding the command, or with
+// script= by N raw bytes of a multi-line shell script
+// Queues the command and replies "SUBMITTED <id>"; it runs detached from
+// this connection as soon as the job manager has a free slot.
+void handle_job_submit(int socket_fd, const char* command) {
+    char response[BUFFER_SIZE];
+    long script_len = 0;
+    char *line;
+    long id;
+    int ok = 1;
 
-    if (select(socket_fd + 1, &read_fds, NULL, NULL, &timeout) > 0) {
-        // Check if data is available
-        if (FD_ISSET(socket_fd, &read_fds)) {
-            // Peek at the data first to see if it matches the magic string
-            ssize_t bytes_read = recv(socket_fd, buffer, strlen(EXTENDED_PROTOCOL_MAGIC), MSG_PEEK);
-            
-            if (bytes_read >= (ssize_t)strlen(EXTENDED_PROTOCOL_MAGIC) - 1) {
-                // Now actually read the data
-                bytes_read = recv(socket_fd, buffer, strlen(EXTENDED_PROTOCOL_MAGIC), 0);
-                
-                if (bytes_read >= (ssize_t)strlen(EXTENDED_PROTOCOL_MAGIC) - 1) {
-                    buffer[bytes_read] = '\0';
-                    
-                    if (strncmp(buffer, EXTENDED_PROTOCOL_MAGIC, strlen(EXTENDED_PROTOCOL_MAGIC) - 1) == 0) {
-                        // Send ACK for extended protocol
-                        send(socket_fd, EXTENDED_ACK, strlen(EXTENDED_ACK), 0);
-                        return 1; // Extended protocol active
-                    }
+    if (sscanf(command, "JOB_SUBMIT script=%ld", &script_len) == 1 &&
+        (script_len <= 0 || script_len > EXEC_SCRIPT_MAX)) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    // Always consume the command so the stream stays in sync
+    line = malloc(script_len > 0 ? script_len + 1 : EXEC_COMMAND_MAX);
+    if (!line) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    if (script_len > 0) {
+        if (recv_all(socket_fd, line, script_len) <= 0) ok = 0;
+        line[script_len] = '\0';
+    } else if (recv_line(socket_fd, line, EXEC_COMMAND_MAX) <= 0) {
+        ok = 0;
+    }
+
+    if (!ok || job_manager_pid < 0 || (id = job_submit(job_dir, job_manager_pid, line)) < 0) {
+        send(socket_fd, "ERROR\n", 6, 0);
+    } else {
+        snprintf(response, sizeof(response), "SUBMITTED %ld\n", id);
+        send(socket_fd, response, strlen(response), 0);
+        metrics_add(METRIC_JOBS_SUBMITTED, 1);
+    }
+    free(line);
+}
+
+// JOB_STATUS [id]
+// One JOB line for the given job, or without an id one per job in the
+// spool followed by "END <count>"
+void handle_job_status(int socket_fd, const char* command) {
+    char response[BUFFER_SIZE];
+    long ids[JOB_LIST_MAX];
+    long id;
+    int count, sent = 0, i;
+
+    if (sscanf(command, "JOB_STATUS %ld", &id) == 1) {
+        if (send_job_status(socket_fd, id) < 0) send(socket_fd, "NOT_FOUND\n", 10, 0);
+        return;
+    }
+    count = job_list(job_dir, ids, JOB_LIST_MAX);
+    for (i = 0; i < count; i++) {
+        if (send_job_status(socket_fd, ids[i]) == 0) sent++;
+    }
+    snprintf(response, sizeof(response), "END %d\n", sent);
+    send(socket_fd, response, strlen(response), 0);
+}
+
+// JOB_OUTPUT <id> <offset> [follow]
+// Sends the job's output from offset as "DATA <offset> <n>" frames of raw
+// bytes; a DATA offset past the one asked for means the ring no longer held
+// the bytes in between. Without follow it stops at the output produced so
+// far, with follow it waits for more until the job finishes or the client
+// sends STOP. Ends with "END <next_offset> <state> <exit_code>", and the
+// next offset can be used to resume after a reconnect.
+void handle_job_output(int socket_fd, const char* command) {
+    char response[BUFFER_SIZE];
+    char mode[16] = "";
+    struct job_info info;
+    long long offset;
+    char *chunk;
+    long id;
+    int follow;
+
+    if (sscanf(command, "JOB_OUTPUT %ld %lld %15s", &id, &offset, mode) < 2 || offset < 0) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    follow = strcmp(mode, "follow") == 0;
+    if (job_read_info(job_dir, id, &info) != 0) {
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+        return;
+    }
+    chunk = malloc(EXEC_FRAME_SIZE);
+    if (!chunk) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+
+    for (;;) {
+        // Read the state first: output that arrives after it is sent on the next turn
+        int finished = job_read_info(job_dir, id, &info) != 0 || job_finished(info.state);
+        ssize_t len = job_read_output(job_dir, id, &offset, chunk, EXEC_FRAME_SIZE);
+
+        if (len > 0) {
+            snprintf(response, sizeof(response), "DATA %lld %ld\n", offset, (long)len);
+            if (send_all(socket_fd, response, strlen(response)) < 0 ||
+                send_all(socket_fd, chunk, len) < 0) {
+                free(chunk);
+                return;
+            }
+            offset += len;
+            continue;
+        }
+        if (len < 0 || finished || !follow) break;
+
+        {
+            fd_set read_fds;
+            struct timeval timeout;
+            char line[BUFFER_SIZE];
+
+            FD_ZERO(&read_fds);
+            FD_SET(socket_fd, &read_fds);
+            timeout.tv_sec = 0;
+            timeout.tv_usec = JOB_POLL_MS * 1000;
+            if (select(socket_fd + 1, &read_fds, NULL, NULL, &timeout) > 0) {
+                if (recv_line(socket_fd, line, sizeof(line)) < 0) {
+                    free(chunk);
+                    return;
                 }
+                if (strcmp(line, "STOP") == 0) break;
             }
         }
     }
-    
-    return 0; // Basic protocol
+    free(chunk);
+
+    snprintf(response, sizeof(response), "END %lld %s %d\n", offset, job_state_name(info.state),
+             info.state == JOB_DONE ? info.exit_code : -1);
+    send(socket_fd, response, strlen(response), 0);
+}
+
+// JOB_CANCEL <id>
+// Replies OK once the manager has been asked to stop the job (a queued job
+// never starts), FINISHED if it already ended, or NOT_FOUND.
+void handle_job_cancel(int socket_fd, const char* command) {
+    long id;
+    int result;
+
+    if (sscanf(command, "JOB_CANCEL %ld", &id) != 1) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    result = job_cancel(job_dir, job_manager_pid, id);
+    if (result == 0) {
+        send(socket_fd, "OK\n", 3, 0);
+    } else if (result == 1) {
+        send(socket_fd, "FINISHED\n", 9, 0);
+    } else {
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+    }
+}
+
+// SESSION_NEW
+// Starts a persistent shell and attaches this connection to it, replying
+// "ATTACHED <id> 0 0". The connection then belongs to the session (see
+// netshell_session.h for the attached stream).
+void handle_session_new(int socket_fd, const char* command) {
+    long id;
+
+    (void)command;
+    id = session_create(session_dir);
+    if (id < 0 || session_attach(session_dir, id, socket_fd, 0, heartbeat_timeout) != 0) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    metrics_add(METRIC_SESSIONS_CREATED, 1);
+    metrics_add(METRIC_SESSION_ATTACHES, 1);
+    connection_handed_off = 1;
+}
+
+// SESSION_ATTACH <id> [offset]
+// Reattaches to a session, first replaying its output from offset (the
+// number of bytes the client has already seen) out of the scrollback ring.
+// The holder replies "ATTACHED <id> <oldest_kept> <produced>"; an earlier
+// connection still attached to it gets "DETACHED".
+void handle_session_attach(int socket_fd, const char* command) {
+    long long offset = 0;
+    long id;
+
+    if (sscanf(command, "SESSION_ATTACH %ld %lld", &id, &offset) < 1 || offset < 0) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    if (session_attach(session_dir, id, socket_fd, offset, heartbeat_timeout) != 0) {
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+        return;
+    }
+    metrics_add(METRIC_SESSION_ATTACHES, 1);
+    connection_handed_off = 1;
+}
+
+// SESSION_LIST
+// One "SESSION <id> <pid> <attached> <running> <exit_code> <output_bytes>
+// <created>" line per live session, then "END <count>"
+void handle_session_list(int socket_fd, const char* command) {
+    char response[BUFFER_SIZE];
+    long ids[SESSION_LIST_MAX];
+    struct session_info info;
+    int count, sent = 0, i;
+
+    (void)command;
+    count = session_list(session_dir, ids, SESSION_LIST_MAX);
+    for (i = 0; i < count; i++) {
+        if (session_read_info(session_dir, ids[i], &info) != 0) continue;
+        snprintf(response, sizeof(response), "SESSION %ld %ld %d %d %d %lld %lld\n", info.id, (long)info.pid,
+                 info.attached, info.running, info.running ? -1 : info.exit_code, info.output_bytes,
+                 info.created);
+        if (send_all(socket_fd, response, strlen(response)) < 0) return;
+        sent++;
+    }
+    snprintf(response, sizeof(response), "END %d\n", sent);
+    send(socket_fd, response, strlen(response), 0);
+}
+
+// SESSION_KILL <id>
+// Hangs up the session's shell; replies OK or NOT_FOUND
+void handle_session_kill(int socket_fd, const char* command) {
+    long id;
+
+    if (sscanf(command, "SESSION_KILL %ld", &id) != 1) {
+        send(socket_fd, "ERROR\n", 6, 0);
+    } else if (session_kill(session_dir, id) != 0) {
+        send(socket_fd, "NOT_FOUND\n", 10, 0);
+    } else {
+        send(socket_fd, "OK\n", 3, 0);
+    }
+}
+
+// Persistent shell sessions alive, for the metrics
+int live_session_count(void) {
+    long ids[SESSION_LIST_MAX];
+    return session_list(session_dir, ids, SESSION_LIST_MAX);
+}
+
+// STATS
+// Server metrics in the Prometheus text format: "STATS <bytes>" and the text
+void handle_stats(int socket_fd, const char* command) {
+    char header[64];
+    char *text = malloc(METRICS_TEXT_MAX);
+    size_t len;
+
+    (void)command;
+    if (!text) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    len = metrics_format(text, METRICS_TEXT_MAX, live_session_count());
+    snprintf(header, sizeof(header), "STATS %lu\n", (unsigned long)len);
+    if (send_all(socket_fd, header, strlen(header)) >= 0) send_all(socket_fd, text, len);
+    free(text);
+}
+
+// TRACE_REPORT
+// Latency percentiles of each connection phase over the last TRACE_RING
+// connections: "PHASE <phase> <mode> <count> <p50_us> <p90_us> <p99_us>
+// <max_us>" lines, then "END <connections>"
+void handle_trace_report(int socket_fd, const char* command) {
+    char *text = malloc(METRICS_TEXT_MAX);
+
+    (void)command;
+    if (!text) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    send_all(socket_fd, text, trace_report(text, METRICS_TEXT_MAX));
+    free(text);
+}
+
+// HEARTBEAT <seconds>
+// The client promises to send something (a command or PING) at least that
+// often; after HEARTBEAT_MISSES intervals of silence the connection is
+// closed and its process exits. Replies OK.
+void handle_heartbeat(int socket_fd, const char* command) {
+    int interval;
+
+    if (sscanf(command, "HEARTBEAT %d", &interval) != 1 || interval < 0 || interval > 3600) {
+        send(socket_fd, "ERROR\n", 6, 0);
+        return;
+    }
+    heartbeat_timeout = interval * HEARTBEAT_MISSES;
+    send(socket_fd, "OK\n", 3, 0);
 }
 
 // Handle file transfer commands
@@ -96,41 +1968,52 @@ int handle_extended_commands(int socket_fd, const char* command) {
     if (sscanf(command, "%s", cmd) == 1) {
         if (strcmp(cmd, "SEND_FILE") == 0) {
             char size_str[32];
-            if (sscanf(command, "%s %s %s", cmd, filename, size_str) == 3) {
+            unsigned int expected_crc = 0;
+            int fields = sscanf(command, "%s %511s %31s %x", cmd, filename, size_str, &expected_crc);
+            if (fields >= 3) {
                 long file_size = atol(size_str);
                 if (file_size > 0) {
                     // Send ready message
                     send(socket_fd, "READY\n", 6, 0);
                     
-                    // Read the file data
-                    FILE *file = fopen(filename, "wb");
-                    if (file) {
-                        char *file_buffer = malloc(file_size);
-                        if (file_buffer) {
-                            ssize_t bytes_read = 0;
-                            ssize_t total_read = 0;
-                            
-                            while (total_read < file_size) {
-                                bytes_read = recv(socket_fd, 
-                                    file_buffer + total_read, 
-                                    file_size - total_read, 0);
-                                if (bytes_read <= 0) break;
-                                total_read += bytes_read;
-                            }
-                            
-                            if (fwrite(file_buffer, 1, file_size, file) == (size_t)file_size) {
+                    // Receive and verify the data before opening the file, so a
+                    // failed transfer leaves an existing file untouched
+                    char *file_buffer = malloc(file_size);
+                    if (file_buffer) {
+                        ssize_t bytes_read = 0;
+                        ssize_t total_read = 0;
+                        FILE *file;
+                        
+                        while (total_read < file_size) {
+                            bytes_read = recv(socket_fd, 
+                                file_buffer + total_read, 
+                                file_size - total_read, 0);
+                            if (bytes_read <= 0) break;
+                            total_read += bytes_read;
+                        }
+                        
+                        // A short read is a failed transfer, and an optional
+                        // CRC32C lets the client retransmit on corruption
+                        if (total_read < file_size) {
+                            send(socket_fd, "ERROR\n", 6, 0);
+                        } else if (fields == 4 && crc32c(0, file_buffer, file_size) != expected_crc) {
+                            log_event(LOG_CRC_MISMATCH, 0, 0, filename);
+                            send(socket_fd, "CHECKSUM_MISMATCH\n", 18, 0);
+                        } else if (!(file = fopen(filename, "wb"))) {
+                            send(socket_fd, "DENY\n", 5, 0);
+                        } else {
+                            int written = fwrite(file_buffer, 1, file_size, file) == (size_t)file_size;
+                            if (fclose(file) != 0) written = 0;
+                            if (written) {
                                 send(socket_fd, "OK\n", 3, 0);
                             } else {
                                 send(socket_fd, "ERROR\n", 6, 0);
                             }
-                            
-                            free(file_buffer);
-                        } else {
-                            send(socket_fd, "ERROR\n", 6, 0);
                         }
-                        fclose(file);
+                        
+                        free(file_buffer);
                     } else {
-                        send(socket_fd, "DENY\n", 5, 0);
+                        send(socket_fd, "ERROR\n", 6, 0);
                     }
                 } else {
                     send(socket_fd, "DENY\n", 5, 0);
@@ -140,28 +2023,24 @@ int handle_extended_commands(int socket_fd, const char* command) {
             }
             return 1;
         } else if (strcmp(cmd, "GET_FILE") == 0) {
-            if (sscanf(command, "%s %s", cmd, filename) == 2) {
+            if (sscanf(command, "%s %511s", cmd, filename) == 2) {
                 struct stat file_stat;
                 if (stat(filename, &file_stat) == 0) {
-                    // Send file size
-                    snprintf(response, sizeof(response), "SIZE %ld\n", (long)file_stat.st_size);
-                    send(socket_fd, response, strlen(response), 0);
-                    
-                    // Open and send the file
+                    // Open and read the file, so the header can carry its CRC32C
                     FILE *file = fopen(filename, "rb");
-                    if (file) {
-                        char *file_buffer = malloc(file_stat.st_size);
-                        if (file_buffer && fread(file_buffer, 1, file_stat.st_size, file) == (size_t)file_stat.st_size) {
-                            send(socket_fd, file_buffer, file_stat.st_size, 0);
-                        } else {
-                            // Send error if unable to read
-                            send(socket_fd, "ERROR\n", 6, 0);
-                        }
-                        if (file_buffer) free(file_buffer);
-                        fclose(file);
+                    char *file_buffer = file ? malloc(file_stat.st_size + 1) : NULL;
+                    if (file_buffer && fread(file_buffer, 1, file_stat.st_size, file) == (size_t)file_stat.st_size) {
+                        snprintf(response, sizeof(response), "SIZE %ld CRC32C %08x\n",
+                                 (long)file_stat.st_size,
+                                 (unsigned int)crc32c(0, file_buffer, file_stat.st_size));
+                        send_all(socket_fd, response, strlen(response));
+                        send_all(socket_fd, file_buffer, file_stat.st_size);
                     } else {
+                        // Send error if unable to read
                         send(socket_fd, "ERROR\n", 6, 0);
                     }
+                    if (file_buffer) free(file_buffer);
+                    if (file) fclose(file);
                 } else {
                     send(socket_fd, "NOT_FOUND\n", 10, 0);
                 }
@@ -169,6 +2048,93 @@ int handle_extended_commands(int socket_fd, const char* command) {
                 send(socket_fd, "ERROR\n", 6, 0);
             }
             return 1;
+        } else if (strcmp(cmd, "GET_FILE_BLOCKS") == 0) {
+            handle_get_file_blocks(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "SEND_FILE_BLOCKS") == 0) {
+            handle_send_file_blocks(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "GET_FILE_RANGE") == 0) {
+            handle_get_file_range(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "SEND_FILE_RANGE") == 0) {
+            handle_send_file_range(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "SEND_FILE_COMMIT") == 0) {
+            handle_send_file_commit(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "SEND_FILE_ABORT") == 0) {
+            handle_send_file_abort(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "CHECKSUM") == 0) {
+            handle_checksum(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "COPY") == 0) {
+            handle_copy(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "MOVE") == 0) {
+            handle_move(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "LINK") == 0 || strcmp(cmd, "SYMLINK") == 0) {
+            handle_link(socket_fd, command, strcmp(cmd, "SYMLINK") == 0);
+            return 1;
+        } else if (strcmp(cmd, "LIST_DIR") == 0) {
+            handle_list_dir(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "STAT_MANY") == 0) {
+            handle_stat_many(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "WALK") == 0) {
+            handle_walk(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "WATCH") == 0) {
+            handle_watch(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "FOLLOW_FILE") == 0) {
+            handle_follow_file(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "EXEC") == 0) {
+            handle_exec(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "BATCH") == 0) {
+            handle_batch(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "JOB_SUBMIT") == 0) {
+            handle_job_submit(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "JOB_STATUS") == 0) {
+            handle_job_status(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "JOB_OUTPUT") == 0) {
+            handle_job_output(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "JOB_CANCEL") == 0) {
+            handle_job_cancel(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "SESSION_NEW") == 0) {
+            handle_session_new(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "SESSION_ATTACH") == 0) {
+            handle_session_attach(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "SESSION_LIST") == 0) {
+            handle_session_list(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "SESSION_KILL") == 0) {
+            handle_session_kill(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "STATS") == 0) {
+            handle_stats(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "TRACE_REPORT") == 0) {
+            handle_trace_report(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "HEARTBEAT") == 0) {
+            handle_heartbeat(socket_fd, command);
+            return 1;
+        } else if (strcmp(cmd, "PING") == 0) {
+            send(socket_fd, "PONG\n", 5, 0);
+            return 1;
         }
     }
     return 0; // Not a recognized extended command
@@ -176,68 +2142,127 @@ int handle_extended_commands(int socket_fd, const char* command) {
 
 // Function to handle each client connection in basic mode
 void handle_basic_client(int client_fd) {
+    char* argv[] = { SHELL_NAME, NULL };
+    struct spawn_setup setup;
     pid_t pid;
     int status;
+    int exec_pipe[2];
+    long long sent_before = 0, received;
+    char c;
     
-    // Fork to create shell process (use vfork on MorphOS)
-#ifdef MORPHOS
-    pid = vfork();
-#else
-    pid = fork();
-#endif
+    // A close-on-exec pipe reads EOF the moment the shell has been exec()ed
+    if (pipe(exec_pipe) != 0) {
+        exec_pipe[0] = exec_pipe[1] = -1;
+    } else {
+        fcntl(exec_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
+    metrics_socket_bytes(client_fd, &sent_before, &received);
+
+    // Start the shell on the client socket
+    spawn_setup_init(&setup);
+    setup.fds[0] = setup.fds[1] = setup.fds[2] = client_fd;
+    setup.close_fds[0] = client_fd;
+    setup.close_fds[1] = exec_pipe[0];
+    pid = spawn_process(SHELL_PATH, argv, &setup);
     
-    if (pid == 0) {
-        // Child process - set up shell
-        // Redirect stdin, stdout, stderr to client socket
-        dup2(client_fd, STDIN_FILENO);
-        dup2(client_fd, STDOUT_FILENO);
-        dup2(client_fd, STDERR_FILENO);
-        
-        // Close the original client socket since we've duplicated it
-        close(client_fd);
-        
-#ifdef MORPHOS
-        // On MorphOS, use ksh from the development environment
-        execl("Work:/Development/gg/bin/ksh", "ksh", NULL);
-#else
-        // On other systems, use standard sh
-        execl("/bin/sh", "sh", NULL);
-#endif
-        
-        // If execl returns, it failed
-        perror("execl");
-        _exit(1);  // Use _exit instead of exit in child after vfork
-    } else if (pid > 0) {
+    if (pid > 0) {
         // Parent process - monitor the shell process
+        if (exec_pipe[1] >= 0) {
+            close(exec_pipe[1]);
+            while (read(exec_pipe[0], &c, 1) < 0 && errno == EINTR) {
+            }
+            close(exec_pipe[0]);
+            trace_mark(&connection_trace, TRACE_SPAWN);
+        }
+        trace_wait_first_byte(&connection_trace, client_fd, sent_before, pid);
+        trace_end(&connection_trace);
         close(client_fd);  // Close client socket in parent
         
         // Wait for shell process to finish
         waitpid(pid, &status, 0);
     } else {
-        // Fork failed
-        perror("fork");
+        // Spawn failed
+        perror("spawn");
+        if (exec_pipe[0] >= 0) {
+            close(exec_pipe[0]);
+            close(exec_pipe[1]);
+        }
+        trace_end(&connection_trace);
         close(client_fd);
     }
-    
-    close(client_fd);
+}
+
+// Wait up to timeout seconds for the client to send something (0: forever).
+// Returns 1 when there is data or the peer closed, 0 on timeout.
+int wait_for_command(int socket_fd, int timeout) {
+    fd_set read_fds;
+    struct timeval tv;
+    int ready;
+
+    if (timeout <= 0) return 1;
+    do {
+        FD_ZERO(&read_fds);
+        FD_SET(socket_fd, &read_fds);
+        tv.tv_sec = timeout;
+        tv.tv_usec = 0;
+        ready = select(socket_fd + 1, &read_fds, NULL, NULL, &tv);
+    } while (ready < 0 && errno == EINTR);
+    return ready != 0;
+}
+
+// File transfer commands, which also feed the transfer metrics
+int is_transfer_command(const char* command) {
+    return strncmp(command, "SEND_FILE", 9) == 0 || strncmp(command, "GET_FILE", 8) == 0;
+}
+
+// Run one extended command, timing it and counting transfer bytes.
+// Returns what handle_extended_commands() does.
+int handle_timed_command(int socket_fd, const char* command) {
+    long long started = metrics_now_us();
+    long long sent_before = 0, received_before = 0, sent, received;
+    int transfer = is_transfer_command(command);
+    int known;
+
+    if (transfer && metrics_socket_bytes(socket_fd, &sent_before, &received_before) != 0) transfer = -1;
+    known = handle_extended_commands(socket_fd, command);
+
+    metrics_add(METRIC_COMMANDS, 1);
+    if (!known) metrics_add(METRIC_COMMANDS_UNKNOWN, 1);
+    metrics_observe_since(METRIC_COMMAND_TIME, started);
+    if (transfer) metrics_observe_since(METRIC_TRANSFER_TIME, started);
+    if (transfer > 0 && metrics_socket_bytes(socket_fd, &sent, &received) == 0) {
+        metrics_add(METRIC_DOWNLOAD_BYTES, sent - sent_before);
+        metrics_add(METRIC_UPLOAD_BYTES, received - received_before);
+    }
+    return known;
 }
 
 // Function to handle each client connection in extended mode
 void handle_extended_client(int client_fd) {
     char buffer[BUFFER_SIZE];
     ssize_t bytes_read;
-    
-    printf("Handling client in extended mode\n");
-    
-    // Main loop for extended protocol
+    long long sent, received;
+
+    set_nodelay(client_fd);
+    warm_init(&warm_shell);
+
+    // Main loop for extended protocol, one command per line
     while (1) {
-        bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_read <= 0) break;
-        
-        buffer[bytes_read] = '\0';
+        int timeout = idle_timeout;
+        if (heartbeat_timeout > 0 && (timeout <= 0 || heartbeat_timeout < timeout)) timeout = heartbeat_timeout;
+        if (!wait_for_command(client_fd, timeout)) {
+            log_event(LOG_IDLE_CLOSE, timeout, 0, NULL);
+            metrics_add(METRIC_CONNECTIONS_REAPED, 1);
+            break;
+        }
+
+        bytes_read = recv_line(client_fd, buffer, sizeof(buffer));
+        if (bytes_read < 0) break;
+        if (bytes_read == 0) continue;
         
         // Check if it's an extended command first
-        if (handle_extended_commands(client_fd, buffer)) {
+        if (handle_timed_command(client_fd, buffer)) {
+            if (connection_handed_off) break;   // A session holder owns the socket now
             continue;
         }
         
@@ -245,6 +2270,14 @@ void handle_extended_client(int client_fd) {
         // but the command isn't recognized
         send(client_fd, "UNKNOWN_COMMAND\n", 16, 0);
     }
+
+    warm_stop(&warm_shell);
+
+    // Traffic of a connection handed to a session is counted up to the hand-off
+    if (metrics_socket_bytes(client_fd, &sent, &received) == 0) {
+        metrics_add(METRIC_BYTES_SENT, sent);
+        metrics_add(METRIC_BYTES_RECEIVED, received);
+    }
     
     close(client_fd);
 }
@@ -255,27 +2288,87 @@ int main(int argc, char *argv[]) {
     socklen_t client_len;
     int port;
     int opt;
+    int job_limit = 0;
+    int i;
     pid_t pid;
-#ifdef MORPHOS
-    char client_ip[INET_ADDRSTRLEN];
-#endif
+    long long accepted_at, fork_started;
+    time_t metrics_written = 0;
     
     client_len = sizeof(client_addr);
     port = DEFAULT_PORT;
     
-    // Parse command line arguments for port
-    if (argc > 1) {
-        port = atoi(argv[1]);
-        if (port <= 0 || port > 65535) {
-            fprintf(stderr, "Invalid port number. Using default port %d\n", DEFAULT_PORT);
-            port = DEFAULT_PORT;
+    // Parse command line arguments: [-j max_jobs] [--job-dir dir] [--session-dir dir]
+    // [--keepalive idle[,interval[,count]]] [--idle-timeout seconds]
+    // [--metrics-file path] [--metrics-interval seconds] [--trace-file path]
+    // [--log-file path] [--spawn fork|vfork|posix_spawn|clone] [--cache-size MB] [port]
+    for (i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc) {
+            job_limit = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--job-dir") == 0 && i + 1 < argc) {
+            job_dir = argv[++i];
+        } else if (strcmp(argv[i], "--session-dir") == 0 && i + 1 < argc) {
+            session_dir = argv[++i];
+        } else if (strcmp(argv[i], "--keepalive") == 0 && i + 1 < argc) {
+            // Fields left out keep their defaults; "0" turns keepalive off
+            sscanf(argv[++i], "%d,%d,%d", &keepalive_idle, &keepalive_interval, &keepalive_count);
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            idle_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--log-file") == 0 && i + 1 < argc) {
+            log_file = argv[++i];
+        } else if (strcmp(argv[i], "--spawn") == 0 && i + 1 < argc) {
+            int strategy = spawn_strategy_parse(argv[++i]);
+            if (strategy < 0) {
+                fprintf(stderr, "Unknown spawn strategy %s. Using %s\n", argv[i], spawn_strategy_name(spawn_strategy));
+            } else {
+                spawn_strategy = strategy;
+            }
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache_megabytes = atoi(argv[++i]);
+            if (cache_megabytes < 0) cache_megabytes = 0;
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            metrics_interval = atoi(argv[++i]);
+            if (metrics_interval <= 0) metrics_interval = METRICS_DEFAULT_INTERVAL;
+        } else {
+            port = atoi(argv[i]);
+            if (port <= 0 || port > 65535) {
+                fprintf(stderr, "Invalid port number. Using default port %d\n", DEFAULT_PORT);
+                port = DEFAULT_PORT;
+            }
         }
     }
+    if (job_limit <= 0) job_limit = default_worker_threads();
     
     // Set up signal handler for graceful shutdown
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
+    // Metrics live in shared memory, so they must be mapped before anything forks
+    if (metrics_init() != 0) {
+        fprintf(stderr, "Metrics shared memory unavailable; STATS covers this process only\n");
+    }
+    if (trace_init(trace_file) != 0) {
+        fprintf(stderr, "Connection tracing limited: %s\n", trace_file ? strerror(errno) : "no shared memory");
+    }
+    if (cache_megabytes > 0 && cache_init(cache_megabytes) != 0) {
+        fprintf(stderr, "Result cache disabled: no shared memory\n");
+        cache_megabytes = 0;
+    }
+    if (log_init() == 0) log_flusher_pid = log_start(log_file);
+    if (log_flusher_pid < 0) {
+        if (log_file) fprintf(stderr, "Cannot log to %s: %s\n", log_file, strerror(errno));
+        fprintf(stderr, "Event log unbuffered; each event is printed directly\n");
+    }
+
+    // Start the job manager before any sockets exist, so jobs never inherit them
+    job_manager_pid = job_manager_start(job_dir, job_limit);
+    if (job_manager_pid < 0) {
+        fprintf(stderr, "Job queue disabled: %s\n", strerror(errno));
+    }
+    
     // Create server socket
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
@@ -315,12 +2408,39 @@ int main(int argc, char *argv[]) {
     }
     
     printf("NetShell server listening on port %d (with extended protocol support)...\n", port);
+    if (job_manager_pid > 0) {
+        printf("Job queue in %s, running up to %d jobs at once\n", job_dir, job_limit);
+    }
+    printf("Starting shells with %s\n", spawn_strategy_name(spawn_strategy));
+    if (cache_megabytes > 0) printf("Result cache of %d MB for EXEC cache=\n", cache_megabytes);
     printf("Waiting for connections (Press Ctrl+C to stop)...\n");
+    fflush(stdout);   // Or every forked connection carries a copy of the banner
     
     // Accept and handle connections
     while (server_running) {
-        // Periodically clean up zombie processes
-        waitpid(-1, NULL, WNOHANG);
+        fd_set accept_fds;
+        struct timeval tv;
+
+        // Collect every connection that ended, not just one per accept, so
+        // finished children do not pile up in the process table
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            if (pid != job_manager_pid && pid != log_flusher_pid) metrics_add(METRIC_CONNECTIONS_ACTIVE, -1);
+        }
+
+        if (metrics_file && time(NULL) - metrics_written >= metrics_interval) {
+            if (metrics_write_file(metrics_file, live_session_count()) != 0 && metrics_written == 0) {
+                fprintf(stderr, "Cannot write metrics to %s: %s\n", metrics_file, strerror(errno));
+            }
+            metrics_written = time(NULL);
+        }
+
+        // Wake up every second even when nobody connects; signal() restarts
+        // a blocked accept(), which would leave SIGTERM unnoticed
+        FD_ZERO(&accept_fds);
+        FD_SET(server_fd, &accept_fds);
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (select(server_fd + 1, &accept_fds, NULL, NULL, &tv) <= 0) continue;
         
 #ifdef MORPHOS
         client_fd = accept(server_fd, (struct sockaddr*)&client_addr, (socklen_t*)&client_len);
@@ -336,18 +2456,15 @@ int main(int argc, char *argv[]) {
                 continue;
             }
         }
+        accepted_at = metrics_now_us();
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+        trace_begin(&connection_trace, client_fd);
+        log_event(LOG_CONNECT, ntohl(client_addr.sin_addr.s_addr), ntohs(client_addr.sin_port), NULL);
         
-#ifdef MORPHOS
-        // On MorphOS, use simpler approach for client IP
-        printf("New connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-#else
-        // Get client address information
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-        printf("New connection from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
-#endif
-        
-        // Fork to handle the client
+        // Fork to handle the client; counted as active before the child can
+        // possibly have ended
+        metrics_add(METRIC_CONNECTIONS_ACTIVE, 1);
+        fork_started = metrics_now_us();
 #ifdef MORPHOS
         pid = vfork();
 #else
@@ -356,20 +2473,32 @@ int main(int argc, char *argv[]) {
         
         if (pid == 0) {
             // Child process - handle client
+            trace_mark(&connection_trace, TRACE_FORK);
             close(server_fd);  // Close server socket in child
+            if (set_keepalive(client_fd, keepalive_idle, keepalive_interval, keepalive_count) < 0) {
+                perror("setsockopt SO_KEEPALIVE");
+            }
             
             // Check if client wants extended protocol
             int extended_mode = check_extended_protocol(client_fd);
+            metrics_observe_since(METRIC_HANDSHAKE_TIME, accepted_at);
+            metrics_add(extended_mode ? METRIC_HANDSHAKE_EXTENDED : METRIC_HANDSHAKE_BASIC, 1);
+            trace_mark(&connection_trace, TRACE_HANDSHAKE);
+            if (extended_mode) {
+                // The EXTENDED_ACK that ended the handshake was the first byte
+                connection_trace.mode = TRACE_MODE_EXTENDED;
+                trace_mark(&connection_trace, TRACE_FIRST_BYTE);
+                trace_end(&connection_trace);
+            }
             
             if (extended_mode) {
-                printf("Extended protocol activated for connection %s:%d\n", 
-                       inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+                log_event(LOG_EXTENDED, ntohl(client_addr.sin_addr.s_addr), ntohs(client_addr.sin_port), NULL);
                 handle_extended_client(client_fd);
             } else {
-                printf("Basic protocol mode for connection %s:%d\n", 
-                       inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+                log_event(LOG_BASIC, ntohl(client_addr.sin_addr.s_addr), ntohs(client_addr.sin_port), NULL);
                 handle_basic_client(client_fd);
             }
+            log_event(LOG_CLOSED, metrics_now_us() - accepted_at, 0, NULL);
             
 #ifdef MORPHOS
             _exit(0);  // Use _exit instead of exit in child after vfork
@@ -378,16 +2507,27 @@ int main(int argc, char *argv[]) {
 #endif
         } else if (pid > 0) {
             // Parent process - close client socket and continue accepting
+            metrics_observe_since(METRIC_FORK_TIME, fork_started);
             close(client_fd);
         } else {
             // Fork failed
-            perror("fork");
+            log_event(LOG_FORK_FAILED, errno, 0, NULL);
+            metrics_add(METRIC_CONNECTIONS_ACTIVE, -1);
+            metrics_add(METRIC_FORK_FAILURES, 1);
             close(client_fd);
         }
     }
     
     // Close server socket
     close(server_fd);
+    if (job_manager_pid > 0) {
+        kill(job_manager_pid, SIGTERM);
+        waitpid(job_manager_pid, NULL, 0);
+    }
+    if (log_flusher_pid > 0) {
+        kill(log_flusher_pid, SIGTERM);
+        waitpid(log_flusher_pid, NULL, 0);
+    }
     printf("\nServer shutting down...\n");
     
     return 0;
@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "netshell_common.h"
+#include "netshell_harness.h"
+
+// Loopback benchmark for netshell: starts a server on a private port (or
+// uses one given with --connect), optionally behind netshell_wanem (--wan)
+// to add WAN delay and bandwidth limits, runs each benchmark, and prints
+// the results as JSON, every latency as percentiles in microseconds.
+//
+//   connect_prompt  connect() until EXTENDED_ACK, the client's prompt
+//   exec_rtt        a whole `netshell_client -e true` run
+//   churn           connect, handshake, close from many threads at once
+//   send_file_<n>   SEND_FILE of n bytes on an open connection
+//   get_file_<n>    GET_FILE of the same file
+//   echo            one "echo" line through a basic mode shell and back
+
+#define BENCH_DEFAULT_PORT 24990
+#define BENCH_ITERATIONS 200
+#define BENCH_WORKERS 8
+#define BENCH_DURATION_MS 2000
+#define BENCH_SIZES_MAX 16
+#define LINE_MAX_LEN 1024
+#define BENCH_WAN_ARGS 32
+
+struct bench_config {
+    const char *server_path;
+    const char *client_path;
+    struct harness_target target;
+    int spawn;                          // Start our own server
+    int iterations;
+    int workers;
+    int duration_ms;
+    long long sizes[BENCH_SIZES_MAX];
+    int size_count;
+    const char *wan_path;
+    const char *wan_options;            // NULL: no WAN emulation
+    int wan_port;
+};
+
+struct churn_worker {
+    const struct bench_config *config;
+    long long deadline_us;
+    struct harness_samples samples;
+    int failures;
+    pthread_t thread;
+};
+
+static char work_dir[256];
+static pid_t server_pid = -1;
+static pid_t wan_pid = -1;
+
+// Separator between results; the first one opens the list
+static int results_written;
+
+// Results with a failure or no samples at all; any makes the exit status 1
+static int results_failed;
+
+static void json_begin(FILE *out, const char *name) {
+    fprintf(out, "%s\n    {\"name\": \"%s\"", results_written++ ? "," : "", name);
+}
+
+// Close a result with the percentiles of its samples
+static void json_end(FILE *out, struct harness_samples *samples, int failures) {
+    if (failures > 0 || samples->count == 0) results_failed++;
+    fprintf(out, ", \"unit\": \"us\", \"failures\": %d, ", failures);
+    harness_print_stats(out, samples);
+    fprintf(out, "}");
+    fflush(out);
+}
+
+// Put netshell_wanem between us and the server, and point config at it
+static int start_wan(struct bench_config *config) {
+    char *argv[BENCH_WAN_ARGS + 5];
+    char *options = strdup(config->wan_options);
+    char listen_port[16], target_port[16];
+    char *token, *save = NULL;
+    int argc = 0;
+
+    if (!options) return -1;
+    argv[argc++] = (char *)config->wan_path;
+    for (token = strtok_r(options, " ", &save); token && argc < BENCH_WAN_ARGS; token = strtok_r(NULL, " ", &save)) {
+        argv[argc++] = token;
+    }
+    snprintf(listen_port, sizeof(listen_port), "%d", config->wan_port);
+    snprintf(target_port, sizeof(target_port), "%d", config->target.port);
+    argv[argc++] = listen_port;
+    argv[argc++] = config->target.host;
+    argv[argc++] = target_port;
+    argv[argc] = NULL;
+    wan_pid = harness_start_process(work_dir, argv, "wanem.out");
+    free(options);
+    if (wan_pid < 0) return -1;
+
+    strcpy(config->target.host, "127.0.0.1");
+    config->target.port = config->wan_port;
+    if (harness_resolve(&config->target) != 0) return -1;
+    return harness_wait_ready(&config->target, &wan_pid);
+}
+
+static void bench_connect_prompt(FILE *out, const struct bench_config *config) {
+    struct harness_samples samples = { NULL, 0, 0 };
+    int failures = 0;
+    int i;
+
+    for (i = 0; i < config->iterations; i++) {
+        long long started = harness_now_us();
+        int fd = harness_connect_extended(&config->target);
+        if (fd < 0) {
+            failures++;
+            continue;
+        }
+        harness_samples_add(&samples, harness_now_us() - started);
+        close(fd);
+    }
+    json_begin(out, "connect_prompt");
+    json_end(out, &samples, failures);
+    free(samples.values);
+}
+
+static void bench_exec_rtt(FILE *out, const struct bench_config *config) {
+    struct harness_samples samples = { NULL, 0, 0 };
+    char port[16];
+    int failures = 0;
+    int i;
+
+    snprintf(port, sizeof(port), "%d", config->target.port);
+    for (i = 0; i < config->iterations; i++) {
+        long long started = harness_now_us();
+        int status = 0;
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            int null_fd = open("/dev/null", O_RDWR);
+            if (null_fd >= 0) {
+                dup2(null_fd, STDIN_FILENO);
+                dup2(null_fd, STDOUT_FILENO);
+                dup2(null_fd, STDERR_FILENO);
+            }
+            execl(config->client_path, config->client_path, "-e", "true", config->target.host, port, (char *)NULL);
+            _exit(127);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failures++;
+            continue;
+        }
+        harness_samples_add(&samples, harness_now_us() - started);
+    }
+    json_begin(out, "exec_rtt");
+    json_end(out, &samples, failures);
+    free(samples.values);
+}
+
+static void *churn_run(void *arg) {
+    struct churn_worker *worker = arg;
+
+    while (harness_now_us() < worker->deadline_us) {
+        long long started = harness_now_us();
+        int fd = harness_connect_extended(&worker->config->target);
+        if (fd < 0) {
+            worker->failures++;
+            continue;
+        }
+        close(fd);
+        harness_samples_add(&worker->samples, harness_now_us() - started);
+    }
+    return NULL;
+}
+
+static void bench_churn(FILE *out, const struct bench_config *config) {
+    struct churn_worker *workers = calloc(config->workers, sizeof(struct churn_worker));
+    struct harness_samples samples = { NULL, 0, 0 };
+    long long started, elapsed;
+    int failures = 0;
+    int i, j;
+
+    if (!workers) return;
+    started = harness_now_us();
+    for (i = 0; i < config->workers; i++) {
+        workers[i].config = config;
+        workers[i].deadline_us = started + (long long)config->duration_ms * 1000;
+        if (pthread_create(&workers[i].thread, NULL, churn_run, &workers[i]) != 0) workers[i].failures = -1;
+    }
+    for (i = 0; i < config->workers; i++) {
+        if (workers[i].failures < 0) continue;
+        pthread_join(workers[i].thread, NULL);
+        failures += workers[i].failures;
+        for (j = 0; j < workers[i].samples.count; j++) harness_samples_add(&samples, workers[i].samples.values[j]);
+        free(workers[i].samples.values);
+    }
+    elapsed = harness_now_us() - started;
+
+    json_begin(out, "churn");
+    fprintf(out, ", \"workers\": %d, \"seconds\": %.3f, \"connections_per_second\": %.1f",
+            config->workers, elapsed / 1e6, samples.count / (elapsed / 1e6));
+    json_end(out, &samples, failures);
+    free(samples.values);
+    free(workers);
+}
+
+// Run a shell command on the server and wait for its EXIT line
+static int remote_exec(int fd, const char *command) {
+    char line[LINE_MAX_LEN];
+    char *skip = NULL;
+
+    if (send_all(fd, "EXEC\n", 5) < 0 || send_all(fd, command, strlen(command)) < 0 || send_all(fd, "\n", 1) < 0) {
+        return -1;
+    }
+    while (recv_line(fd, line, sizeof(line)) >= 0) {
+        long long len;
+
+        if (strncmp(line, "EXIT ", 5) == 0) {
+            free(skip);
+            return atoi(line + 5);
+        }
+        if (sscanf(line, "OUTPUT %lld", &len) != 1 || len < 0) break;
+        if (len > 0) {
+            char *grown = realloc(skip, len);
+            if (!grown || recv_all(fd, grown, len) <= 0) {
+                free(grown ? grown : skip);
+                return -1;
+            }
+            skip = grown;
+        }
+    }
+    free(skip);
+    return -1;
+}
+
+static int send_file_once(int fd, const char *path, const char *data, long long size) {
+    char line[LINE_MAX_LEN];
+
+    snprintf(line, sizeof(line), "SEND_FILE %s %lld\n", path, size);
+    if (send_all(fd, line, strlen(line)) < 0 || recv_line(fd, line, sizeof(line)) < 0 || strcmp(line, "READY") != 0) {
+        return -1;
+    }
+    if (size > 0 && send_all(fd, data, size) < 0) return -1;
+    if (recv_line(fd, line, sizeof(line)) < 0 || strcmp(line, "OK") != 0) return -1;
+    return 0;
+}
+
+static int get_file_once(int fd, const char *path, char *data, long long size) {
+    char line[LINE_MAX_LEN];
+    long long got;
+
+    snprintf(line, sizeof(line), "GET_FILE %s\n", path);
+    if (send_all(fd, line, strlen(line)) < 0 || recv_line(fd, line, sizeof(line)) < 0) return -1;
+    if (sscanf(line, "SIZE %lld", &got) != 1 || got != size) return -1;
+    if (size > 0 && recv_all(fd, data, size) <= 0) return -1;
+    return 0;
+}
+
+// Throughput in MB/s at the median transfer time
+static void json_rate(FILE *out, struct harness_samples *samples, long long size) {
+    if (samples->count == 0) return;
+    harness_samples_sort(samples);
+    fprintf(out, ", \"bytes\": %lld, \"mb_per_second_p50\": %.1f", size,
+            harness_percentile(samples, 50) > 0 ? size / (double)harness_percentile(samples, 50) : 0.0);
+}
+
+static void bench_transfers(FILE *out, const struct bench_config *config) {
+    long long largest = 0;
+    char *data;
+    int i, s;
+    int fd = harness_connect_extended(&config->target);
+
+    if (fd < 0) {
+        results_failed++;
+        return;
+    }
+    for (s = 0; s < config->size_count; s++) {
+        if (config->sizes[s] > largest) largest = config->sizes[s];
+    }
+    data = malloc(largest > 0 ? largest : 1);
+    if (!data) {
+        close(fd);
+        results_failed++;
+        return;
+    }
+    // Incompressible, as most payloads worth timing are
+    srand(1);
+    for (i = 0; i < largest; i++) data[i] = (char)(rand() >> 7);
+
+    for (s = 0; s < config->size_count; s++) {
+        struct harness_samples sent = { NULL, 0, 0 }, received = { NULL, 0, 0 };
+        long long size = config->sizes[s];
+        int send_failures = 0, get_failures = 0;
+        // Fewer rounds for big files, so each size costs about the same
+        int rounds = size > 1024 * 1024 ? config->iterations / 10 : config->iterations;
+        char path[300], name[64], command[400];
+
+        if (rounds < 3) rounds = 3;
+        snprintf(path, sizeof(path), "/tmp/netshell-bench-%d-%lld.bin", (int)getpid(), size);
+        for (i = 0; i < rounds; i++) {
+            long long started = harness_now_us();
+            if (send_file_once(fd, path, data, size) != 0) {
+                send_failures++;
+                break;   // The connection is out of step
+            }
+            harness_samples_add(&sent, harness_now_us() - started);
+        }
+        for (i = 0; i < rounds && send_failures == 0; i++) {
+            long long started = harness_now_us();
+            if (get_file_once(fd, path, data, size) != 0) {
+                get_failures++;
+                break;
+            }
+            harness_samples_add(&received, harness_now_us() - started);
+        }
+
+        snprintf(name, sizeof(name), "send_file_%lld", size);
+        json_begin(out, name);
+        json_rate(out, &sent, size);
+        json_end(out, &sent, send_failures);
+        snprintf(name, sizeof(name), "get_file_%lld", size);
+        json_begin(out, name);
+        json_rate(out, &received, size);
+        json_end(out, &received, get_failures);
+        free(sent.values);
+        free(received.values);
+
+        if (send_failures || get_failures) {
+            close(fd);
+            fd = harness_connect_extended(&config->target);
+            if (fd < 0) {
+                results_failed++;   // The sizes after this one go unmeasured
+                break;
+            }
+        }
+        snprintf(command, sizeof(command), "rm -f %s", path);
+        remote_exec(fd, command);
+    }
+    if (fd >= 0) close(fd);
+    free(data);
+}
+
+// Read until a line equal to expect. Returns 0, or -1 on EOF or timeout.
+static int wait_for_line(int fd, const char *expect) {
+    char line[LINE_MAX_LEN];
+
+    while (recv_line(fd, line, sizeof(line)) >= 0) {
+        if (strcmp(line, expect) == 0) return 0;
+    }
+    return -1;
+}
+
+static void bench_echo(FILE *out, const struct bench_config *config) {
+    struct harness_samples samples = { NULL, 0, 0 };
+    char command[64], expect[32];
+    int failures = 0;
+    int i;
+    // Typing first skips the server's wait for the extended handshake
+    int fd = harness_connect(&config->target);
+
+    // A shell that never answers is reported as a failed result
+    if (fd < 0 || send_all(fd, "echo ready\n", 11) < 0 || wait_for_line(fd, "ready") != 0) failures++;
+    for (i = 0; failures == 0 && i < config->iterations; i++) {
+        long long started = harness_now_us();
+
+        snprintf(expect, sizeof(expect), "%d", i);
+        snprintf(command, sizeof(command), "echo %d\n", i);
+        if (send_all(fd, command, strlen(command)) < 0 || wait_for_line(fd, expect) != 0) {
+            failures++;
+            break;
+        }
+        harness_samples_add(&samples, harness_now_us() - started);
+    }
+    if (fd >= 0) {
+        send_all(fd, "exit\n", 5);
+        close(fd);
+    }
+
+    json_begin(out, "echo");
+    json_end(out, &samples, failures);
+    free(samples.values);
+}
+
+static int parse_sizes(struct bench_config *config, const char *list) {
+    char *copy = strdup(list);
+    char *token, *save = NULL;
+
+    if (!copy) return -1;
+    config->size_count = 0;
+    for (token = strtok_r(copy, ",", &save); token && config->size_count < BENCH_SIZES_MAX;
+         token = strtok_r(NULL, ",", &save)) {
+        char *end;
+        long long size = strtoll(token, &end, 10);
+        if (*end == 'k' || *end == 'K') size *= 1024;
+        if (*end == 'm' || *end == 'M') size *= 1024 * 1024;
+        if (size < 0) continue;
+        config->sizes[config->size_count++] = size;
+    }
+    free(copy);
+    return config->size_count > 0 ? 0 : -1;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  -n <iterations>        Samples per latency benchmark (default %d)\n", BENCH_ITERATIONS);
+    fprintf(stderr, "  --workers <n>          Threads in the churn benchmark (default %d)\n", BENCH_WORKERS);
+    fprintf(stderr, "  --duration <ms>        Length of the churn benchmark (default %d)\n", BENCH_DURATION_MS);
+    fprintf(stderr, "  --sizes <list>         File sizes, e.g. 4k,64k,1m,16m (the default)\n");
+    fprintf(stderr, "  --server <path>        Server to start (default ./netshell)\n");
+    fprintf(stderr, "  --client <path>        Client for exec_rtt (default ./netshell_client)\n");
+    fprintf(stderr, "  --port <port>          Port for the server we start (default %d)\n", BENCH_DEFAULT_PORT);
+    fprintf(stderr, "  --connect <host:port>  Benchmark a running server instead\n");
+    fprintf(stderr, "  --wan \"<options>\"      Run through netshell_wanem with these options,\n");
+    fprintf(stderr, "                         e.g. \"--delay 100 --jitter 10 --rate 10000\"\n");
+    fprintf(stderr, "  --wanem <path>         WAN emulator (default ./netshell_wanem)\n");
+    fprintf(stderr, "  --quick                Few samples, for a smoke test\n");
+    fprintf(stderr, "  -o <file>              Write the JSON there instead of stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_config config;
+    const char *output = NULL;
+    FILE *out = stdout;
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    config.server_path = "./netshell";
+    config.client_path = "./netshell_client";
+    strcpy(config.target.host, "127.0.0.1");
+    config.target.port = BENCH_DEFAULT_PORT;
+    config.spawn = 1;
+    config.wan_path = "./netshell_wanem";
+    config.iterations = BENCH_ITERATIONS;
+    config.workers = BENCH_WORKERS;
+    config.duration_ms = BENCH_DURATION_MS;
+    parse_sizes(&config, "4k,64k,1m,16m");
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            config.iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            config.workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            config.duration_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            if (parse_sizes(&config, argv[++i]) != 0) {
+                fprintf(stderr, "Bad size list: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            config.server_path = argv[++i];
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            config.client_path = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            config.target.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            if (harness_parse_address(&config.target, argv[++i]) != 0) {
+                fprintf(stderr, "Expected host:port, got %s\n", argv[i]);
+                return 1;
+            }
+            config.spawn = 0;
+        } else if (strcmp(argv[i], "--wan") == 0 && i + 1 < argc) {
+            config.wan_options = argv[++i];
+        } else if (strcmp(argv[i], "--wanem") == 0 && i + 1 < argc) {
+            config.wan_path = argv[++i];
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            config.iterations = 20;
+            config.duration_ms = 500;
+            parse_sizes(&config, "4k,1m");
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (config.iterations < 1) config.iterations = 1;
+    if (config.workers < 1) config.workers = 1;
+    if (config.target.port <= 0 || config.target.port > 65535 || harness_resolve(&config.target) != 0) {
+        fprintf(stderr, "Cannot resolve %s:%d\n", config.target.host, config.target.port);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (harness_make_dir(work_dir, sizeof(work_dir), "netshell-bench") != 0) {
+        perror("mkdtemp");
+        return 1;
+    }
+    config.wan_port = (config.spawn ? config.target.port : BENCH_DEFAULT_PORT) + 1;
+    if (config.spawn) {
+        fprintf(stderr, "Starting %s on port %d\n", config.server_path, config.target.port);
+        server_pid = harness_start_server(work_dir, config.server_path, &config.target);
+        if (server_pid < 0) {
+            fprintf(stderr, "Server did not come up; see %s/server.out\n", work_dir);
+            return 1;
+        }
+    }
+    if (config.wan_options) {
+        fprintf(stderr, "Relaying through %s %s\n", config.wan_path, config.wan_options);
+        if (start_wan(&config) != 0) {
+            fprintf(stderr, "WAN emulator did not come up; see %s/wanem.out\n", work_dir);
+            harness_stop_process(&wan_pid);
+            harness_stop_process(&server_pid);
+            return 1;
+        }
+    }
+    if (output && !(out = fopen(output, "w"))) {
+        perror(output);
+        harness_stop_process(&wan_pid);
+        harness_stop_process(&server_pid);
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"host\": \"%s\", \"port\": %d, \"started\": %lld, \"iterations\": %d,\n",
+            config.target.host, config.target.port, (long long)time(NULL), config.iterations);
+    if (config.wan_options) {
+        fprintf(out, "  \"wan\": \"%s\",\n", config.wan_options);
+    } else {
+        fprintf(out, "  \"wan\": null,\n");
+    }
+    fprintf(out, "  \"results\": [");
+    fprintf(stderr, "connect_prompt\n");
+    bench_connect_prompt(out, &config);
+    fprintf(stderr, "exec_rtt\n");
+    bench_exec_rtt(out, &config);
+    fprintf(stderr, "churn\n");
+    bench_churn(out, &config);
+    fprintf(stderr, "file transfers\n");
+    bench_transfers(out, &config);
+    fprintf(stderr, "echo\n");
+    bench_echo(out, &config);
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+
+    harness_stop_process(&wan_pid);
+    harness_stop_process(&server_pid);
+    harness_remove_dir(work_dir);
+    if (results_failed > 0) {
+        fprintf(stderr, "%d benchmark%s failed or recorded nothing\n", results_failed, results_failed == 1 ? "" : "s");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,572 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE   // SEEK_DATA/SEEK_HOLE and fallocate()
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+#include "netshell_common.h"
+#include "netshell_block.h"
+#include "netshell_lz.h"
+#include "netshell_crc32c.h"
+
+#ifdef NETSHELL_THREADS
+#include <pthread.h>
+#endif
+
+#define SLOT_FREE 0
+#define SLOT_FILLED 1
+#define SLOT_DONE 2
+
+// Slot error codes
+#define SLOT_IO_ERROR 1
+#define SLOT_CORRUPT 2
+
+// Both buffers keep BLOCK_HEADER_SIZE bytes of headroom so a block goes out
+// with a single send of header and payload.
+struct block_slot {
+    int state;
+    int error;
+    struct block_header header;
+    uint32_t crc;                // Decode: CRC32C of the bytes the block decoded to
+    unsigned char *raw;
+    unsigned char *enc;
+};
+
+struct block_pipeline {
+    int encode;              // 1: file -> socket, 0: socket -> file
+    int socket_fd;
+    int file_fd;
+    size_t block_size;
+    off_t file_size;         // Encode: bytes to send
+    off_t next_offset;       // Encode: next file offset to read
+    int sparse;              // Encode: SEEK_DATA/SEEK_HOLE work on file_fd
+    off_t data_end;          // Encode: end of the data extent being read
+    uint64_t received;       // Decode: decoded bytes seen so far
+    uint32_t file_crc;       // Running whole-file CRC32C, rolled up in file order
+                             // (decode: from the decoded bytes, not the headers)
+    struct block_header end; // Decode: end of stream marker
+    int end_seen;
+    int broken;              // Socket stream is out of sync or closed
+    int corrupt;             // A block failed its integrity check
+    int error;
+
+    // Slots form a ring; sequence numbers only ever grow, and
+    // next_emit <= next_work <= next_fill <= next_emit + nslots.
+    struct block_slot *slots;
+    int nslots;
+    unsigned long next_fill;
+    unsigned long next_work;
+    unsigned long next_emit;
+
+    int nthreads;            // 0 = process blocks inline on the caller
+    int stop;
+#ifdef NETSHELL_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[MAX_WORKER_THREADS];
+#endif
+};
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void block_header_encode(const struct block_header *header, unsigned char *out) {
+    put32(out, BLOCK_MAGIC);
+    put32(out + 4, header->flags);
+    put32(out + 8, (uint32_t)(header->offset >> 32));
+    put32(out + 12, (uint32_t)header->offset);
+    put32(out + 16, header->raw_len);
+    put32(out + 20, header->enc_len);
+    put32(out + 24, header->checksum);
+    put32(out + 28, 0);
+}
+
+int block_header_decode(struct block_header *header, const unsigned char *in) {
+    if (get32(in) != BLOCK_MAGIC) return 0;
+    header->flags = get32(in + 4);
+    header->offset = ((uint64_t)get32(in + 8) << 32) | get32(in + 12);
+    header->raw_len = get32(in + 16);
+    header->enc_len = get32(in + 20);
+    header->checksum = get32(in + 24);
+    return 1;
+}
+
+static void pipeline_lock(struct block_pipeline *p) {
+#ifdef NETSHELL_THREADS
+    if (p->nthreads) pthread_mutex_lock(&p->lock);
+#else
+    (void)p;
+#endif
+}
+
+static void pipeline_unlock(struct block_pipeline *p) {
+#ifdef NETSHELL_THREADS
+    if (p->nthreads) pthread_mutex_unlock(&p->lock);
+#else
+    (void)p;
+#endif
+}
+
+static void pipeline_wait(struct block_pipeline *p) {
+#ifdef NETSHELL_THREADS
+    if (p->nthreads) pthread_cond_wait(&p->cond, &p->lock);
+#else
+    (void)p;
+#endif
+}
+
+static void pipeline_wake(struct block_pipeline *p) {
+#ifdef NETSHELL_THREADS
+    if (p->nthreads) pthread_cond_broadcast(&p->cond);
+#else
+    (void)p;
+#endif
+}
+
+static int is_zero_block(const unsigned char *data, size_t len) {
+    return len > 0 && data[0] == 0 && memcmp(data, data + 1, len - 1) == 0;
+}
+
+// Give a hole's range back to the filesystem. Receivers write into freshly
+// truncated files where the range already reads as zeros, so failure is harmless.
+static void punch_hole(int fd, off_t offset, off_t length) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+#endif
+}
+
+// CPU-heavy part of a block, run on a worker: checksum and compress on the
+// sending side, decompress, verify and write on the receiving side.
+static void block_process(struct block_pipeline *p, struct block_slot *slot) {
+    struct block_header *h = &slot->header;
+    unsigned char *raw = slot->raw + BLOCK_HEADER_SIZE;
+    unsigned char *enc = slot->enc + BLOCK_HEADER_SIZE;
+
+    if (p->encode) {
+        size_t clen;
+
+        if (h->flags & BLOCK_HOLE) {
+            h->checksum = crc32c_zeros(h->raw_len);
+            return;
+        }
+        h->checksum = crc32c(0, raw, h->raw_len);
+        if (is_zero_block(raw, h->raw_len)) {
+            // Allocated but all zeros: send it as a hole as well
+            h->flags = BLOCK_HOLE;
+            h->enc_len = 0;
+            return;
+        }
+        clen = lz_compress(raw, h->raw_len, enc, h->raw_len - 1);
+        if (clen > 0) {
+            h->flags = BLOCK_COMPRESSED;
+            h->enc_len = (uint32_t)clen;
+        } else {
+            h->flags = 0;
+            h->enc_len = h->raw_len;
+        }
+        return;
+    }
+
+    if (h->flags & BLOCK_HOLE) {
+        slot->crc = crc32c_zeros(h->raw_len);
+        if (slot->crc != h->checksum) {
+            fprintf(stderr, "Hole at offset %llu failed CRC32C check\n", (unsigned long long)h->offset);
+            slot->error = SLOT_CORRUPT;
+            return;
+        }
+        punch_hole(p->file_fd, (off_t)h->offset, h->raw_len);
+        return;
+    }
+
+    if (h->flags & BLOCK_COMPRESSED) {
+        if (lz_decompress(enc, h->enc_len, raw, p->block_size) != (long)h->raw_len) {
+            fprintf(stderr, "Block at offset %llu failed to decompress\n",
+                    (unsigned long long)h->offset);
+            slot->error = SLOT_CORRUPT;
+            return;
+        }
+    }
+    slot->crc = crc32c(0, raw, h->raw_len);
+    if (slot->crc != h->checksum) {
+        fprintf(stderr, "Block at offset %llu failed CRC32C check\n", (unsigned long long)h->offset);
+        slot->error = SLOT_CORRUPT;
+        return;
+    }
+    if (pwrite_all(p->file_fd, raw, h->raw_len, (off_t)h->offset) < 0) {
+        perror("pwrite");
+        slot->error = SLOT_IO_ERROR;
+    }
+}
+
+#ifdef NETSHELL_THREADS
+static void *block_worker(void *arg) {
+    struct block_pipeline *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        struct block_slot *slot;
+
+        while (!p->stop && p->next_work == p->next_fill) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->stop) break;
+
+        slot = &p->slots[p->next_work++ % p->nslots];
+        pthread_mutex_unlock(&p->lock);
+
+        block_process(p, slot);
+
+        pthread_mutex_lock(&p->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+#endif
+
+// I/O part of a block, run on the calling thread.
+// Returns 1 if the slot was filled, 0 at end of input, -1 on error.
+static int block_fill(struct block_pipeline *p, struct block_slot *slot) {
+    struct block_header *h = &slot->header;
+    unsigned char hdr[BLOCK_HEADER_SIZE];
+    unsigned char *dest;
+
+    memset(h, 0, sizeof(*h));
+    slot->error = 0;
+
+    if (p->encode) {
+        off_t left = p->file_size - p->next_offset;
+        size_t len;
+
+        if (left <= 0) return 0;
+
+#ifdef SEEK_DATA
+        // Describe holes instead of reading them, and never let a data block
+        // run past the end of its extent
+        if (p->sparse && p->next_offset >= p->data_end) {
+            off_t data = lseek(p->file_fd, p->next_offset, SEEK_DATA);
+
+            if (data < 0 && errno == ENXIO) data = p->file_size; // Hole runs to EOF
+            if (data < 0) {
+                p->sparse = 0; // Not supported by this filesystem: all data
+            } else if (data > p->next_offset) {
+                off_t hole = (data > p->file_size ? p->file_size : data) - p->next_offset;
+                if (hole > BLOCK_MAX_HOLE) hole = BLOCK_MAX_HOLE;
+                h->flags = BLOCK_HOLE;
+                h->offset = (uint64_t)p->next_offset;
+                h->raw_len = (uint32_t)hole;
+                p->next_offset += hole;
+                return 1;
+            } else {
+                p->data_end = lseek(p->file_fd, data, SEEK_HOLE);
+                if (p->data_end <= data) p->sparse = 0;
+            }
+        }
+        if (p->sparse && p->data_end - p->next_offset < left) {
+            left = p->data_end - p->next_offset;
+        }
+#endif
+
+        len = left < (off_t)p->block_size ? (size_t)left : p->block_size;
+        if (pread_all(p->file_fd, slot->raw + BLOCK_HEADER_SIZE, len, p->next_offset) < 0) {
+            perror("pread");
+            return -1;
+        }
+        h->offset = (uint64_t)p->next_offset;
+        h->raw_len = (uint32_t)len;
+        p->next_offset += len;
+        return 1;
+    }
+
+    if (recv_all(p->socket_fd, hdr, sizeof(hdr)) <= 0 || !block_header_decode(h, hdr)) {
+        p->broken = 1;
+        return -1;
+    }
+    if (h->flags & BLOCK_END) {
+        p->end = *h;
+        p->end_seen = 1;
+        return (h->flags & BLOCK_ERROR) ? -1 : 0;
+    }
+    // Blocks must tile the file in order: a duplicated, overlapping, missing
+    // or reordered block would still pass its own checksum
+    if (h->offset != p->received) {
+        fprintf(stderr, "Block at offset %llu out of order, expected %llu\n",
+                (unsigned long long)h->offset, (unsigned long long)p->received);
+        p->broken = 1;
+        return -1;
+    }
+    if (h->flags & BLOCK_HOLE) {
+        if (h->raw_len == 0 || h->raw_len > BLOCK_MAX_HOLE || h->enc_len != 0) {
+            p->broken = 1;
+            return -1;
+        }
+    } else if (h->raw_len == 0 || h->raw_len > p->block_size ||
+               h->enc_len > lz_compress_bound(p->block_size) ||
+               (!(h->flags & BLOCK_COMPRESSED) && h->enc_len != h->raw_len)) {
+        p->broken = 1;
+        return -1;
+    }
+
+    dest = (h->flags & BLOCK_COMPRESSED) ? slot->enc : slot->raw;
+    if (h->enc_len > 0 && recv_all(p->socket_fd, dest + BLOCK_HEADER_SIZE, h->enc_len) <= 0) {
+        p->broken = 1;
+        return -1;
+    }
+    p->received += h->raw_len;
+    return 1;
+}
+
+// Hand a finished block on, strictly in file order. Returns -1 on error.
+static int block_emit(struct block_pipeline *p, struct block_slot *slot) {
+    struct block_header *h = &slot->header;
+    unsigned char *buf;
+
+    if (slot->error) {
+        if (slot->error == SLOT_CORRUPT) p->corrupt = 1;
+        return -1;
+    }
+    if (!p->encode) {
+        // Emitted in file order, so the decoded blocks' CRCs roll up to the file's
+        p->file_crc = crc32c_combine(p->file_crc, slot->crc, h->raw_len);
+        return 0;
+    }
+    if (p->error) return 0;
+
+    p->file_crc = crc32c_combine(p->file_crc, h->checksum, h->raw_len);
+
+    buf = (h->flags & BLOCK_COMPRESSED) ? slot->enc : slot->raw;
+    block_header_encode(h, buf);
+    if (send_all(p->socket_fd, buf, BLOCK_HEADER_SIZE + h->enc_len) < 0) {
+        p->broken = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void block_pipeline_destroy(struct block_pipeline *p) {
+    int i;
+
+#ifdef NETSHELL_THREADS
+    if (p->nthreads) {
+        pthread_mutex_lock(&p->lock);
+        p->stop = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        for (i = 0; i < p->nthreads; i++) {
+            pthread_join(p->threads[i], NULL);
+        }
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+    }
+#endif
+
+    if (p->slots) {
+        for (i = 0; i < p->nslots; i++) {
+            free(p->slots[i].raw);
+            free(p->slots[i].enc);
+        }
+        free(p->slots);
+    }
+}
+
+static int block_pipeline_init(struct block_pipeline *p, int encode, int socket_fd,
+                               int file_fd, size_t block_size, int threads) {
+    int i;
+
+    memset(p, 0, sizeof(*p));
+    p->encode = encode;
+    p->socket_fd = socket_fd;
+    p->file_fd = file_fd;
+    p->block_size = block_size;
+
+    if (threads > MAX_WORKER_THREADS) threads = MAX_WORKER_THREADS;
+#ifdef NETSHELL_THREADS
+    p->nthreads = threads > 1 ? threads : 0;
+#else
+    (void)threads;
+#endif
+
+    // Two slots per worker keeps every worker busy while the caller does I/O
+    p->nslots = p->nthreads ? p->nthreads * 2 : 1;
+    p->slots = calloc(p->nslots, sizeof(*p->slots));
+    if (!p->slots) return 0;
+    for (i = 0; i < p->nslots; i++) {
+        p->slots[i].raw = malloc(BLOCK_HEADER_SIZE + block_size);
+        p->slots[i].enc = malloc(BLOCK_HEADER_SIZE + lz_compress_bound(block_size));
+        if (!p->slots[i].raw || !p->slots[i].enc) {
+            p->nthreads = 0;
+            block_pipeline_destroy(p);
+            return 0;
+        }
+    }
+
+#ifdef NETSHELL_THREADS
+    if (p->nthreads) {
+        int wanted = p->nthreads;
+
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->cond, NULL);
+        p->nthreads = 0;
+        for (i = 0; i < wanted; i++) {
+            if (pthread_create(&p->threads[i], NULL, block_worker, p) != 0) break;
+            p->nthreads++;
+        }
+        if (p->nthreads == 0) {
+            // No workers could be started; fall back to inline processing
+            pthread_cond_destroy(&p->cond);
+            pthread_mutex_destroy(&p->lock);
+        }
+    }
+#endif
+    return 1;
+}
+
+static int block_pipeline_run(struct block_pipeline *p) {
+    int input_left = 1;
+
+    for (;;) {
+        struct block_slot *slot;
+        int emit = 0;
+        int r;
+
+        pipeline_lock(p);
+        for (;;) {
+            slot = &p->slots[p->next_emit % p->nslots];
+            if (p->next_emit < p->next_fill && slot->state == SLOT_DONE) {
+                emit = 1;
+                break;
+            }
+            if (input_left && p->next_fill - p->next_emit < (unsigned long)p->nslots) break;
+            if (!input_left && p->next_emit == p->next_fill) {
+                pipeline_unlock(p);
+                return !p->error;
+            }
+            pipeline_wait(p);
+        }
+        pipeline_unlock(p);
+
+        if (emit) {
+            if (block_emit(p, slot) < 0) {
+                p->error = 1;
+                input_left = 0;
+            }
+            pipeline_lock(p);
+            slot->state = SLOT_FREE;
+            p->next_emit++;
+            pipeline_unlock(p);
+            continue;
+        }
+
+        slot = &p->slots[p->next_fill % p->nslots];
+        r = block_fill(p, slot);
+        if (r <= 0) {
+            if (r < 0) p->error = 1;
+            input_left = 0;
+            continue;
+        }
+
+        if (p->nthreads == 0) {
+            block_process(p, slot);
+            slot->state = SLOT_DONE;
+            p->next_fill++;
+            p->next_work++;
+        } else {
+            pipeline_lock(p);
+            slot->state = SLOT_FILLED;
+            p->next_fill++;
+            pipeline_wake(p);
+            pipeline_unlock(p);
+        }
+    }
+}
+
+int block_send_file(int socket_fd, int file_fd, off_t file_size, size_t block_size, int threads) {
+    struct block_pipeline p;
+    struct block_header end;
+    unsigned char hdr[BLOCK_HEADER_SIZE];
+    int ok = 0;
+
+    if (block_pipeline_init(&p, 1, socket_fd, file_fd, block_size, threads)) {
+        p.file_size = file_size;
+#ifdef SEEK_DATA
+        p.sparse = 1;
+#endif
+        ok = block_pipeline_run(&p);
+        block_pipeline_destroy(&p);
+        if (p.broken) return 0;
+    }
+
+    // Always terminate the stream so the receiver never waits on a dead sender
+    memset(&end, 0, sizeof(end));
+    end.flags = BLOCK_END | (ok ? 0 : BLOCK_ERROR);
+    end.offset = (uint64_t)file_size;
+    end.checksum = ok ? p.file_crc : 0;
+    block_header_encode(&end, hdr);
+    if (send_all(socket_fd, hdr, sizeof(hdr)) < 0) return 0;
+    return ok;
+}
+
+// Skip the rest of a block stream after a failure
+static int block_drain(int socket_fd) {
+    unsigned char hdr[BLOCK_HEADER_SIZE];
+    char scratch[4096];
+    struct block_header h;
+
+    for (;;) {
+        uint32_t left;
+
+        if (recv_all(socket_fd, hdr, sizeof(hdr)) <= 0 || !block_header_decode(&h, hdr)) return 0;
+        if (h.flags & BLOCK_END) return 1;
+        for (left = h.enc_len; left > 0; ) {
+            size_t n = left < sizeof(scratch) ? left : sizeof(scratch);
+            if (recv_all(socket_fd, scratch, n) <= 0) return 0;
+            left -= n;
+        }
+    }
+}
+
+int block_receive_file(int socket_fd, int file_fd, size_t block_size, int threads, off_t *file_size) {
+    struct block_pipeline p;
+    int ok = 0;
+
+    if (block_pipeline_init(&p, 0, socket_fd, file_fd, block_size, threads)) {
+        ok = block_pipeline_run(&p);
+        block_pipeline_destroy(&p);
+        if (!p.end_seen && !p.broken) block_drain(socket_fd);
+    } else {
+        block_drain(socket_fd);
+        return 0;
+    }
+
+    if (p.corrupt) return -1;
+    if (!ok || !p.end_seen) return 0;
+    if (p.received != p.end.offset || p.file_crc != p.end.checksum) {
+        fprintf(stderr, "Transfer failed whole-file CRC32C check\n");
+        return -1;
+    }
+    if (ftruncate(file_fd, (off_t)p.end.offset) != 0) {
+        perror("ftruncate");
+        return 0;
+    }
+    *file_size = (off_t)p.end.offset;
+    return 1;
+}
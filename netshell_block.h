@@ -0,0 +1,59 @@
+#ifndef NETSHELL_BLOCK_H
+#define NETSHELL_BLOCK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Block transfer pipeline used by GET_FILE_BLOCKS / SEND_FILE_BLOCKS.
+//
+// A file is cut into independent blocks. Each block is checksummed and
+// compressed by a pool of worker threads while the calling thread keeps the
+// socket busy, so throughput scales with cores until the link saturates.
+// The sender emits blocks in file order; the receiver decodes them on its own
+// pool and writes each one at its offset with pwrite(). A block whose offset
+// is not where the previous one ended breaks the stream.
+//
+// Wire format per block: a fixed BLOCK_HEADER_SIZE header (big-endian fields)
+// followed by enc_len payload bytes. The stream ends with a header carrying
+// BLOCK_END, whose offset field holds the total file size and whose checksum
+// is the whole-file CRC32C rolled up from the per-block CRCs. The receiver
+// compares it with the CRC32C of what it actually decoded.
+
+#define BLOCK_MAGIC 0x4E53424BU   // "NSBK"
+#define BLOCK_HEADER_SIZE 32
+#define BLOCK_DEFAULT_SIZE (1024 * 1024)
+#define BLOCK_MIN_SIZE (64 * 1024)
+#define BLOCK_MAX_SIZE (16 * 1024 * 1024)
+
+// Header flags
+#define BLOCK_COMPRESSED 0x1   // Payload is lz-compressed
+#define BLOCK_END        0x2   // End of stream marker, no payload
+#define BLOCK_ERROR      0x4   // Sender failed; stream is aborted
+#define BLOCK_HOLE       0x8   // raw_len zero bytes, no payload
+
+// Largest hole described by a single header
+#define BLOCK_MAX_HOLE (1024 * 1024 * 1024)
+
+struct block_header {
+    uint32_t flags;
+    uint64_t offset;     // File offset of the block (file size for BLOCK_END)
+    uint32_t raw_len;    // Decoded length
+    uint32_t enc_len;    // Payload length on the wire
+    uint32_t checksum;   // CRC32C of the decoded bytes
+};
+
+void block_header_encode(const struct block_header *header, unsigned char *out);
+int block_header_decode(struct block_header *header, const unsigned char *in);
+
+// Send the first file_size bytes of file_fd as a block stream.
+// Returns 1 on success, 0 on failure.
+int block_send_file(int socket_fd, int file_fd, off_t file_size, size_t block_size, int threads);
+
+// Receive a block stream into file_fd. On success the total size announced
+// by the end marker is stored in *file_size and the file is truncated to it.
+// On a bad block the rest of the stream is drained so the connection stays
+// in sync. Returns 1 on success, -1 if a block or the whole file failed its
+// CRC32C check (the caller should retransmit), 0 on other failures.
+int block_receive_file(int socket_fd, int file_fd, size_t block_size, int threads, off_t *file_size);
+
+#endif
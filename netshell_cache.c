@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef MORPHOS
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#include "netshell_metrics.h"
+#include "netshell_cache.h"
+
+#define CACHE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define CACHE_SPINS 4096           // Between checks that the lock holder still lives
+
+struct cache_entry {
+    unsigned long long hash;       // 0: free
+    long long position;            // Start of the record, in arena bytes ever written
+    long long expires;             // Unix time
+    unsigned int record_len;
+    unsigned int command_len;
+    unsigned int output_len;
+    int dep_count;
+    int exit_code;
+};
+
+// A record in the arena: the command, each dependency's state followed by
+// its path, then the output
+struct cache_region {
+    int lock;                      // pid of the holder, 0: free
+    long long head;                // Arena bytes ever written
+    long long arena_size;
+    struct cache_entry entries[CACHE_ENTRIES];
+    char arena[];
+};
+
+static struct cache_region *region;
+
+void cache_request_init(struct cache_request *request) {
+    request->ttl = 0;
+    request->dep_count = 0;
+    request->looked_up = 0;
+}
+
+int cache_init(size_t megabytes) {
+#ifndef MORPHOS
+    size_t size = megabytes * 1024 * 1024;
+    void *shared;
+
+    if (size <= sizeof(struct cache_region)) return -1;
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) return -1;
+    region = shared;   // Zero filled by the kernel
+    region->arena_size = (long long)(size - sizeof(struct cache_region)) & ~7LL;
+    return 0;
+#else
+    (void)megabytes;
+    return -1;
+#endif
+}
+
+size_t cache_max_output(void) {
+    return region ? (size_t)region->arena_size / 4 : 0;
+}
+
+#ifndef MORPHOS
+static void cache_lock(void) {
+    pid_t self = getpid();
+    int spins = 0;
+
+    while (!__sync_bool_compare_and_swap(&region->lock, 0, self)) {
+        if (++spins < CACHE_SPINS) continue;
+        spins = 0;
+        sched_yield();
+        {
+            // A connection killed while holding it would stop every other one;
+            // what it was writing is suspect, so the table goes with it
+            pid_t holder = region->lock;
+            if (holder != 0 && kill(holder, 0) < 0 && errno == ESRCH &&
+                __sync_bool_compare_and_swap(&region->lock, holder, self)) {
+                memset(region->entries, 0, sizeof(region->entries));
+                return;
+            }
+        }
+    }
+}
+
+static void cache_unlock(void) {
+    __sync_lock_release(&region->lock);
+}
+
+// FNV-1a over the command and the dependency paths
+static unsigned long long cache_hash(const struct cache_request *request, const char* command, size_t command_len) {
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t i;
+    int d;
+
+    for (i = 0; i < command_len; i++) hash = (hash ^ (unsigned char)command[i]) * 1099511628211ULL;
+    for (d = 0; d < request->dep_count; d++) {
+        const char *path = request->deps[d];
+        hash = (hash ^ 0xff) * 1099511628211ULL;
+        for (; *path; path++) hash = (hash ^ (unsigned char)*path) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+static void cache_stat(const char *path, struct cache_dep_state *state) {
+    struct stat st;
+
+    memset(state, 0, sizeof(*state));
+    state->path_len = strlen(path);
+    if (stat(path, &st) != 0) return;
+    state->exists = 1;
+    state->mtime_sec = st.st_mtim.tv_sec;
+    state->mtime_nsec = st.st_mtim.tv_nsec;
+    state->ctime_sec = st.st_ctim.tv_sec;
+    state->ctime_nsec = st.st_ctim.tv_nsec;
+    state->size = st.st_size;
+    state->inode = st.st_ino;
+}
+
+static size_t cache_record_len(const struct cache_request *request, size_t command_len, size_t output_len) {
+    size_t length = CACHE_ALIGN(command_len);
+    int d;
+
+    for (d = 0; d < request->dep_count; d++) {
+        length += sizeof(struct cache_dep_state) + CACHE_ALIGN(request->states[d].path_len);
+    }
+    return length + CACHE_ALIGN(output_len);
+}
+
+static char* cache_record(const struct cache_entry *entry) {
+    return region->arena + entry->position % region->arena_size;
+}
+
+// Not yet overwritten by newer records
+static int cache_entry_live(const struct cache_entry *entry) {
+    return entry->hash != 0 && entry->position >= region->head - region->arena_size;
+}
+
+// Does the entry hold this command and these dependency paths? Sets
+// *current when the dependencies also look as they did then.
+static int cache_entry_matches(const struct cache_entry *entry, const struct cache_request *request,
+                               const char* command, size_t command_len, int *current) {
+    const char *record = cache_record(entry);
+    int d;
+
+    if (entry->command_len != command_len || entry->dep_count != request->dep_count) return 0;
+    if (memcmp(record, command, command_len) != 0) return 0;
+    record += CACHE_ALIGN(command_len);
+    *current = 1;
+    for (d = 0; d < request->dep_count; d++) {
+        struct cache_dep_state stored;
+        memcpy(&stored, record, sizeof(stored));
+        record += sizeof(stored);
+        if (stored.path_len != request->states[d].path_len ||
+            memcmp(record, request->deps[d], stored.path_len) != 0) {
+            return 0;
+        }
+        if (memcmp(&stored, &request->states[d], sizeof(stored)) != 0) *current = 0;
+        record += CACHE_ALIGN(stored.path_len);
+    }
+    return 1;
+}
+
+// Slot of the entry for this key, or -1
+static int cache_find(const struct cache_request *request, const char* command, size_t command_len,
+                      unsigned long long hash, int *current) {
+    int i;
+
+    for (i = 0; i < CACHE_PROBE; i++) {
+        int slot = (int)((hash + i) % CACHE_ENTRIES);
+        struct cache_entry *entry = &region->entries[slot];
+        if (entry->hash == hash && cache_entry_live(entry) &&
+            cache_entry_matches(entry, request, command, command_len, current)) {
+            return slot;
+        }
+    }
+    return -1;
+}
+#endif
+
+char* cache_lookup(struct cache_request *request, const char* command, size_t *length, int *exit_code) {
+    char *output = NULL;
+#ifndef MORPHOS
+    size_t command_len = strlen(command);
+    unsigned long long hash;
+    int current = 0, slot, d;
+
+    if (!region) return NULL;
+    request->looked_up = time(NULL);
+    for (d = 0; d < request->dep_count; d++) cache_stat(request->deps[d], &request->states[d]);
+    hash = cache_hash(request, command, command_len);
+
+    cache_lock();
+    slot = cache_find(request, command, command_len, hash, &current);
+    if (slot >= 0) {
+        struct cache_entry *entry = &region->entries[slot];
+        if (!current || entry->expires <= request->looked_up) {
+            entry->hash = 0;   // Stale; the run about to happen replaces it
+        } else if ((output = malloc(entry->output_len + 1))) {
+            const char *record = cache_record(entry);
+            memcpy(output, record + entry->record_len - CACHE_ALIGN(entry->output_len), entry->output_len);
+            *length = entry->output_len;
+            *exit_code = entry->exit_code;
+        }
+    }
+    cache_unlock();
+    metrics_add(output ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES, 1);
+#else
+    (void)request;
+    (void)command;
+    (void)length;
+    (void)exit_code;
+#endif
+    return output;
+}
+
+void cache_store(const struct cache_request *request, const char* command,
+                 const char* output, size_t length, int exit_code) {
+#ifndef MORPHOS
+    size_t command_len = strlen(command);
+    size_t record_len;
+    unsigned long long hash;
+    struct cache_entry *entry;
+    char *record;
+    int current, slot, d, i;
+
+    if (!region || request->ttl <= 0) return;
+    record_len = cache_record_len(request, command_len, length);
+    if (record_len > (size_t)region->arena_size / 4) return;
+    for (d = 0; d < request->dep_count; d++) {
+        // Changed in the second before the run: a second change within the
+        // same timestamp tick would go unseen, as with racy git index entries
+        const struct cache_dep_state *state = &request->states[d];
+        if (state->exists && (state->mtime_sec >= request->looked_up - 1 ||
+                              state->ctime_sec >= request->looked_up - 1)) {
+            return;
+        }
+    }
+    hash = cache_hash(request, command, command_len);
+
+    cache_lock();
+    slot = cache_find(request, command, command_len, hash, &current);
+    for (i = 0; slot < 0 && i < CACHE_PROBE; i++) {
+        int candidate = (int)((hash + i) % CACHE_ENTRIES);
+        if (!cache_entry_live(&region->entries[candidate]) ||
+            region->entries[candidate].expires <= request->looked_up) {
+            slot = candidate;
+        }
+    }
+    if (slot < 0) {
+        // Every slot taken: the oldest goes
+        slot = (int)(hash % CACHE_ENTRIES);
+        for (i = 1; i < CACHE_PROBE; i++) {
+            int candidate = (int)((hash + i) % CACHE_ENTRIES);
+            if (region->entries[candidate].position < region->entries[slot].position) slot = candidate;
+        }
+    }
+
+    // Records never wrap: one that does not fit before the end starts over at the front
+    if (region->head % region->arena_size + (long long)record_len > region->arena_size) {
+        region->head += region->arena_size - region->head % region->arena_size;
+    }
+    entry = &region->entries[slot];
+    entry->hash = 0;
+    entry->position = region->head;
+    region->head += record_len;
+
+    record = cache_record(entry);
+    memcpy(record, command, command_len);
+    record += CACHE_ALIGN(command_len);
+    for (d = 0; d < request->dep_count; d++) {
+        memcpy(record, &request->states[d], sizeof(struct cache_dep_state));
+        record += sizeof(struct cache_dep_state);
+        memcpy(record, request->deps[d], request->states[d].path_len);
+        record += CACHE_ALIGN(request->states[d].path_len);
+    }
+    memcpy(record, output, length);
+
+    entry->expires = request->looked_up + request->ttl;
+    entry->record_len = record_len;
+    entry->command_len = command_len;
+    entry->output_len = length;
+    entry->dep_count = request->dep_count;
+    entry->exit_code = exit_code;
+    entry->hash = hash;
+    cache_unlock();
+    metrics_add(METRIC_CACHE_STORES, 1);
+#else
+    (void)request;
+    (void)command;
+    (void)output;
+    (void)length;
+    (void)exit_code;
+#endif
+}
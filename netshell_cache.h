@@ -0,0 +1,67 @@
+#ifndef NETSHELL_CACHE_H
+#define NETSHELL_CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Result cache for EXEC cache=<ttl>: the raw output and exit code of
+// commands the client marks as cacheable, kept in one shared memory region
+// mapped before the server forks, so every connection answers a repeated
+// query from memory without starting anything.
+//
+// An entry is keyed on the command text and the dependency paths declared
+// with dep=<path>. Each dependency's stat() (mtime, ctime, size, inode, or
+// that it is missing) is recorded before the command runs; a lookup that
+// finds any of them changed, or the entry past its TTL, is a miss. A
+// directory as dependency covers entries being added or removed.
+//
+// The region is a fixed budget: a table of entries and an arena written
+// front to back as a ring, so storing a new result overwrites the oldest
+// ones. A result larger than a quarter of the arena is not cached.
+
+#define CACHE_DEFAULT_MB 16
+#define CACHE_ENTRIES 1024
+#define CACHE_PROBE 8              // Table slots a key may live in
+#define CACHE_DEPS_MAX 8
+#define CACHE_PATH_MAX 512
+#define CACHE_TTL_MAX 86400        // Seconds
+
+struct cache_dep_state {
+    long long mtime_sec;
+    long long mtime_nsec;
+    long long ctime_sec;
+    long long ctime_nsec;
+    long long size;
+    long long inode;
+    int exists;
+    int path_len;                  // In the arena the path follows
+};
+
+// What EXEC asked for, and what the dependencies looked like at lookup
+struct cache_request {
+    int ttl;                       // 0: not cacheable
+    int dep_count;
+    char deps[CACHE_DEPS_MAX][CACHE_PATH_MAX];
+    struct cache_dep_state states[CACHE_DEPS_MAX];
+    long long looked_up;           // Unix time of the lookup
+};
+
+void cache_request_init(struct cache_request *request);
+
+// Map a region of megabytes. Call once in the server before forking
+// anything. Returns 0, or -1 if there is no cache (0 MB, no shared memory).
+int cache_init(size_t megabytes);
+
+// Largest output that is worth collecting for cache_store(); 0 without a cache
+size_t cache_max_output(void);
+
+// Look command up. On a hit returns a malloc()ed copy of its output, with
+// *length and *exit_code. On a miss returns NULL, leaving the dependencies'
+// current state in request for cache_store().
+char* cache_lookup(struct cache_request *request, const char* command, size_t *length, int *exit_code);
+
+// Store the output of a command that ran after cache_lookup() missed
+void cache_store(const struct cache_request *request, const char* command,
+                 const char* output, size_t length, int exit_code);
+
+#endif
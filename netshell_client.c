@@ -14,6 +14,15 @@
 #include <sys/time.h>
 #include <time.h>
 
+#include "netshell_common.h"
+#include "netshell_block.h"
+#include "netshell_crc32c.h"
+#include "netshell_stat.h"
+
+#ifdef NETSHELL_THREADS
+#include <pthread.h>
+#endif
+
 #define DEFAULT_PORT 2324
 #define BUFFER_SIZE 4096
 #define MAX_PATH 512
@@ -21,10 +30,50 @@
 #define DEFAULT_SESSION_FILE ".config/netshell/default"
 #define EXTENDED_PROTOCOL_MAGIC "NETSHELL_EXTENDED_V1\n"
 #define EXTENDED_ACK "EXTENDED_ACK\n"
+#define DEFAULT_STREAMS 4
+#define TRANSFER_ATTEMPTS 3
+#define MIN_RANGE_SIZE (1024 * 1024)
+#define MAX_STAT_PATHS 64
+#define EXEC_UNSUPPORTED -2
+#define EXEC_COMMAND_MAX 8192           // Longest command line the server reads
+#define BATCH_MAX 1024
+#define JOB_UNFINISHED -2
+#define SESSION_ENDED 0
+#define SESSION_DETACHED 1
+#define SESSION_LOST 2
+#define SESSION_TAKEN_OVER 3
+#define HEARTBEAT_INTERVAL_MS 2000       // Idle time before a session client sends PING
+#define HEARTBEAT_TIMEOUT_MS 6000        // Silence after which the link counts as dead
+#define RECONNECT_DEFAULT_LIMIT 300      // Seconds to keep retrying a dropped link
+#define RECONNECT_FIRST_DELAY_MS 250
+#define RECONNECT_MAX_DELAY_MS 10000
+#define RECONNECT_CONNECT_TIMEOUT_MS 3000
 
 // Global flag for extended protocol mode
 int extended_mode = 0;
 
+// Seconds to keep trying to reconnect a dropped link (0: do not reconnect)
+int reconnect_limit = RECONNECT_DEFAULT_LIMIT;
+int heartbeat_interval = HEARTBEAT_DEFAULT_INTERVAL;   // Seconds, 0: no heartbeat
+
+// EXEC options for commands typed in interactive mode; "warm=<name>" runs
+// them all on one shell on the server
+const char* interactive_exec_options = "";
+char warm_options[64];
+
+// EXEC option naming this user's warm shell on the server, which every
+// --warm run shares: warm=$USER, or warm=default if that is no valid name
+const char* warm_shell_option(void) {
+    const char* user = getenv("USER");
+    const char* valid = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-";
+
+    if (!user || !user[0] || user[0] == '.' || strlen(user) > 32 || strspn(user, valid) != strlen(user)) {
+        user = "default";
+    }
+    snprintf(warm_options, sizeof(warm_options), "warm=%s", user);
+    return warm_options;
+}
+
 // Session configuration structure
 struct SessionConfig {
     char hostname[256];
@@ -33,24 +82,28 @@ struct SessionConfig {
     char description[256];
     time_t last_used;
     int is_default;
+    int reconnect;          // Seconds to retry a dropped link, -1: default
+    long shell_session;     // Last persistent shell used, 0: none
 };
 
-// Function to establish connection
-int connect_to_server(const char* hostname, int port) {
+// Connect, giving up after timeout_ms (0: wait as long as the system does).
+// quiet leaves error reporting to the caller, for reconnect attempts.
+int connect_to_server_timeout(const char* hostname, int port, int timeout_ms, int quiet) {
     struct sockaddr_in server_addr;
     struct hostent *server;
     int sockfd;
+    int result;
 
     // Create socket
     if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
+        if (!quiet) perror("socket");
         return -1;
     }
 
     // Get host information
     server = gethostbyname(hostname);
     if (server == NULL) {
-        fprintf(stderr, "No such host: %s\n", hostname);
+        if (!quiet) fprintf(stderr, "No such host: %s\n", hostname);
         close(sockfd);
         return -1;
     }
@@ -61,16 +114,41 @@ int connect_to_server(const char* hostname, int port) {
     server_addr.sin_port = htons(port);
     memcpy(&server_addr.sin_addr, server->h_addr_list[0], server->h_length);
 
-    // Connect to server
-    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect");
+    // Connect to server; with a timeout the connect runs non-blocking
+    if (timeout_ms > 0) fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    result = connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    if (result < 0 && timeout_ms > 0 && errno == EINPROGRESS) {
+        struct pollfd pfd;
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        pfd.fd = sockfd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, timeout_ms) == 1 &&
+            getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0) {
+            result = 0;
+        } else {
+            errno = error ? error : ETIMEDOUT;
+        }
+    }
+    if (result < 0) {
+        if (!quiet) perror("connect");
         close(sockfd);
         return -1;
     }
+    if (timeout_ms > 0) fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+
+    // Notice a server that vanished even while we only wait for it
+    set_keepalive(sockfd, KEEPALIVE_IDLE, KEEPALIVE_INTERVAL, KEEPALIVE_COUNT);
 
     return sockfd;
 }
 
+// Function to establish connection
+int connect_to_server(const char* hostname, int port) {
+    return connect_to_server_timeout(hostname, port, 0, 0);
+}
+
 // Function to enable raw mode for terminal (for ncurses compatibility)
 void enable_raw_mode(struct termios *orig_termios) {
     struct termios raw = *orig_termios;
@@ -103,6 +181,7 @@ int negotiate_extended_protocol(int sockfd) {
     if (bytes_read > 0) {
         response[bytes_read] = '\0';
         if (strncmp(response, EXTENDED_ACK, strlen(EXTENDED_ACK)) == 0) {
+            set_nodelay(sockfd);
             return 1;
         }
     }
@@ -117,7 +196,8 @@ int send_file_to_server(int sockfd, const char* local_path, const char* remote_p
     char command[BUFFER_SIZE];
     char response[BUFFER_SIZE];
     char *file_buffer;
-    ssize_t bytes_read;
+    uint32_t crc;
+    int attempt;
 
     // Get file size
     if (stat(local_path, &file_stat) != 0) {
@@ -149,37 +229,41 @@ int send_file_to_server(int sockfd, const char* local_path, const char* remote_p
     }
 
     fclose(file);
+    crc = crc32c(0, file_buffer, file_stat.st_size);
+
+    // The server verifies the CRC32C and asks for a retransmit on mismatch
+    for (attempt = 0; attempt < TRANSFER_ATTEMPTS; attempt++) {
+        // Send command to server
+        snprintf(command, sizeof(command), "SEND_FILE %s %ld %08x\n",
+                 remote_path, (long)file_stat.st_size, (unsigned int)crc);
+        if (send_all(sockfd, command, strlen(command)) < 0) {
+            perror("send command");
+            break;
+        }
 
-    // Send command to server
-    snprintf(command, sizeof(command), "SEND_FILE %s %ld\n", remote_path, (long)file_stat.st_size);
-    if (send(sockfd, command, strlen(command), 0) < 0) {
-        perror("send command");
-        free(file_buffer);
-        return 0;
-    }
+        // Wait for server response
+        if (recv_line(sockfd, response, sizeof(response)) < 0 || strcmp(response, "READY") != 0) {
+            break;
+        }
 
-    // Wait for server response
-    bytes_read = recv(sockfd, response, sizeof(response) - 1, 0);
-    if (bytes_read > 0) {
-        response[bytes_read] = '\0';
-        if (strncmp(response, "READY", 5) == 0) {
-            // Send file content
-            if (send(sockfd, file_buffer, file_stat.st_size, 0) < 0) {
-                perror("send file");
-                free(file_buffer);
-                return 0;
-            }
+        // Send file content
+        if (send_all(sockfd, file_buffer, file_stat.st_size) < 0) {
+            perror("send file");
+            break;
+        }
 
-            // Wait for final response
-            bytes_read = recv(sockfd, response, sizeof(response) - 1, 0);
-            if (bytes_read > 0) {
-                response[bytes_read] = '\0';
-                if (strncmp(response, "OK", 2) == 0) {
-                    free(file_buffer);
-                    return 1;
-                }
-            }
+        // Wait for final response
+        if (recv_line(sockfd, response, sizeof(response)) < 0) {
+            break;
         }
+        if (strcmp(response, "OK") == 0) {
+            free(file_buffer);
+            return 1;
+        }
+        if (strcmp(response, "CHECKSUM_MISMATCH") != 0) {
+            break;
+        }
+        fprintf(stderr, "Server reported CRC32C mismatch, retransmitting %s\n", local_path);
     }
 
     free(file_buffer);
@@ -193,162 +277,1517 @@ int receive_file_from_server(int sockfd, const char* remote_path, const char* lo
     char *file_buffer = NULL;
     FILE *file;
     long file_size = 0;
-    ssize_t bytes_read;
+    unsigned int expected_crc = 0;
+    int fields;
+    int attempt;
+
+    for (attempt = 0; attempt < TRANSFER_ATTEMPTS; attempt++) {
+        // Send command to server
+        snprintf(command, sizeof(command), "GET_FILE %s\n", remote_path);
+        if (send_all(sockfd, command, strlen(command)) < 0) {
+            perror("send command");
+            return 0;
+        }
+
+        // Wait for server response with file size and CRC32C
+        if (recv_line(sockfd, response, sizeof(response)) < 0) {
+            return 0;
+        }
+        fields = sscanf(response, "SIZE %ld CRC32C %x", &file_size, &expected_crc);
+        if (fields < 1 || file_size < 0) {
+            // NOT_FOUND or ERROR
+            return 0;
+        }
+
+        // Allocate buffer for file content
+        file_buffer = malloc(file_size + 1);
+        if (!file_buffer) {
+            perror("malloc");
+            return 0;
+        }
+
+        // Read file content
+        if (recv_all(sockfd, file_buffer, file_size) != file_size) {
+            free(file_buffer);
+            return 0;
+        }
+
+        // Servers without integrity support send no CRC
+        if (fields == 2 && crc32c(0, file_buffer, file_size) != expected_crc) {
+            fprintf(stderr, "CRC32C mismatch receiving %s, retransmitting\n", remote_path);
+            free(file_buffer);
+            file_buffer = NULL;
+            continue;
+        }
+
+        // Write file to local system
+        file = fopen(local_path, "wb");
+        if (file) {
+            if (fwrite(file_buffer, 1, file_size, file) == (size_t)file_size) {
+                fclose(file);
+                free(file_buffer);
+                return 1;
+            } else {
+                perror("fwrite");
+            }
+            fclose(file);
+        } else {
+            perror("fopen");
+        }
+        break;
+    }
+
+    if (file_buffer) free(file_buffer);
+    return 0;
+}
+
+// Send a file as a parallel-compressed block stream (SEND_FILE_BLOCKS),
+// retransmitting if the server reports a CRC32C mismatch.
+// Returns 1 on success, 0 on failure, -1 if the server lacks block support.
+int send_file_blocks_to_server(int sockfd, const char* local_path, const char* remote_path) {
+    struct stat file_stat;
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    int attempt;
+    int fd;
+    int ok = 0;
+
+    fd = open(local_path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 0;
+    }
+    if (fstat(fd, &file_stat) != 0) {
+        perror("fstat");
+        close(fd);
+        return 0;
+    }
+
+    for (attempt = 0; attempt < TRANSFER_ATTEMPTS && !ok; attempt++) {
+        snprintf(command, sizeof(command), "SEND_FILE_BLOCKS %s %ld %d\n",
+                 remote_path, (long)file_stat.st_size, BLOCK_DEFAULT_SIZE);
+        if (send_all(sockfd, command, strlen(command)) < 0) {
+            perror("send command");
+            break;
+        }
+
+        if (recv_line(sockfd, response, sizeof(response)) < 0) {
+            break;
+        }
+        if (strcmp(response, "UNKNOWN_COMMAND") == 0) {
+            close(fd);
+            return -1;
+        }
+        if (strcmp(response, "READY") != 0) {
+            break;
+        }
+
+        ok = block_send_file(sockfd, fd, file_stat.st_size, BLOCK_DEFAULT_SIZE, default_worker_threads());
+        if (recv_line(sockfd, response, sizeof(response)) < 0) {
+            ok = 0;
+            break;
+        }
+        if (strcmp(response, "CHECKSUM_MISMATCH") == 0) {
+            fprintf(stderr, "Server reported CRC32C mismatch, retransmitting %s\n", local_path);
+            ok = 0;
+            continue;
+        }
+        ok = ok && strcmp(response, "OK") == 0;
+        break;
+    }
+
+    close(fd);
+    return ok;
+}
+
+// Receive a file as a parallel-compressed block stream (GET_FILE_BLOCKS),
+// requesting it again if a block or the whole file fails its CRC32C check.
+// The blocks go to <local_path>.netshell-tmp, renamed over local_path once
+// the whole file verified, so a failed transfer leaves an existing file as it was.
+// Returns 1 on success, 0 on failure, -1 if the server lacks block support.
+int receive_file_blocks_from_server(int sockfd, const char* remote_path, const char* local_path) {
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char temp_path[MAX_PATH + 16];
+    struct stat old_stat;
+    long file_size = 0;
+    long block_size = 0;
+    off_t received = 0;
+    int attempt;
+    int result = 0;
+    int fd;
+
+    snprintf(temp_path, sizeof(temp_path), "%s.netshell-tmp", local_path);
+    for (attempt = 0; attempt < TRANSFER_ATTEMPTS; attempt++) {
+        snprintf(command, sizeof(command), "GET_FILE_BLOCKS %s %d\n", remote_path, BLOCK_DEFAULT_SIZE);
+        if (send_all(sockfd, command, strlen(command)) < 0) {
+            perror("send command");
+            return 0;
+        }
+
+        if (recv_line(sockfd, response, sizeof(response)) < 0) return 0;
+        if (strcmp(response, "UNKNOWN_COMMAND") == 0) return -1;
+        if (sscanf(response, "BLOCKS %ld %ld", &file_size, &block_size) != 2) return 0;
+
+        fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            // Still consume the stream so the connection stays usable
+            perror("open");
+            fd = open("/dev/null", O_WRONLY);
+            block_receive_file(sockfd, fd, block_size, default_worker_threads(), &received);
+            close(fd);
+            return 0;
+        }
+        // A replaced file keeps its permissions
+        if (stat(local_path, &old_stat) == 0) fchmod(fd, old_stat.st_mode & 07777);
+        result = block_receive_file(sockfd, fd, block_size, default_worker_threads(), &received);
+        if (close(fd) != 0 && result > 0) result = 0;
+
+        if (result >= 0) break;
+        fprintf(stderr, "CRC32C mismatch receiving %s, retransmitting\n", remote_path);
+    }
+    if (result > 0 && received == file_size) {
+        if (rename(temp_path, local_path) == 0) return 1;
+        perror("rename");
+    }
+    unlink(temp_path);
+    return 0;
+}
+
+// Open a second connection in extended mode, for transfer streams
+int connect_extended(const char* hostname, int port) {
+    int sockfd = connect_to_server(hostname, port);
+    if (sockfd < 0) {
+        return -1;
+    }
+    if (!negotiate_extended_protocol(sockfd)) {
+        fprintf(stderr, "Server does not support the extended protocol\n");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+long long monotonic_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Reconnect after the link dropped, in extended mode. Attempts back off
+// exponentially from RECONNECT_FIRST_DELAY_MS to RECONNECT_MAX_DELAY_MS with
+// random jitter, so clients cut off together do not retry in lockstep, for
+// up to reconnect_limit seconds. Returns the socket, or -1.
+int reconnect_extended(const char* hostname, int port) {
+    long long give_up = monotonic_ms() + (long long)reconnect_limit * 1000;
+    int delay = RECONNECT_FIRST_DELAY_MS;
+    int attempt;
+
+    srand((unsigned int)(getpid() ^ monotonic_ms()));
+    for (attempt = 1; reconnect_limit > 0 && monotonic_ms() < give_up; attempt++) {
+        int sockfd = connect_to_server_timeout(hostname, port, RECONNECT_CONNECT_TIMEOUT_MS, 1);
+        if (sockfd >= 0) {
+            if (negotiate_extended_protocol(sockfd)) return sockfd;
+            close(sockfd);
+        }
+        if (attempt == 1 || attempt % 5 == 0) {
+            fprintf(stderr, "[reconnecting to %s:%d, attempt %d]\n", hostname, port, attempt);
+        }
+        usleep((delay / 2 + rand() % (delay / 2 + 1)) * 1000);
+        delay = delay * 2 > RECONNECT_MAX_DELAY_MS ? RECONNECT_MAX_DELAY_MS : delay * 2;
+    }
+    fprintf(stderr, "Could not reconnect to %s:%d\n", hostname, port);
+    return -1;
+}
+
+// Ask the server to drop this connection if we go silent for
+// HEARTBEAT_MISSES intervals of the given seconds. Older servers answer
+// UNKNOWN_COMMAND, which is just as fine.
+void announce_heartbeat(int sockfd, int interval) {
+    char command[64];
+    char response[BUFFER_SIZE];
+
+    if (interval <= 0) return;
+    snprintf(command, sizeof(command), "HEARTBEAT %d\n", interval);
+    if (send_all(sockfd, command, strlen(command)) >= 0) recv_line(sockfd, response, sizeof(response));
+}
 
-    // Send command to server
-    snprintf(command, sizeof(command), "GET_FILE %s\n", remote_path);
-    if (send(sockfd, command, strlen(command), 0) < 0) {
+// PING an idle link and wait up to one heartbeat interval for any answer.
+// Returns 1 if the server answered.
+int heartbeat_ok(int sockfd) {
+    char response[BUFFER_SIZE];
+    struct pollfd pfd;
+
+    if (send_all(sockfd, "PING\n", 5) < 0) return 0;
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, heartbeat_interval * 1000) != 1) return 0;
+    return recv_line(sockfd, response, sizeof(response)) >= 0;
+}
+
+// One byte range of a parallel transfer, moved over its own connection
+struct RangeTask {
+    const char *hostname;
+    int port;
+    const char *remote_path;
+    int local_fd;
+    int upload;
+    long long offset;
+    long long length;
+    long long total_size;
+    int ok;
+};
+
+void *transfer_range(void *arg) {
+    struct RangeTask *task = arg;
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    int sockfd;
+
+    task->ok = 0;
+    sockfd = connect_extended(task->hostname, task->port);
+    if (sockfd < 0) {
+        return NULL;
+    }
+
+    if (task->upload) {
+        snprintf(command, sizeof(command), "SEND_FILE_RANGE %s %lld %lld %lld\n",
+                 task->remote_path, task->offset, task->length, task->total_size);
+        if (send_all(sockfd, command, strlen(command)) >= 0 &&
+            recv_line(sockfd, response, sizeof(response)) >= 0 &&
+            strcmp(response, "READY") == 0 &&
+            send_file_range(sockfd, task->local_fd, task->offset, task->length) == 0 &&
+            recv_line(sockfd, response, sizeof(response)) >= 0 &&
+            strcmp(response, "OK") == 0) {
+            task->ok = 1;
+        }
+    } else {
+        long long offset, length, size;
+        snprintf(command, sizeof(command), "GET_FILE_RANGE %s %lld %lld\n",
+                 task->remote_path, task->offset, task->length);
+        if (send_all(sockfd, command, strlen(command)) >= 0 &&
+            recv_line(sockfd, response, sizeof(response)) >= 0 &&
+            sscanf(response, "RANGE %lld %lld %lld", &offset, &length, &size) == 3 &&
+            offset == task->offset && length == task->length &&
+            recv_file_range(sockfd, task->local_fd, offset, length) == 0) {
+            task->ok = 1;
+        }
+    }
+
+    close(sockfd);
+    return NULL;
+}
+
+// Ask the server for the CRC32C of a file, or of one range of it when
+// length >= 0; with staged, of what a ranged upload has written for it so
+// far. *size is set to the size of the whole remote file.
+int get_remote_checksum(const char* hostname, int port, const char* remote_path, int staged,
+                        long long offset, long long length, long long *size, uint32_t *checksum) {
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    unsigned int sum;
+    int ok = 0;
+    int sockfd = connect_extended(hostname, port);
+
+    if (sockfd < 0) {
+        return 0;
+    }
+    if (length >= 0) {
+        snprintf(command, sizeof(command), "CHECKSUM %s %lld %lld%s\n", remote_path, offset, length,
+                 staged ? " staged" : "");
+    } else {
+        snprintf(command, sizeof(command), "CHECKSUM %s%s\n", remote_path, staged ? " staged" : "");
+    }
+    if (send_all(sockfd, command, strlen(command)) >= 0 &&
+        recv_line(sockfd, response, sizeof(response)) >= 0 &&
+        sscanf(response, "CHECKSUM %lld %x", size, &sum) == 2) {
+        *checksum = sum;
+        ok = 1;
+    }
+    close(sockfd);
+    return ok;
+}
+
+// Compare every range of a parallel transfer with the remote copy and move
+// the ones that differ again. Returns the number of ranges resent, -1 on error.
+int repair_ranges(struct RangeTask *tasks, int streams) {
+    long long remote_size;
+    uint32_t local_sum, remote_sum;
+    int resent = 0;
+    int i;
+
+    for (i = 0; i < streams; i++) {
+        struct RangeTask *task = &tasks[i];
+        if (task->length == 0) continue;
+        if (crc32c_file(task->local_fd, task->offset, task->length, &local_sum) != 0 ||
+            !get_remote_checksum(task->hostname, task->port, task->remote_path, task->upload,
+                                 task->offset, task->length, &remote_size, &remote_sum)) {
+            return -1;
+        }
+        if (local_sum != remote_sum) {
+            fprintf(stderr, "Range %lld+%lld failed CRC32C check, retransmitting\n",
+                    task->offset, task->length);
+            transfer_range(task);
+            if (!task->ok) return -1;
+            resent++;
+        }
+    }
+    return resent;
+}
+
+// End a ranged upload. With commit the server checks what was staged against
+// size and checksum and moves it over remote_path; otherwise it drops it.
+// Returns 1 when committed (or dropped), 0 on a checksum mismatch, which
+// leaves the staged file for repair_ranges(), and -1 on error.
+int finish_upload(const char* hostname, int port, const char* remote_path, int commit,
+                  long long size, uint32_t checksum) {
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    int result = -1;
+    int sockfd = connect_extended(hostname, port);
+
+    if (sockfd < 0) {
+        return -1;
+    }
+    if (commit) {
+        snprintf(command, sizeof(command), "SEND_FILE_COMMIT %s %lld %08x\n", remote_path, size,
+                 (unsigned int)checksum);
+    } else {
+        snprintf(command, sizeof(command), "SEND_FILE_ABORT %s\n", remote_path);
+    }
+    if (send_all(sockfd, command, strlen(command)) >= 0 &&
+        recv_line(sockfd, response, sizeof(response)) >= 0) {
+        if (strcmp(response, "OK") == 0) {
+            result = 1;
+        } else if (strcmp(response, "CHECKSUM_MISMATCH") == 0) {
+            result = 0;
+        }
+    }
+    close(sockfd);
+    return result;
+}
+
+// Move one large file as byte ranges over several parallel connections, each
+// range written in place at its offset, then compare whole-file checksums.
+// Both ends write to a temporary file next to the target and only move it
+// into place once it verified, so a failed transfer leaves the target as it
+// was. Returns 1 on success, 0 on failure.
+int parallel_transfer(const char* hostname, int port, int upload,
+                      const char* local_path, const char* remote_path, int streams) {
+    struct RangeTask tasks[MAX_WORKER_THREADS];
+    char temp_path[MAX_PATH + 16];
+    struct timeval start, end;
+    long long total_size = 0;
+    long long chunk;
+    long long remote_size = 0;
+    uint32_t local_sum = 0, remote_sum = 0;
+    double elapsed;
+    int attempt;
+    int ok = 1;
+    int fd;
+    int i;
+
+    gettimeofday(&start, NULL);
+
+    if (upload) {
+        struct stat file_stat;
+        fd = open(local_path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &file_stat) != 0) {
+            perror("open");
+            if (fd >= 0) close(fd);
+            return 0;
+        }
+        total_size = file_stat.st_size;
+    } else {
+        // A zero-length range request reports the file size
+        char command[BUFFER_SIZE];
+        char response[BUFFER_SIZE];
+        long long offset, length;
+        int sockfd = connect_extended(hostname, port);
+        if (sockfd < 0) {
+            return 0;
+        }
+        snprintf(command, sizeof(command), "GET_FILE_RANGE %s 0 0\n", remote_path);
+        if (send_all(sockfd, command, strlen(command)) < 0 ||
+            recv_line(sockfd, response, sizeof(response)) < 0 ||
+            sscanf(response, "RANGE %lld %lld %lld", &offset, &length, &total_size) != 3) {
+            close(sockfd);
+            return 0;
+        }
+        close(sockfd);
+
+        snprintf(temp_path, sizeof(temp_path), "%s.netshell-tmp", local_path);
+        fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0 || ftruncate(fd, total_size) != 0) {
+            perror("open");
+            if (fd >= 0) {
+                close(fd);
+                unlink(temp_path);
+            }
+            return 0;
+        }
+    }
+
+    if (streams < 1) streams = 1;
+    if (streams > MAX_WORKER_THREADS) streams = MAX_WORKER_THREADS;
+    if (total_size / streams < MIN_RANGE_SIZE) {
+        streams = (int)(total_size / MIN_RANGE_SIZE);
+        if (streams < 1) streams = 1;
+    }
+    chunk = (total_size + streams - 1) / streams;
+
+    for (i = 0; i < streams; i++) {
+        tasks[i].hostname = hostname;
+        tasks[i].port = port;
+        tasks[i].remote_path = remote_path;
+        tasks[i].local_fd = fd;
+        tasks[i].upload = upload;
+        tasks[i].offset = chunk * i;
+        tasks[i].length = chunk * i >= total_size ? 0 :
+                          (total_size - chunk * i < chunk ? total_size - chunk * i : chunk);
+        tasks[i].total_size = total_size;
+        tasks[i].ok = 0;
+    }
+
+#ifdef NETSHELL_THREADS
+    {
+        pthread_t threads[MAX_WORKER_THREADS];
+        int started[MAX_WORKER_THREADS];
+        for (i = 0; i < streams; i++) {
+            started[i] = pthread_create(&threads[i], NULL, transfer_range, &tasks[i]) == 0;
+            if (!started[i]) {
+                transfer_range(&tasks[i]);
+            }
+        }
+        for (i = 0; i < streams; i++) {
+            if (started[i]) pthread_join(threads[i], NULL);
+        }
+    }
+#else
+    for (i = 0; i < streams; i++) {
+        transfer_range(&tasks[i]);
+    }
+#endif
+
+    for (i = 0; i < streams; i++) {
+        if (!tasks[i].ok) {
+            fprintf(stderr, "Range %lld+%lld failed\n", tasks[i].offset, tasks[i].length);
+            ok = 0;
+        }
+    }
+
+    // Final end-to-end integrity check; on mismatch find and resend the bad
+    // ranges. An upload is checked by the server as it commits the file.
+    for (attempt = 0; ok; attempt++) {
+        int matched;
+        if (crc32c_file(fd, 0, -1, &local_sum) != 0) {
+            matched = -1;
+        } else if (upload) {
+            matched = finish_upload(hostname, port, remote_path, 1, total_size, local_sum);
+        } else if (!get_remote_checksum(hostname, port, remote_path, 0, 0, -1, &remote_size, &remote_sum)) {
+            matched = -1;
+        } else {
+            matched = remote_size == total_size && remote_sum == local_sum;
+        }
+        if (matched < 0) {
+            fprintf(stderr, "Unable to verify transfer\n");
+            ok = 0;
+        } else if (matched) {
+            break;
+        } else if (attempt + 1 >= TRANSFER_ATTEMPTS || repair_ranges(tasks, streams) <= 0) {
+            fprintf(stderr, "CRC32C mismatch: local %08x\n", (unsigned int)local_sum);
+            ok = 0;
+        }
+    }
+
+    if (upload) {
+        if (!ok) finish_upload(hostname, port, remote_path, 0, 0, 0);
+    } else if (ok) {
+        // A replaced file keeps its permissions
+        struct stat old_stat;
+        if (stat(local_path, &old_stat) == 0) fchmod(fd, old_stat.st_mode & 07777);
+        if (rename(temp_path, local_path) != 0) {
+            perror("rename");
+            unlink(temp_path);
+            ok = 0;
+        }
+    } else {
+        unlink(temp_path);
+    }
+    close(fd);
+
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    if (ok) {
+        printf("%lld bytes over %d streams in %.2f s (%.1f MB/s)\n", total_size, streams,
+               elapsed, elapsed > 0 ? total_size / elapsed / 1e6 : 0.0);
+    }
+    return ok;
+}
+
+// Run a server-local file operation (COPY, MOVE, LINK, SYMLINK), showing
+// progress lines as they arrive. Returns 1 on success, 0 on failure.
+int remote_file_operation(int sockfd, const char* operation, const char* src, const char* dst) {
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    long long done, total;
+    int shown_progress = 0;
+
+    snprintf(command, sizeof(command), "%s %s %s\n", operation, src, dst);
+    if (send_all(sockfd, command, strlen(command)) < 0) {
         perror("send command");
         return 0;
     }
 
-    // Wait for server response with file size
-    bytes_read = recv(sockfd, response, sizeof(response) - 1, 0);
-    if (bytes_read > 0) {
-        response[bytes_read] = '\0';
+    while (recv_line(sockfd, response, sizeof(response)) >= 0) {
+        if (sscanf(response, "PROGRESS %lld %lld", &done, &total) == 2) {
+            printf("\r%s: %lld/%lld bytes (%d%%)", operation, done, total,
+                   total > 0 ? (int)(done * 100 / total) : 100);
+            fflush(stdout);
+            shown_progress = 1;
+            continue;
+        }
+        if (shown_progress) printf("\n");
+        if (strncmp(response, "OK", 2) == 0) {
+            return 1;
+        }
+        fprintf(stderr, "%s failed: %s\n", operation, response);
+        return 0;
+    }
+    return 0;
+}
+
+// Print a stat record as an ls -l style line
+void print_stat_record(const struct stat_record *record) {
+    char perms[11] = "----------";
+    char when[32] = "-";
+    time_t mtime = (time_t)record->mtime;
+    struct tm *tm;
+    int i;
+
+    if (record->flags & STAT_MISSING) {
+        printf("%-10s %12s %16s %.*s\n", "?", "-", "-", (int)record->name_len, record->name);
+        return;
+    }
+
+    if (S_ISDIR(record->mode)) perms[0] = 'd';
+    else if (S_ISLNK(record->mode)) perms[0] = 'l';
+    else if (S_ISCHR(record->mode)) perms[0] = 'c';
+    else if (S_ISBLK(record->mode)) perms[0] = 'b';
+    else if (S_ISFIFO(record->mode)) perms[0] = 'p';
+    else if (S_ISSOCK(record->mode)) perms[0] = 's';
+    for (i = 0; i < 9; i++) {
+        if (record->mode & (0400 >> i)) perms[i + 1] = "rwx"[i % 3];
+    }
+
+    if (record->flags & STAT_NOSTAT) {
+        printf("%c %.*s\n", perms[0], (int)record->name_len, record->name);
+        return;
+    }
+    tm = localtime(&mtime);
+    if (tm) strftime(when, sizeof(when), "%Y-%m-%d %H:%M", tm);
+    printf("%s %12llu %16s %.*s\n", perms, (unsigned long long)record->size, when,
+           (int)record->name_len, record->name);
+}
+
+// Read the "ENTRIES <count> <bytes>" pages of a LIST_DIR or STAT_MANY reply
+// up to "END <total>", printing each record.
+// Returns the number of records, or -1 on failure.
+long long read_stat_pages(int sockfd) {
+    char response[BUFFER_SIZE];
+    unsigned char *page = malloc(STAT_PAGE_BYTES);
+    struct stat_record record;
+    long long total = -1;
+    unsigned long bytes;
+    int count, i;
+
+    if (!page) return -1;
+    while (recv_line(sockfd, response, sizeof(response)) >= 0) {
+        if (sscanf(response, "ENTRIES %d %lu", &count, &bytes) == 2) {
+            size_t pos = 0, used;
+            if (bytes > STAT_PAGE_BYTES || recv_all(sockfd, page, bytes) <= 0) break;
+            for (i = 0; i < count; i++) {
+                used = stat_record_decode(&record, page + pos, bytes - pos);
+                if (used == 0) break;
+                print_stat_record(&record);
+                pos += used;
+            }
+            continue;
+        }
+        if (sscanf(response, "END %lld", &total) != 1) {
+            fprintf(stderr, "Listing failed: %s\n", response);
+        }
+        break;
+    }
+    free(page);
+    return total;
+}
+
+// List a remote directory. nostat asks only for names and types, which is
+// much cheaper on huge directories.
+int list_remote_dir(int sockfd, const char* remote_path, int nostat) {
+    char command[BUFFER_SIZE];
+    long long total;
+
+    snprintf(command, sizeof(command), "LIST_DIR %s %d%s\n", remote_path, STAT_PAGE_ENTRIES,
+             nostat ? " NOSTAT" : "");
+    if (send_all(sockfd, command, strlen(command)) < 0) {
+        perror("send command");
+        return 0;
+    }
+    total = read_stat_pages(sockfd);
+    if (total < 0) return 0;
+    printf("%lld entries\n", total);
+    return 1;
+}
+
+// Stat a batch of remote paths in one round trip
+int stat_remote_paths(int sockfd, char **paths, int count) {
+    char command[BUFFER_SIZE];
+    int i;
+
+    snprintf(command, sizeof(command), "STAT_MANY %d\n", count);
+    if (send_all(sockfd, command, strlen(command)) < 0) {
+        perror("send command");
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        snprintf(command, sizeof(command), "%s\n", paths[i]);
+        if (send_all(sockfd, command, strlen(command)) < 0) {
+            perror("send path");
+            return 0;
+        }
+    }
+    return read_stat_pages(sockfd) >= 0;
+}
+
+// Walk a remote tree with server-side filters (name=, type=, min_size=,
+// max_size=, newer=, older=, depth=, threads=). With summary only the
+// totals come back, du style.
+int walk_remote(int sockfd, const char* root, const char* options, int summary) {
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    unsigned long long matched, bytes, dirs, errors;
+
+    snprintf(command, sizeof(command), "WALK %s%s%s%s\n", root, options[0] ? " " : "", options,
+             summary ? " summary" : "");
+    if (send_all(sockfd, command, strlen(command)) < 0) {
+        perror("send command");
+        return 0;
+    }
+
+    if (summary) {
+        if (recv_line(sockfd, response, sizeof(response)) < 0) return 0;
+        if (sscanf(response, "SUMMARY %llu %llu %llu %llu", &matched, &bytes, &dirs, &errors) != 4) {
+            fprintf(stderr, "Walk failed: %s\n", response);
+            return 0;
+        }
+        printf("%llu entries, %llu bytes in %llu directories", matched, bytes, dirs);
+    } else {
+        long long total = read_stat_pages(sockfd);
+        if (total < 0) return 0;
+        printf("%lld entries", total);
+        errors = 0;
+    }
+    if (errors) printf(" (%llu unreadable)", errors);
+    printf("\n");
+    return 1;
+}
+
+// Watch remote paths, printing change events as the server pushes them.
+// Stops after the first event when until_first is set, otherwise when a
+// line is entered on stdin. Returns 1 if the watch ran, 0 on failure.
+int watch_remote(int sockfd, char **paths, int count, int until_first) {
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    size_t len;
+    int stopping = 0;
+    int i;
+
+    len = snprintf(command, sizeof(command), "WATCH");
+    for (i = 0; i < count && len < sizeof(command); i++) {
+        len += snprintf(command + len, sizeof(command) - len, " %s", paths[i]);
+    }
+    if (len + 1 >= sizeof(command)) {
+        fprintf(stderr, "Too many paths\n");
+        return 0;
+    }
+    command[len++] = '\n';
+    if (send_all(sockfd, command, len) < 0) {
+        perror("send command");
+        return 0;
+    }
+    if (recv_line(sockfd, response, sizeof(response)) < 0 || strncmp(response, "WATCHING", 8) != 0) {
+        fprintf(stderr, "Watch failed: %s\n", response);
+        return 0;
+    }
+    if (!until_first) printf("%s (press Enter to stop)\n", response);
+
+    while (1) {
+        struct pollfd pfd[2];
+        int nfds = 1;
+
+        pfd[0].fd = sockfd;
+        pfd[0].events = POLLIN;
+        if (!until_first && !stopping) {
+            pfd[1].fd = STDIN_FILENO;
+            pfd[1].events = POLLIN;
+            nfds = 2;
+        }
+        if (poll(pfd, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+
+        if (nfds == 2 && (pfd[1].revents & POLLIN)) {
+            char line[BUFFER_SIZE];
+            if (!fgets(line, sizeof(line), stdin)) line[0] = '\0';
+            send_all(sockfd, "UNWATCH\n", 8);
+            stopping = 1;
+        }
+
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            if (recv_line(sockfd, response, sizeof(response)) < 0) return 0;
+            if (strncmp(response, "END", 3) == 0) return 1;
+            if (strncmp(response, "EVENT ", 6) == 0) {
+                printf("%s\n", response + 6);
+                fflush(stdout);
+                if (until_first && !stopping) {
+                    send_all(sockfd, "UNWATCH\n", 8);
+                    stopping = 1;
+                }
+            }
+        }
+    }
+}
+
+// Follow remote logs, copying appended bytes to stdout (tail -f style, with
+// "==> path <==" headers when several files are followed). Stops when a
+// line is entered on stdin if stop_on_input is set, otherwise runs until the
+// connection drops. Returns 1 on a clean stop, 0 on failure.
+int follow_remote(int sockfd, char **paths, int count, int stop_on_input) {
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char data[BUFFER_SIZE * 16];
+    long long offset, length;
+    size_t len;
+    int current = -1;
+    int stopping = 0;
+    int index, i;
+
+    len = snprintf(command, sizeof(command), "FOLLOW_FILE");
+    for (i = 0; i < count && len < sizeof(command); i++) {
+        len += snprintf(command + len, sizeof(command) - len, " end %s", paths[i]);
+    }
+    if (len + 1 >= sizeof(command)) {
+        fprintf(stderr, "Too many paths\n");
+        return 0;
+    }
+    command[len++] = '\n';
+    if (send_all(sockfd, command, len) < 0) {
+        perror("send command");
+        return 0;
+    }
+    if (recv_line(sockfd, response, sizeof(response)) < 0 || strncmp(response, "FOLLOWING", 9) != 0) {
+        fprintf(stderr, "Follow failed: %s\n", response);
+        return 0;
+    }
+    if (stop_on_input) fprintf(stderr, "Following %d file(s), press Enter to stop\n", count);
+
+    while (1) {
+        struct pollfd pfd[2];
+        int nfds = 1;
+
+        pfd[0].fd = sockfd;
+        pfd[0].events = POLLIN;
+        if (stop_on_input && !stopping) {
+            pfd[1].fd = STDIN_FILENO;
+            pfd[1].events = POLLIN;
+            nfds = 2;
+        }
+        if (poll(pfd, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+
+        if (nfds == 2 && (pfd[1].revents & POLLIN)) {
+            char line[BUFFER_SIZE];
+            if (!fgets(line, sizeof(line), stdin)) line[0] = '\0';
+            send_all(sockfd, "UNFOLLOW\n", 9);
+            stopping = 1;
+        }
+
+        if (!(pfd[0].revents & (POLLIN | POLLHUP))) continue;
+        if (recv_line(sockfd, response, sizeof(response)) < 0) return 0;
+
+        if (sscanf(response, "DATA %d %lld %lld", &index, &offset, &length) == 3) {
+            if (count > 1 && index != current && index >= 0 && index < count) {
+                printf("\n==> %s <==\n", paths[index]);
+            }
+            current = index;
+            while (length > 0) {
+                size_t chunk = length > (long long)sizeof(data) ? sizeof(data) : (size_t)length;
+                if (recv_all(sockfd, data, chunk) <= 0) return 0;
+                fwrite(data, 1, chunk, stdout);
+                length -= chunk;
+            }
+            fflush(stdout);
+        } else if (sscanf(response, "ROTATED %d", &index) == 1 ||
+                   sscanf(response, "TRUNCATED %d", &index) == 1) {
+            if (index >= 0 && index < count) {
+                fprintf(stderr, "%s: file %s\n", paths[index],
+                        response[0] == 'R' ? "rotated" : "truncated");
+            }
+        } else if (strcmp(response, "END") == 0) {
+            return 1;
+        }
+    }
+}
+
+// -f: follow remote logs until interrupted
+int follow_files(const char* hostname, int port, char **paths, int count) {
+    int sockfd = connect_extended(hostname, port);
+    int result;
+
+    if (sockfd < 0) return 1;
+    result = follow_remote(sockfd, paths, count, 0);
+    close(sockfd);
+    return result ? 0 : 1;
+}
+
+// -w: wait until one of the paths changes, then exit
+int wait_for_change(const char* hostname, int port, char **paths, int count) {
+    int sockfd = connect_extended(hostname, port);
+    int result;
+
+    if (sockfd < 0) return 1;
+    result = watch_remote(sockfd, paths, count, 1);
+    close(sockfd);
+    return result ? 0 : 1;
+}
+
+// Run a command with EXEC, copying its output (already filtered on the
+// server by the options in filter, e.g. "grep=error head=20") to stdout.
+// Returns the remote exit code, -1 on failure, or EXEC_UNSUPPORTED if the
+// server has no EXEC command.
+int exec_remote(int sockfd, const char* command, const char* filter) {
+    char header[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char data[BUFFER_SIZE * 16];
+    size_t command_len = strlen(command);
+    int multiline = strchr(command, '\n') != NULL;
+    unsigned long length;
+    int code;
+
+    // Multi-line scripts go as a raw body rather than a single line
+    if (multiline) {
+        snprintf(header, sizeof(header), "EXEC%s%s script=%lu\n", filter[0] ? " " : "", filter,
+                 (unsigned long)command_len);
+    } else {
+        snprintf(header, sizeof(header), "EXEC%s%s\n", filter[0] ? " " : "", filter);
+    }
+    if (send_all(sockfd, header, strlen(header)) < 0 ||
+        send_all(sockfd, command, command_len) < 0 ||
+        (!multiline && send_all(sockfd, "\n", 1) < 0)) {
+        perror("send command");
+        return -1;
+    }
+
+    while (recv_line(sockfd, response, sizeof(response)) >= 0) {
+        if (sscanf(response, "OUTPUT %lu", &length) == 1) {
+            while (length > 0) {
+                size_t chunk = length > sizeof(data) ? sizeof(data) : length;
+                if (recv_all(sockfd, data, chunk) <= 0) return -1;
+                fwrite(data, 1, chunk, stdout);
+                length -= chunk;
+            }
+            fflush(stdout);
+        } else if (sscanf(response, "EXIT %d", &code) == 1) {
+            return code;
+        } else if (strcmp(response, "UNKNOWN_COMMAND") == 0) {
+            return EXEC_UNSUPPORTED;
+        } else {
+            fprintf(stderr, "Command failed: %s\n", response);
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Function to execute a command and return output
+// In extended mode the command runs through EXEC and its exit code is
+// returned; filter holds EXEC filter options ("" for none).
+int execute_command(const char* hostname, int port, const char* command, const char* filter) {
+    int sockfd = connect_to_server(hostname, port);
+    if (sockfd < 0) {
+        return 1;
+    }
+
+    // Try to negotiate extended protocol
+    extended_mode = negotiate_extended_protocol(sockfd);
+    
+    if (extended_mode) {
+        int code = exec_remote(sockfd, command, filter);
+        if (code != EXEC_UNSUPPORTED) {
+            close(sockfd);
+            return code < 0 ? 1 : code;
+        }
+        // Older server: run it through the shell of a basic connection
+        close(sockfd);
+        sockfd = connect_to_server(hostname, port);
+        if (sockfd < 0) {
+            return 1;
+        }
+    }
+    if (filter[0]) {
+        fprintf(stderr, "Server cannot filter output; showing all of it\n");
+    }
+
+    // Send the command
+    char cmd_buffer[BUFFER_SIZE];
+    snprintf(cmd_buffer, sizeof(cmd_buffer), "%s\n", command);
+    if (send(sockfd, cmd_buffer, strlen(cmd_buffer), 0) < 0) {
+        perror("send");
+        close(sockfd);
+        return 1;
+    }
+
+    // Receive and print output with timeout
+    char response[BUFFER_SIZE];
+    ssize_t bytes_read;
+    fd_set read_fds;
+    struct timeval timeout;
+    
+    while (1) {
+        FD_ZERO(&read_fds);
+        FD_SET(sockfd, &read_fds);
         
-        if (strncmp(response, "SIZE", 4) == 0) {
-            // Parse file size
-            sscanf(response, "SIZE %ld", &file_size);
-            
-            // Allocate buffer for file content
-            file_buffer = malloc(file_size);
-            if (!file_buffer) {
-                perror("malloc");
-                return 0;
+        // Set timeout to 2 seconds
+        timeout.tv_sec = 2;
+        timeout.tv_usec = 0;
+        
+        int select_result = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
+        
+        if (select_result < 0) {
+            perror("select");
+            break;
+        } else if (select_result == 0) {
+            // Timeout - no more data, break
+            break;
+        }
+        
+        if (FD_ISSET(sockfd, &read_fds)) {
+            bytes_read = recv(sockfd, response, sizeof(response) - 1, 0);
+            if (bytes_read > 0) {
+                response[bytes_read] = '\0';
+                printf("%s", response);
+                fflush(stdout);
+            } else if (bytes_read <= 0) {
+                // Connection closed or error
+                break;
+            }
+        }
+    }
+
+    close(sockfd);
+    return 0;
+}
+
+// Function to execute a command from file and return output
+int execute_command_from_file(const char* hostname, int port, const char* filename, const char* filter) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("fopen");
+        return 1;
+    }
+
+    // Read the entire file content
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *command = malloc(file_size + 1);
+    if (!command) {
+        fclose(file);
+        perror("malloc");
+        return 1;
+    }
+
+    size_t bytes_read = fread(command, 1, file_size, file);
+    command[bytes_read] = '\0';
+    fclose(file);
+
+    // Remove trailing newline if present
+    if (bytes_read > 0 && command[bytes_read - 1] == '\n') {
+        command[bytes_read - 1] = '\0';
+    }
+
+    int result = execute_command(hostname, port, command, filter);
+    free(command);
+    return result;
+}
+
+// Output of one batch command, held until it exits when commands run in parallel
+struct BatchResult {
+    char *output;
+    size_t len;
+    size_t cap;
+};
+
+// Run every line of filename (skipping blank lines and # comments) as one
+// BATCH on a single connection, with up to parallel commands at a time.
+// Each command's output is printed under a "==> [n] command <==" header with
+// its exit code and duration. Returns 0 if every command succeeded.
+int execute_batch(const char* hostname, int port, const char* filename, int parallel, const char* filter) {
+    char line[EXEC_COMMAND_MAX];
+    char response[BUFFER_SIZE];
+    char data[BUFFER_SIZE * 16];
+    char *commands[BATCH_MAX];
+    struct BatchResult *results = NULL;
+    unsigned long length;
+    long ms;
+    int count = 0, tag, code, failed = -1, live = -1, total;
+    int sockfd = -1, lineno = 0;
+    int i;
+    FILE *file = fopen(filename, "r");
+
+    if (!file) {
+        perror("fopen");
+        return 1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        char *start = line + strspn(line, " \t");
+        lineno++;
+        if (!strchr(line, '\n') && strlen(line) == sizeof(line) - 1) {
+            // fgets split the line, and the server would not read it whole either
+            fprintf(stderr, "%s: line %d longer than %d bytes\n", filename, lineno, (int)sizeof(line) - 2);
+            goto done;
+        }
+        start[strcspn(start, "\r\n")] = '\0';
+        if (start[0] == '\0' || start[0] == '#') continue;
+        if (count == BATCH_MAX) {
+            // The server takes no more in one batch; running part of the file is worse than none
+            fprintf(stderr, "%s: more than %d commands in a batch\n", filename, BATCH_MAX);
+            goto done;
+        }
+        if (!(commands[count] = strdup(start))) {
+            perror("strdup");
+            goto done;
+        }
+        count++;
+    }
+    fclose(file);
+    file = NULL;
+    if (count == 0) return 0;
+
+    results = calloc(count, sizeof(*results));
+    sockfd = connect_extended(hostname, port);
+    if (!results || sockfd < 0) goto done;
+
+    snprintf(line, sizeof(line), "BATCH %d parallel=%d%s%s\n", count, parallel, filter[0] ? " " : "", filter);
+    if (send_all(sockfd, line, strlen(line)) < 0) goto done;
+    for (i = 0; i < count; i++) {
+        if (send_all(sockfd, commands[i], strlen(commands[i])) < 0 || send_all(sockfd, "\n", 1) < 0) goto done;
+    }
+
+    while (recv_line(sockfd, response, sizeof(response)) >= 0) {
+        if (sscanf(response, "OUTPUT %d %lu", &tag, &length) == 2 && tag >= 0 && tag < count) {
+            struct BatchResult *result = &results[tag];
+            // Run one at a time, output can stream straight through
+            if (parallel == 1 && live != tag) {
+                printf("==> [%d] %s <==\n", tag + 1, commands[tag]);
+                live = tag;
             }
+            while (length > 0) {
+                size_t chunk = length > sizeof(data) ? sizeof(data) : length;
+                if (recv_all(sockfd, data, chunk) <= 0) goto done;
+                if (parallel == 1) {
+                    fwrite(data, 1, chunk, stdout);
+                } else {
+                    if (result->len + chunk > result->cap) {
+                        size_t cap = (result->len + chunk) * 2;
+                        char *grown = realloc(result->output, cap);
+                        if (!grown) goto done;
+                        result->output = grown;
+                        result->cap = cap;
+                    }
+                    memcpy(result->output + result->len, data, chunk);
+                    result->len += chunk;
+                }
+                length -= chunk;
+            }
+        } else if (sscanf(response, "EXIT %d %d %ld", &tag, &code, &ms) == 3 && tag >= 0 && tag < count) {
+            if (live != tag) printf("==> [%d] %s <==\n", tag + 1, commands[tag]);
+            fwrite(results[tag].output ? results[tag].output : "", 1, results[tag].len, stdout);
+            printf("[exit %d, %ld ms]\n", code, ms);
+            fflush(stdout);
+            free(results[tag].output);
+            results[tag].output = NULL;
+            live = -1;
+        } else if (sscanf(response, "BATCH_END %d %d %ld", &total, &failed, &ms) == 3) {
+            fprintf(stderr, "%d commands, %d failed, %ld ms\n", total, failed, ms);
+            break;
+        } else if (strcmp(response, "UNKNOWN_COMMAND") == 0) {
+            // Older server: send the file to its shell as before
+            close(sockfd);
+            sockfd = -1;
+            failed = execute_command_from_file(hostname, port, filename, filter);
+            break;
+        } else {
+            fprintf(stderr, "Batch failed: %s\n", response);
+            break;
+        }
+    }
+
+done:
+    if (file) fclose(file);
+    if (sockfd >= 0) close(sockfd);
+    for (i = 0; i < count; i++) {
+        free(commands[i]);
+        if (results) free(results[i].output);
+    }
+    free(results);
+    return failed == 0 ? 0 : 1;
+}
+
+// Queue a command as a detached job on the server. Returns its id, or -1.
+long submit_job(int sockfd, const char* command) {
+    char header[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    size_t command_len = strlen(command);
+    int multiline = strchr(command, '\n') != NULL;
+    long id;
+
+    if (multiline) {
+        snprintf(header, sizeof(header), "JOB_SUBMIT script=%lu\n", (unsigned long)command_len);
+    } else {
+        snprintf(header, sizeof(header), "JOB_SUBMIT\n");
+    }
+    if (send_all(sockfd, header, strlen(header)) < 0 ||
+        send_all(sockfd, command, command_len) < 0 ||
+        (!multiline && send_all(sockfd, "\n", 1) < 0)) {
+        perror("send command");
+        return -1;
+    }
+    if (recv_line(sockfd, response, sizeof(response)) < 0) return -1;
+    if (sscanf(response, "SUBMITTED %ld", &id) == 1) return id;
+    fprintf(stderr, "Submit failed: %s\n", response);
+    return -1;
+}
+
+// Print one "JOB ..." status line from the server
+void print_job_status(const char* response) {
+    char state[32];
+    long id;
+    int code, command_start = 0;
+    long long bytes, submitted, started, finished;
+
+    if (sscanf(response, "JOB %ld %31s %d %lld %lld %lld %lld %n", &id, state, &code, &bytes,
+               &submitted, &started, &finished, &command_start) < 7) {
+        return;
+    }
+    if (strcmp(state, "done") == 0) {
+        snprintf(state + strlen(state), sizeof(state) - strlen(state), " (%d)", code);
+    }
+    printf("%6ld  %-12s %10lld  %s\n", id, state, bytes, command_start ? response + command_start : "");
+}
+
+// Show one job (id > 0) or every job on the server. Returns 0 or -1.
+int show_jobs(int sockfd, long id) {
+    char command[64];
+    char response[BUFFER_SIZE];
+
+    if (id > 0) {
+        snprintf(command, sizeof(command), "JOB_STATUS %ld\n", id);
+    } else {
+        snprintf(command, sizeof(command), "JOB_STATUS\n");
+    }
+    if (send_all(sockfd, command, strlen(command)) < 0) return -1;
+
+    printf("%6s  %-12s %10s  %s\n", "ID", "STATE", "OUTPUT", "COMMAND");
+    while (recv_line(sockfd, response, sizeof(response)) >= 0) {
+        if (strncmp(response, "JOB ", 4) == 0) {
+            print_job_status(response);
+            if (id > 0) return 0;
+        } else if (strncmp(response, "END", 3) == 0) {
+            return 0;
+        } else {
+            fprintf(stderr, "Job status failed: %s\n", response);
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Copy a job's output from offset to stdout. With follow, keeps waiting for
+// output until the job ends, or until a line is entered on stdin if
+// stop_on_input is set. Returns the job's exit code, JOB_UNFINISHED if it
+// was still going, or -1 on failure.
+int job_output_remote(int sockfd, long id, long long offset, int follow, int stop_on_input) {
+    char command[128];
+    char response[BUFFER_SIZE];
+    char data[BUFFER_SIZE * 16];
+    char state[32];
+    long long at, length;
+    int stopping = 0;
+    int code;
 
-            // Read file content
-            ssize_t total_read = 0;
-            while (total_read < file_size) {
-                bytes_read = recv(sockfd, file_buffer + total_read, 
-                                file_size - total_read, 0);
-                if (bytes_read <= 0) break;
-                total_read += bytes_read;
-            }
+    snprintf(command, sizeof(command), "JOB_OUTPUT %ld %lld%s\n", id, offset, follow ? " follow" : "");
+    if (send_all(sockfd, command, strlen(command)) < 0) return -1;
 
-            if (total_read == file_size) {
-                // Write file to local system
-                file = fopen(local_path, "wb");
-                if (file) {
-                    if (fwrite(file_buffer, 1, file_size, file) == (size_t)file_size) {
-                        fclose(file);
-                        free(file_buffer);
-                        return 1;
-                    } else {
-                        perror("fwrite");
-                    }
-                    fclose(file);
-                } else {
-                    perror("fopen");
-                }
+    while (1) {
+        if (stop_on_input && follow && !stopping) {
+            struct pollfd pfd[2];
+            pfd[0].fd = sockfd;
+            pfd[0].events = POLLIN;
+            pfd[1].fd = STDIN_FILENO;
+            pfd[1].events = POLLIN;
+            if (poll(pfd, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (pfd[1].revents & POLLIN) {
+                char line[BUFFER_SIZE];
+                if (!fgets(line, sizeof(line), stdin)) line[0] = '\0';
+                send_all(sockfd, "STOP\n", 5);
+                stopping = 1;
             }
-        } else if (strncmp(response, "NOT_FOUND", 9) == 0) {
-            // File not found on server
+            if (!(pfd[0].revents & (POLLIN | POLLHUP))) continue;
+        }
+        if (recv_line(sockfd, response, sizeof(response)) < 0) return -1;
+
+        if (sscanf(response, "DATA %lld %lld", &at, &length) == 2) {
+            if (at > offset) fprintf(stderr, "[%lld bytes of output no longer kept]\n", at - offset);
+            offset = at + length;
+            while (length > 0) {
+                size_t chunk = length > (long long)sizeof(data) ? sizeof(data) : (size_t)length;
+                if (recv_all(sockfd, data, chunk) <= 0) return -1;
+                fwrite(data, 1, chunk, stdout);
+                length -= chunk;
+            }
+            fflush(stdout);
+        } else if (sscanf(response, "END %lld %31s %d", &at, state, &code) == 3) {
+            if (strcmp(state, "done") == 0) return code;
+            if (strcmp(state, "queued") == 0 || strcmp(state, "running") == 0) return JOB_UNFINISHED;
+            fprintf(stderr, "Job %ld %s\n", id, state);
+            return -1;
+        } else {
+            fprintf(stderr, "Job output failed: %s\n", response);
+            return -1;
         }
     }
-
-    if (file_buffer) free(file_buffer);
-    return 0;
 }
 
-// Function to execute a command and return output
-int execute_command(const char* hostname, int port, const char* command) {
-    int sockfd = connect_to_server(hostname, port);
-    if (sockfd < 0) {
-        return 1;
-    }
+// Ask the server to cancel a job. Returns 0 or -1.
+int cancel_job(int sockfd, long id) {
+    char command[64];
+    char response[BUFFER_SIZE];
 
-    // Try to negotiate extended protocol
-    extended_mode = negotiate_extended_protocol(sockfd);
-    
-    if (extended_mode) {
-        // We don't need extended features for simple command execution
-        // Just send the command and get the output
+    snprintf(command, sizeof(command), "JOB_CANCEL %ld\n", id);
+    if (send_all(sockfd, command, strlen(command)) < 0 ||
+        recv_line(sockfd, response, sizeof(response)) < 0) {
+        return -1;
     }
+    if (strcmp(response, "OK") == 0) return 0;
+    fprintf(stderr, "Cancel failed: %s\n", strcmp(response, "FINISHED") == 0 ? "job already finished" : response);
+    return -1;
+}
 
-    // Send the command
-    char cmd_buffer[BUFFER_SIZE];
-    snprintf(cmd_buffer, sizeof(cmd_buffer), "%s\n", command);
-    if (send(sockfd, cmd_buffer, strlen(cmd_buffer), 0) < 0) {
-        perror("send");
-        close(sockfd);
-        return 1;
+// Print the server's metrics (Prometheus text format). Returns 0 or -1.
+int show_server_stats(int sockfd) {
+    char response[BUFFER_SIZE];
+    char *text;
+    long len;
+
+    if (send_all(sockfd, "STATS\n", 6) < 0 || recv_line(sockfd, response, sizeof(response)) < 0) return -1;
+    if (sscanf(response, "STATS %ld", &len) != 1 || len < 0) {
+        fprintf(stderr, "Stats not available: %s\n", response);
+        return -1;
+    }
+    text = malloc(len + 1);
+    if (!text || recv_all(sockfd, text, len) != len) {
+        free(text);
+        return -1;
     }
+    fwrite(text, 1, len, stdout);
+    free(text);
+    return 0;
+}
 
-    // Receive and print output with timeout
+// Print the server's per-phase connection latency percentiles. Returns 0 or -1.
+int show_trace_report(int sockfd) {
     char response[BUFFER_SIZE];
-    ssize_t bytes_read;
-    fd_set read_fds;
-    struct timeval timeout;
-    
-    while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(sockfd, &read_fds);
-        
-        // Set timeout to 2 seconds
-        timeout.tv_sec = 2;
-        timeout.tv_usec = 0;
-        
-        int select_result = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (select_result < 0) {
-            perror("select");
-            break;
-        } else if (select_result == 0) {
-            // Timeout - no more data, break
-            break;
-        }
-        
-        if (FD_ISSET(sockfd, &read_fds)) {
-            bytes_read = recv(sockfd, response, sizeof(response) - 1, 0);
-            if (bytes_read > 0) {
-                response[bytes_read] = '\0';
-                printf("%s", response);
-                fflush(stdout);
-            } else if (bytes_read <= 0) {
-                // Connection closed or error
-                break;
-            }
+    char phase[32], mode[32];
+    long long p50, p90, p99, max;
+    int count, connections;
+
+    if (send_all(sockfd, "TRACE_REPORT\n", 13) < 0) return -1;
+    printf("%-11s %-9s %7s %10s %10s %10s %10s\n", "PHASE", "MODE", "COUNT", "P50 ms", "P90 ms", "P99 ms", "MAX ms");
+    while (recv_line(sockfd, response, sizeof(response)) >= 0) {
+        if (sscanf(response, "PHASE %31s %31s %d %lld %lld %lld %lld", phase, mode, &count,
+                   &p50, &p90, &p99, &max) == 7) {
+            printf("%-11s %-9s %7d %10.3f %10.3f %10.3f %10.3f\n", phase, mode, count,
+                   p50 / 1000.0, p90 / 1000.0, p99 / 1000.0, max / 1000.0);
+        } else if (sscanf(response, "END %d", &connections) == 1) {
+            printf("(%d recent connections)\n", connections);
+            return 0;
+        } else {
+            fprintf(stderr, "Trace report not available: %s\n", response);
+            return -1;
         }
     }
+    return -1;
+}
+
+// --stats / --trace-report: print the server's metrics or latency report and exit
+int print_server_stats(const char* hostname, int port, int trace_only) {
+    int sockfd = connect_extended(hostname, port);
+    int result;
+
+    if (sockfd < 0) return 1;
+    result = trace_only ? show_trace_report(sockfd) : show_server_stats(sockfd);
+    close(sockfd);
+    return result == 0 ? 0 : 1;
+}
 
+// --submit: queue a command, print its job id and exit
+int submit_job_command(const char* hostname, int port, const char* command) {
+    int sockfd = connect_extended(hostname, port);
+    long id;
+
+    if (sockfd < 0) return 1;
+    id = submit_job(sockfd, command);
     close(sockfd);
+    if (id < 0) return 1;
+    printf("%ld\n", id);
     return 0;
 }
 
-// Function to execute a command from file and return output
-int execute_command_from_file(const char* hostname, int port, const char* filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        perror("fopen");
-        return 1;
-    }
+// --attach: stream a job's output from the start until it ends, exiting
+// with its exit code
+int attach_job(const char* hostname, int port, long id) {
+    int sockfd = connect_extended(hostname, port);
+    int code;
 
-    // Read the entire file content
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    if (sockfd < 0) return 1;
+    code = job_output_remote(sockfd, id, 0, 1, 0);
+    close(sockfd);
+    return code < 0 ? 1 : code;
+}
 
-    char *command = malloc(file_size + 1);
-    if (!command) {
-        fclose(file);
-        perror("malloc");
-        return 1;
-    }
+// Talk to an attached shell session: stdin lines go to the shell, its
+// output to stdout. A line holding only "~." (or EOF on stdin) detaches and
+// leaves the shell running. The link is checked with PING when idle.
+// *offset tracks the output bytes seen so far, so a later attach can replay
+// just the rest. Returns SESSION_ENDED with the shell's exit code in
+// *exit_code, SESSION_DETACHED, SESSION_TAKEN_OVER if another connection
+// attached, or SESSION_LOST if the connection dropped.
+int session_loop(int sockfd, long long *offset, int *exit_code) {
+    char response[BUFFER_SIZE];
+    char data[BUFFER_SIZE * 16];
+    char line[BUFFER_SIZE + 64];
+    long long at, length;
+    long long last_heard = monotonic_ms();
+    int ping_sent = 0;
+    int input_open = 1;
 
-    size_t bytes_read = fread(command, 1, file_size, file);
-    command[bytes_read] = '\0';
-    fclose(file);
+    while (1) {
+        struct pollfd pfd[2];
+        int nfds = input_open ? 2 : 1;
+        int ready;
+
+        pfd[0].fd = sockfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = STDIN_FILENO;
+        pfd[1].events = POLLIN;
+        ready = poll(pfd, nfds, HEARTBEAT_INTERVAL_MS / 2);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return SESSION_LOST;
+        }
 
-    // Remove trailing newline if present
-    if (bytes_read > 0 && command[bytes_read - 1] == '\n') {
-        command[bytes_read - 1] = '\0';
+        // A quiet link gets a PING; one that stays silent is dead even
+        // without a FIN or RST (laptop suspended, NAT entry expired, roaming)
+        if (monotonic_ms() - last_heard >= HEARTBEAT_TIMEOUT_MS) return SESSION_LOST;
+        if (!ping_sent && monotonic_ms() - last_heard >= HEARTBEAT_INTERVAL_MS) {
+            if (send_all(sockfd, "PING\n", 5) < 0) return SESSION_LOST;
+            ping_sent = 1;
+        }
+        if (ready == 0) continue;
+
+        if (nfds == 2 && (pfd[1].revents & (POLLIN | POLLHUP))) {
+            char input[BUFFER_SIZE];
+            if (!fgets(input, sizeof(input), stdin) || strcmp(input, "~.\n") == 0) {
+                send_all(sockfd, "DETACH\n", 7);
+                input_open = 0;
+            } else {
+                size_t len = strlen(input);
+                int header = snprintf(line, sizeof(line), "INPUT %lu\n", (unsigned long)len);
+                memcpy(line + header, input, len);
+                if (send_all(sockfd, line, header + len) < 0) return SESSION_LOST;
+            }
+        }
+
+        if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        if (recv_line(sockfd, response, sizeof(response)) < 0) return SESSION_LOST;
+        last_heard = monotonic_ms();
+        ping_sent = 0;
+
+        if (strcmp(response, "PONG") == 0) {
+            continue;
+        } else if (sscanf(response, "DATA %lld %lld", &at, &length) == 2) {
+            if (at > *offset) fprintf(stderr, "[%lld bytes of output no longer kept]\n", at - *offset);
+            while (length > 0) {
+                size_t chunk = length > (long long)sizeof(data) ? sizeof(data) : (size_t)length;
+                if (recv_all(sockfd, data, chunk) <= 0) return SESSION_LOST;
+                fwrite(data, 1, chunk, stdout);
+                at += chunk;
+                length -= chunk;
+            }
+            *offset = at;
+            fflush(stdout);
+        } else if (sscanf(response, "EXIT %d", exit_code) == 1) {
+            return SESSION_ENDED;
+        } else if (strcmp(response, "DETACHED") == 0) {
+            return input_open ? SESSION_TAKEN_OVER : SESSION_DETACHED;
+        } else {
+            fprintf(stderr, "Session error: %s\n", response);
+            return SESSION_LOST;
+        }
     }
+}
 
-    int result = execute_command(hostname, port, command);
-    free(command);
-    return result;
+// Print the server's persistent shell sessions. Returns 0 or -1.
+int list_remote_sessions(int sockfd) {
+    char response[BUFFER_SIZE];
+    long id, pid;
+    int attached, running, code;
+    long long bytes, created;
+
+    if (send_all(sockfd, "SESSION_LIST\n", 13) < 0) return -1;
+    printf("%6s  %8s  %-10s %10s  %s\n", "ID", "PID", "STATE", "OUTPUT", "CREATED");
+    while (recv_line(sockfd, response, sizeof(response)) >= 0) {
+        if (sscanf(response, "SESSION %ld %ld %d %d %d %lld %lld", &id, &pid, &attached, &running, &code,
+                   &bytes, &created) == 7) {
+            char state[32];
+            char when[32];
+            time_t t = (time_t)created;
+            if (running) {
+                snprintf(state, sizeof(state), "%s", attached ? "attached" : "detached");
+            } else {
+                snprintf(state, sizeof(state), "exit %d", code);
+            }
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+            printf("%6ld  %8ld  %-10s %10lld  %s\n", id, pid, state, bytes, when);
+        } else if (strncmp(response, "END", 3) == 0) {
+            return 0;
+        } else {
+            fprintf(stderr, "Session list failed: %s\n", response);
+            return -1;
+        }
+    }
+    return -1;
 }
 
 // Function to create config directory if it doesn't exist
@@ -397,6 +1836,8 @@ int save_session_config(const struct SessionConfig *config, const char *session_
     fprintf(file, "description=%.255s\n", config->description);  // Limit description length
     fprintf(file, "last_used=%ld\n", config->last_used);
     fprintf(file, "is_default=%d\n", config->is_default);
+    if (config->reconnect >= 0) fprintf(file, "reconnect=%d\n", config->reconnect);
+    if (config->shell_session > 0) fprintf(file, "shell_session=%ld\n", config->shell_session);
     
     fclose(file);
     return 0;
@@ -410,6 +1851,9 @@ int load_session_config(struct SessionConfig *config, const char *session_name)
     snprintf(home_dir, sizeof(home_dir), "%s", getenv("HOME"));
     snprintf(session_path, sizeof(session_path), "%s/%s/%s", home_dir, SESSION_DIR, session_name);
     
+    memset(config, 0, sizeof(*config));
+    config->reconnect = -1;
+
     FILE *file = fopen(session_path, "r");
     if (!file) {
         return 1; // Session file doesn't exist
@@ -434,6 +1878,10 @@ int load_session_config(struct SessionConfig *config, const char *session_name)
             config->last_used = atol(line + 10);
         } else if (strncmp(line, "is_default=", 11) == 0) {
             config->is_default = atoi(line + 11);
+        } else if (strncmp(line, "reconnect=", 10) == 0) {
+            config->reconnect = atoi(line + 10);
+        } else if (strncmp(line, "shell_session=", 14) == 0) {
+            config->shell_session = atol(line + 14);
         }
     }
     
@@ -578,19 +2026,126 @@ void list_sessions() {
     }
 }
 
-// Interactive mode for command line operations
-void interactive_mode(int sockfd) {
+// Send SESSION_NEW (id <= 0) or SESSION_ATTACH and read the ATTACHED reply.
+// Returns the session id, with the oldest output byte the server still
+// holds in *oldest, or -1 (*response holds the server's answer).
+long attach_remote_session(int sockfd, long id, long long offset, long long *oldest,
+                           char *response, size_t size) {
+    char command[64];
+    long long produced;
+
+    // session_loop() PINGs every HEARTBEAT_INTERVAL_MS, so the session
+    // can let go of this connection soon after we vanish
+    announce_heartbeat(sockfd, HEARTBEAT_INTERVAL_MS / 1000);
+    if (id > 0) {
+        snprintf(command, sizeof(command), "SESSION_ATTACH %ld %lld\n", id, offset);
+    } else {
+        snprintf(command, sizeof(command), "SESSION_NEW\n");
+    }
+    response[0] = '\0';
+    if (send_all(sockfd, command, strlen(command)) < 0 ||
+        recv_line(sockfd, response, size) < 0 ||
+        sscanf(response, "ATTACHED %ld %lld %lld", &id, oldest, &produced) != 3) {
+        return -1;
+    }
+    return id;
+}
+
+// -N / -R: start a persistent shell session (id <= 0) or reattach to one,
+// replaying its scrollback first. If the link drops, reconnect and resume
+// from the last output byte received. With a saved session config the id
+// is remembered there, for "-R last".
+int run_session(const char* hostname, int port, long id,
+                struct SessionConfig *config, const char *config_name) {
+    char response[BUFFER_SIZE];
+    long long offset = 0, oldest;
+    int sockfd = connect_extended(hostname, port);
+    int exit_code = 0;
+    int result;
+
+    if (sockfd < 0) return 1;
+    id = attach_remote_session(sockfd, id, 0, &oldest, response, sizeof(response));
+    if (id < 0) {
+        fprintf(stderr, "Session failed: %s\n", response);
+        close(sockfd);
+        return 1;
+    }
+    offset = oldest;
+    fprintf(stderr, "Attached to session %ld (\"~.\" on a line of its own detaches)\n", id);
+    if (config && config->shell_session != id) {
+        config->shell_session = id;
+        save_session_config(config, config_name);
+    }
+
+    while (1) {
+        result = session_loop(sockfd, &offset, &exit_code);
+        close(sockfd);
+        if (result != SESSION_LOST || reconnect_limit <= 0) break;
+
+        fprintf(stderr, "\n[connection to session %ld lost]\n", id);
+        sockfd = reconnect_extended(hostname, port);
+        if (sockfd < 0) break;
+        if (attach_remote_session(sockfd, id, offset, &oldest, response, sizeof(response)) < 0) {
+            fprintf(stderr, "Session %ld is gone: %s\n", id, response);
+            close(sockfd);
+            return 1;
+        }
+        fprintf(stderr, "[resumed session %ld at byte %lld]\n", id, offset);
+    }
+
+    if (result == SESSION_ENDED) {
+        fprintf(stderr, "Session %ld ended with exit code %d\n", id, exit_code);
+        return exit_code;
+    }
+    if (result == SESSION_DETACHED) {
+        fprintf(stderr, "Detached from session %ld; reattach with -R %ld\n", id, id);
+        return 0;
+    }
+    if (result == SESSION_TAKEN_OVER) {
+        fprintf(stderr, "Session %ld was attached from another connection\n", id);
+        return 0;
+    }
+    fprintf(stderr, "Connection to session %ld lost; reattach with -R %ld\n", id, id);
+    return 1;
+}
+
+// Has the peer closed or reset the connection? Consumes nothing.
+int link_is_down(int sockfd) {
+    char c;
+    ssize_t n = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// Replace a dropped extended-mode connection. Commands there are
+// stateless, so nothing else needs restoring. Returns the new socket, or
+// -1 (the old one is closed either way).
+int reconnect_interactive(int sockfd, const char* hostname, int port) {
+    close(sockfd);
+    if (reconnect_limit <= 0) return -1;
+    sockfd = reconnect_extended(hostname, port);
+    if (sockfd >= 0) {
+        announce_heartbeat(sockfd, heartbeat_interval);
+        printf("[reconnected to %s:%d]\n", hostname, port);
+    }
+    return sockfd;
+}
+
+// Interactive mode for command line operations.
+// Returns the socket in use at the end (it may have been replaced by a
+// reconnect), or -1 if none is left
+int interactive_mode(int sockfd, const char* hostname, int port) {
     struct termios orig_termios;
     char input_buffer[BUFFER_SIZE];
     char command_buffer[BUFFER_SIZE];
-    char *cmd, *arg1, *arg2;
+    char *cmd, *arg1, *arg2, *arg3;
     ssize_t bytes_read;
     struct pollfd pfd[2]; // 0: stdin, 1: socket
+    long long last_active = monotonic_ms();
 
     // Save original terminal settings
     if (tcgetattr(STDIN_FILENO, &orig_termios) < 0) {
         perror("tcgetattr");
-        return;
+        return sockfd;
     }
 
     printf("\nNetShell Client Connected\n");
@@ -612,7 +2167,23 @@ void interactive_mode(int sockfd) {
             break;
         }
 
+        // Check an idle extended link, so a dead one is replaced before the
+        // next command instead of failing it, and the server sees us alive
+        if (extended_mode && heartbeat_interval > 0 && ret == 0 &&
+            monotonic_ms() - last_active >= (long long)heartbeat_interval * 1000) {
+            if (!heartbeat_ok(sockfd)) {
+                printf("\n[no answer from %s:%d]\n", hostname, port);
+                if ((sockfd = reconnect_interactive(sockfd, hostname, port)) < 0) break;
+                pfd[1].fd = sockfd;
+                printf("> ");
+                fflush(stdout);
+            }
+            last_active = monotonic_ms();
+            continue;
+        }
+
         if (pfd[0].revents & POLLIN) {
+            last_active = monotonic_ms();
             // Input from stdin
             if (fgets(input_buffer, sizeof(input_buffer), stdin)) {
                 // Remove newline
@@ -637,12 +2208,34 @@ void interactive_mode(int sockfd) {
                 
                 arg1 = strtok_r(NULL, " ", &saveptr);
                 arg2 = strtok_r(NULL, " ", &saveptr);
+                arg3 = strtok_r(NULL, " ", &saveptr);
                 
                 if (strcmp(cmd, "help") == 0) {
                     printf("Available commands:\n");
                     if (extended_mode) {
                         printf("  send_file <local_path> <remote_path> - Send a file to server\n");
                         printf("  get_file <remote_path> <local_path> - Download a file from server\n");
+                        printf("  psend_file <local_path> <remote_path> [streams] - Send over parallel connections\n");
+                        printf("  pget_file <remote_path> <local_path> [streams] - Download over parallel connections\n");
+                        printf("  rcopy <src> <dst> - Copy a file on the server\n");
+                        printf("  rmove <src> <dst> - Move a file on the server\n");
+                        printf("  rlink <src> <dst> - Hard link a file on the server\n");
+                        printf("  rsymlink <target> <linkpath> - Create a symlink on the server\n");
+                        printf("  rls <remote_dir> [nostat] - List a directory on the server\n");
+                        printf("  rstat <remote_path>... - Show metadata of server paths\n");
+                        printf("  rfind <remote_dir> [name=<glob>] [type=f|d|l] [min_size=N] [max_size=N]\n");
+                        printf("        [newer=T] [older=T] [depth=N] - Search a tree on the server\n");
+                        printf("  rdu <remote_dir> [filters] - Total size of a tree on the server\n");
+                        printf("  rwatch <remote_path>... - Show changes to server paths as they happen\n");
+                        printf("  rtail <remote_path>... - Follow server logs as they grow\n");
+                        printf("  jsubmit <command> - Run a command as a detached job on the server\n");
+                        printf("  jobs [id] - Show queued, running and finished jobs\n");
+                        printf("  joutput <id> [offset] - Show a job's output, following it until it ends\n");
+                        printf("  jcancel <id> - Cancel a queued or running job\n");
+                        printf("  sessions - List persistent shell sessions (start one with -N)\n");
+                        printf("  stats - Show the server's metrics\n");
+                        printf("  trace - Show latency percentiles of each connection phase\n");
+                        printf("  skill <id> - Hang up a persistent shell session\n");
                     }
                     printf("  ncurses <command> - Run command with ncurses support\n");
                     printf("  exit - Exit the client\n");
@@ -714,7 +2307,11 @@ void interactive_mode(int sockfd) {
                     if (!arg1 || !arg2) {
                         printf("Usage: send_file <local_path> <remote_path>\n");
                     } else {
-                        if (send_file_to_server(sockfd, arg1, arg2)) {
+                        int sent = send_file_blocks_to_server(sockfd, arg1, arg2);
+                        if (sent < 0) {
+                            sent = send_file_to_server(sockfd, arg1, arg2);
+                        }
+                        if (sent) {
                             printf("File sent successfully\n");
                         } else {
                             printf("Failed to send file\n");
@@ -724,21 +2321,139 @@ void interactive_mode(int sockfd) {
                     if (!arg1 || !arg2) {
                         printf("Usage: get_file <remote_path> <local_path>\n");
                     } else {
-                        if (receive_file_from_server(sockfd, arg1, arg2)) {
+                        int received = receive_file_blocks_from_server(sockfd, arg1, arg2);
+                        if (received < 0) {
+                            received = receive_file_from_server(sockfd, arg1, arg2);
+                        }
+                        if (received) {
                             printf("File received successfully\n");
                         } else {
                             printf("Failed to receive file\n");
                         }
                     }
+                } else if (extended_mode && (strcmp(cmd, "psend_file") == 0 ||
+                                             strcmp(cmd, "pget_file") == 0)) {
+                    int upload = strcmp(cmd, "psend_file") == 0;
+                    int streams = arg3 ? atoi(arg3) : DEFAULT_STREAMS;
+                    if (!arg1 || !arg2) {
+                        printf("Usage: %s <%s> <%s> [streams]\n", cmd,
+                               upload ? "local_path" : "remote_path",
+                               upload ? "remote_path" : "local_path");
+                    } else if (parallel_transfer(hostname, port, upload,
+                                                 upload ? arg1 : arg2, upload ? arg2 : arg1, streams)) {
+                        printf("File %s successfully\n", upload ? "sent" : "received");
+                    } else {
+                        printf("Failed to %s file\n", upload ? "send" : "receive");
+                    }
+                } else if (extended_mode && (strcmp(cmd, "rcopy") == 0 || strcmp(cmd, "rmove") == 0 ||
+                                             strcmp(cmd, "rlink") == 0 || strcmp(cmd, "rsymlink") == 0)) {
+                    const char *operation = strcmp(cmd, "rcopy") == 0 ? "COPY" :
+                                            strcmp(cmd, "rmove") == 0 ? "MOVE" :
+                                            strcmp(cmd, "rlink") == 0 ? "LINK" : "SYMLINK";
+                    if (!arg1 || !arg2) {
+                        printf("Usage: %s <src> <dst>\n", cmd);
+                    } else if (remote_file_operation(sockfd, operation, arg1, arg2)) {
+                        printf("Done\n");
+                    }
+                } else if (extended_mode && strcmp(cmd, "rls") == 0) {
+                    list_remote_dir(sockfd, arg1 ? arg1 : ".", arg2 && strcmp(arg2, "nostat") == 0);
+                } else if (extended_mode && strcmp(cmd, "rstat") == 0) {
+                    char *paths[MAX_STAT_PATHS];
+                    int count = 0;
+                    char *next;
+                    if (arg1) paths[count++] = arg1;
+                    if (arg2) paths[count++] = arg2;
+                    if (arg3) paths[count++] = arg3;
+                    while (count < MAX_STAT_PATHS && (next = strtok_r(NULL, " ", &saveptr))) {
+                        paths[count++] = next;
+                    }
+                    if (count == 0) {
+                        printf("Usage: rstat <remote_path>...\n");
+                    } else {
+                        stat_remote_paths(sockfd, paths, count);
+                    }
+                } else if (extended_mode && (strcmp(cmd, "rwatch") == 0 || strcmp(cmd, "rtail") == 0)) {
+                    char *paths[MAX_STAT_PATHS];
+                    int count = 0;
+                    char *next;
+                    if (arg1) paths[count++] = arg1;
+                    if (arg2) paths[count++] = arg2;
+                    if (arg3) paths[count++] = arg3;
+                    while (count < MAX_STAT_PATHS && (next = strtok_r(NULL, " ", &saveptr))) {
+                        paths[count++] = next;
+                    }
+                    if (count == 0) {
+                        printf("Usage: %s <remote_path>...\n", cmd);
+                    } else if (strcmp(cmd, "rtail") == 0) {
+                        follow_remote(sockfd, paths, count, 1);
+                    } else {
+                        watch_remote(sockfd, paths, count, 0);
+                    }
+                } else if (extended_mode && (strcmp(cmd, "rfind") == 0 || strcmp(cmd, "rdu") == 0)) {
+                    // Everything after the directory is passed through as filters
+                    const char *options = arg2 ? input_buffer + (arg2 - command_buffer) : "";
+                    walk_remote(sockfd, arg1 ? arg1 : ".", options, strcmp(cmd, "rdu") == 0);
+                } else if (extended_mode && strcmp(cmd, "jsubmit") == 0) {
+                    long id;
+                    if (!arg1) {
+                        printf("Usage: jsubmit <command>\n> ");
+                        continue;
+                    }
+                    id = submit_job(sockfd, input_buffer + (arg1 - command_buffer));
+                    if (id > 0) printf("Job %ld queued\n", id);
+                } else if (extended_mode && strcmp(cmd, "jobs") == 0) {
+                    show_jobs(sockfd, arg1 ? atol(arg1) : 0);
+                } else if (extended_mode && strcmp(cmd, "joutput") == 0) {
+                    int code;
+                    if (!arg1) {
+                        printf("Usage: joutput <id> [offset]\n> ");
+                        continue;
+                    }
+                    code = job_output_remote(sockfd, atol(arg1), arg2 ? atoll(arg2) : 0, 1, 1);
+                    if (code > 0) printf("[exit %d]\n", code);
+                } else if (extended_mode && strcmp(cmd, "jcancel") == 0) {
+                    if (!arg1) {
+                        printf("Usage: jcancel <id>\n> ");
+                        continue;
+                    }
+                    if (cancel_job(sockfd, atol(arg1)) == 0) printf("Job %s cancelled\n", arg1);
+                } else if (extended_mode && strcmp(cmd, "sessions") == 0) {
+                    list_remote_sessions(sockfd);
+                } else if (extended_mode && strcmp(cmd, "stats") == 0) {
+                    show_server_stats(sockfd);
+                } else if (extended_mode && strcmp(cmd, "trace") == 0) {
+                    show_trace_report(sockfd);
+                } else if (extended_mode && strcmp(cmd, "skill") == 0) {
+                    char response[BUFFER_SIZE];
+                    if (!arg1) {
+                        printf("Usage: skill <id>\n> ");
+                        continue;
+                    }
+                    snprintf(response, sizeof(response), "SESSION_KILL %ld\n", atol(arg1));
+                    if (send_all(sockfd, response, strlen(response)) < 0 ||
+                        recv_line(sockfd, response, sizeof(response)) < 0) {
+                        break;
+                    }
+                    printf("%s\n", strcmp(response, "OK") == 0 ? "Session hung up" : "No such session");
+                } else if (extended_mode) {
+                    // Regular command - the extended protocol runs it with EXEC
+                    int code = exec_remote(sockfd, input_buffer, interactive_exec_options);
+                    if (code > 0) printf("[exit %d]\n", code);
                 } else {
-                    // Regular command - send to server
-                    snprintf(input_buffer, sizeof(input_buffer), "%s\n", command_buffer);
-                    if (send(sockfd, input_buffer, strlen(input_buffer), 0) < 0) {
+                    // Regular command - send the whole line to the shell
+                    char line_buffer[BUFFER_SIZE + 1];
+                    snprintf(line_buffer, sizeof(line_buffer), "%s\n", input_buffer);
+                    if (send(sockfd, line_buffer, strlen(line_buffer), 0) < 0) {
                         perror("send");
                         break;
                     }
                 }
             }
+            if (extended_mode && link_is_down(sockfd)) {
+                if ((sockfd = reconnect_interactive(sockfd, hostname, port)) < 0) break;
+                pfd[1].fd = sockfd;
+                pfd[1].revents = 0;
+            }
             printf("> ");
         }
 
@@ -750,13 +2465,19 @@ void interactive_mode(int sockfd) {
                     perror("recv");
                 }
                 printf("\nConnection closed by server\n");
-                break;
+                if (!extended_mode || (sockfd = reconnect_interactive(sockfd, hostname, port)) < 0) break;
+                pfd[1].fd = sockfd;
+                printf("> ");
+                fflush(stdout);
+                continue;
             }
             input_buffer[bytes_read] = '\0';
             printf("%s", input_buffer);
             fflush(stdout);
+            last_active = monotonic_ms();
         }
     }
+    return sockfd;
 }
 
 int main(int argc, char *argv[]) {
@@ -768,6 +2489,30 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Options:\n");
         fprintf(stderr, "  -e, --eval <command>     Execute command and exit\n");
         fprintf(stderr, "  -E, --eval-file <file>   Execute command from file and exit\n");
+        fprintf(stderr, "  -B, --batch <file>       Run each line of file as a command, on one connection\n");
+        fprintf(stderr, "                           (at most 1024 commands)\n");
+        fprintf(stderr, "  -j, --jobs <n>           Commands a batch runs at once (default 1)\n");
+        fprintf(stderr, "  --grep <text>            Keep only output lines containing text (server side)\n");
+        fprintf(stderr, "  --regex <re>             Keep only output lines matching an extended regex\n");
+        fprintf(stderr, "  --invert                 Keep the lines that do not match instead\n");
+        fprintf(stderr, "  --head <n> / --tail <n>  Keep the first / last n lines\n");
+        fprintf(stderr, "  --bytes <start>-[end]    Keep a byte range of the raw output\n");
+        fprintf(stderr, "  --warm / --reset         Run commands on one shell kept on the server / a fresh one\n");
+        fprintf(stderr, "  --cache <seconds>        Answer from the server's result cache, at most this old\n");
+        fprintf(stderr, "  --dep <path>             Cached result goes stale when path changes (repeatable)\n");
+        fprintf(stderr, "  -w, --wait <path>        Wait until a remote path changes (repeatable)\n");
+        fprintf(stderr, "  -f, --follow <path>      Follow a remote log as it grows (repeatable)\n");
+        fprintf(stderr, "  --submit <command>       Queue command as a detached job and print its id\n");
+        fprintf(stderr, "  --attach <id>            Stream a job's output until it ends, exit with its code\n");
+        fprintf(stderr, "  --stats                  Print the server's metrics and exit\n");
+        fprintf(stderr, "  --trace-report           Print connection phase latency percentiles and exit\n");
+        fprintf(stderr, "  -N, --new-session        Start a persistent shell that survives disconnects\n");
+        fprintf(stderr, "  -R, --resume <id|last>   Reattach to a persistent shell, replaying its scrollback\n");
+        fprintf(stderr, "                           (last: the one this saved session used most recently)\n");
+        fprintf(stderr, "  --reconnect <seconds>    How long to retry a dropped link (default %d, 0: never)\n",
+                RECONNECT_DEFAULT_LIMIT);
+        fprintf(stderr, "  --heartbeat <seconds>    PING an idle link this often (default %d, 0: never)\n",
+                HEARTBEAT_DEFAULT_INTERVAL);
         fprintf(stderr, "  -s, --session <name>     Use saved session\n");
         fprintf(stderr, "  -l, --list               List saved sessions\n");
         fprintf(stderr, "  -S, --save <name>        Save current connection as session\n");
@@ -780,6 +2525,9 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Examples:\n");
         fprintf(stderr, "  %s -e \"ls -la\" 192.168.1.136 2324\n", argv[0]);
         fprintf(stderr, "  %s -E script.sh 192.168.1.136 2324\n", argv[0]);
+        fprintf(stderr, "  %s -w /build/out.bin 192.168.1.136 2324  (wait for a build)\n", argv[0]);
+        fprintf(stderr, "  %s -e \"make\" --grep error --tail 20 192.168.1.136 2324\n", argv[0]);
+        fprintf(stderr, "  %s -B checks.txt -j 4 192.168.1.136 2324\n", argv[0]);
         fprintf(stderr, "  %s myserver\n", argv[0]);
         fprintf(stderr, "  %s -S myserver -a 192.168.1.136 -p 2324 -desc \"My server\"\n", argv[0]);
         fprintf(stderr, "  %s -d myserver  (set default)\n", argv[0]);
@@ -794,6 +2542,19 @@ int main(int argc, char *argv[]) {
     const char *command_file = NULL;
     int eval_mode = 0;
     int eval_file_mode = 0;
+    char *watch_paths[MAX_STAT_PATHS];
+    int watch_count = 0;
+    char *follow_paths[MAX_STAT_PATHS];
+    int follow_count = 0;
+    char exec_filter[BUFFER_SIZE] = "";
+    const char *batch_file = NULL;
+    const char *submit_command = NULL;
+    long attach_id = 0;
+    int stats_only = 0;   // 1: --stats, 2: --trace-report
+    long shell_session = -1;   // 0: new session, > 0: reattach
+    int resume_last = 0;
+    int reconnect_option = -1;
+    int batch_jobs = 1;
     int save_session = 0;
     int list_sessions_flag = 0;
     int set_default = 0;
@@ -823,6 +2584,110 @@ int main(int argc, char *argv[]) {
             eval_file_mode = 1;
             command_file = argv[arg_idx + 1];
             arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--grep") == 0 || strcmp(argv[arg_idx], "--regex") == 0 ||
+                   strcmp(argv[arg_idx], "--head") == 0 || strcmp(argv[arg_idx], "--tail") == 0 ||
+                   strcmp(argv[arg_idx], "--bytes") == 0 || strcmp(argv[arg_idx], "--cache") == 0 ||
+                   strcmp(argv[arg_idx], "--dep") == 0) {
+            // Collected as EXEC filter options, e.g. "grep=some%20text"
+            char encoded[BUFFER_SIZE / 2];
+            size_t used = strlen(exec_filter);
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[arg_idx]);
+                return 1;
+            }
+            percent_encode(argv[arg_idx + 1], encoded, sizeof(encoded));
+            snprintf(exec_filter + used, sizeof(exec_filter) - used, "%s%s=%s",
+                     used ? " " : "", argv[arg_idx] + 2, encoded);
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "-B") == 0 || strcmp(argv[arg_idx], "--batch") == 0) {
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: -B/--batch requires a file argument\n");
+                return 1;
+            }
+            batch_file = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "-j") == 0 || strcmp(argv[arg_idx], "--jobs") == 0) {
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: -j/--jobs requires a number\n");
+                return 1;
+            }
+            batch_jobs = atoi(argv[arg_idx + 1]);
+            if (batch_jobs < 1) batch_jobs = 1;
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--invert") == 0) {
+            size_t used = strlen(exec_filter);
+            snprintf(exec_filter + used, sizeof(exec_filter) - used, "%sinvert", used ? " " : "");
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--warm") == 0 || strcmp(argv[arg_idx], "--reset") == 0) {
+            // Commands share one shell on the server, from one run to the
+            // next; --reset starts it afresh
+            size_t used = strlen(exec_filter);
+            interactive_exec_options = warm_shell_option();
+            snprintf(exec_filter + used, sizeof(exec_filter) - used, "%s%s%s", used ? " " : "",
+                     interactive_exec_options, argv[arg_idx][2] == 'r' ? " reset" : "");
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--submit") == 0) {
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: --submit requires a command argument\n");
+                return 1;
+            }
+            submit_command = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--stats") == 0) {
+            stats_only = 1;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "--trace-report") == 0) {
+            stats_only = 2;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "-N") == 0 || strcmp(argv[arg_idx], "--new-session") == 0) {
+            shell_session = 0;
+            arg_idx++;
+        } else if (strcmp(argv[arg_idx], "-R") == 0 || strcmp(argv[arg_idx], "--resume") == 0) {
+            if (arg_idx + 1 < argc && strcmp(argv[arg_idx + 1], "last") == 0) {
+                resume_last = 1;
+                shell_session = 0;
+            } else if (arg_idx + 1 < argc && atol(argv[arg_idx + 1]) > 0) {
+                shell_session = atol(argv[arg_idx + 1]);
+            } else {
+                fprintf(stderr, "Error: -R/--resume requires a session id or \"last\"\n");
+                return 1;
+            }
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--reconnect") == 0) {
+            if (arg_idx + 1 >= argc || atoi(argv[arg_idx + 1]) < 0) {
+                fprintf(stderr, "Error: --reconnect requires a number of seconds\n");
+                return 1;
+            }
+            reconnect_option = atoi(argv[arg_idx + 1]);
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--heartbeat") == 0) {
+            if (arg_idx + 1 >= argc || atoi(argv[arg_idx + 1]) < 0) {
+                fprintf(stderr, "Error: --heartbeat requires a number of seconds\n");
+                return 1;
+            }
+            heartbeat_interval = atoi(argv[arg_idx + 1]);
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "--attach") == 0) {
+            if (arg_idx + 1 >= argc || atol(argv[arg_idx + 1]) <= 0) {
+                fprintf(stderr, "Error: --attach requires a job id\n");
+                return 1;
+            }
+            attach_id = atol(argv[arg_idx + 1]);
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "-w") == 0 || strcmp(argv[arg_idx], "--wait") == 0) {
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: -w/--wait requires a path argument\n");
+                return 1;
+            }
+            if (watch_count < MAX_STAT_PATHS) watch_paths[watch_count++] = argv[arg_idx + 1];
+            arg_idx += 2;
+        } else if (strcmp(argv[arg_idx], "-f") == 0 || strcmp(argv[arg_idx], "--follow") == 0) {
+            if (arg_idx + 1 >= argc) {
+                fprintf(stderr, "Error: -f/--follow requires a path argument\n");
+                return 1;
+            }
+            if (follow_count < MAX_STAT_PATHS) follow_paths[follow_count++] = argv[arg_idx + 1];
+            arg_idx += 2;
         } else if (strcmp(argv[arg_idx], "-s") == 0 || strcmp(argv[arg_idx], "--session") == 0) {
             if (arg_idx + 1 >= argc) {
                 fprintf(stderr, "Error: -s/--session requires a session name\n");
@@ -966,6 +2831,8 @@ int main(int argc, char *argv[]) {
         config.description[sizeof(config.description) - 1] = '\0';
         config.last_used = time(NULL);
         config.is_default = 0; // Don't automatically make it default
+        config.reconnect = reconnect_option;
+        config.shell_session = 0;
         
         if (save_session_config(&config, temp_session_name) == 0) {
             printf("Session '%s' saved.\n", temp_session_name);
@@ -975,9 +2842,12 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    // Session data lives for the rest of main() since hostname may point into it
+    char default_session[256];
+    struct SessionConfig session_config;
+
     // Check for default session if no hostname or session specified
     if (!hostname && !session_name) {
-        char default_session[256];
         if (get_default_session_name(default_session, sizeof(default_session)) == 0) {
             session_name = default_session;
         }
@@ -985,14 +2855,13 @@ int main(int argc, char *argv[]) {
 
     // If using a session, load the configuration
     if (session_name) {
-        struct SessionConfig config;
-        if (load_session_config(&config, session_name) == 0) {
-            hostname = config.hostname;
-            port = config.port;
+        if (load_session_config(&session_config, session_name) == 0) {
+            hostname = session_config.hostname;
+            port = session_config.port;
             
             // Update last used time
-            config.last_used = time(NULL);
-            save_session_config(&config, session_name);
+            session_config.last_used = time(NULL);
+            save_session_config(&session_config, session_name);
         } else {
             fprintf(stderr, "Session '%s' not found\n", session_name);
             printf("Available sessions:\n");
@@ -1014,7 +2883,7 @@ int main(int argc, char *argv[]) {
                     local_hostname[sizeof(local_hostname) - 1] = '\0';
                     int local_port = config.port;
                     
-                    return execute_command(local_hostname, local_port, command);
+                    return execute_command(local_hostname, local_port, command, exec_filter);
                 } else {
                     fprintf(stderr, "Default session '%s' not found\n", default_session);
                     return 1;
@@ -1024,7 +2893,7 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
         }
-        return execute_command(hostname, port, command);
+        return execute_command(hostname, port, command, exec_filter);
     }
 
     if (eval_file_mode && command_file) {
@@ -1039,7 +2908,7 @@ int main(int argc, char *argv[]) {
                     local_hostname[sizeof(local_hostname) - 1] = '\0';
                     int local_port = config.port;
                     
-                    return execute_command_from_file(local_hostname, local_port, command_file);
+                    return execute_command_from_file(local_hostname, local_port, command_file, exec_filter);
                 } else {
                     fprintf(stderr, "Default session '%s' not found\n", default_session);
                     return 1;
@@ -1049,7 +2918,7 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
         }
-        return execute_command_from_file(hostname, port, command_file);
+        return execute_command_from_file(hostname, port, command_file, exec_filter);
     }
 
     // If hostname is NULL at this point, we have an error
@@ -1058,6 +2927,38 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (watch_count > 0) {
+        return wait_for_change(hostname, port, watch_paths, watch_count);
+    }
+    if (follow_count > 0) {
+        return follow_files(hostname, port, follow_paths, follow_count);
+    }
+    if (stats_only) {
+        return print_server_stats(hostname, port, stats_only == 2);
+    }
+    if (submit_command) {
+        return submit_job_command(hostname, port, submit_command);
+    }
+    if (attach_id > 0) {
+        return attach_job(hostname, port, attach_id);
+    }
+    if (session_name && session_config.reconnect >= 0) reconnect_limit = session_config.reconnect;
+    if (reconnect_option >= 0) reconnect_limit = reconnect_option;
+    if (shell_session >= 0) {
+        if (resume_last) {
+            if (!session_name || session_config.shell_session <= 0) {
+                fprintf(stderr, "No persistent shell recorded for this saved session\n");
+                return 1;
+            }
+            shell_session = session_config.shell_session;
+        }
+        return run_session(hostname, port, shell_session, session_name ? &session_config : NULL,
+                           session_name);
+    }
+    if (batch_file) {
+        return execute_batch(hostname, port, batch_file, batch_jobs, exec_filter);
+    }
+
     // Connect to server and enter interactive mode
     int sockfd = connect_to_server(hostname, port);
     if (sockfd < 0) {
@@ -1066,10 +2967,11 @@ int main(int argc, char *argv[]) {
 
     // Try to negotiate extended protocol
     extended_mode = negotiate_extended_protocol(sockfd);
+    if (extended_mode) announce_heartbeat(sockfd, heartbeat_interval);
 
     // Enter interactive mode
-    interactive_mode(sockfd);
+    sockfd = interactive_mode(sockfd, hostname, port);
 
-    close(sockfd);
+    if (sockfd >= 0) close(sockfd);
     return 0;
 }
\ No newline at end of file
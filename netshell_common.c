@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "netshell_common.h"
+
+#define RANGE_BUFFER_SIZE (256 * 1024)
+
+ssize_t send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    size_t sent = 0;
+
+    while (sent < len) {
+        ssize_t n = send(fd, p + sent, len - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        sent += n;
+    }
+    return (ssize_t)sent;
+}
+
+ssize_t recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = recv(fd, p + got, len - got, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return 0;
+        got += n;
+    }
+    return (ssize_t)got;
+}
+
+ssize_t recv_line(int fd, char *buf, size_t size) {
+    size_t len = 0;
+
+    while (len < size - 1) {
+        // Peek first so we only ever consume up to and including the newline
+        ssize_t n = recv(fd, buf + len, size - 1 - len, MSG_PEEK);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+
+        char *nl = memchr(buf + len, '\n', n);
+        size_t take = nl ? (size_t)(nl - (buf + len)) + 1 : (size_t)n;
+
+        if (recv_all(fd, buf + len, take) <= 0) return -1;
+        len += take;
+
+        if (nl) {
+            len--;
+            if (len > 0 && buf[len - 1] == '\r') len--;
+            buf[len] = '\0';
+            return (ssize_t)len;
+        }
+    }
+    return -1; // Line too long for buffer
+}
+
+int skip_line(int fd) {
+    char chunk[4096];
+
+    while (1) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_PEEK);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+
+        char *nl = memchr(chunk, '\n', n);
+        size_t take = nl ? (size_t)(nl - chunk) + 1 : (size_t)n;
+
+        if (recv_all(fd, chunk, take) <= 0) return -1;
+        if (nl) return 0;
+    }
+}
+
+int set_keepalive(int fd, int idle, int interval, int count) {
+    int on = idle > 0;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0) return -1;
+    if (!on) return 0;
+    if (interval <= 0) interval = KEEPALIVE_INTERVAL;
+    if (count <= 0) count = KEEPALIVE_COUNT;
+#ifdef TCP_KEEPIDLE
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+#endif
+#ifdef TCP_KEEPINTVL
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+#endif
+#ifdef TCP_KEEPCNT
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+#ifdef TCP_USER_TIMEOUT
+    {
+        unsigned int timeout_ms = (unsigned int)(idle + interval * count) * 1000;
+        setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout_ms, sizeof(timeout_ms));
+    }
+#endif
+    return 0;
+}
+
+int set_nodelay(int fd) {
+    int on = 1;
+
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+ssize_t pread_all(int fd, void *buf, size_t len, off_t offset) {
+    char *p = buf;
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = pread(fd, p + got, len - got, offset + got);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1; // File shrank underneath us
+        got += n;
+    }
+    return (ssize_t)got;
+}
+
+ssize_t pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pwrite(fd, p + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+int send_file_range(int socket_fd, int file_fd, off_t offset, off_t length) {
+    char *buf;
+
+#ifdef __linux__
+    // Zero-copy path; fall back to read/send if the fd pair isn't supported
+    while (length > 0) {
+        size_t chunk = length > (1 << 30) ? (1 << 30) : (size_t)length;
+        ssize_t n = sendfile(socket_fd, file_fd, &offset, chunk);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) break;
+            return -1;
+        }
+        if (n == 0) return -1;
+        length -= n;
+    }
+    if (length == 0) return 0;
+#endif
+
+    buf = malloc(RANGE_BUFFER_SIZE);
+    if (!buf) return -1;
+    while (length > 0) {
+        size_t chunk = length > RANGE_BUFFER_SIZE ? RANGE_BUFFER_SIZE : (size_t)length;
+        if (pread_all(file_fd, buf, chunk, offset) < 0 || send_all(socket_fd, buf, chunk) < 0) {
+            free(buf);
+            return -1;
+        }
+        offset += chunk;
+        length -= chunk;
+    }
+    free(buf);
+    return 0;
+}
+
+int recv_file_range(int socket_fd, int file_fd, off_t offset, off_t length) {
+    char *buf = malloc(RANGE_BUFFER_SIZE);
+
+    if (!buf) return -1;
+    while (length > 0) {
+        size_t want = length > RANGE_BUFFER_SIZE ? RANGE_BUFFER_SIZE : (size_t)length;
+        ssize_t n = recv(socket_fd, buf, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || pwrite_all(file_fd, buf, n, offset) < 0) {
+            free(buf);
+            return -1;
+        }
+        offset += n;
+        length -= n;
+    }
+    free(buf);
+    return 0;
+}
+
+int default_worker_threads(void) {
+#ifdef NETSHELL_THREADS
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > MAX_WORKER_THREADS) cpus = MAX_WORKER_THREADS;
+    return (int)cpus;
+#else
+    return 1;
+#endif
+}
+
+size_t percent_encode(const char *src, char *dst, size_t size) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t out = 0;
+
+    for (; *src; src++) {
+        unsigned char c = (unsigned char)*src;
+        if (c <= ' ' || c == '%' || c >= 0x7f) {
+            if (out + 3 >= size) break;
+            dst[out++] = '%';
+            dst[out++] = hex[c >> 4];
+            dst[out++] = hex[c & 0xf];
+        } else {
+            if (out + 1 >= size) break;
+            dst[out++] = c;
+        }
+    }
+    if (size > 0) dst[out] = '\0';
+    return out;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+size_t percent_decode(const char *src, char *dst, size_t size) {
+    size_t out = 0;
+
+    while (*src && out + 1 < size) {
+        if (src[0] == '%' && hex_value(src[1]) >= 0 && hex_value(src[2]) >= 0) {
+            dst[out++] = (char)(hex_value(src[1]) * 16 + hex_value(src[2]));
+            src += 3;
+        } else {
+            dst[out++] = *src++;
+        }
+    }
+    if (size > 0) dst[out] = '\0';
+    return out;
+}
@@ -0,0 +1,75 @@
+#ifndef NETSHELL_COMMON_H
+#define NETSHELL_COMMON_H
+
+#include <sys/types.h>
+
+// Worker threads are only used where pthreads are available; the MorphOS
+// build runs every parallel stage inline on the calling thread instead.
+#ifndef MORPHOS
+#define NETSHELL_THREADS 1
+#endif
+
+#define MAX_WORKER_THREADS 16
+
+// TCP keepalive defaults: probe after 30 idle seconds, every 10 seconds,
+// and give up after 3 unanswered probes, so a peer that vanished without a
+// FIN is noticed in about a minute
+#define KEEPALIVE_IDLE 30
+#define KEEPALIVE_INTERVAL 10
+#define KEEPALIVE_COUNT 3
+
+// Extended-mode heartbeat: a client that sent "HEARTBEAT <seconds>" PINGs
+// an idle link that often, and is treated as dead once HEARTBEAT_MISSES
+// intervals pass without hearing from it
+#define HEARTBEAT_DEFAULT_INTERVAL 10
+#define HEARTBEAT_MISSES 3
+
+// Send the whole buffer, retrying on short writes and EINTR.
+// Returns len on success, -1 on error.
+ssize_t send_all(int fd, const void *buf, size_t len);
+
+// Receive exactly len bytes. Returns len, 0 if the peer closed first, -1 on error.
+ssize_t recv_all(int fd, void *buf, size_t len);
+
+// Receive one '\n' terminated line without consuming any bytes past it, so
+// raw payload that follows a header line stays in the socket for the caller.
+// The newline is stripped. Returns line length, -1 on close, error or overflow.
+ssize_t recv_line(int fd, char *buf, size_t size);
+
+// Consume the rest of a line recv_line() found too long, up to and including
+// its newline. Returns 0, or -1 if the peer closed or on error.
+int skip_line(int fd);
+
+// Enable TCP keepalive on a socket with the given idle time, probe interval
+// (both in seconds) and probe count, where the system lets us tune them. On
+// Linux unacknowledged data times out after the same total, so a dead peer
+// is also noticed while we are sending. idle 0 turns keepalive off.
+// Returns 0, or -1 if SO_KEEPALIVE itself failed.
+int set_keepalive(int fd, int idle, int interval, int count);
+
+// Send small writes at once instead of waiting for the peer's ACK (Nagle).
+// The extended protocol sends a request or reply in several writes and then
+// waits, which otherwise meets the peer's delayed ACK: 40 ms per round trip.
+int set_nodelay(int fd);
+
+// Positional file I/O that retries short transfers. Return len or -1.
+ssize_t pread_all(int fd, void *buf, size_t len, off_t offset);
+ssize_t pwrite_all(int fd, const void *buf, size_t len, off_t offset);
+
+// Send length bytes of file_fd starting at offset (sendfile() where available).
+// Returns 0 on success, -1 on error.
+int send_file_range(int socket_fd, int file_fd, off_t offset, off_t length);
+
+// Receive length bytes from the socket and write them at offset.
+// Returns 0 on success, -1 on error or early close.
+int recv_file_range(int socket_fd, int file_fd, off_t offset, off_t length);
+
+// Escape spaces, control bytes and '%' as %XX so a value fits in one token
+// of a command line, and undo it. Both return the output length.
+size_t percent_encode(const char *src, char *dst, size_t size);
+size_t percent_decode(const char *src, char *dst, size_t size);
+
+// Number of worker threads to use for parallel stages (1 when threads are unavailable).
+int default_worker_threads(void);
+
+#endif
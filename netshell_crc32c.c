@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "netshell_common.h"
+#include "netshell_crc32c.h"
+
+#ifdef NETSHELL_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__GNUC__) && defined(__aarch64__)
+#include <arm_acle.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#endif
+#define CRC32C_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78U   // Castagnoli polynomial, bit-reflected
+#define CRC32C_FILE_BUFFER (1024 * 1024)
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw;
+
+#ifdef NETSHELL_THREADS
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+#else
+static int crc32c_ready;
+#endif
+
+static void crc32c_init(void) {
+    uint32_t i, c;
+    int k;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            c = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (c >> 8) ^ crc32c_table[0][c & 0xff];
+        }
+    }
+
+#if defined(CRC32C_X86)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_ARM)
+#if defined(__ARM_FEATURE_CRC32)
+    crc32c_hw = 1;
+#elif defined(__linux__) && defined(HWCAP_CRC32)
+    crc32c_hw = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+#endif
+}
+
+static void crc32c_setup(void) {
+#ifdef NETSHELL_THREADS
+    pthread_once(&crc32c_once, crc32c_init);
+#else
+    if (!crc32c_ready) {
+        crc32c_init();
+        crc32c_ready = 1;
+    }
+#endif
+}
+
+// Slicing-by-8; bytes are assembled explicitly so it is endian-neutral
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                             ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        uint32_t hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) |
+                      ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(CRC32C_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_update(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#elif defined(CRC32C_ARM)
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw_update(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    crc32c_setup();
+    crc = ~crc;
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    if (crc32c_hw) return ~crc32c_hw_update(crc, p, len);
+#endif
+    return ~crc32c_sw(crc, p, len);
+}
+
+const char *crc32c_impl(void) {
+    crc32c_setup();
+#if defined(CRC32C_X86)
+    if (crc32c_hw) return "sse4.2";
+#elif defined(CRC32C_ARM)
+    if (crc32c_hw) return "armv8";
+#endif
+    return "table";
+}
+
+// GF(2) matrix helpers for crc32c_combine (same approach as zlib's crc32_combine)
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    int n;
+
+    for (n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    uint32_t even[32], odd[32];
+    uint32_t row = 1;
+    int n;
+
+    if (len2 == 0) return crc1;
+
+    // Operator for one zero bit
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);   // two zero bits
+    gf2_matrix_square(odd, even);   // four zero bits
+
+    // Apply len2 zero bytes to crc1, squaring the operator for each bit of len2
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+
+        gf2_matrix_square(odd, even);
+        if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+uint32_t crc32c_zeros(uint64_t len) {
+    static const unsigned char zeros[4096];
+    uint64_t chunk_len = sizeof(zeros);
+    uint32_t chunk = crc32c(0, zeros, sizeof(zeros));
+    uint32_t crc = crc32c(0, zeros, len % sizeof(zeros));
+    uint64_t n = len / sizeof(zeros);
+
+    // All pieces are zeros, so append doubling runs for each set bit of n
+    while (n) {
+        if (n & 1) crc = crc32c_combine(crc, chunk, chunk_len);
+        n >>= 1;
+        if (n) {
+            chunk = crc32c_combine(chunk, chunk, chunk_len);
+            chunk_len *= 2;
+        }
+    }
+    return crc;
+}
+
+int crc32c_file(int fd, off_t offset, off_t length, uint32_t *crc) {
+    unsigned char *buf = malloc(CRC32C_FILE_BUFFER);
+    uint32_t sum = 0;
+
+    if (!buf) return -1;
+    while (length != 0) {
+        size_t want = (length < 0 || length > CRC32C_FILE_BUFFER) ? CRC32C_FILE_BUFFER : (size_t)length;
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || (n == 0 && length > 0)) {
+            free(buf);
+            return -1;
+        }
+        if (n == 0) break;
+        sum = crc32c(sum, buf, n);
+        offset += n;
+        if (length > 0) length -= n;
+    }
+    free(buf);
+    *crc = sum;
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef NETSHELL_CRC32C_H
+#define NETSHELL_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// CRC32C (Castagnoli) used for end-to-end transfer integrity. Uses the
+// SSE4.2 or ARMv8 CRC instructions when the CPU has them and a
+// slicing-by-8 table everywhere else, so checking stays far cheaper than
+// the network.
+
+// Extend crc with len bytes; start a new checksum with crc = 0.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// CRC of A followed by B, given crc(A), crc(B) and the length of B.
+// Lets per-block checksums computed in parallel roll up to a whole-file CRC.
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+// CRC of len zero bytes, without touching that much memory (for file holes).
+uint32_t crc32c_zeros(uint64_t len);
+
+// CRC of length bytes of fd starting at offset (length < 0: to end of file).
+// Returns 0 on success, -1 on read error.
+int crc32c_file(int fd, off_t offset, off_t length, uint32_t *crc);
+
+// Name of the implementation in use ("sse4.2", "armv8" or "table").
+const char *crc32c_impl(void);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef NETSHELL_EXEC_H
+#define NETSHELL_EXEC_H
+
+#include <sys/types.h>
+
+// Running shell commands for EXEC, BATCH and the job queue
+
+#ifdef MORPHOS
+// On MorphOS, use ksh from the development environment
+#define SHELL_PATH "Work:/Development/gg/bin/ksh"
+#define SHELL_NAME "ksh"
+#else
+#define SHELL_PATH "/bin/sh"
+#define SHELL_NAME "sh"
+#endif
+
+// How shells and commands are started. fork() copies the server's page
+// tables, so it slows down as the server grows; the others run the child on
+// the parent's memory until it has exec()ed.
+#define SPAWN_FORK 0
+#define SPAWN_VFORK 1
+#define SPAWN_POSIX_SPAWN 2
+#define SPAWN_CLONE 3                   // clone(CLONE_VM | CLONE_VFORK), Linux only
+#define SPAWN_STRATEGIES 4
+
+#define SPAWN_MAX_CLOSE 5
+
+extern int spawn_strategy;
+
+// SPAWN_* for "fork", "vfork", "posix_spawn" or "clone"; -1 if the name is
+// unknown or the strategy is not available on this platform
+int spawn_strategy_parse(const char* name);
+const char* spawn_strategy_name(int strategy);
+
+// Commands longer than this, or with more words, always go to the shell
+#define EXEC_DIRECT_MAX_LEN 1024
+#define EXEC_DIRECT_MAX_ARGS 64
+
+// The child's side of a spawn: what becomes its stdin, stdout and stderr
+// (-1: /dev/null), descriptors to close after that (-1: unused), whether it
+// gets its own process group, and whether SIGHUP and SIGPIPE go back to
+// their defaults. With search_path the program is looked up in PATH; if it
+// cannot be exec()ed at all, the shell is run with fallback_argv instead
+// (NULL: the child exits 127).
+struct spawn_setup {
+    int fds[3];
+    int close_fds[SPAWN_MAX_CLOSE];
+    int new_group;
+    int default_signals;
+    int search_path;
+    char* const* fallback_argv;
+};
+
+// /dev/null for all three, nothing to close, nothing else changed
+void spawn_setup_init(struct spawn_setup *setup);
+
+// Start path with argv the spawn_strategy way. Returns the pid, or -1.
+pid_t spawn_process(const char* path, char* const argv[], const struct spawn_setup *setup);
+
+// Split a command line that needs nothing from the shell (no quoting,
+// expansion, redirection, operators, assignments or builtins) into words
+// in buf. Returns the word count, or 0 if only the shell can run it.
+int split_direct_command(const char* command, char* buf, size_t size, char* argv[], int max_args);
+
+// Start command in its own process group, with stdin from /dev/null and
+// stdout and stderr on a pipe whose read end goes to *output_fd. A plain
+// "program arg ..." is exec()ed directly; anything else runs under the
+// shell. close_fd (e.g. the client socket) is closed in the child
+// unless it is -1. Returns the pid, or -1.
+pid_t spawn_shell_command(int close_fd, const char* command, int *output_fd);
+
+// Stop a command started by spawn_shell_command(), with its whole pipeline
+void stop_command(pid_t pid, int sig);
+
+// Shell-style exit code; a command we stopped ourselves ends the way
+// "cmd | head" would
+int command_exit_code(int status, int stopped);
+
+#endif
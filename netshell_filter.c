@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "netshell_filter.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define FILTER_X86 1
+#endif
+
+// Substring search in the style of "SIMD-friendly Rabin-Karp": compare the
+// first and last needle bytes against 16 or 32 candidate positions at once
+// and only memcmp() the positions where both match.
+#if defined(FILTER_X86)
+static int filter_avx2;
+static int filter_cpu_checked;
+
+__attribute__((target("avx2")))
+static size_t search_avx2(const char *h, size_t n, const char *needle, size_t m) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i;
+
+    for (i = 0; i + m - 1 + 32 <= n; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(h + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(h + i + m - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(h + i + bit + 1, needle + 1, m - 2) == 0) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return i;   // No match: first position not yet checked
+}
+
+static size_t search_sse2(const char *h, size_t n, const char *needle, size_t m) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i;
+
+    for (i = 0; i + m - 1 + 16 <= n; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(h + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(h + i + m - 1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(h + i + bit + 1, needle + 1, m - 2) == 0) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return i;
+}
+#endif
+
+const char *find_substring(const char *haystack, size_t haystack_len,
+                           const char *needle, size_t needle_len) {
+    const char *p = haystack;
+    const char *end = haystack + haystack_len;
+
+    if (needle_len == 0) return haystack;
+    if (needle_len > haystack_len) return NULL;
+    if (needle_len == 1) return memchr(haystack, needle[0], haystack_len);
+
+#if defined(FILTER_X86)
+    {
+        size_t checked;
+        if (!filter_cpu_checked) {
+            filter_avx2 = __builtin_cpu_supports("avx2");
+            filter_cpu_checked = 1;
+        }
+        checked = filter_avx2 ? search_avx2(haystack, haystack_len, needle, needle_len)
+                              : search_sse2(haystack, haystack_len, needle, needle_len);
+        if (checked + needle_len <= haystack_len &&
+            memcmp(haystack + checked, needle, needle_len) == 0) {
+            return haystack + checked;
+        }
+        // No match in the vector loop; the last few positions need a scalar pass
+        p = haystack + checked;
+    }
+#endif
+
+    // Scalar search over what is left: memchr() to the first byte, then compare
+    while ((size_t)(end - p) >= needle_len) {
+        p = memchr(p, needle[0], (end - p) - needle_len + 1);
+        if (!p) return NULL;
+        if (memcmp(p, needle, needle_len) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+void output_filter_init(struct output_filter *filter) {
+    memset(filter, 0, sizeof(*filter));
+    filter->byte_end = -1;
+}
+
+int output_filter_start(struct output_filter *filter, filter_emit_fn emit, void *ctx) {
+    filter->emit = emit;
+    filter->ctx = ctx;
+    filter->partial = malloc(FILTER_LINE_MAX);
+    if (!filter->partial) return -1;
+
+    if (filter->tail > FILTER_TAIL_MAX) filter->tail = FILTER_TAIL_MAX;
+    if (filter->tail > 0) {
+        filter->ring = calloc(filter->tail, sizeof(*filter->ring));
+        if (!filter->ring) return -1;
+    }
+
+    if (filter->match == FILTER_MATCH_REGEX) {
+#ifdef FILTER_HAVE_REGEX
+        filter->scratch = malloc(FILTER_LINE_MAX + 1);
+        if (!filter->scratch) return -1;
+        if (regcomp(&filter->regex, filter->pattern, REG_EXTENDED | REG_NOSUB) != 0) return -1;
+        filter->regex_ready = 1;
+#else
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+// Does a line (without its newline) pass the match stage?
+static int filter_line_matches(struct output_filter *filter, const char *line, size_t len) {
+    int matched;
+
+    if (filter->match == FILTER_MATCH_NONE) return 1;
+    if (filter->match == FILTER_MATCH_FIXED) {
+        matched = find_substring(line, len, filter->pattern, filter->pattern_len) != NULL;
+    } else {
+#ifdef FILTER_HAVE_REGEX
+        if (len > FILTER_LINE_MAX) len = FILTER_LINE_MAX;
+        memcpy(filter->scratch, line, len);
+        filter->scratch[len] = '\0';
+        matched = regexec(&filter->regex, filter->scratch, 0, NULL, 0) == 0;
+#else
+        matched = 0;
+#endif
+    }
+    return matched != filter->invert;
+}
+
+// A line that passed the match stage goes through head and tail
+static void filter_keep_line(struct output_filter *filter, const char *line, size_t len) {
+    if (filter->head > 0 && filter->lines_kept >= filter->head) {
+        filter->done = 1;
+        return;
+    }
+    filter->lines_kept++;
+    if (filter->head > 0 && filter->lines_kept == filter->head) filter->done = 1;
+
+    if (filter->tail > 0) {
+        struct filter_line *slot = &filter->ring[filter->ring_count % filter->tail];
+        char *copy = malloc(len ? len : 1);
+        if (!copy) {
+            filter->failed = 1;
+            filter->done = 1;
+            return;
+        }
+        memcpy(copy, line, len);
+        free(slot->data);
+        slot->data = copy;
+        slot->len = len;
+        filter->ring_count++;
+    } else if (filter->emit(filter->ctx, line, len) != 0) {
+        filter->failed = 1;
+        filter->done = 1;
+    }
+}
+
+static void filter_one_line(struct output_filter *filter, const char *line, size_t len) {
+    size_t content = (len > 0 && line[len - 1] == '\n') ? len - 1 : len;
+
+    if (filter_line_matches(filter, line, content)) {
+        filter_keep_line(filter, line, len);
+    }
+}
+
+// Filter a run of complete lines (the last byte is a newline)
+static void filter_block(struct output_filter *filter, const char *p, size_t n) {
+    const char *end = p + n;
+
+    if (filter->match == FILTER_MATCH_FIXED && !filter->invert) {
+        // Jump from match to match instead of visiting every line
+        while (p < end && !filter->done) {
+            const char *hit = find_substring(p, end - p, filter->pattern, filter->pattern_len);
+            const char *line_start, *line_end;
+            if (!hit) break;
+            line_start = hit;
+            while (line_start > p && line_start[-1] != '\n') line_start--;
+            line_end = memchr(hit, '\n', end - hit);
+            line_end = line_end ? line_end + 1 : end;
+            filter_keep_line(filter, line_start, line_end - line_start);
+            p = line_end;
+        }
+        return;
+    }
+
+    while (p < end && !filter->done) {
+        const char *line_end = memchr(p, '\n', end - p);
+        line_end = line_end ? line_end + 1 : end;
+        filter_one_line(filter, p, line_end - p);
+        p = line_end;
+    }
+}
+
+int output_filter_feed(struct output_filter *filter, const char *data, size_t len) {
+    int range_ended = 0;
+    size_t complete;
+
+    if (filter->done) return filter->failed ? -1 : 1;
+
+    // Byte range stage
+    if (filter->raw_offset < filter->byte_start) {
+        long long skip = filter->byte_start - filter->raw_offset;
+        if ((long long)len < skip) skip = len;
+        data += skip;
+        len -= skip;
+        filter->raw_offset += skip;
+    }
+    if (filter->byte_end >= 0 && filter->raw_offset + (long long)len >= filter->byte_end) {
+        len = filter->byte_end > filter->raw_offset ? (size_t)(filter->byte_end - filter->raw_offset) : 0;
+        range_ended = 1;
+    }
+    filter->raw_offset += len;
+
+    // Complete the line carried over from the last feed
+    if (filter->partial_len > 0 && len > 0) {
+        const char *newline = memchr(data, '\n', len);
+        size_t take = newline ? (size_t)(newline - data) + 1 : len;
+        if (filter->partial_len + take > FILTER_LINE_MAX) take = FILTER_LINE_MAX - filter->partial_len;
+        memcpy(filter->partial + filter->partial_len, data, take);
+        filter->partial_len += take;
+        data += take;
+        len -= take;
+        if (filter->partial[filter->partial_len - 1] == '\n' || filter->partial_len == FILTER_LINE_MAX) {
+            filter_one_line(filter, filter->partial, filter->partial_len);
+            filter->partial_len = 0;
+        }
+    }
+
+    // Whole lines straight from the caller's buffer
+    complete = len;
+    while (complete > 0 && data[complete - 1] != '\n') complete--;
+    if (complete > 0 && !filter->done) filter_block(filter, data, complete);
+    data += complete;
+    len -= complete;
+
+    // Keep the unterminated remainder, splitting overlong lines
+    while (len > 0 && !filter->done) {
+        size_t take = len;
+        if (filter->partial_len + take >= FILTER_LINE_MAX) {
+            take = FILTER_LINE_MAX - filter->partial_len;
+            memcpy(filter->partial + filter->partial_len, data, take);
+            filter_one_line(filter, filter->partial, FILTER_LINE_MAX);
+            filter->partial_len = 0;
+        } else {
+            memcpy(filter->partial + filter->partial_len, data, take);
+            filter->partial_len += take;
+        }
+        data += take;
+        len -= take;
+    }
+
+    if (range_ended) filter->done = 1;
+    if (filter->failed) return -1;
+    return filter->done;
+}
+
+int output_filter_finish(struct output_filter *filter) {
+    long long i, first;
+
+    if (filter->partial_len > 0 && !filter->failed) {
+        filter_one_line(filter, filter->partial, filter->partial_len);
+        filter->partial_len = 0;
+    }
+
+    if (filter->tail > 0 && !filter->failed) {
+        first = filter->ring_count > filter->tail ? filter->ring_count - filter->tail : 0;
+        for (i = first; i < filter->ring_count; i++) {
+            struct filter_line *line = &filter->ring[i % filter->tail];
+            if (filter->emit(filter->ctx, line->data, line->len) != 0) {
+                filter->failed = 1;
+                break;
+            }
+        }
+    }
+    return filter->failed ? -1 : 0;
+}
+
+void output_filter_free(struct output_filter *filter) {
+    long long i;
+
+    if (filter->ring) {
+        for (i = 0; i < filter->tail; i++) free(filter->ring[i].data);
+        free(filter->ring);
+    }
+#ifdef FILTER_HAVE_REGEX
+    if (filter->regex_ready) regfree(&filter->regex);
+#endif
+    free(filter->scratch);
+    free(filter->partial);
+    filter->ring = NULL;
+    filter->scratch = NULL;
+    filter->partial = NULL;
+}
@@ -0,0 +1,83 @@
+#ifndef NETSHELL_FILTER_H
+#define NETSHELL_FILTER_H
+
+#include <stddef.h>
+
+#ifndef MORPHOS
+#include <regex.h>
+#define FILTER_HAVE_REGEX 1
+#endif
+
+// Output filters applied by EXEC on the server, so only the bytes the
+// client keeps cross the network. Stages run in this order: byte range on
+// the raw output, then line match (fixed string or regex, optionally
+// inverted), then head, then tail.
+
+#define FILTER_PATTERN_MAX 1024
+#define FILTER_LINE_MAX (64 * 1024)   // Longer lines are split
+#define FILTER_TAIL_MAX 100000
+
+#define FILTER_MATCH_NONE 0
+#define FILTER_MATCH_FIXED 1
+#define FILTER_MATCH_REGEX 2
+
+// Receives filtered output. Return non-zero to stop filtering.
+typedef int (*filter_emit_fn)(void *ctx, const char *data, size_t len);
+
+struct filter_line {
+    char *data;
+    size_t len;
+};
+
+struct output_filter {
+    // Settings, filled in before output_filter_start()
+    int match;
+    char pattern[FILTER_PATTERN_MAX];
+    size_t pattern_len;
+    int invert;
+    long long head;          // Keep the first N lines (0: all)
+    long long tail;          // Then keep the last N lines (0: all)
+    long long byte_start;    // Raw output range [byte_start, byte_end)
+    long long byte_end;      // -1: to the end
+
+    // State
+    filter_emit_fn emit;
+    void *ctx;
+#ifdef FILTER_HAVE_REGEX
+    regex_t regex;
+    int regex_ready;
+#endif
+    char *partial;           // Incomplete last line carried between feeds
+    size_t partial_len;
+    char *scratch;           // NUL terminated copy of a line for regexec()
+    struct filter_line *ring;
+    long long ring_count;
+    long long raw_offset;
+    long long lines_kept;
+    int done;
+    int failed;
+};
+
+// Set every stage to pass-through
+void output_filter_init(struct output_filter *filter);
+
+// Prepare to filter. Returns 0, or -1 if the regex does not compile or
+// memory runs out.
+int output_filter_start(struct output_filter *filter, filter_emit_fn emit, void *ctx);
+
+// Feed raw command output. Returns 1 once no more input can change the
+// result (head reached or past the byte range), 0 to keep feeding, -1 if
+// emit failed.
+int output_filter_feed(struct output_filter *filter, const char *data, size_t len);
+
+// Flush the last partial line and the tail buffer. Returns 0 or -1.
+int output_filter_finish(struct output_filter *filter);
+
+void output_filter_free(struct output_filter *filter);
+
+// Vectorised substring search (AVX2 or SSE2 on x86-64, memchr() elsewhere).
+// Returns a pointer to the first occurrence of needle in haystack, or NULL.
+const char *find_substring(const char *haystack, size_t haystack_len,
+                           const char *needle, size_t needle_len);
+
+#endif
@@ -0,0 +1,203 @@
+#define _GNU_SOURCE   // nftw(), mkdtemp()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "netshell_common.h"
+#include "netshell_harness.h"
+
+long long harness_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int harness_parse_address(struct harness_target *target, const char *host_port) {
+    const char *colon = strrchr(host_port, ':');
+
+    if (!colon || colon == host_port || (size_t)(colon - host_port) >= sizeof(target->host)) return -1;
+    memcpy(target->host, host_port, colon - host_port);
+    target->host[colon - host_port] = '\0';
+    target->port = atoi(colon + 1);
+    return target->port > 0 && target->port <= 65535 ? 0 : -1;
+}
+
+int harness_resolve(struct harness_target *target) {
+    struct addrinfo hints, *info;
+    char port[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", target->port);
+    if (getaddrinfo(target->host, port, &hints, &info) != 0) return -1;
+    memcpy(&target->addr, info->ai_addr, info->ai_addrlen);
+    target->addr_len = info->ai_addrlen;
+    freeaddrinfo(info);
+    return 0;
+}
+
+int harness_connect(const struct harness_target *target) {
+    int fd = socket(target->addr.ss_family, SOCK_STREAM, 0);
+    struct timeval tv;
+    int on = 1;
+
+    if (fd < 0) return -1;
+    if (connect(fd, (const struct sockaddr *)&target->addr, target->addr_len) != 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    // Give up on a reply that never comes instead of hanging the run
+    tv.tv_sec = HARNESS_REPLY_TIMEOUT_MS / 1000;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+int harness_connect_extended(const struct harness_target *target) {
+    char line[256];
+    int fd = harness_connect(target);
+
+    if (fd < 0) return -1;
+    if (send_all(fd, HARNESS_MAGIC, strlen(HARNESS_MAGIC)) < 0 ||
+        recv_line(fd, line, sizeof(line)) < 0 || strcmp(line, "EXTENDED_ACK") != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int harness_make_dir(char *dir, size_t size, const char *name) {
+    snprintf(dir, size, "/tmp/%s.XXXXXX", name);
+    return mkdtemp(dir) ? 0 : -1;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+void harness_remove_dir(const char *dir) {
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+pid_t harness_start_process(const char *dir, char *const argv[], const char *out_name) {
+    char out[512];
+    pid_t pid;
+    int fd;
+
+    snprintf(out, sizeof(out), "%s/%s", dir, out_name);
+    pid = fork();
+    if (pid == 0) {
+        fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+void harness_stop_process(pid_t *pid) {
+    if (*pid <= 0) return;
+    kill(*pid, SIGTERM);
+    waitpid(*pid, NULL, 0);
+    *pid = -1;
+}
+
+int harness_wait_ready(const struct harness_target *target, pid_t *pid) {
+    long long deadline = harness_now_us() + (long long)HARNESS_START_TIMEOUT_MS * 1000;
+
+    while (harness_now_us() < deadline) {
+        int fd;
+
+        if (waitpid(*pid, NULL, WNOHANG) == *pid) {
+            *pid = -1;
+            return -1;
+        }
+        fd = harness_connect_extended(target);
+        if (fd >= 0) {
+            close(fd);
+            return 0;
+        }
+        usleep(50000);
+    }
+    return -1;
+}
+
+pid_t harness_start_server(const char *dir, const char *server_path, const struct harness_target *target) {
+    char port[16], jobs[300], sessions[300], log[300];
+    char *argv[] = { (char *)server_path, "--job-dir", jobs, "--session-dir", sessions,
+                     "--log-file", log, port, NULL };
+    pid_t pid;
+
+    snprintf(port, sizeof(port), "%d", target->port);
+    snprintf(jobs, sizeof(jobs), "%s/jobs", dir);
+    snprintf(sessions, sizeof(sessions), "%s/sessions", dir);
+    snprintf(log, sizeof(log), "%s/events.log", dir);
+    pid = harness_start_process(dir, argv, "server.out");
+    if (pid < 0) return -1;
+    if (harness_wait_ready(target, &pid) != 0) harness_stop_process(&pid);
+    return pid;
+}
+
+int harness_samples_add(struct harness_samples *samples, long long value) {
+    if (samples->count == samples->capacity) {
+        int capacity = samples->capacity ? samples->capacity * 2 : 256;
+        long long *values = realloc(samples->values, sizeof(long long) * capacity);
+        if (!values) return -1;
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+    return 0;
+}
+
+static int compare_values(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+long long harness_percentile(const struct harness_samples *samples, int percent) {
+    int rank = (samples->count * percent + 99) / 100;
+    if (rank < 1) rank = 1;
+    return samples->values[rank - 1];
+}
+
+void harness_samples_sort(struct harness_samples *samples) {
+    if (samples->count > 0) qsort(samples->values, samples->count, sizeof(long long), compare_values);
+}
+
+void harness_print_stats(FILE *out, struct harness_samples *samples) {
+    long long sum = 0;
+    int i;
+
+    fprintf(out, "\"count\": %d", samples->count);
+    if (samples->count == 0) return;
+    harness_samples_sort(samples);
+    for (i = 0; i < samples->count; i++) sum += samples->values[i];
+    fprintf(out, ", \"min\": %lld, \"mean\": %lld, \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"max\": %lld",
+            samples->values[0], sum / samples->count, harness_percentile(samples, 50),
+            harness_percentile(samples, 90), harness_percentile(samples, 99), samples->values[samples->count - 1]);
+}
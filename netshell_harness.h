@@ -0,0 +1,75 @@
+#ifndef NETSHELL_HARNESS_H
+#define NETSHELL_HARNESS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Shared by the test tools (netshell_bench, netshell_stress): reaching a
+// server, starting one of our own in a scratch directory, and collecting
+// latency samples.
+
+#define HARNESS_START_TIMEOUT_MS 10000  // The server sleeps a second before bind()
+#define HARNESS_REPLY_TIMEOUT_MS 30000
+#define HARNESS_MAGIC "NETSHELL_EXTENDED_V1\n"
+
+struct harness_target {
+    char host[256];
+    int port;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+};
+
+struct harness_samples {
+    long long *values;
+    int count;
+    int capacity;
+};
+
+// Monotonic clock in microseconds
+long long harness_now_us(void);
+
+// Fill in target from "host:port". Returns 0 or -1.
+int harness_parse_address(struct harness_target *target, const char *host_port);
+
+// Look up target's host and port once, so timings leave DNS out
+int harness_resolve(struct harness_target *target);
+
+// Blocking connect with TCP_NODELAY and a reply timeout. Returns the socket or -1.
+int harness_connect(const struct harness_target *target);
+
+// Connect and negotiate the extended protocol. Returns the socket or -1.
+int harness_connect_extended(const struct harness_target *target);
+
+// Make a fresh directory /tmp/<name>.XXXXXX in dir. Returns 0 or -1.
+int harness_make_dir(char *dir, size_t size, const char *name);
+
+// Remove dir and everything in it
+void harness_remove_dir(const char *dir);
+
+// Start argv[0] with its output in dir/out_name. Returns the pid or -1.
+pid_t harness_start_process(const char *dir, char *const argv[], const char *out_name);
+
+// SIGTERM the process and wait for it; sets *pid to -1
+void harness_stop_process(pid_t *pid);
+
+// Wait until target answers the extended handshake, or *pid exits (*pid
+// becomes -1). Returns 0 or -1.
+int harness_wait_ready(const struct harness_target *target, pid_t *pid);
+
+// Start server_path on target's port with its job, session and log files in
+// dir, and wait until it is up. Output goes to dir/server.out. Returns the
+// pid, or -1 (the server stopped).
+pid_t harness_start_server(const char *dir, const char *server_path, const struct harness_target *target);
+
+int harness_samples_add(struct harness_samples *samples, long long value);
+void harness_samples_sort(struct harness_samples *samples);
+
+// Sort the samples and print them as JSON members: count, then min, mean,
+// p50, p90, p99 and max if there are any
+void harness_print_stats(FILE *out, struct harness_samples *samples);
+
+// Nearest-rank percentile; the samples must be sorted
+long long harness_percentile(const struct harness_samples *samples, int percent);
+
+#endif
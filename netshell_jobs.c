@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+
+#include "netshell_exec.h"
+#include "netshell_jobs.h"
+
+#define JOB_PATH_MAX 512
+#define JOB_READ_CHUNK (64 * 1024)
+#define JOB_SCAN_INTERVAL 1   // Seconds between spool rescans without a wakeup
+
+static void job_path(char *buf, size_t size, const char *dir, long id, const char *file) {
+    snprintf(buf, size, "%s/%ld/%s", dir, id, file);
+}
+
+int job_finished(int state) {
+    return state == JOB_DONE || state == JOB_CANCELLED || state == JOB_LOST;
+}
+
+const char *job_state_name(int state) {
+    switch (state) {
+    case JOB_QUEUED: return "queued";
+    case JOB_RUNNING: return "running";
+    case JOB_DONE: return "done";
+    case JOB_CANCELLED: return "cancelled";
+    case JOB_LOST: return "lost";
+    default: return "unknown";
+    }
+}
+
+// The status file is replaced with rename(), so readers never see half of one
+static int job_write_status(const char *dir, const struct job_info *info) {
+    char path[JOB_PATH_MAX], tmp[JOB_PATH_MAX];
+    FILE *f;
+
+    job_path(path, sizeof(path), dir, info->id, "status");
+    job_path(tmp, sizeof(tmp), dir, info->id, "status.tmp");
+    f = fopen(tmp, "w");
+    if (!f) return -1;
+    fprintf(f, "%d %d %lld %lld %lld %ld\n", info->state, info->exit_code, info->submitted,
+            info->started, info->finished, (long)info->pid);
+    if (fclose(f) != 0) return -1;
+    return rename(tmp, path);
+}
+
+// Total bytes written to a ring, from its header
+static long long job_ring_written(int fd) {
+    uint64_t written;
+
+    if (pread(fd, &written, sizeof(written), 0) != (ssize_t)sizeof(written)) return 0;
+    return (long long)written;
+}
+
+int job_read_info(const char *dir, long id, struct job_info *info) {
+    char path[JOB_PATH_MAX];
+    long pid;
+    FILE *f;
+    int fd;
+
+    memset(info, 0, sizeof(*info));
+    info->id = id;
+    job_path(path, sizeof(path), dir, id, "status");
+    f = fopen(path, "r");
+    if (!f) return -1;
+    if (fscanf(f, "%d %d %lld %lld %lld %ld", &info->state, &info->exit_code, &info->submitted,
+               &info->started, &info->finished, &pid) != 6) {
+        fclose(f);
+        errno = EINVAL;
+        return -1;
+    }
+    fclose(f);
+    info->pid = (pid_t)pid;
+
+    job_path(path, sizeof(path), dir, id, "output");
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        info->output_bytes = job_ring_written(fd);
+        close(fd);
+    }
+    return 0;
+}
+
+int job_read_command(const char *dir, long id, char *buf, size_t size) {
+    char path[JOB_PATH_MAX];
+    FILE *f;
+
+    buf[0] = '\0';
+    job_path(path, sizeof(path), dir, id, "command");
+    f = fopen(path, "r");
+    if (!f) return -1;
+    if (!fgets(buf, size, f)) buf[0] = '\0';
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+static int job_id_compare(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+int job_list(const char *dir, long *ids, int max) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    int count = 0;
+
+    if (!d) return 0;
+    while ((entry = readdir(d)) && count < max) {
+        char *end;
+        long id = strtol(entry->d_name, &end, 10);
+        if (end != entry->d_name && *end == '\0' && id > 0) ids[count++] = id;
+    }
+    closedir(d);
+    qsort(ids, count, sizeof(*ids), job_id_compare);
+    return count;
+}
+
+long job_submit(const char *dir, pid_t manager, const char *command) {
+    char path[JOB_PATH_MAX];
+    struct job_info info;
+    long ids[JOB_LIST_MAX];
+    long id;
+    int count;
+    FILE *f;
+
+    mkdir(dir, 0700);
+    count = job_list(dir, ids, JOB_LIST_MAX);
+    id = count > 0 ? ids[count - 1] + 1 : 1;
+
+    // mkdir() is atomic, so two connections submitting at once get distinct ids
+    for (;;) {
+        snprintf(path, sizeof(path), "%s/%ld", dir, id);
+        if (mkdir(path, 0700) == 0) break;
+        if (errno != EEXIST) return -1;
+        id++;
+    }
+
+    job_path(path, sizeof(path), dir, id, "command");
+    f = fopen(path, "w");
+    if (!f || fputs(command, f) < 0 || fclose(f) != 0) return -1;
+
+    // The manager ignores a job until its status file exists
+    memset(&info, 0, sizeof(info));
+    info.id = id;
+    info.state = JOB_QUEUED;
+    info.exit_code = -1;
+    info.submitted = time(NULL);
+    if (job_write_status(dir, &info) != 0) return -1;
+
+    if (manager > 0) kill(manager, SIGUSR1);
+    return id;
+}
+
+int job_cancel(const char *dir, pid_t manager, long id) {
+    char path[JOB_PATH_MAX];
+    struct job_info info;
+    int fd;
+
+    if (job_read_info(dir, id, &info) != 0) return -1;
+    if (job_finished(info.state)) return 1;
+
+    job_path(path, sizeof(path), dir, id, "cancel");
+    fd = open(path, O_WRONLY | O_CREAT, 0600);
+    if (fd < 0) return -1;
+    close(fd);
+    if (manager > 0) kill(manager, SIGUSR1);
+    return 0;
+}
+
+ssize_t job_read_output(const char *dir, long id, long long *offset, char *buf, size_t len) {
+    char path[JOB_PATH_MAX];
+    long long written, oldest, position;
+    ssize_t got = 0;
+    int fd;
+
+    job_path(path, sizeof(path), dir, id, "output");
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;   // Still queued
+
+    for (;;) {
+        written = job_ring_written(fd);
+        oldest = written > JOB_RING_SIZE ? written - JOB_RING_SIZE : 0;
+        if (*offset < oldest) *offset = oldest;
+        if (*offset >= written) break;
+
+        position = *offset % JOB_RING_SIZE;
+        if ((long long)len > written - *offset) len = written - *offset;
+        if ((long long)len > JOB_RING_SIZE - position) len = JOB_RING_SIZE - position;
+        got = pread(fd, buf, len, JOB_RING_HEADER + position);
+        if (got <= 0) break;
+
+        // The manager may have wrapped around over what we just read
+        written = job_ring_written(fd);
+        if (written - JOB_RING_SIZE <= *offset) break;
+        got = 0;
+    }
+    close(fd);
+    return got;
+}
+
+#ifdef NETSHELL_JOBS
+struct job_slot {
+    long id;
+    pid_t pid;
+    int output_fd;           // Pipe from the command; -1 once closed, while it is reaped
+    int ring_fd;
+    long long written;
+    int cancelled;
+    struct job_info info;
+};
+
+static volatile sig_atomic_t manager_wakeup;
+static volatile sig_atomic_t manager_stop;
+
+static void job_manager_signal(int sig) {
+    if (sig == SIGUSR1) {
+        manager_wakeup = 1;
+    } else if (sig == SIGCHLD) {
+        // Only wakes pselect(); reaping slots are checked on every pass
+    } else {
+        manager_stop = 1;
+    }
+}
+
+static int job_ring_append(struct job_slot *slot, const char *data, size_t len) {
+    uint64_t header;
+
+    while (len > 0) {
+        long long position = slot->written % JOB_RING_SIZE;
+        size_t take = len;
+        if ((long long)take > JOB_RING_SIZE - position) take = JOB_RING_SIZE - position;
+        if (pwrite(slot->ring_fd, data, take, JOB_RING_HEADER + position) != (ssize_t)take) return -1;
+        slot->written += take;
+        data += take;
+        len -= take;
+    }
+    header = (uint64_t)slot->written;
+    return pwrite(slot->ring_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) ? 0 : -1;
+}
+
+static int job_cancel_requested(const char *dir, long id) {
+    char path[JOB_PATH_MAX];
+
+    job_path(path, sizeof(path), dir, id, "cancel");
+    return access(path, F_OK) == 0;
+}
+
+static void job_remove(const char *dir, long id) {
+    static const char *files[] = { "command", "status", "status.tmp", "output", "cancel" };
+    char path[JOB_PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        job_path(path, sizeof(path), dir, id, files[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/%ld", dir, id);
+    rmdir(path);
+}
+
+static int job_start(const char *dir, struct job_slot *slot, const sigset_t *run_mask) {
+    char path[JOB_PATH_MAX];
+    char *command;
+    sigset_t manager_mask;
+    uint64_t header = 0;
+    ssize_t len;
+    int fd;
+
+    job_path(path, sizeof(path), dir, slot->id, "command");
+    fd = open(path, O_RDONLY);
+    command = malloc(JOB_COMMAND_MAX + 1);
+    len = (fd >= 0 && command) ? read(fd, command, JOB_COMMAND_MAX) : -1;
+    if (fd >= 0) close(fd);
+    if (len < 0) {
+        free(command);
+        return -1;
+    }
+    command[len] = '\0';
+
+    job_path(path, sizeof(path), dir, slot->id, "output");
+    slot->ring_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (slot->ring_fd < 0 || pwrite(slot->ring_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        if (slot->ring_fd >= 0) close(slot->ring_fd);
+        free(command);
+        return -1;
+    }
+    fcntl(slot->ring_fd, F_SETFD, FD_CLOEXEC);
+
+    // The command must not inherit the manager's blocked SIGUSR1
+    sigprocmask(SIG_SETMASK, run_mask, &manager_mask);
+    slot->pid = spawn_shell_command(-1, command, &slot->output_fd);
+    sigprocmask(SIG_SETMASK, &manager_mask, NULL);
+    free(command);
+    if (slot->pid < 0) {
+        close(slot->ring_fd);
+        return -1;
+    }
+    fcntl(slot->output_fd, F_SETFD, FD_CLOEXEC);
+
+    slot->written = 0;
+    slot->cancelled = 0;
+    slot->info.state = JOB_RUNNING;
+    slot->info.started = time(NULL);
+    slot->info.pid = slot->pid;
+    job_write_status(dir, &slot->info);
+    return 0;
+}
+
+static void job_end(const char *dir, struct job_slot *slot, int state, int status) {
+    if (slot->output_fd >= 0) close(slot->output_fd);
+    close(slot->ring_fd);
+    slot->info.state = state;
+    slot->info.exit_code = state == JOB_DONE ? command_exit_code(status, 0) : -1;
+    slot->info.finished = time(NULL);
+    slot->info.pid = 0;
+    job_write_status(dir, &slot->info);
+    slot->id = 0;
+}
+
+// Apply cancel requests, start queued jobs while slots are free and trim
+// old finished jobs
+static void job_schedule(const char *dir, struct job_slot *slots, int limit, const sigset_t *run_mask) {
+    long ids[JOB_LIST_MAX];
+    int count = job_list(dir, ids, JOB_LIST_MAX);
+    int finished = 0;
+    int i, j;
+
+    for (i = count - 1; i >= 0; i--) {
+        struct job_info info;
+        if (job_read_info(dir, ids[i], &info) == 0 && job_finished(info.state) &&
+            ++finished > JOB_KEEP_FINISHED) {
+            job_remove(dir, ids[i]);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        struct job_info info;
+        struct job_slot *free_slot = NULL;
+
+        if (job_read_info(dir, ids[i], &info) != 0) continue;   // Still being submitted
+
+        if (info.state == JOB_RUNNING) {
+            for (j = 0; j < limit; j++) {
+                if (slots[j].id == info.id && !slots[j].cancelled && job_cancel_requested(dir, info.id)) {
+                    slots[j].cancelled = 1;
+                    stop_command(slots[j].pid, SIGTERM);
+                }
+            }
+            continue;
+        }
+        if (info.state != JOB_QUEUED) continue;
+
+        if (job_cancel_requested(dir, info.id)) {
+            info.state = JOB_CANCELLED;
+            info.finished = time(NULL);
+            job_write_status(dir, &info);
+            continue;
+        }
+        for (j = 0; j < limit && !free_slot; j++) {
+            if (slots[j].id == 0) free_slot = &slots[j];
+        }
+        if (!free_slot) continue;   // Keep scanning for cancels of queued jobs
+
+        free_slot->id = info.id;
+        free_slot->info = info;
+        if (job_start(dir, free_slot, run_mask) != 0) {
+            free_slot->info.state = JOB_DONE;
+            free_slot->info.exit_code = 127;
+            free_slot->info.finished = time(NULL);
+            job_write_status(dir, &free_slot->info);
+            free_slot->id = 0;
+        }
+    }
+}
+
+// Jobs still marked running belonged to a manager that is gone
+static void job_recover(const char *dir) {
+    long ids[JOB_LIST_MAX];
+    int count = job_list(dir, ids, JOB_LIST_MAX);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        struct job_info info;
+        if (job_read_info(dir, ids[i], &info) == 0 && info.state == JOB_RUNNING) {
+            info.state = JOB_LOST;
+            info.finished = time(NULL);
+            info.pid = 0;
+            job_write_status(dir, &info);
+        }
+    }
+}
+
+static void job_manager_run(const char *dir, int limit, pid_t server) {
+    struct job_slot slots[JOB_MAX_RUNNING];
+    struct sigaction action;
+    sigset_t block, run_mask;
+    char *chunk = malloc(JOB_READ_CHUNK);
+    time_t last_scan = 0;
+    int i;
+
+    memset(slots, 0, sizeof(slots));
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = job_manager_signal;   // No SA_RESTART: wake pselect()
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGCHLD, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 and SIGCHLD are only delivered inside pselect(), so a wakeup
+    // or a job ending between the scan and the wait is never lost
+    sigemptyset(&block);
+    sigaddset(&block, SIGUSR1);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &run_mask);
+
+    job_recover(dir);
+    manager_wakeup = 1;
+
+    while (!manager_stop && getppid() == server && chunk) {
+        struct timespec timeout;
+        fd_set read_fds;
+        int max_fd = -1;
+
+        // Jobs whose output has closed end once their command has exited
+        for (i = 0; i < limit; i++) {
+            int status = 0;
+            if (slots[i].id == 0 || slots[i].output_fd >= 0) continue;
+            if (waitpid(slots[i].pid, &status, WNOHANG) == 0) continue;
+            job_end(dir, &slots[i], slots[i].cancelled ? JOB_CANCELLED : JOB_DONE, status);
+            manager_wakeup = 1;   // A slot is free
+        }
+
+        if (manager_wakeup || time(NULL) - last_scan >= JOB_SCAN_INTERVAL) {
+            manager_wakeup = 0;
+            last_scan = time(NULL);
+            job_schedule(dir, slots, limit, &run_mask);
+        }
+
+        FD_ZERO(&read_fds);
+        for (i = 0; i < limit; i++) {
+            if (slots[i].id == 0 || slots[i].output_fd < 0) continue;
+            FD_SET(slots[i].output_fd, &read_fds);
+            if (slots[i].output_fd > max_fd) max_fd = slots[i].output_fd;
+        }
+        timeout.tv_sec = JOB_SCAN_INTERVAL;
+        timeout.tv_nsec = 0;
+        if (pselect(max_fd + 1, &read_fds, NULL, NULL, &timeout, &run_mask) <= 0) continue;
+
+        for (i = 0; i < limit; i++) {
+            struct job_slot *slot = &slots[i];
+            ssize_t len;
+
+            if (slot->id == 0 || slot->output_fd < 0 || !FD_ISSET(slot->output_fd, &read_fds)) continue;
+            len = read(slot->output_fd, chunk, JOB_READ_CHUNK);
+            if (len < 0 && errno == EINTR) continue;
+            if (len > 0) {
+                job_ring_append(slot, chunk, len);
+                continue;
+            }
+            // Output closed. The command usually exits with it, but one that
+            // closed stdout and kept running (exec >/dev/null) must not stall
+            // the other jobs: the slot stays busy until it is reaped above.
+            close(slot->output_fd);
+            slot->output_fd = -1;
+        }
+    }
+
+    for (i = 0; i < limit; i++) {
+        if (slots[i].id == 0) continue;
+        stop_command(slots[i].pid, SIGTERM);
+        waitpid(slots[i].pid, NULL, 0);
+        job_end(dir, &slots[i], JOB_LOST, 0);
+    }
+    free(chunk);
+}
+
+pid_t job_manager_start(const char *dir, int limit) {
+    pid_t server = getpid();
+    pid_t pid;
+
+    if (limit < 1) limit = 1;
+    if (limit > JOB_MAX_RUNNING) limit = JOB_MAX_RUNNING;
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return -1;
+
+    pid = fork();
+    if (pid == 0) {
+        job_manager_run(dir, limit, server);
+        _exit(0);
+    }
+    return pid;
+}
+#else
+pid_t job_manager_start(const char *dir, int limit) {
+    (void)dir;
+    (void)limit;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
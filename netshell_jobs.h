@@ -0,0 +1,79 @@
+#ifndef NETSHELL_JOBS_H
+#define NETSHELL_JOBS_H
+
+#include <sys/types.h>
+
+// Detached job queue used by the JOB_* commands.
+//
+// Every connection is served by its own process, so jobs live in a spool
+// directory they all share: one subdirectory per job id holding the
+// command, a one-line status file and the output ring. A job manager
+// process forked at server startup starts queued jobs in id order while
+// fewer than the concurrency limit are running, copies their output into
+// the ring and records how they ended. Handlers submit and cancel by writing
+// into the spool and sending the manager SIGUSR1, and read status and output
+// straight from the files, so a job outlives the connection that started it.
+//
+// The ring is a fixed size file: byte N of the output is stored at
+// JOB_RING_HEADER + N % JOB_RING_SIZE and the header holds the total written,
+// so the last JOB_RING_SIZE bytes can be read from any offset.
+
+#ifndef MORPHOS
+#define NETSHELL_JOBS 1   // The manager needs fork(), not vfork()
+#endif
+
+#define JOB_DEFAULT_DIR "/tmp/netshell-jobs"
+#define JOB_RING_SIZE (4 * 1024 * 1024)
+#define JOB_RING_HEADER 64
+#define JOB_KEEP_FINISHED 100          // Older finished jobs are removed
+#define JOB_COMMAND_MAX (1024 * 1024)
+#define JOB_MAX_RUNNING 64
+#define JOB_LIST_MAX 1024
+
+// Job states
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_CANCELLED 3
+#define JOB_LOST 4        // The manager stopped while the job ran
+
+struct job_info {
+    long id;
+    int state;
+    int exit_code;           // Valid once JOB_DONE
+    long long output_bytes;  // Produced so far, including any overwritten in the ring
+    long long submitted;     // Unix times (0: not yet)
+    long long started;
+    long long finished;
+    pid_t pid;
+};
+
+// Fork the job manager, running at most limit jobs at once. Jobs left
+// running by an earlier server are marked lost. Returns its pid, or -1.
+pid_t job_manager_start(const char *dir, int limit);
+
+// Queue a command. Returns the new job id, or -1.
+long job_submit(const char *dir, pid_t manager, const char *command);
+
+// Returns 0, or -1 if there is no such job
+int job_read_info(const char *dir, long id, struct job_info *info);
+
+// First line of the job's command, truncated to fit size
+int job_read_command(const char *dir, long id, char *buf, size_t size);
+
+// Ask the manager to cancel a job. Returns 0 when requested, 1 if the job
+// already finished, -1 if there is no such job.
+int job_cancel(const char *dir, pid_t manager, long id);
+
+// Read output from *offset. An offset the ring has already overwritten is
+// moved up to the oldest byte still kept. Returns the bytes read (0: none
+// available yet), or -1.
+ssize_t job_read_output(const char *dir, long id, long long *offset, char *buf, size_t len);
+
+// Ids of the jobs in the spool, ascending. Returns the count.
+int job_list(const char *dir, long *ids, int max);
+
+int job_finished(int state);
+const char *job_state_name(int state);
+
+#endif
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#ifndef MORPHOS
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#include "netshell_log.h"
+
+#define LOG_BATCH 256            // Records per write() from the flusher
+
+struct log_ring {
+    uint64_t head;               // Records ever claimed
+    struct log_record slots[LOG_RING];
+};
+
+static struct log_ring *ring;
+static int log_flushing;         // A flusher drains the ring
+static pid_t log_pid;            // getpid() is a system call; kept current across fork()
+static volatile sig_atomic_t flusher_stop;
+
+static void log_refresh_pid(void) {
+    log_pid = getpid();
+}
+
+static long long log_wall_us(void) {
+#ifdef CLOCK_REALTIME
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
+        return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+int log_init(void) {
+    log_refresh_pid();
+#ifndef MORPHOS
+    pthread_atfork(NULL, NULL, log_refresh_pid);
+    {
+        void *shared = mmap(NULL, sizeof(struct log_ring), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared != MAP_FAILED) {
+            ring = shared;   // Zero filled by the kernel
+            return 0;
+        }
+    }
+#endif
+    return -1;
+}
+
+static void log_fill(struct log_record *record, int event, long long arg0, long long arg1, const char *text) {
+    record->time_us = log_wall_us();
+    record->pid = log_pid;
+    record->event = event;
+    record->reserved = 0;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    if (text) {
+        size_t len = strlen(text);
+        if (len >= LOG_TEXT_MAX) text += len - (LOG_TEXT_MAX - 1);
+        strncpy(record->text, text, LOG_TEXT_MAX - 1);
+        record->text[LOG_TEXT_MAX - 1] = '\0';
+    } else {
+        record->text[0] = '\0';
+    }
+}
+
+void log_event(int event, long long arg0, long long arg1, const char *text) {
+    struct log_record *slot;
+    uint64_t position;
+
+    if (!log_flushing) {
+        // Nobody drains the ring: print the line the old way
+        struct log_record record;
+        char line[256];
+        size_t len;
+
+        log_fill(&record, event, arg0, arg1, text);
+        len = log_format(&record, line, sizeof(line) - 1);
+        line[len++] = '\n';
+        if (write(STDOUT_FILENO, line, len) != (ssize_t)len) {
+            // Nowhere left to report it
+        }
+        return;
+    }
+
+    position = __sync_fetch_and_add(&ring->head, 1);
+    slot = &ring->slots[position % LOG_RING];
+    slot->seq = 0;
+    __sync_synchronize();
+    log_fill(slot, event, arg0, arg1, text);
+    __sync_synchronize();
+    slot->seq = position + 1;
+}
+
+static const char *log_event_name(int event) {
+    switch (event) {
+    case LOG_CONNECT: return "connect";
+    case LOG_EXTENDED: return "extended";
+    case LOG_BASIC: return "basic";
+    case LOG_IDLE_CLOSE: return "idle_close";
+    case LOG_CLOSED: return "closed";
+    case LOG_CRC_MISMATCH: return "crc_mismatch";
+    case LOG_COPY: return "copy";
+    case LOG_FORK_FAILED: return "fork_failed";
+    case LOG_LOST: return "lost";
+    default: return "unknown";
+    }
+}
+
+size_t log_format(const struct log_record *record, char *buf, size_t size) {
+    time_t seconds = (time_t)(record->time_us / 1000000);
+    long long a0 = record->args[0], a1 = record->args[1];
+    char stamp[32];
+    char address[16];
+    struct tm tm;
+    int used, n;
+
+    if (size == 0) return 0;
+    localtime_r(&seconds, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    used = snprintf(buf, size, "%s.%06lld [%d] ", stamp, (long long)(record->time_us % 1000000), (int)record->pid);
+    if (used < 0 || (size_t)used >= size) return size - 1;
+
+    snprintf(address, sizeof(address), "%u.%u.%u.%u", (unsigned)(a0 >> 24) & 255, (unsigned)(a0 >> 16) & 255,
+             (unsigned)(a0 >> 8) & 255, (unsigned)a0 & 255);
+    switch (record->event) {
+    case LOG_CONNECT:
+        n = snprintf(buf + used, size - used, "New connection from %s:%lld", address, a1);
+        break;
+    case LOG_EXTENDED:
+        n = snprintf(buf + used, size - used, "Extended protocol activated for connection %s:%lld", address, a1);
+        break;
+    case LOG_BASIC:
+        n = snprintf(buf + used, size - used, "Basic protocol mode for connection %s:%lld", address, a1);
+        break;
+    case LOG_IDLE_CLOSE:
+        n = snprintf(buf + used, size - used, "Closing connection: nothing heard for %lld seconds", a0);
+        break;
+    case LOG_CLOSED:
+        n = snprintf(buf + used, size - used, "Connection closed after %.3f seconds", a0 / 1e6);
+        break;
+    case LOG_CRC_MISMATCH:
+        n = snprintf(buf + used, size - used, "CRC32C mismatch receiving %.*s", LOG_TEXT_MAX, record->text);
+        break;
+    case LOG_COPY:
+        n = snprintf(buf + used, size - used, "Copied %lld bytes to %.*s", a0, LOG_TEXT_MAX, record->text);
+        break;
+    case LOG_FORK_FAILED:
+        n = snprintf(buf + used, size - used, "fork: %s", strerror((int)a0));
+        break;
+    case LOG_LOST:
+        n = snprintf(buf + used, size - used, "%lld log records lost", a0);
+        break;
+    default:
+        n = snprintf(buf + used, size - used, "%s %lld %lld %.*s", log_event_name(record->event), a0, a1,
+                     LOG_TEXT_MAX, record->text);
+        break;
+    }
+    if (n < 0) return used;
+    return (size_t)n < size - used ? (size_t)(used + n) : size - 1;
+}
+
+#ifndef MORPHOS
+static void log_flusher_signal(int sig) {
+    (void)sig;
+    flusher_stop = 1;
+}
+
+static long long log_monotonic_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Hand a batch to the file, or print it when there is no file
+static void log_emit(int fd, const struct log_record *batch, int count) {
+    int i;
+
+    if (count == 0) return;
+    if (fd >= 0) {
+        size_t len = sizeof(*batch) * count;
+        if (write(fd, batch, len) != (ssize_t)len) {
+            // A full disk only costs us the log
+        }
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        char line[256];
+        size_t len = log_format(&batch[i], line, sizeof(line) - 1);
+        line[len++] = '\n';
+        fwrite(line, 1, len, stdout);
+    }
+    fflush(stdout);
+}
+
+// Add a record to the batch, writing the batch out when it is full
+static void log_batch_add(int fd, struct log_record *batch, int *count, const struct log_record *record) {
+    batch[(*count)++] = *record;
+    if (*count == LOG_BATCH) {
+        log_emit(fd, batch, *count);
+        *count = 0;
+    }
+}
+
+// Note a gap in the log where it happened
+static void log_batch_lost(int fd, struct log_record *batch, int *count, uint64_t *lost) {
+    struct log_record record;
+
+    if (*lost == 0) return;
+    log_fill(&record, LOG_LOST, (long long)*lost, 0, NULL);
+    record.seq = 0;
+    log_batch_add(fd, batch, count, &record);
+    *lost = 0;
+}
+
+// Copy every published record from position on, in order. A slot that was
+// overwritten before we got to it is counted as lost; one that stays
+// claimed but unwritten (its writer died) is skipped after LOG_STALL_MS.
+static uint64_t log_drain(int fd, struct log_record *batch, uint64_t position, long long *stalled_since) {
+    struct log_record record;
+    int count = 0;
+    uint64_t lost = 0;
+
+    for (;;) {
+        uint64_t head = ring->head;
+        struct log_record *slot;
+        uint64_t seq;
+
+        if (position == head) break;
+        if (head - position > LOG_RING) {
+            lost += head - position - LOG_RING;
+            position = head - LOG_RING;
+        }
+
+        slot = &ring->slots[position % LOG_RING];
+        seq = slot->seq;
+        if (seq == position + 1) {
+            __sync_synchronize();
+            record = *slot;
+            __sync_synchronize();
+            if (slot->seq != seq) continue;   // Overwritten while copying; the lap check catches it
+            *stalled_since = 0;
+            position++;
+            log_batch_lost(fd, batch, &count, &lost);
+            log_batch_add(fd, batch, &count, &record);
+            continue;
+        }
+        if (seq > position + 1) {
+            lost++;   // Already reused by a later lap
+            position++;
+            continue;
+        }
+        // Claimed, not yet written
+        if (*stalled_since == 0) *stalled_since = log_monotonic_ms();
+        if (log_monotonic_ms() - *stalled_since < LOG_STALL_MS) break;
+        *stalled_since = 0;
+        lost++;
+        position++;
+    }
+
+    log_batch_lost(fd, batch, &count, &lost);
+    log_emit(fd, batch, count);
+    return position;
+}
+
+static void log_flusher_run(int fd, pid_t server, const sigset_t *run_mask) {
+    struct log_record *batch = malloc(sizeof(struct log_record) * LOG_BATCH);
+    struct sigaction action;
+    long long stalled_since = 0;
+    uint64_t position = 0;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = log_flusher_signal;   // No SA_RESTART: cut the sleep short
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGINT, SIG_IGN);                  // Ctrl+C stops the server, which then stops us
+    signal(SIGPIPE, SIG_IGN);
+    sigprocmask(SIG_SETMASK, run_mask, NULL);
+    if (!batch) return;
+
+    while (!flusher_stop && getppid() == server) {
+        position = log_drain(fd, batch, position, &stalled_since);
+        usleep(LOG_FLUSH_MS * 1000);
+    }
+    // Whatever the connections managed to log before the server went away
+    log_drain(fd, batch, position, &stalled_since);
+    free(batch);
+}
+
+pid_t log_start(const char *log_file) {
+    pid_t server = getpid();
+    sigset_t block, run_mask;
+    pid_t pid;
+    int fd = -1;
+
+    if (!ring) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (log_file) {
+        struct stat st;
+
+        fd = open(log_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) return -1;
+        if (fstat(fd, &st) == 0 && st.st_size == 0 && write(fd, LOG_MAGIC, LOG_MAGIC_LEN) != LOG_MAGIC_LEN) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    // A SIGTERM that comes before the flusher has its handler must still
+    // let it drain, so hold it back until then
+    sigemptyset(&block);
+    sigaddset(&block, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block, &run_mask);
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        log_flusher_run(fd, server, &run_mask);
+        _exit(0);
+    }
+    sigprocmask(SIG_SETMASK, &run_mask, NULL);
+    if (fd >= 0) close(fd);
+    if (pid > 0) log_flushing = 1;
+    return pid;
+}
+#else
+pid_t log_start(const char *log_file) {
+    (void)log_file;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
@@ -0,0 +1,63 @@
+#ifndef NETSHELL_LOG_H
+#define NETSHELL_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Server event log. Connection processes do not print: each event is one
+// fixed-size binary record claimed with an atomic add in a ring in shared
+// memory, which costs a clock read and a few stores and never blocks. A
+// flusher process drains the ring every LOG_FLUSH_MS, appending the records
+// to the --log-file, or printing them as text lines when there is none.
+// netshell_logdump turns a log file back into text.
+//
+// A log file is a LOG_MAGIC header followed by struct log_record entries in
+// the server's byte order.
+
+#define LOG_MAGIC "NSLOG001"
+#define LOG_MAGIC_LEN 8
+#define LOG_RING 16384                   // Records waiting for the flusher
+#define LOG_TEXT_MAX 88                  // Text per record, NUL included
+#define LOG_FLUSH_MS 100
+#define LOG_STALL_MS 1000                // A slot claimed but unfinished this long is skipped
+
+// Events, with what their arguments hold
+#define LOG_CONNECT 1        // args: IPv4 address (host order), port
+#define LOG_EXTENDED 2       // args: address, port
+#define LOG_BASIC 3          // args: address, port
+#define LOG_IDLE_CLOSE 4     // args: seconds without a command
+#define LOG_CLOSED 5         // args: connection lifetime in microseconds
+#define LOG_CRC_MISMATCH 6   // text: file received
+#define LOG_COPY 7           // args: bytes; text: destination
+#define LOG_FORK_FAILED 8    // args: errno
+#define LOG_LOST 9           // args: records overwritten or abandoned before the flusher saw them
+
+struct log_record {
+    uint64_t seq;                        // Position in the ring plus one; written last
+    int64_t time_us;                     // Wall clock, microseconds since the epoch
+    int32_t pid;
+    uint16_t event;
+    uint16_t reserved;
+    int64_t args[2];
+    char text[LOG_TEXT_MAX];
+};
+
+// Map the shared ring. Call once in the server before forking anything.
+// Returns 0, or -1 if there is no shared memory (log_event() then prints
+// each event directly).
+int log_init(void);
+
+// Fork the flusher, appending to log_file (NULL: text on stdout). Returns
+// its pid, or -1 with events printed directly. Stop it with SIGTERM; it
+// drains the ring before it exits.
+pid_t log_start(const char *log_file);
+
+// Record an event; text may be NULL. Long text keeps its end, where the
+// file name is.
+void log_event(int event, long long arg0, long long arg1, const char *text);
+
+// One line of text for a record, without the newline. Returns its length.
+size_t log_format(const struct log_record *record, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "netshell_log.h"
+
+#define FOLLOW_POLL_MS 200
+
+// Print the records of a netshell --log-file as text, one line each
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-f] <log_file>\n", program);
+    fprintf(stderr, "  -f  keep reading as the server appends\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct log_record record;
+    char magic[LOG_MAGIC_LEN];
+    char line[256];
+    const char *path = NULL;
+    int follow = 0;
+    FILE *file;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            follow = 1;
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, LOG_MAGIC, LOG_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a netshell log file\n", path);
+        fclose(file);
+        return 1;
+    }
+
+    for (;;) {
+        long position = ftell(file);
+
+        if (fread(&record, sizeof(record), 1, file) == 1) {
+            log_format(&record, line, sizeof(line));
+            puts(line);
+            continue;
+        }
+        if (!follow) break;
+        // Nothing more yet, or half a batch: read it again when it is complete
+        fflush(stdout);
+        clearerr(file);
+        fseek(file, position, SEEK_SET);
+        usleep(FOLLOW_POLL_MS * 1000);
+    }
+
+    if (ferror(file)) {
+        perror(path);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "netshell_lz.h"
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5   // Matches never cover the final bytes of a block
+#define LZ_MFLIMIT 12        // No match may start this close to the end
+
+static uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static size_t lz_put_length(unsigned char *op, size_t len) {
+    size_t n = 0;
+    while (len >= 255) {
+        op[n++] = 255;
+        len -= 255;
+    }
+    op[n++] = (unsigned char)len;
+    return n;
+}
+
+// Emit one sequence: literals followed by an optional match (match_len 0 = none)
+static int lz_emit(unsigned char *dst, size_t dst_cap, size_t *op,
+                   const unsigned char *lit, size_t lit_len,
+                   size_t offset, size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    unsigned char *out = dst + *op;
+    size_t n = 1;
+    unsigned char token;
+
+    if (*op + need > dst_cap) return 0;
+
+    token = (unsigned char)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (match_len) {
+        size_t ml = match_len - LZ_MIN_MATCH;
+        token |= (unsigned char)(ml >= 15 ? 15 : ml);
+    }
+    out[0] = token;
+
+    if (lit_len >= 15) n += lz_put_length(out + n, lit_len - 15);
+    memcpy(out + n, lit, lit_len);
+    n += lit_len;
+
+    if (match_len) {
+        size_t ml = match_len - LZ_MIN_MATCH;
+        out[n++] = (unsigned char)(offset & 0xff);
+        out[n++] = (unsigned char)(offset >> 8);
+        if (ml >= 15) n += lz_put_length(out + n, ml - 15);
+    }
+
+    *op += n;
+    return 1;
+}
+
+size_t lz_compress_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t dst_cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    size_t ip = 0, anchor = 0, op = 0;
+
+    if (n > LZ_MFLIMIT) {
+        size_t limit = n - LZ_MFLIMIT;
+
+        memset(table, 0, sizeof(table));
+        while (ip < limit) {
+            uint32_t seq = lz_read32(src + ip);
+            uint32_t h = lz_hash(seq);
+            size_t ref = table[h];
+
+            table[h] = (uint32_t)ip;
+            if (ref < ip && ip - ref <= LZ_MAX_OFFSET && lz_read32(src + ref) == seq) {
+                size_t match_len = LZ_MIN_MATCH;
+                size_t max_len = n - LZ_LAST_LITERALS - ip;
+
+                while (match_len < max_len && src[ref + match_len] == src[ip + match_len]) {
+                    match_len++;
+                }
+                if (!lz_emit(dst, dst_cap, &op, src + anchor, ip - anchor, ip - ref, match_len)) {
+                    return 0;
+                }
+                ip += match_len;
+                anchor = ip;
+                continue;
+            }
+            ip++;
+        }
+    }
+
+    if (!lz_emit(dst, dst_cap, &op, src + anchor, n - anchor, 0, 0)) return 0;
+    return op;
+}
+
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t dst_cap) {
+    size_t ip = 0, op = 0;
+
+    while (ip < n) {
+        unsigned char token = src[ip++];
+        size_t lit_len = token >> 4;
+        size_t match_len, offset;
+        unsigned char b;
+
+        if (lit_len == 15) {
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (lit_len > n - ip || lit_len > dst_cap - op) return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == n) break; // Final sequence carries literals only
+
+        if (n - ip < 2) return -1;
+        offset = src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+
+        match_len = token & 15;
+        if (match_len == 15) {
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+        if (match_len > dst_cap - op) return -1;
+
+        if (offset >= match_len) {
+            memcpy(dst + op, dst + op - offset, match_len);
+            op += match_len;
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            while (match_len--) {
+                dst[op] = dst[op - offset];
+                op++;
+            }
+        }
+    }
+    return (long)op;
+}
@@ -0,0 +1,21 @@
+#ifndef NETSHELL_LZ_H
+#define NETSHELL_LZ_H
+
+#include <stddef.h>
+
+// Small LZ77 block codec (LZ4-style token layout) used for transfer blocks.
+// It trades ratio for speed so compression never becomes the bottleneck of a
+// transfer, and needs no external library on either platform.
+
+// Worst-case compressed size for n input bytes.
+size_t lz_compress_bound(size_t n);
+
+// Compress src into dst. Returns the compressed size, or 0 if the result
+// would not fit in dst_cap (the caller then sends the block uncompressed).
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t dst_cap);
+
+// Decompress src into dst. Returns the decompressed size, or -1 if the input
+// is malformed or would overflow dst_cap.
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t dst_cap);
+
+#endif
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#ifndef MORPHOS
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>   // tcp_info with the byte counters glibc leaves out
+#endif
+
+#include "netshell_metrics.h"
+
+struct metric_histogram {
+    unsigned long long buckets[METRIC_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum_us;
+    unsigned long long max_us;
+};
+
+struct metrics_region {
+    long long counters[METRIC_COUNTERS];
+    struct metric_histogram histograms[METRIC_HISTOGRAMS];
+    long long started_us;
+    time_t started;
+};
+
+struct metric_name {
+    const char *name;
+    const char *type;
+    const char *help;
+};
+
+static const struct metric_name counter_names[METRIC_COUNTERS] = {
+    { "netshell_connections_accepted_total", "counter", "Connections accepted" },
+    { "netshell_connections_active", "gauge", "Connection processes alive" },
+    { "netshell_handshake_extended_total", "counter", "Connections that negotiated the extended protocol" },
+    { "netshell_handshake_basic_total", "counter", "Connections that fell back to a plain shell" },
+    { "netshell_fork_failures_total", "counter", "Connections dropped because fork() failed" },
+    { "netshell_connections_reaped_total", "counter", "Connections closed by idle or heartbeat timeout" },
+    { "netshell_commands_total", "counter", "Extended commands handled" },
+    { "netshell_commands_unknown_total", "counter", "Extended commands not recognised" },
+    { "netshell_bytes_received_total", "counter", "Bytes received on extended connections" },
+    { "netshell_bytes_sent_total", "counter", "Bytes sent on extended connections" },
+    { "netshell_upload_bytes_total", "counter", "Bytes received by file transfer commands" },
+    { "netshell_download_bytes_total", "counter", "Bytes sent by file transfer commands" },
+    { "netshell_spawns_total", "counter", "Shell commands started" },
+    { "netshell_spawn_failures_total", "counter", "Shell commands that could not be started" },
+    { "netshell_jobs_submitted_total", "counter", "Detached jobs queued" },
+    { "netshell_sessions_created_total", "counter", "Persistent shell sessions started" },
+    { "netshell_session_attaches_total", "counter", "Connections handed to a persistent shell session" },
+    { "netshell_direct_spawns_total", "counter", "Shell commands simple enough to run without the shell" },
+    { "netshell_warm_runs_total", "counter", "Commands run on a connection's warm shell" },
+    { "netshell_cache_hits_total", "counter", "Cacheable commands answered from the result cache" },
+    { "netshell_cache_misses_total", "counter", "Cacheable commands that had to run" },
+    { "netshell_cache_stores_total", "counter", "Command results stored in the result cache" },
+};
+
+static const struct metric_name histogram_names[METRIC_HISTOGRAMS] = {
+    { "netshell_fork_seconds", "histogram", "Time to fork a connection process" },
+    { "netshell_handshake_seconds", "histogram", "Time from accept to a protocol decision" },
+    { "netshell_command_seconds", "histogram", "Time to handle one extended command" },
+    { "netshell_transfer_seconds", "histogram", "Time to handle one file transfer command" },
+    { "netshell_spawn_seconds", "histogram", "Time to start a shell command" },
+};
+
+// Used until metrics_init() runs, and instead of shared memory if it fails
+static struct metrics_region local_region;
+static struct metrics_region *region = &local_region;
+
+int metrics_init(void) {
+#ifndef MORPHOS
+    void *shared = mmap(NULL, sizeof(struct metrics_region), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared != MAP_FAILED) {
+        region = shared;   // Zero filled by the kernel
+    }
+#endif
+    region->started_us = metrics_now_us();
+    region->started = time(NULL);
+    return region == &local_region ? -1 : 0;
+}
+
+long long metrics_now_us(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+void metrics_add(int counter, long long delta) {
+    if (counter < 0 || counter >= METRIC_COUNTERS) return;
+    __sync_fetch_and_add(&region->counters[counter], delta);
+}
+
+// Smallest i with value <= 2^i, capped at the overflow bucket
+static int metrics_bucket(unsigned long long value) {
+    int bucket = 0;
+
+    while (bucket < METRIC_BUCKETS - 1 && value > (1ULL << bucket)) bucket++;
+    return bucket;
+}
+
+void metrics_observe(int histogram, long long microseconds) {
+    struct metric_histogram *h;
+    unsigned long long value = microseconds > 0 ? (unsigned long long)microseconds : 0;
+    unsigned long long max;
+
+    if (histogram < 0 || histogram >= METRIC_HISTOGRAMS) return;
+    h = &region->histograms[histogram];
+    __sync_fetch_and_add(&h->buckets[metrics_bucket(value)], 1);
+    __sync_fetch_and_add(&h->count, 1);
+    __sync_fetch_and_add(&h->sum_us, value);
+    max = h->max_us;
+    while (value > max && !__sync_bool_compare_and_swap(&h->max_us, max, value)) {
+        max = h->max_us;
+    }
+}
+
+void metrics_observe_since(int histogram, long long started_us) {
+    metrics_observe(histogram, metrics_now_us() - started_us);
+}
+
+int metrics_socket_bytes(int socket_fd, long long *sent, long long *received) {
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    int queued = 0;
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(socket_fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) return -1;
+    // Kernels before 4.1 return a shorter struct without the byte counters
+    if (len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received)) return -1;
+    // Written by us = acknowledged + still in the send queue
+    if (ioctl(socket_fd, SIOCOUTQ, &queued) != 0) queued = 0;
+    *sent = (long long)info.tcpi_bytes_acked + queued;
+    *received = (long long)info.tcpi_bytes_received;
+    return 0;
+#else
+    (void)socket_fd;
+    (void)sent;
+    (void)received;
+    return -1;
+#endif
+}
+
+// snprintf() that keeps track of the position and never runs past size
+static void metrics_append(char *buf, size_t size, size_t *used, const char *format, ...) {
+    va_list args;
+    int n;
+
+    if (*used + 1 >= size) return;
+    va_start(args, format);
+    n = vsnprintf(buf + *used, size - *used, format, args);
+    va_end(args);
+    if (n < 0) return;
+    *used += (size_t)n < size - *used ? (size_t)n : size - *used - 1;
+}
+
+static void metrics_header(char *buf, size_t size, size_t *used, const struct metric_name *metric) {
+    metrics_append(buf, size, used, "# HELP %s %s\n# TYPE %s %s\n",
+                   metric->name, metric->help, metric->name, metric->type);
+}
+
+size_t metrics_format(char *buf, size_t size, int live_sessions) {
+    size_t used = 0;
+    int i, b;
+
+    if (size == 0) return 0;
+    buf[0] = '\0';
+
+    metrics_append(buf, size, &used, "# HELP netshell_start_time_seconds When the server started\n"
+                   "# TYPE netshell_start_time_seconds gauge\nnetshell_start_time_seconds %lld\n",
+                   (long long)region->started);
+    metrics_append(buf, size, &used, "# HELP netshell_uptime_seconds Seconds since the server started\n"
+                   "# TYPE netshell_uptime_seconds gauge\nnetshell_uptime_seconds %.3f\n",
+                   (metrics_now_us() - region->started_us) / 1e6);
+
+    for (i = 0; i < METRIC_COUNTERS; i++) {
+        metrics_header(buf, size, &used, &counter_names[i]);
+        metrics_append(buf, size, &used, "%s %lld\n", counter_names[i].name, region->counters[i]);
+    }
+    if (live_sessions >= 0) {
+        metrics_append(buf, size, &used, "# HELP netshell_sessions_live Persistent shell sessions alive\n"
+                       "# TYPE netshell_sessions_live gauge\nnetshell_sessions_live %d\n", live_sessions);
+    }
+
+    for (i = 0; i < METRIC_HISTOGRAMS; i++) {
+        const struct metric_histogram *h = &region->histograms[i];
+        const char *name = histogram_names[i].name;
+        unsigned long long cumulative = 0;
+
+        metrics_header(buf, size, &used, &histogram_names[i]);
+        for (b = 0; b < METRIC_BUCKETS - 1; b++) {
+            cumulative += h->buckets[b];
+            metrics_append(buf, size, &used, "%s_bucket{le=\"%g\"} %llu\n", name, (1ULL << b) / 1e6, cumulative);
+        }
+        cumulative += h->buckets[METRIC_BUCKETS - 1];
+        metrics_append(buf, size, &used, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+        metrics_append(buf, size, &used, "%s_sum %.6f\n%s_count %llu\n", name, h->sum_us / 1e6, name, h->count);
+        metrics_append(buf, size, &used, "# HELP %s_max Slowest observation\n# TYPE %s_max gauge\n%s_max %.6f\n",
+                       name, name, name, h->max_us / 1e6);
+    }
+    return used;
+}
+
+int metrics_write_file(const char *path, int live_sessions) {
+    char tmp_path[1024];
+    size_t size = METRICS_TEXT_MAX;
+    char *text = malloc(size);
+    size_t len;
+    FILE *file;
+    int ok;
+
+    if (!text) return -1;
+    len = metrics_format(text, size, live_sessions);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    file = fopen(tmp_path, "w");
+    if (!file) {
+        free(text);
+        return -1;
+    }
+    ok = fwrite(text, 1, len, file) == len;
+    ok = fclose(file) == 0 && ok;
+    free(text);
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
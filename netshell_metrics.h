@@ -0,0 +1,76 @@
+#ifndef NETSHELL_METRICS_H
+#define NETSHELL_METRICS_H
+
+#include <stddef.h>
+
+// Server metrics: counters and latency histograms in one shared memory
+// region, mapped by the server before it forks, so every connection, job
+// and spawn adds to the same totals with an atomic add and no syscall.
+// Reported in the Prometheus text format by STATS and the metrics file.
+
+// Counters (gauges where noted)
+#define METRIC_CONNECTIONS_ACCEPTED 0
+#define METRIC_CONNECTIONS_ACTIVE 1     // Gauge: connection processes alive
+#define METRIC_HANDSHAKE_EXTENDED 2
+#define METRIC_HANDSHAKE_BASIC 3
+#define METRIC_FORK_FAILURES 4
+#define METRIC_CONNECTIONS_REAPED 5     // Closed by idle or heartbeat timeout
+#define METRIC_COMMANDS 6
+#define METRIC_COMMANDS_UNKNOWN 7
+#define METRIC_BYTES_RECEIVED 8         // Extended connections, all traffic
+#define METRIC_BYTES_SENT 9
+#define METRIC_UPLOAD_BYTES 10          // File transfer commands only
+#define METRIC_DOWNLOAD_BYTES 11
+#define METRIC_SPAWNS 12
+#define METRIC_SPAWN_FAILURES 13
+#define METRIC_JOBS_SUBMITTED 14
+#define METRIC_SESSIONS_CREATED 15
+#define METRIC_SESSION_ATTACHES 16
+#define METRIC_SPAWNS_DIRECT 17         // Of METRIC_SPAWNS, exec()ed without the shell
+#define METRIC_WARM_RUNS 18             // EXEC commands run on a warm shell, no spawn
+#define METRIC_CACHE_HITS 19           // EXEC cache= answered from the result cache
+#define METRIC_CACHE_MISSES 20
+#define METRIC_CACHE_STORES 21
+#define METRIC_COUNTERS 22
+
+// Latency histograms
+#define METRIC_FORK_TIME 0              // fork() of a connection process
+#define METRIC_HANDSHAKE_TIME 1         // Protocol probe after accept
+#define METRIC_COMMAND_TIME 2           // One extended command, start to finish
+#define METRIC_TRANSFER_TIME 3          // File transfer commands
+#define METRIC_SPAWN_TIME 4             // Starting a shell command (EXEC, BATCH, jobs)
+#define METRIC_HISTOGRAMS 5
+
+// Bucket i counts values up to 2^i microseconds; the last one the rest
+#define METRIC_BUCKETS 26
+
+#define METRICS_TEXT_MAX (64 * 1024)       // Room for everything metrics_format() writes
+#define METRICS_DEFAULT_INTERVAL 10        // Seconds between metrics file updates
+
+// Map the shared region. Call once in the server before forking anything.
+// Falls back to process-local counters if shared memory is unavailable.
+// Returns 0, or -1 on fallback.
+int metrics_init(void);
+
+// Monotonic clock in microseconds, for timing with metrics_observe()
+long long metrics_now_us(void);
+
+void metrics_add(int counter, long long delta);
+void metrics_observe(int histogram, long long microseconds);
+
+// Record the time since started_us (from metrics_now_us())
+void metrics_observe_since(int histogram, long long started_us);
+
+// Bytes written and received so far on a TCP socket, where the system reports
+// them (Linux TCP_INFO). Returns 0, or -1 if unknown.
+int metrics_socket_bytes(int socket_fd, long long *sent, long long *received);
+
+// Render every metric in the Prometheus text format. live_sessions < 0
+// leaves that gauge out. Returns the length written (truncated to size - 1).
+size_t metrics_format(char *buf, size_t size, int live_sessions);
+
+// Write the rendered metrics to path through a temporary file and
+// rename(), so readers never see half a file. Returns 0 or -1.
+int metrics_write_file(const char *path, int live_sessions);
+
+#endif
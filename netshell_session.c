@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "netshell_common.h"
+#include "netshell_exec.h"
+#include "netshell_session.h"
+
+#ifdef NETSHELL_SESSIONS
+
+#define SESSION_CHUNK (64 * 1024)
+#define SESSION_LINE_MAX 256
+#define SESSION_FD_LIMIT 1024
+
+struct session_holder {
+    long id;
+    int listen_fd;
+    pid_t shell;
+    int shell_in;              // Shell stdin, -1 once closed
+    int shell_out;             // Shell stdout and stderr, -1 at EOF
+    int client_fd;             // Attached client, -1 when detached
+    int client_timeout;        // Seconds of silence after which the client is gone, 0: never
+    time_t client_active;      // Last frame sent to or received from the client
+    int exit_code;
+    int running;
+    time_t created;
+    time_t ended;
+    int collected;             // A client has seen the EXIT
+    char *ring;
+    long long written;
+};
+
+static void session_socket_path(struct sockaddr_un *addr, const char *dir, long id) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%ld.sock", dir, id);
+}
+
+// Connect to a session holder. Returns the socket, or -1.
+static int session_connect(const char *dir, long id) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) return -1;
+    session_socket_path(&addr, dir, id);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        // A holder that died without cleaning up leaves its socket behind
+        if (errno == ECONNREFUSED) unlink(addr.sun_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Ask a holder one question and read its one-line answer
+static int session_request(const char *dir, long id, const char *request, char *reply, size_t size) {
+    int fd = session_connect(dir, id);
+    int result = -1;
+
+    if (fd < 0) return -1;
+    if (send_all(fd, request, strlen(request)) >= 0 && recv_line(fd, reply, size) >= 0) result = 0;
+    close(fd);
+    return result;
+}
+
+static int session_id_compare(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Ids that have a socket in dir, whether or not a holder still listens
+static int session_scan(const char *dir, long *ids, int max) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    int count = 0;
+
+    if (!d) return 0;
+    while ((entry = readdir(d)) && count < max) {
+        char *end;
+        long id = strtol(entry->d_name, &end, 10);
+        if (end != entry->d_name && strcmp(end, ".sock") == 0 && id > 0) ids[count++] = id;
+    }
+    closedir(d);
+    qsort(ids, count, sizeof(*ids), session_id_compare);
+    return count;
+}
+
+int session_list(const char *dir, long *ids, int max) {
+    int count = session_scan(dir, ids, max);
+    int live = 0, i;
+
+    for (i = 0; i < count; i++) {
+        int fd = session_connect(dir, ids[i]);
+        if (fd < 0) continue;
+        close(fd);
+        ids[live++] = ids[i];
+    }
+    return live;
+}
+
+int session_read_info(const char *dir, long id, struct session_info *info) {
+    char reply[SESSION_LINE_MAX];
+    long pid;
+
+    memset(info, 0, sizeof(*info));
+    info->id = id;
+    if (session_request(dir, id, "INFO\n", reply, sizeof(reply)) != 0) return -1;
+    if (sscanf(reply, "%ld %d %d %d %lld %lld", &pid, &info->attached, &info->running, &info->exit_code,
+               &info->output_bytes, &info->created) != 6) {
+        errno = EINVAL;
+        return -1;
+    }
+    info->pid = (pid_t)pid;
+    return 0;
+}
+
+int session_kill(const char *dir, long id) {
+    char reply[SESSION_LINE_MAX];
+
+    return session_request(dir, id, "KILL\n", reply, sizeof(reply));
+}
+
+int session_attach(const char *dir, long id, int client_fd, long long offset, int timeout) {
+    char request[SESSION_LINE_MAX];
+    char reply[SESSION_LINE_MAX];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int fd = session_connect(dir, id);
+    int result = -1;
+
+    if (fd < 0) return -1;
+    snprintf(request, sizeof(request), "ATTACH %lld %d\n", offset, timeout);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = request;
+    iov.iov_len = strlen(request);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+
+    // The holder answers once it owns the client
+    if (sendmsg(fd, &msg, 0) == (ssize_t)iov.iov_len && recv_line(fd, reply, sizeof(reply)) >= 0 &&
+        strcmp(reply, "OK") == 0) {
+        result = 0;
+    }
+    close(fd);
+    return result;
+}
+
+// Receive a request line and the descriptor that may come with it
+static int session_recv_request(int fd, char *line, size_t size, int *passed_fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t len;
+
+    *passed_fd = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = line;
+    iov.iov_len = size - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    len = recvmsg(fd, &msg, 0);
+    if (len <= 0) return -1;
+    line[len] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return 0;
+}
+
+static void session_drop_client(struct session_holder *h, const char *farewell) {
+    if (h->client_fd < 0) return;
+    if (farewell) send_all(h->client_fd, farewell, strlen(farewell));
+    close(h->client_fd);
+    h->client_fd = -1;
+}
+
+// Send output [offset, written) from the ring, clamped to what it still holds
+static int session_send_output(struct session_holder *h, long long offset) {
+    char header[64];
+    long long oldest = h->written > SESSION_SCROLLBACK ? h->written - SESSION_SCROLLBACK : 0;
+
+    if (offset < oldest) offset = oldest;
+    while (offset < h->written) {
+        long long position = offset % SESSION_SCROLLBACK;
+        long long len = h->written - offset;
+        if (len > SESSION_SCROLLBACK - position) len = SESSION_SCROLLBACK - position;
+        snprintf(header, sizeof(header), "DATA %lld %lld\n", offset, len);
+        if (send_all(h->client_fd, header, strlen(header)) < 0 ||
+            send_all(h->client_fd, h->ring + position, len) < 0) {
+            return -1;
+        }
+        offset += len;
+        h->client_active = time(NULL);
+    }
+    return 0;
+}
+
+static int session_send_exit(struct session_holder *h) {
+    char line[64];
+
+    snprintf(line, sizeof(line), "EXIT %d\n", h->exit_code);
+    if (send_all(h->client_fd, line, strlen(line)) < 0) return -1;
+    h->collected = 1;
+    return 0;
+}
+
+static void session_take_client(struct session_holder *h, int fd, long long offset, int idle_limit) {
+    struct timeval timeout;
+    char line[SESSION_LINE_MAX];
+
+    // A newer connection wins: the old one is most likely a dead link
+    session_drop_client(h, "DETACHED\n");
+
+    // A client that stops reading must not stall the shell forever
+    timeout.tv_sec = SESSION_IO_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    h->client_fd = fd;
+    h->client_timeout = idle_limit;
+    h->client_active = time(NULL);
+
+    snprintf(line, sizeof(line), "ATTACHED %ld %lld %lld\n", h->id,
+             h->written > SESSION_SCROLLBACK ? h->written - SESSION_SCROLLBACK : 0, h->written);
+    if (send_all(fd, line, strlen(line)) < 0 || session_send_output(h, offset) < 0) {
+        session_drop_client(h, NULL);
+        return;
+    }
+    if (!h->running && h->shell_out < 0) {
+        session_send_exit(h);
+        session_drop_client(h, NULL);
+    }
+}
+
+static void session_handle_request(struct session_holder *h) {
+    char line[SESSION_LINE_MAX];
+    char reply[SESSION_LINE_MAX];
+    struct timeval io_timeout;
+    long long offset;
+    int timeout = 0;
+    int passed_fd;
+    int fd = accept(h->listen_fd, NULL, NULL);
+
+    if (fd < 0) return;
+    // The shell's output waits while we do; a requester that connects and
+    // then says (or reads) nothing must not hold it up for long
+    io_timeout.tv_sec = SESSION_REQUEST_TIMEOUT_MS / 1000;
+    io_timeout.tv_usec = (SESSION_REQUEST_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+    if (session_recv_request(fd, line, sizeof(line), &passed_fd) != 0) {
+        close(fd);
+        return;
+    }
+
+    if (sscanf(line, "ATTACH %lld %d", &offset, &timeout) >= 1 && passed_fd >= 0) {
+        send_all(fd, "OK\n", 3);
+        session_take_client(h, passed_fd, offset, timeout);
+        passed_fd = -1;
+    } else if (strcmp(line, "INFO") == 0) {
+        snprintf(reply, sizeof(reply), "%ld %d %d %d %lld %lld\n", (long)h->shell, h->client_fd >= 0,
+                 h->running, h->exit_code, h->written, (long long)h->created);
+        send_all(fd, reply, strlen(reply));
+    } else if (strcmp(line, "KILL") == 0) {
+        if (h->running) stop_command(h->shell, SIGHUP);
+        h->collected = 1;   // Nobody wants the last output of a killed session
+        send_all(fd, "OK\n", 3);
+    } else {
+        send_all(fd, "ERROR\n", 6);
+    }
+    if (passed_fd >= 0) close(passed_fd);
+    close(fd);
+}
+
+// One frame from the attached client
+static void session_handle_client(struct session_holder *h, char *chunk) {
+    char line[SESSION_LINE_MAX];
+    long length;
+
+    if (recv_line(h->client_fd, line, sizeof(line)) < 0) {
+        session_drop_client(h, NULL);
+        return;
+    }
+    h->client_active = time(NULL);
+    if (sscanf(line, "INPUT %ld", &length) == 1 && length > 0 && length <= SESSION_CHUNK) {
+        if (recv_all(h->client_fd, chunk, length) <= 0) {
+            session_drop_client(h, NULL);
+        } else if (h->shell_in >= 0 && write(h->shell_in, chunk, length) != length) {
+            close(h->shell_in);
+            h->shell_in = -1;
+        }
+    } else if (strcmp(line, "PING") == 0) {
+        if (send_all(h->client_fd, "PONG\n", 5) < 0) session_drop_client(h, NULL);
+    } else if (strcmp(line, "DETACH") == 0) {
+        session_drop_client(h, "DETACHED\n");
+    } else {
+        // Out of sync; the client can reattach from its last offset
+        session_drop_client(h, "ERROR\n");
+    }
+}
+
+// Once its output has closed, collect the shell if it has ended and tell
+// the client. One that closed its output and kept running (exec >/dev/null)
+// is tried again on a later pass instead of blocking the holder.
+static void session_reap(struct session_holder *h) {
+    int status = 0;
+
+    if (h->running) {
+        if (waitpid(h->shell, &status, WNOHANG) == 0) return;
+        h->running = 0;
+        h->exit_code = command_exit_code(status, 0);
+        h->ended = time(NULL);
+    }
+    if (h->client_fd >= 0) {
+        session_send_exit(h);
+        session_drop_client(h, NULL);
+    }
+}
+
+static void session_handle_output(struct session_holder *h, char *chunk) {
+    ssize_t len = read(h->shell_out, chunk, SESSION_CHUNK);
+    long long from = h->written;
+    ssize_t done = 0;
+
+    if (len < 0 && errno == EINTR) return;
+    if (len <= 0) {
+        close(h->shell_out);
+        h->shell_out = -1;
+        session_reap(h);
+        return;
+    }
+
+    while (done < len) {
+        long long position = h->written % SESSION_SCROLLBACK;
+        long long take = len - done;
+        if (take > SESSION_SCROLLBACK - position) take = SESSION_SCROLLBACK - position;
+        memcpy(h->ring + position, chunk + done, take);
+        h->written += take;
+        done += take;
+    }
+    if (h->client_fd >= 0 && session_send_output(h, from) < 0) session_drop_client(h, NULL);
+}
+
+// Hang up the shell and collect it. A shell that ignores SIGHUP gets
+// SESSION_KILL_GRACE_MS and then SIGKILL, so the holder always gets to exit.
+static void session_stop_shell(struct session_holder *h) {
+    int waited = 0;
+
+    stop_command(h->shell, SIGHUP);
+    while (waitpid(h->shell, NULL, WNOHANG) == 0) {
+        if (waited >= SESSION_KILL_GRACE_MS) {
+            stop_command(h->shell, SIGKILL);
+            while (waitpid(h->shell, NULL, 0) < 0 && errno == EINTR) {
+            }
+            break;
+        }
+        usleep(50 * 1000);
+        waited += 50;
+    }
+    h->running = 0;
+}
+
+// Start the shell with stdin and output on pipes, in its own process group
+static int session_start_shell(struct session_holder *h) {
+    char* argv[] = { SHELL_NAME, NULL };
+    struct spawn_setup setup;
+    int in_fds[2], out_fds[2];
+
+    if (pipe(in_fds) != 0) return -1;
+    if (pipe(out_fds) != 0) {
+        close(in_fds[0]);
+        close(in_fds[1]);
+        return -1;
+    }
+    spawn_setup_init(&setup);
+    setup.fds[0] = in_fds[0];
+    setup.fds[1] = setup.fds[2] = out_fds[1];
+    setup.close_fds[0] = in_fds[0];
+    setup.close_fds[1] = in_fds[1];
+    setup.close_fds[2] = out_fds[0];
+    setup.close_fds[3] = out_fds[1];
+    setup.new_group = 1;
+    setup.default_signals = 1;   // The holder ignores SIGHUP and SIGPIPE; the shell must not
+    h->shell = spawn_process(SHELL_PATH, argv, &setup);
+    close(in_fds[0]);
+    close(out_fds[1]);
+    if (h->shell < 0) {
+        close(in_fds[1]);
+        close(out_fds[0]);
+        return -1;
+    }
+    setpgid(h->shell, h->shell);
+    h->shell_in = in_fds[1];
+    h->shell_out = out_fds[0];
+    fcntl(h->shell_in, F_SETFD, FD_CLOEXEC);
+    fcntl(h->shell_out, F_SETFD, FD_CLOEXEC);
+    h->running = 1;
+    return 0;
+}
+
+// Bind the first free id past the existing sessions. Returns the listening
+// socket, or -1.
+static int session_bind(const char *dir, long *id) {
+    struct sockaddr_un addr;
+    long ids[SESSION_LIST_MAX];
+    int count = session_scan(dir, ids, SESSION_LIST_MAX);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) return -1;
+    *id = count > 0 ? ids[count - 1] + 1 : 1;
+    for (;;) {
+        session_socket_path(&addr, dir, *id);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) break;
+        if (errno != EADDRINUSE) {
+            close(fd);
+            return -1;
+        }
+        (*id)++;
+    }
+    if (listen(fd, 8) != 0) {
+        unlink(addr.sun_path);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static void session_holder_run(const char *dir, int ready_fd) {
+    struct session_holder h;
+    struct sockaddr_un addr;
+    char *chunk = malloc(SESSION_CHUNK);
+
+    memset(&h, 0, sizeof(h));
+    h.client_fd = -1;
+    h.shell_in = -1;
+    h.shell_out = -1;
+    h.created = time(NULL);
+    h.ring = malloc(SESSION_SCROLLBACK);
+    h.listen_fd = (chunk && h.ring) ? session_bind(dir, &h.id) : -1;
+    if (h.listen_fd >= 0 && session_start_shell(&h) != 0) {
+        session_socket_path(&addr, dir, h.id);
+        unlink(addr.sun_path);
+        close(h.listen_fd);
+        h.listen_fd = -1;
+    }
+
+    // Tell the connection that created us which id we got
+    if (h.listen_fd < 0) h.id = -1;
+    if (write(ready_fd, &h.id, sizeof(h.id)) != (ssize_t)sizeof(h.id)) h.id = -1;
+    close(ready_fd);
+
+    // Stay until a client has seen the shell end, or nobody came for the
+    // last output within SESSION_LINGER
+    while (h.id > 0 && !h.collected) {
+        struct timeval timeout;
+        fd_set read_fds;
+        int max_fd = h.listen_fd;
+
+        if (h.running && h.shell_out < 0) session_reap(&h);
+        if (!h.running && h.shell_out < 0 && time(NULL) - h.ended >= SESSION_LINGER) break;
+
+        // A heartbeating client that went quiet is gone (suspended laptop,
+        // dropped route); free the connection now instead of waiting for TCP
+        if (h.client_fd >= 0 && h.client_timeout > 0 && time(NULL) - h.client_active > h.client_timeout) {
+            session_drop_client(&h, NULL);
+        }
+
+        FD_ZERO(&read_fds);
+        FD_SET(h.listen_fd, &read_fds);
+        if (h.shell_out >= 0) {
+            FD_SET(h.shell_out, &read_fds);
+            if (h.shell_out > max_fd) max_fd = h.shell_out;
+        }
+        if (h.client_fd >= 0) {
+            FD_SET(h.client_fd, &read_fds);
+            if (h.client_fd > max_fd) max_fd = h.client_fd;
+        }
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        if (select(max_fd + 1, &read_fds, NULL, NULL, &timeout) <= 0) continue;
+
+        if (FD_ISSET(h.listen_fd, &read_fds)) session_handle_request(&h);
+        if (h.shell_out >= 0 && FD_ISSET(h.shell_out, &read_fds)) session_handle_output(&h, chunk);
+        if (h.client_fd >= 0 && FD_ISSET(h.client_fd, &read_fds)) session_handle_client(&h, chunk);
+    }
+
+    if (h.id > 0) {
+        session_socket_path(&addr, dir, h.id);
+        unlink(addr.sun_path);
+        close(h.listen_fd);
+    }
+    if (h.running) session_stop_shell(&h);
+    free(h.ring);
+    free(chunk);
+}
+
+long session_create(const char *dir) {
+    int ready[2];
+    long id = -1;
+    pid_t pid;
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return -1;
+    if (pipe(ready) != 0) return -1;
+
+    pid = fork();
+    if (pid == 0) {
+        // Detach from the connection (and the server's terminal) so the
+        // session outlives both
+        int fd;
+        for (fd = 3; fd < SESSION_FD_LIMIT; fd++) {
+            if (fd != ready[1]) close(fd);   // Not the client socket or anything else of ours
+        }
+        setsid();
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        if (fork() == 0) {
+            session_holder_run(dir, ready[1]);
+        }
+        _exit(0);
+    }
+    close(ready[1]);
+    if (pid > 0) {
+        if (read(ready[0], &id, sizeof(id)) != (ssize_t)sizeof(id)) id = -1;
+        waitpid(pid, NULL, 0);
+    }
+    close(ready[0]);
+    return id;
+}
+
+#else
+
+long session_create(const char *dir) {
+    (void)dir;
+    errno = ENOSYS;
+    return -1;
+}
+
+int session_attach(const char *dir, long id, int client_fd, long long offset, int timeout) {
+    (void)dir;
+    (void)id;
+    (void)client_fd;
+    (void)offset;
+    (void)timeout;
+    errno = ENOSYS;
+    return -1;
+}
+
+int session_read_info(const char *dir, long id, struct session_info *info) {
+    (void)dir;
+    (void)id;
+    (void)info;
+    errno = ENOSYS;
+    return -1;
+}
+
+int session_kill(const char *dir, long id) {
+    (void)dir;
+    (void)id;
+    errno = ENOSYS;
+    return -1;
+}
+
+int session_list(const char *dir, long *ids, int max) {
+    (void)dir;
+    (void)ids;
+    (void)max;
+    return 0;
+}
+
+#endif
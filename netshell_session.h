@@ -0,0 +1,65 @@
+#ifndef NETSHELL_SESSION_H
+#define NETSHELL_SESSION_H
+
+#include <sys/types.h>
+
+// Persistent shell sessions used by the SESSION_* commands.
+//
+// Each session is a holder process that owns the shell (stdin and output on
+// pipes, as in basic mode) and keeps its last SESSION_SCROLLBACK bytes of
+// output in a ring. The holder listens on a UNIX socket named after the
+// session id in the session directory. To attach, a connection handler
+// passes its client socket to the holder over that socket (SCM_RIGHTS),
+// and from then on the holder talks to the client directly; the handler
+// process is done. When the client goes away the shell keeps running and
+// its output keeps filling the ring until someone attaches again.
+//
+// Attached stream, holder to client: "DATA <offset> <n>" plus n bytes,
+// "EXIT <code>" when the shell ends, "DETACHED" when another connection
+// takes the session over or the client asked to detach.
+// Client to holder: "INPUT <n>" plus n bytes for the shell's stdin, "DETACH",
+// and "PING", answered with "PONG", to check an idle link.
+
+#ifndef MORPHOS
+#define NETSHELL_SESSIONS 1   // Needs fork() and descriptor passing
+#endif
+
+#define SESSION_DEFAULT_DIR "/tmp/netshell-sessions"
+#define SESSION_SCROLLBACK (256 * 1024)
+#define SESSION_IO_TIMEOUT 10          // Seconds a stalled client may block the holder
+#define SESSION_REQUEST_TIMEOUT_MS 2000   // A local request that is not sent by then is dropped
+#define SESSION_KILL_GRACE_MS 2000     // After SIGHUP, before the shell's group gets SIGKILL
+#define SESSION_LINGER 600             // Seconds an ended session waits to be collected
+#define SESSION_LIST_MAX 256
+
+struct session_info {
+    long id;
+    pid_t pid;                // Shell
+    int attached;
+    int running;
+    int exit_code;            // Once the shell ended
+    long long output_bytes;   // Produced so far; the ring keeps the last SESSION_SCROLLBACK
+    long long created;        // Unix time
+};
+
+// Start a detached session. Returns its id, or -1.
+long session_create(const char *dir);
+
+// Hand client_fd over to session id, replaying output from offset (an
+// offset the ring no longer holds starts at the oldest byte kept). On
+// success the holder owns the connection and the caller must stop using
+// it. A client that announced a heartbeat is dropped after timeout seconds
+// without traffic either way (0: never). Returns 0, or -1 if there is no
+// such session.
+int session_attach(const char *dir, long id, int client_fd, long long offset, int timeout);
+
+// Returns 0, or -1 if there is no such session
+int session_read_info(const char *dir, long id, struct session_info *info);
+
+// Hang up the session's shell. Returns 0, or -1 if there is no such session.
+int session_kill(const char *dir, long id);
+
+// Ids of live sessions, ascending; stale sockets are removed. Returns the count.
+int session_list(const char *dir, long *ids, int max);
+
+#endif
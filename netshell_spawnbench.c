@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "netshell_exec.h"
+#include "netshell_harness.h"
+
+// Spawn strategy benchmark: runs the server's own spawn_shell_command()
+// with each strategy while this process holds more and more touched memory,
+// the way a server grows. Per memory size and strategy it reports
+//   spawn_us    how long the caller is held up starting the command
+//   run_us      start to exit for the whole command, output read
+//   per_second  commands run back to back
+// as JSON, latencies as percentiles in microseconds.
+
+#define SPAWNBENCH_ITERATIONS 500
+#define SPAWNBENCH_WARMUP 10
+#define SPAWNBENCH_SIZES_MAX 16
+
+static long long sizes[SPAWNBENCH_SIZES_MAX];
+static int size_count;
+static int strategies[SPAWN_STRATEGIES];
+static int strategy_count;
+
+static int parse_sizes(const char *list) {
+    char *copy = strdup(list);
+    char *token, *save = NULL;
+
+    if (!copy) return -1;
+    size_count = 0;
+    for (token = strtok_r(copy, ",", &save); token && size_count < SPAWNBENCH_SIZES_MAX;
+         token = strtok_r(NULL, ",", &save)) {
+        char *end;
+        long long size = strtoll(token, &end, 10);
+        if (*end == 'k' || *end == 'K') size *= 1024;
+        if (*end == 'm' || *end == 'M') size *= 1024 * 1024;
+        if (*end == 'g' || *end == 'G') size *= 1024 * 1024 * 1024;
+        if (size < 0) continue;
+        sizes[size_count++] = size;
+    }
+    free(copy);
+    return size_count > 0 ? 0 : -1;
+}
+
+static int parse_strategies(const char *list) {
+    char *copy = strdup(list);
+    char *token, *save = NULL;
+
+    if (!copy) return -1;
+    strategy_count = 0;
+    for (token = strtok_r(copy, ",", &save); token && strategy_count < SPAWN_STRATEGIES;
+         token = strtok_r(NULL, ",", &save)) {
+        int strategy = spawn_strategy_parse(token);
+        if (strategy < 0) {
+            fprintf(stderr, "Skipping %s: not available here\n", token);
+            continue;
+        }
+        strategies[strategy_count++] = strategy;
+    }
+    free(copy);
+    return strategy_count > 0 ? 0 : -1;
+}
+
+// Resident set of this process, from /proc where there is one
+static long long rss_kb(void) {
+    FILE *file = fopen("/proc/self/statm", "r");
+    long long pages = 0;
+
+    if (!file) return 0;
+    if (fscanf(file, "%*s %lld", &pages) != 1) pages = 0;
+    fclose(file);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Start command, drain its output, reap it. Returns 0, or -1 if it could
+// not be started.
+static int run_once(const char *command, long long *spawn_us, long long *run_us) {
+    long long started = harness_now_us();
+    char buf[4096];
+    int output_fd, status;
+    ssize_t n;
+    pid_t pid;
+
+    pid = spawn_shell_command(-1, command, &output_fd);
+    if (pid < 0) return -1;
+    *spawn_us = harness_now_us() - started;
+    do {
+        n = read(output_fd, buf, sizeof(buf));
+    } while (n > 0 || (n < 0 && errno == EINTR));
+    close(output_fd);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    *run_us = harness_now_us() - started;
+    return 0;
+}
+
+static void bench_strategy(FILE *out, const char *command, int iterations, long long size, int first) {
+    struct harness_samples spawn_samples, run_samples;
+    long long spawn_us, run_us, started;
+    double seconds;
+    int failures = 0, i;
+
+    memset(&spawn_samples, 0, sizeof(spawn_samples));
+    memset(&run_samples, 0, sizeof(run_samples));
+    for (i = 0; i < SPAWNBENCH_WARMUP; i++) run_once(command, &spawn_us, &run_us);
+
+    started = harness_now_us();
+    for (i = 0; i < iterations; i++) {
+        if (run_once(command, &spawn_us, &run_us) != 0) {
+            failures++;
+            continue;
+        }
+        harness_samples_add(&spawn_samples, spawn_us);
+        harness_samples_add(&run_samples, run_us);
+    }
+    seconds = (harness_now_us() - started) / 1e6;
+
+    fprintf(out, "%s\n    {\"strategy\": \"%s\", \"memory\": %lld, \"rss_kb\": %lld, \"failures\": %d, "
+            "\"per_second\": %.1f,\n      \"spawn_us\": {",
+            first ? "" : ",", spawn_strategy_name(spawn_strategy), size, rss_kb(), failures,
+            seconds > 0 ? run_samples.count / seconds : 0.0);
+    harness_print_stats(out, &spawn_samples);
+    fprintf(out, "},\n      \"run_us\": {");
+    harness_print_stats(out, &run_samples);
+    fprintf(out, "}}");
+    fflush(out);
+    free(spawn_samples.values);
+    free(run_samples.values);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  -n <count>               Commands per strategy and size (default %d)\n", SPAWNBENCH_ITERATIONS);
+    fprintf(stderr, "  --sizes <list>           Memory held while spawning (default 0,64m,256m,1g)\n");
+    fprintf(stderr, "  --strategies <list>      Default fork,vfork,posix_spawn,clone\n");
+    fprintf(stderr, "  --command <cmd>          Shell command to run (default \"true\")\n");
+    fprintf(stderr, "  -o <file>                Write the JSON there instead of stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *command = "true";
+    const char *output = NULL;
+    int iterations = SPAWNBENCH_ITERATIONS;
+    char *ballast = NULL;
+    size_t ballast_size = 0;
+    FILE *out = stdout;
+    int first = 1, i, s;
+
+    parse_sizes("0,64m,256m,1g");
+    parse_strategies("fork,vfork,posix_spawn,clone");
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            if (parse_sizes(argv[++i]) != 0) {
+                fprintf(stderr, "Bad size list: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--strategies") == 0 && i + 1 < argc) {
+            if (parse_strategies(argv[++i]) != 0) {
+                fprintf(stderr, "No usable strategy in %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--command") == 0 && i + 1 < argc) {
+            command = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (output && !(out = fopen(output, "w"))) {
+        perror(output);
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"command\": \"%s\", \"iterations\": %d, \"started\": %lld,\n  \"results\": [",
+            command, iterations, (long long)time(NULL));
+    for (i = 0; i < size_count; i++) {
+        // Private, written memory, as a server's heap would be
+        if (ballast) munmap(ballast, ballast_size);
+        ballast = NULL;
+        ballast_size = (size_t)sizes[i];
+        if (ballast_size > 0) {
+            ballast = mmap(NULL, ballast_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ballast == MAP_FAILED) {
+                fprintf(stderr, "Cannot hold %lld bytes: %s\n", sizes[i], strerror(errno));
+                ballast = NULL;
+                break;
+            }
+            memset(ballast, 1, ballast_size);
+        }
+        for (s = 0; s < strategy_count; s++) {
+            spawn_strategy = strategies[s];
+            fprintf(stderr, "%s with %lld bytes held\n", spawn_strategy_name(spawn_strategy), sizes[i]);
+            bench_strategy(out, command, iterations, sizes[i], first);
+            first = 0;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (ballast) munmap(ballast, ballast_size);
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,214 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE   // statx(), fstatat() and DTTOIF
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "netshell_stat.h"
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define STAT_GETDENTS 1
+#define DIR_READER_BUFFER (256 * 1024)
+
+// Kernel record returned by getdents64()
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+#ifdef DTTOIF
+#define DTYPE_TO_MODE(t) ((t) == DT_UNKNOWN ? 0 : DTTOIF(t))
+#else
+#define DTYPE_TO_MODE(t) 0
+#endif
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+    put32(p, (uint32_t)(v >> 32));
+    put32(p + 4, (uint32_t)v);
+}
+
+static uint64_t get64(const unsigned char *p) {
+    return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+size_t stat_record_encode(const struct stat_record *record, unsigned char *out) {
+    put64(out, record->size);
+    put64(out + 8, record->inode);
+    put64(out + 16, (uint64_t)record->mtime);
+    put32(out + 24, record->mtime_nsec);
+    put32(out + 28, record->mode);
+    out[32] = record->name_len >> 8;
+    out[33] = record->name_len;
+    out[34] = record->flags;
+    out[35] = 0;
+    memcpy(out + STAT_RECORD_HEADER_SIZE, record->name, record->name_len);
+    return STAT_RECORD_HEADER_SIZE + record->name_len;
+}
+
+size_t stat_record_decode(struct stat_record *record, const unsigned char *in, size_t avail) {
+    if (avail < STAT_RECORD_HEADER_SIZE) return 0;
+    record->size = get64(in);
+    record->inode = get64(in + 8);
+    record->mtime = (int64_t)get64(in + 16);
+    record->mtime_nsec = get32(in + 24);
+    record->mode = get32(in + 28);
+    record->name_len = ((uint16_t)in[32] << 8) | in[33];
+    record->flags = in[34];
+    if (avail < (size_t)STAT_RECORD_HEADER_SIZE + record->name_len) return 0;
+    record->name = (const char *)in + STAT_RECORD_HEADER_SIZE;
+    return STAT_RECORD_HEADER_SIZE + record->name_len;
+}
+
+void stat_record_fill(struct stat_record *record, const struct dir_reader *dir, const char *name) {
+    size_t len = strlen(name);
+    int ok;
+
+    memset(record, 0, sizeof(*record));
+    record->name = name;
+    record->name_len = len > STAT_RECORD_MAX_NAME ? STAT_RECORD_MAX_NAME : (uint16_t)len;
+
+#if defined(STATX_BASIC_STATS)
+    {
+        // Only ask for what the record carries, and never force a sync with
+        // a remote filesystem just to list it
+        struct statx stx;
+        ok = statx(dir ? dir->fd : AT_FDCWD, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                   STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO, &stx) == 0;
+        if (ok) {
+            record->size = stx.stx_size;
+            record->inode = stx.stx_ino;
+            record->mtime = stx.stx_mtime.tv_sec;
+            record->mtime_nsec = stx.stx_mtime.tv_nsec;
+            record->mode = stx.stx_mode;
+        }
+    }
+#else
+    {
+        struct stat st;
+#ifdef AT_FDCWD
+        ok = fstatat(dir ? dir->fd : AT_FDCWD, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+#else
+        char path[STAT_RECORD_MAX_NAME * 2];
+        if (dir) {
+            snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+            ok = lstat(path, &st) == 0;
+        } else {
+            ok = lstat(name, &st) == 0;
+        }
+#endif
+        if (ok) {
+            record->size = st.st_size;
+            record->inode = st.st_ino;
+            record->mtime = st.st_mtime;
+            record->mode = st.st_mode;
+        }
+    }
+#endif
+
+    if (!ok) record->flags |= STAT_MISSING;
+}
+
+int dir_reader_open(struct dir_reader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+
+#ifdef STAT_GETDENTS
+    reader->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (reader->fd < 0) return -1;
+    reader->buf = malloc(DIR_READER_BUFFER);
+    if (!reader->buf) {
+        close(reader->fd);
+        return -1;
+    }
+#else
+    reader->dir = opendir(path);
+    if (!reader->dir) return -1;
+    reader->path = strdup(path);
+#ifdef AT_FDCWD
+    reader->fd = dirfd((DIR *)reader->dir);
+#endif
+#endif
+    return 0;
+}
+
+static int is_dot_entry(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+int dir_reader_next(struct dir_reader *reader, const char **name, uint32_t *mode) {
+#ifdef STAT_GETDENTS
+    for (;;) {
+        struct linux_dirent64 *entry;
+
+        if (reader->pos >= reader->len) {
+            long n = syscall(SYS_getdents64, reader->fd, reader->buf, DIR_READER_BUFFER);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return -1;
+            if (n == 0) return 0;
+            reader->len = n;
+            reader->pos = 0;
+        }
+        entry = (struct linux_dirent64 *)(reader->buf + reader->pos);
+        reader->pos += entry->d_reclen;
+        if (is_dot_entry(entry->d_name)) continue;
+        *name = entry->d_name;
+        *mode = DTYPE_TO_MODE(entry->d_type);
+        return 1;
+    }
+#else
+    struct dirent *entry;
+
+    for (;;) {
+        errno = 0;
+        entry = readdir((DIR *)reader->dir);
+        if (!entry) return errno ? -1 : 0;
+        if (is_dot_entry(entry->d_name)) continue;
+        *name = entry->d_name;
+#ifdef _DIRENT_HAVE_D_TYPE
+        *mode = DTYPE_TO_MODE(entry->d_type);
+#else
+        *mode = 0;
+#endif
+        return 1;
+    }
+#endif
+}
+
+void dir_reader_close(struct dir_reader *reader) {
+#ifdef STAT_GETDENTS
+    if (reader->fd >= 0) close(reader->fd);
+    free(reader->buf);
+#else
+    if (reader->dir) closedir((DIR *)reader->dir);
+    free(reader->path);
+#endif
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+}
@@ -0,0 +1,70 @@
+#ifndef NETSHELL_STAT_H
+#define NETSHELL_STAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Binary file metadata records used by LIST_DIR and STAT_MANY.
+//
+// Each record is a fixed STAT_RECORD_HEADER_SIZE header (big-endian fields)
+// followed by name_len bytes of name, with no terminator:
+//
+//   0  8  size          24  4  mtime nanoseconds
+//   8  8  inode         28  4  mode (type and permission bits)
+//  16  8  mtime seconds 32  2  name length
+//                       34  1  flags, 35 1 reserved
+
+#define STAT_RECORD_HEADER_SIZE 36
+#define STAT_RECORD_MAX_NAME 4096
+#define STAT_PAGE_ENTRIES 1024            // Default records per page
+#define STAT_PAGE_BYTES (64 * 1024)       // Pages are flushed before growing past this
+
+// Record flags
+#define STAT_MISSING 0x1   // stat failed; only the name is valid
+#define STAT_NOSTAT  0x2   // Listed without stat; only name and file type are valid
+
+struct stat_record {
+    uint64_t size;
+    uint64_t inode;
+    int64_t mtime;
+    uint32_t mtime_nsec;
+    uint32_t mode;
+    uint8_t flags;
+    uint16_t name_len;
+    const char *name;
+};
+
+// Encode a record into out, which must have room for
+// STAT_RECORD_HEADER_SIZE + name_len bytes. Returns the bytes written.
+size_t stat_record_encode(const struct stat_record *record, unsigned char *out);
+
+// Decode one record from in. The name points into in and is not terminated.
+// Returns the bytes consumed, or 0 if avail is too short.
+size_t stat_record_decode(struct stat_record *record, const unsigned char *in, size_t avail);
+
+// Streaming directory reader: getdents64() on Linux so huge directories are
+// read in large batches, readdir() elsewhere.
+struct dir_reader {
+    int fd;
+    void *dir;          // DIR * for the readdir() fallback
+    char *path;         // Directory path, for stat() without fstatat()
+    char *buf;
+    long len;
+    long pos;
+};
+
+// Fill a record by stat'ing name inside dir, or name as a path when dir is
+// NULL, without following symlinks (statx() where available). The record
+// keeps a pointer to name. Sets STAT_MISSING on failure.
+void stat_record_fill(struct stat_record *record, const struct dir_reader *dir, const char *name);
+
+int dir_reader_open(struct dir_reader *reader, const char *path);
+
+// Next entry, skipping "." and "..". *mode gets the type bits from the
+// directory entry (0 if unknown). Returns 1 for an entry, 0 at end, -1 on error.
+int dir_reader_next(struct dir_reader *reader, const char **name, uint32_t *mode);
+
+void dir_reader_close(struct dir_reader *reader);
+
+#endif
@@ -0,0 +1,617 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "netshell_harness.h"
+
+// Connection stress test for netshell (Linux: epoll and /proc). Two phases,
+// each optional:
+//   hold   open --hold connections, a --basic share of them as plain shells,
+//          keep them all open for --hold-time, then close them
+//   churn  open connections at --rate per second for --duration, each one
+//          closed as soon as its handshake is done
+// Every connection counts as established, refused, timed out (connect or
+// handshake), failed, or dropped by the server while held. Meanwhile the
+// server's process tree is sampled: processes, zombies, summed RSS and the
+// main process's open descriptors. After a settle period the same numbers
+// are compared with the baseline to find leaked descriptors and processes.
+// Results are printed as JSON.
+
+#define STRESS_DEFAULT_PORT 24980
+#define STRESS_TIMEOUT_MS 5000
+#define STRESS_SAMPLE_MS 500
+#define STRESS_SETTLE_MS 10000
+#define STRESS_MAX_INFLIGHT 512         // Handshakes under way at once
+#define STRESS_EVENTS 256
+#define STRESS_SCAN_MS 50               // How often timeouts are checked
+// Shorter than the extended magic, so the server's probe peeks at it and
+// hands it to the shell instead of reading it
+#define STRESS_BASIC_PROBE "echo nsstress\n"
+#define STRESS_BASIC_REPLY "nsstress\n"
+
+#define CONN_CONNECTING 1
+#define CONN_HANDSHAKE 2
+#define CONN_ESTABLISHED 3
+
+struct stress_conn {
+    int state;                          // 0: slot free
+    int basic;
+    int churn;                          // Close once established
+    long long started_us;
+    long long deadline_us;
+    char reply[32];
+    int reply_len;
+};
+
+struct stress_counts {
+    long long attempted;
+    long long established;
+    long long refused;
+    long long connect_timeouts;
+    long long handshake_timeouts;
+    long long failed;                   // Any other connect or handshake error
+    long long dropped;                  // Closed by the server while held
+    long long local_limit;              // No descriptor left on our side
+    long long peak_open;
+    struct harness_samples connect_us;
+    struct harness_samples handshake_us;
+};
+
+struct proc_snapshot {
+    int processes;                      // Server and everything under it
+    int zombies;
+    long long rss_kb;                   // Summed over the tree
+    long long server_rss_kb;
+    int server_fds;
+};
+
+struct stress_config {
+    struct harness_target target;
+    const char *server_path;
+    int spawn;
+    pid_t monitor_pid;                  // 0: nothing to monitor
+    int hold;
+    int hold_ms;
+    int basic_percent;
+    int open_rate;                      // 0: as fast as handshakes allow
+    int rate;
+    int duration_ms;
+    int timeout_ms;
+    int sample_ms;
+    int settle_ms;
+};
+
+static struct stress_config config;
+static struct stress_conn *conns;       // Indexed by descriptor
+static int conn_limit;
+static int open_count;                  // Established connections
+static int inflight;                    // Connecting or in handshake
+static int epoll_fd;
+static long long started_us;
+static char work_dir[256];
+static pid_t server_pid = -1;
+static FILE *out;
+static int samples_written;
+
+// Walk /proc for the process tree under root
+static int proc_snapshot(pid_t root, struct proc_snapshot *snap) {
+    struct entry { pid_t pid, ppid; char state; long long rss_pages; } *entries = NULL;
+    int count = 0, capacity = 0;
+    char *in_tree;
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    DIR *dir = opendir("/proc");
+    struct dirent *de;
+    char path[64];
+    int changed, i;
+
+    memset(snap, 0, sizeof(*snap));
+    if (!dir) return -1;
+    while ((de = readdir(dir)) != NULL) {
+        char buf[1024], *close_paren;
+        FILE *file;
+        pid_t pid = atoi(de->d_name);
+
+        if (pid <= 0) continue;
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        if (!(file = fopen(path, "r"))) continue;
+        if (!fgets(buf, sizeof(buf), file)) buf[0] = '\0';
+        fclose(file);
+        // The command name may hold spaces and parentheses; fields resume after the last ')'
+        close_paren = strrchr(buf, ')');
+        if (!close_paren) continue;
+        if (count == capacity) {
+            struct entry *grown = realloc(entries, sizeof(*entries) * (capacity = capacity ? capacity * 2 : 1024));
+            if (!grown) break;
+            entries = grown;
+        }
+        entries[count].pid = pid;
+        entries[count].rss_pages = 0;
+        // state ppid, then 19 more fields to rss (field 24)
+        if (sscanf(close_paren + 2, "%c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %*u %*u %lld",
+                   &entries[count].state, &entries[count].ppid, &entries[count].rss_pages) >= 2) {
+            count++;
+        }
+    }
+    closedir(dir);
+
+    in_tree = calloc(count ? count : 1, 1);
+    if (!in_tree) {
+        free(entries);
+        return -1;
+    }
+    // A few passes reach every level (server, connection, shell, command)
+    do {
+        changed = 0;
+        for (i = 0; i < count; i++) {
+            int j;
+            if (in_tree[i]) continue;
+            if (entries[i].pid == root) {
+                in_tree[i] = changed = 1;
+                continue;
+            }
+            for (j = 0; j < count; j++) {
+                if (in_tree[j] && entries[j].pid == entries[i].ppid) {
+                    in_tree[i] = changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+
+    for (i = 0; i < count; i++) {
+        if (!in_tree[i]) continue;
+        snap->processes++;
+        if (entries[i].state == 'Z') snap->zombies++;
+        snap->rss_kb += entries[i].rss_pages * page_kb;
+        if (entries[i].pid == root) snap->server_rss_kb = entries[i].rss_pages * page_kb;
+    }
+    free(in_tree);
+    free(entries);
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", root);
+    if ((dir = opendir(path)) != NULL) {
+        while ((de = readdir(dir)) != NULL) {
+            if (de->d_name[0] != '.') snap->server_fds++;
+        }
+        closedir(dir);
+    }
+    return snap->processes > 0 ? 0 : -1;
+}
+
+static void print_snapshot(const struct proc_snapshot *snap) {
+    fprintf(out, "\"processes\": %d, \"zombies\": %d, \"rss_kb\": %lld, \"server_rss_kb\": %lld, \"server_fds\": %d",
+            snap->processes, snap->zombies, snap->rss_kb, snap->server_rss_kb, snap->server_fds);
+}
+
+static void sample(const char *phase) {
+    struct proc_snapshot snap;
+
+    if (config.monitor_pid <= 0 || proc_snapshot(config.monitor_pid, &snap) != 0) return;
+    fprintf(out, "%s\n    {\"t_ms\": %lld, \"phase\": \"%s\", \"open\": %d, \"inflight\": %d, ",
+            samples_written++ ? "," : "", (harness_now_us() - started_us) / 1000, phase, open_count, inflight);
+    print_snapshot(&snap);
+    fprintf(out, "}");
+}
+
+static void conn_close(int fd) {
+    if (conns[fd].state == CONN_ESTABLISHED) open_count--;
+    else if (conns[fd].state) inflight--;
+    conns[fd].state = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+static void conn_start(struct stress_counts *counts, int basic, int churn) {
+    struct epoll_event event;
+    int fd, on = 1;
+
+    counts->attempted++;
+    fd = socket(config.target.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0 || fd >= conn_limit) {
+        if (fd >= 0) close(fd);
+        counts->local_limit++;
+        return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    memset(&conns[fd], 0, sizeof(conns[fd]));
+    conns[fd].basic = basic;
+    conns[fd].churn = churn;
+    conns[fd].started_us = harness_now_us();
+    conns[fd].deadline_us = conns[fd].started_us + (long long)config.timeout_ms * 1000;
+    conns[fd].state = CONN_CONNECTING;
+    inflight++;
+
+    if (connect(fd, (const struct sockaddr *)&config.target.addr, config.target.addr_len) != 0 &&
+        errno != EINPROGRESS) {
+        if (errno == ECONNREFUSED) counts->refused++;
+        else counts->failed++;
+        conn_close(fd);
+        return;
+    }
+    event.events = EPOLLOUT | EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void conn_established(struct stress_counts *counts, int fd) {
+    struct stress_conn *conn = &conns[fd];
+    struct epoll_event event;
+
+    harness_samples_add(&counts->handshake_us, harness_now_us() - conn->started_us);
+    counts->established++;
+    inflight--;
+    open_count++;
+    conn->state = CONN_ESTABLISHED;
+    if (open_count > counts->peak_open) counts->peak_open = open_count;
+    if (conn->churn) {
+        conn_close(fd);
+        return;
+    }
+    // Held: only a close from the server is of interest now
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+static void conn_event(struct stress_counts *counts, int fd, unsigned int events) {
+    struct stress_conn *conn = &conns[fd];
+    struct epoll_event event;
+    char buf[256];
+    ssize_t n;
+
+    if (conn->state == CONN_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        const char *hello = conn->basic ? STRESS_BASIC_PROBE : HARNESS_MAGIC;
+
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error) {
+            if (error == ECONNREFUSED) counts->refused++;
+            else counts->failed++;
+            conn_close(fd);
+            return;
+        }
+        harness_samples_add(&counts->connect_us, harness_now_us() - conn->started_us);
+        if (send(fd, hello, strlen(hello), MSG_NOSIGNAL) != (ssize_t)strlen(hello)) {
+            counts->failed++;
+            conn_close(fd);
+            return;
+        }
+        conn->state = CONN_HANDSHAKE;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+        return;
+    }
+
+    n = recv(fd, buf, sizeof(buf), 0);
+    if (conn->state == CONN_ESTABLISHED) {
+        if (n > 0) return;   // A shell saying something unasked; not our business
+        if (n < 0 && errno == EAGAIN) return;
+        counts->dropped++;
+        conn_close(fd);
+        return;
+    }
+
+    // Handshake: wait for the whole expected reply
+    if (n <= 0) {
+        if (n < 0 && errno == EAGAIN) return;
+        counts->failed++;
+        conn_close(fd);
+        return;
+    }
+    {
+        const char *expect = conn->basic ? STRESS_BASIC_REPLY : "EXTENDED_ACK\n";
+        int take = (size_t)n < sizeof(conn->reply) - 1 - conn->reply_len ? (int)n
+                                                                        : (int)sizeof(conn->reply) - 1 - conn->reply_len;
+        memcpy(conn->reply + conn->reply_len, buf, take);
+        conn->reply_len += take;
+        conn->reply[conn->reply_len] = '\0';
+        if (strstr(conn->reply, expect)) {
+            conn_established(counts, fd);
+        } else if (conn->reply_len >= (int)sizeof(conn->reply) - 1) {
+            counts->failed++;
+            conn_close(fd);
+        }
+    }
+}
+
+static void check_timeouts(struct stress_counts *counts, long long now) {
+    int fd;
+
+    for (fd = 0; fd < conn_limit; fd++) {
+        int state = conns[fd].state;
+        if ((state != CONN_CONNECTING && state != CONN_HANDSHAKE) || now < conns[fd].deadline_us) continue;
+        if (state == CONN_CONNECTING) counts->connect_timeouts++;
+        else counts->handshake_timeouts++;
+        conn_close(fd);
+    }
+}
+
+static void close_all(void) {
+    int fd;
+
+    for (fd = 0; fd < conn_limit; fd++) {
+        if (conns[fd].state) conn_close(fd);
+    }
+}
+
+// Run the event loop until `until` (or, if 0, until nothing is in flight),
+// starting connections as pace allows. Samples as it goes.
+static void run_loop(struct stress_counts *counts, const char *phase, int to_start, int rate, int churn,
+                     long long until, long long *next_sample) {
+    struct epoll_event events[STRESS_EVENTS];
+    long long phase_start = harness_now_us();
+    long long last_scan = 0;
+    int started = 0;
+
+    for (;;) {
+        long long now = harness_now_us();
+        int n, i, timeout;
+
+        // Start what the pace allows
+        while (started < to_start && inflight < STRESS_MAX_INFLIGHT &&
+               (rate <= 0 || started < (now - phase_start) * rate / 1000000 + 1)) {
+            conn_start(counts, started % 100 < config.basic_percent, churn);
+            started++;
+        }
+        if (until > 0 ? now >= until : (started >= to_start && inflight == 0)) break;
+
+        if (now - last_scan >= STRESS_SCAN_MS * 1000) {
+            check_timeouts(counts, now);
+            last_scan = now;
+        }
+        if (now >= *next_sample) {
+            sample(phase);
+            *next_sample = now + (long long)config.sample_ms * 1000;
+        }
+
+        timeout = STRESS_SCAN_MS;
+        if (rate > 0 && started < to_start) timeout = 1;
+        n = epoll_wait(epoll_fd, events, STRESS_EVENTS, timeout);
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (conns[fd].state) conn_event(counts, fd, events[i].events);
+        }
+    }
+}
+
+static void print_counts(const char *phase, struct stress_counts *counts, double seconds) {
+    fprintf(out, "    \"%s\": {\"attempted\": %lld, \"established\": %lld, \"refused\": %lld, "
+            "\"connect_timeouts\": %lld, \"handshake_timeouts\": %lld, \"failed\": %lld, \"dropped\": %lld, "
+            "\"local_fd_limit\": %lld, \"peak_open\": %lld, \"seconds\": %.3f, \"per_second\": %.1f,\n",
+            phase, counts->attempted, counts->established, counts->refused, counts->connect_timeouts,
+            counts->handshake_timeouts, counts->failed, counts->dropped, counts->local_limit, counts->peak_open,
+            seconds, seconds > 0 ? counts->established / seconds : 0.0);
+    fprintf(out, "      \"connect_us\": {");
+    harness_print_stats(out, &counts->connect_us);
+    fprintf(out, "},\n      \"handshake_us\": {");
+    harness_print_stats(out, &counts->handshake_us);
+    fprintf(out, "}}");
+    free(counts->connect_us.values);
+    free(counts->handshake_us.values);
+}
+
+// Raise our descriptor limit as far as allowed; a server we start inherits it
+static int raise_fd_limit(int wanted) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return 1024;
+    if (limit.rlim_cur < (rlim_t)wanted) {
+        limit.rlim_cur = limit.rlim_max < (rlim_t)wanted ? limit.rlim_max : (rlim_t)wanted;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return (int)limit.rlim_cur;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  --hold <n>             Connections to open and hold (default 1000)\n");
+    fprintf(stderr, "  --hold-time <ms>       How long to hold them (default 2000)\n");
+    fprintf(stderr, "  --basic <percent>      Share of plain shell connections (default 10)\n");
+    fprintf(stderr, "  --open-rate <n>        Connections opened per second while filling (default: no limit)\n");
+    fprintf(stderr, "  --rate <n>             Churn: connections per second (default 500; 0 skips churn)\n");
+    fprintf(stderr, "  --duration <ms>        Churn length (default 5000)\n");
+    fprintf(stderr, "  --timeout <ms>         Connect and handshake timeout (default %d)\n", STRESS_TIMEOUT_MS);
+    fprintf(stderr, "  --sample <ms>          Server sampling interval (default %d)\n", STRESS_SAMPLE_MS);
+    fprintf(stderr, "  --settle <ms>          Longest wait for the server to clean up (default %d)\n", STRESS_SETTLE_MS);
+    fprintf(stderr, "  --server <path>        Server to start (default ./netshell)\n");
+    fprintf(stderr, "  --port <port>          Port for the server we start (default %d)\n", STRESS_DEFAULT_PORT);
+    fprintf(stderr, "  --connect <host:port>  Stress a running server instead\n");
+    fprintf(stderr, "  --pid <pid>            Its process, to sample with --connect\n");
+    fprintf(stderr, "  -o <file>              Write the JSON there instead of stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct stress_counts hold_counts, churn_counts;
+    struct proc_snapshot baseline, final;
+    long long next_sample, phase_start, settle_until;
+    double hold_seconds = 0, churn_seconds = 0;
+    const char *output = NULL;
+    int have_baseline = 0, have_final = 0;
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    strcpy(config.target.host, "127.0.0.1");
+    config.target.port = STRESS_DEFAULT_PORT;
+    config.server_path = "./netshell";
+    config.spawn = 1;
+    config.hold = 1000;
+    config.hold_ms = 2000;
+    config.basic_percent = 10;
+    config.rate = 500;
+    config.duration_ms = 5000;
+    config.timeout_ms = STRESS_TIMEOUT_MS;
+    config.sample_ms = STRESS_SAMPLE_MS;
+    config.settle_ms = STRESS_SETTLE_MS;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--hold") == 0 && i + 1 < argc) {
+            config.hold = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hold-time") == 0 && i + 1 < argc) {
+            config.hold_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--basic") == 0 && i + 1 < argc) {
+            config.basic_percent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--open-rate") == 0 && i + 1 < argc) {
+            config.open_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            config.rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            config.duration_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            config.timeout_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            config.sample_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--settle") == 0 && i + 1 < argc) {
+            config.settle_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            config.server_path = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            config.target.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            if (harness_parse_address(&config.target, argv[++i]) != 0) {
+                fprintf(stderr, "Expected host:port, got %s\n", argv[i]);
+                return 1;
+            }
+            config.spawn = 0;
+        } else if (strcmp(argv[i], "--pid") == 0 && i + 1 < argc) {
+            config.monitor_pid = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (config.basic_percent < 0) config.basic_percent = 0;
+    if (config.basic_percent > 100) config.basic_percent = 100;
+    if (config.sample_ms < 10) config.sample_ms = 10;
+    if (harness_resolve(&config.target) != 0) {
+        fprintf(stderr, "Cannot resolve %s:%d\n", config.target.host, config.target.port);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    conn_limit = raise_fd_limit(config.hold + STRESS_MAX_INFLIGHT + 64);
+    if (config.hold + STRESS_MAX_INFLIGHT > conn_limit) {
+        fprintf(stderr, "Descriptor limit %d is below --hold %d; the rest count as local_fd_limit\n",
+                conn_limit, config.hold);
+    }
+    conns = calloc(conn_limit, sizeof(*conns));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!conns || epoll_fd < 0) {
+        perror("epoll");
+        return 1;
+    }
+
+    if (config.spawn) {
+        if (harness_make_dir(work_dir, sizeof(work_dir), "netshell-stress") != 0) {
+            perror("mkdtemp");
+            return 1;
+        }
+        fprintf(stderr, "Starting %s on port %d\n", config.server_path, config.target.port);
+        server_pid = harness_start_server(work_dir, config.server_path, &config.target);
+        if (server_pid < 0) {
+            fprintf(stderr, "Server did not come up; see %s/server.out\n", work_dir);
+            return 1;
+        }
+        config.monitor_pid = server_pid;
+    }
+    out = stdout;
+    if (output && !(out = fopen(output, "w"))) {
+        perror(output);
+        harness_stop_process(&server_pid);
+        return 1;
+    }
+
+    memset(&hold_counts, 0, sizeof(hold_counts));
+    memset(&churn_counts, 0, sizeof(churn_counts));
+    started_us = harness_now_us();
+    next_sample = started_us;
+    // The baseline waits for the readiness probe's connection to be reaped
+    settle_until = started_us + (long long)config.settle_ms * 1000;
+    while (config.monitor_pid > 0 && (have_baseline = proc_snapshot(config.monitor_pid, &baseline) == 0) &&
+           baseline.zombies > 0 && harness_now_us() < settle_until) {
+        usleep(50000);
+    }
+
+    fprintf(out, "{\n  \"host\": \"%s\", \"port\": %d, \"started\": %lld, \"fd_limit\": %d,\n  \"samples\": [",
+            config.target.host, config.target.port, (long long)time(NULL), conn_limit);
+
+    if (config.hold > 0) {
+        fprintf(stderr, "hold: opening %d connections (%d%% basic)\n", config.hold, config.basic_percent);
+        phase_start = harness_now_us();
+        run_loop(&hold_counts, "fill", config.hold, config.open_rate, 0, 0, &next_sample);
+        fprintf(stderr, "hold: %lld established, holding %d ms\n", hold_counts.established, config.hold_ms);
+        run_loop(&hold_counts, "hold", 0, 0, 0, harness_now_us() + (long long)config.hold_ms * 1000, &next_sample);
+        hold_seconds = (harness_now_us() - phase_start) / 1e6;
+        close_all();
+    }
+    if (config.rate > 0 && config.duration_ms > 0) {
+        long long until;
+
+        fprintf(stderr, "churn: %d connections per second for %d ms\n", config.rate, config.duration_ms);
+        phase_start = harness_now_us();
+        until = phase_start + (long long)config.duration_ms * 1000;
+        run_loop(&churn_counts, "churn", (int)((long long)config.rate * config.duration_ms / 1000), config.rate, 1,
+                 until, &next_sample);
+        // Let the handshakes still under way finish
+        run_loop(&churn_counts, "churn", 0, 0, 1, 0, &next_sample);
+        churn_seconds = (harness_now_us() - phase_start) / 1e6;
+        close_all();
+    }
+
+    // Wait for the server to reap everything, up to the settle limit
+    fprintf(stderr, "settling\n");
+    settle_until = harness_now_us() + (long long)config.settle_ms * 1000;
+    while (have_baseline && harness_now_us() < settle_until) {
+        if (proc_snapshot(config.monitor_pid, &final) == 0 && final.processes <= baseline.processes &&
+            final.zombies == 0 && final.server_fds <= baseline.server_fds) {
+            break;
+        }
+        if (harness_now_us() >= next_sample) {
+            sample("settle");
+            next_sample = harness_now_us() + (long long)config.sample_ms * 1000;
+        }
+        usleep(50000);
+    }
+    have_final = have_baseline && proc_snapshot(config.monitor_pid, &final) == 0;
+    sample("end");
+    fprintf(out, "\n  ],\n");
+
+    print_counts("hold", &hold_counts, hold_seconds);
+    fprintf(out, ",\n");
+    print_counts("churn", &churn_counts, churn_seconds);
+    fprintf(out, ",\n");
+    if (have_final) {
+        fprintf(out, "  \"baseline\": {");
+        print_snapshot(&baseline);
+        fprintf(out, "},\n  \"final\": {");
+        print_snapshot(&final);
+        fprintf(out, "},\n  \"leaks\": {\"server_fds\": %d, \"processes\": %d, \"zombies\": %d}\n}\n",
+                final.server_fds - baseline.server_fds, final.processes - baseline.processes, final.zombies);
+    } else {
+        fprintf(out, "  \"baseline\": null, \"final\": null, \"leaks\": null\n}\n");
+    }
+    if (out != stdout) fclose(out);
+
+    harness_stop_process(&server_pid);
+    if (config.spawn) harness_remove_dir(work_dir);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifndef MORPHOS
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#endif
+
+#include "netshell_metrics.h"
+#include "netshell_trace.h"
+
+struct trace_slot {
+    unsigned long long seq;              // 0 while empty or being written
+    long long started;
+    int mode;
+    long long phase_us[TRACE_PHASES];
+};
+
+struct trace_ring {
+    unsigned long long next;
+    struct trace_slot slots[TRACE_RING];
+};
+
+static const char *phase_names[TRACE_PHASES] = { "queue", "fork", "handshake", "spawn", "first_byte" };
+
+static struct trace_ring local_ring;
+static struct trace_ring *ring = &local_ring;
+static int trace_fd = -1;
+
+int trace_init(const char *trace_file) {
+    int result = -1;
+
+#ifndef MORPHOS
+    void *shared = mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared != MAP_FAILED) {
+        ring = shared;
+        result = 0;
+    }
+#endif
+    if (trace_file) {
+        trace_fd = open(trace_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (trace_fd < 0) result = -1;
+    }
+    return result;
+}
+
+void trace_begin(struct trace_conn *trace, int client_fd) {
+    int i;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->accepted_us = metrics_now_us();
+    trace->mark_us = trace->accepted_us;
+    trace->started = time(NULL);
+    for (i = 0; i < TRACE_PHASES; i++) trace->phase_us[i] = -1;
+
+#if defined(__linux__) && defined(TCP_INFO)
+    {
+        // The last ACK from the client is the end of its TCP handshake,
+        // unless it has already sent data (as extended clients do right
+        // away), in which case this is a lower bound
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if (getsockopt(client_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            trace->phase_us[TRACE_QUEUE] = (long long)info.tcpi_last_ack_recv * 1000;
+        }
+    }
+#else
+    (void)client_fd;
+#endif
+}
+
+void trace_mark(struct trace_conn *trace, int phase) {
+    long long now = metrics_now_us();
+
+    if (phase < 0 || phase >= TRACE_PHASES) return;
+    trace->phase_us[phase] = now - trace->mark_us;
+    trace->mark_us = now;
+}
+
+void trace_end(struct trace_conn *trace) {
+    struct trace_slot *slot;
+    unsigned long long seq;
+    char line[256];
+    int used, i;
+
+    if (trace->done) return;
+    trace->done = 1;
+
+    seq = __sync_add_and_fetch(&ring->next, 1);
+    slot = &ring->slots[(seq - 1) % TRACE_RING];
+    slot->seq = 0;
+    __sync_synchronize();
+    slot->started = trace->started;
+    slot->mode = trace->mode;
+    memcpy(slot->phase_us, trace->phase_us, sizeof(slot->phase_us));
+    __sync_synchronize();
+    slot->seq = seq;
+
+    if (trace_fd < 0) return;
+    // One write() per record, so lines from many processes never interleave
+    used = snprintf(line, sizeof(line), "%lld %llu %s", trace->started, seq,
+                    trace->mode == TRACE_MODE_EXTENDED ? "extended" : "basic");
+    for (i = 0; i < TRACE_PHASES; i++) {
+        if (trace->phase_us[i] < 0) {
+            used += snprintf(line + used, sizeof(line) - used, " %s=-", phase_names[i]);
+        } else {
+            used += snprintf(line + used, sizeof(line) - used, " %s=%lld", phase_names[i], trace->phase_us[i]);
+        }
+    }
+    used += snprintf(line + used, sizeof(line) - used, "\n");
+    if (write(trace_fd, line, used) != used) {
+        // A full disk only costs us the trace
+    }
+}
+
+int trace_wait_first_byte(struct trace_conn *trace, int client_fd, long long sent_before, pid_t shell_pid) {
+#ifdef __linux__
+    long long started = metrics_now_us();
+    long long sent, received;
+
+    if (metrics_socket_bytes(client_fd, &sent, &received) != 0) return 0;
+    for (;;) {
+        long long waited = metrics_now_us() - started;
+        long long period = waited / 10;
+        siginfo_t info;
+
+        if (sent > sent_before) {
+            trace_mark(trace, TRACE_FIRST_BYTE);
+            return 1;
+        }
+        if (waited >= (long long)TRACE_FIRST_BYTE_MAX_MS * 1000) return 0;
+
+        // Has the shell ended? WNOWAIT leaves it for the caller to collect
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PID, shell_pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid == shell_pid) {
+            return 0;
+        }
+
+        if (period < 100) period = 100;
+        if (period > 50000) period = 50000;
+        usleep(period);
+        if (metrics_socket_bytes(client_fd, &sent, &received) != 0) return 0;
+    }
+#else
+    (void)trace;
+    (void)client_fd;
+    (void)sent_before;
+    (void)shell_pid;
+    return 0;
+#endif
+}
+
+const char *trace_phase_name(int phase) {
+    return phase >= 0 && phase < TRACE_PHASES ? phase_names[phase] : "unknown";
+}
+
+static int trace_compare(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+static long long trace_percentile(const long long *values, int count, int percent) {
+    int rank = (count * percent + 99) / 100;
+    if (rank < 1) rank = 1;
+    return values[rank - 1];
+}
+
+size_t trace_report(char *buf, size_t size) {
+    struct trace_slot *copy = malloc(sizeof(struct trace_slot) * TRACE_RING);
+    long long *values = malloc(sizeof(long long) * TRACE_RING);
+    size_t used = 0;
+    int records = 0;
+    int i, phase, mode;
+
+    if (size == 0) return 0;
+    buf[0] = '\0';
+    if (!copy || !values) {
+        free(copy);
+        free(values);
+        return 0;
+    }
+
+    // Take a consistent copy of each published slot
+    for (i = 0; i < TRACE_RING; i++) {
+        unsigned long long seq = ring->slots[i].seq;
+        if (seq == 0) continue;
+        __sync_synchronize();
+        copy[records] = ring->slots[i];
+        __sync_synchronize();
+        if (ring->slots[i].seq == seq) records++;
+    }
+
+    for (mode = TRACE_MODE_BASIC; mode <= TRACE_MODE_EXTENDED; mode++) {
+        for (phase = 0; phase < TRACE_PHASES; phase++) {
+            int count = 0;
+            int n;
+
+            for (i = 0; i < records; i++) {
+                if (copy[i].mode == mode && copy[i].phase_us[phase] >= 0) values[count++] = copy[i].phase_us[phase];
+            }
+            if (count == 0) continue;
+            qsort(values, count, sizeof(*values), trace_compare);
+            n = snprintf(buf + used, size - used, "PHASE %s %s %d %lld %lld %lld %lld\n", phase_names[phase],
+                         mode == TRACE_MODE_EXTENDED ? "extended" : "basic", count,
+                         trace_percentile(values, count, 50), trace_percentile(values, count, 90),
+                         trace_percentile(values, count, 99), values[count - 1]);
+            if (n < 0 || (size_t)n >= size - used) break;
+            used += n;
+        }
+    }
+    i = snprintf(buf + used, size - used, "END %d\n", records);
+    if (i > 0 && (size_t)i < size - used) used += i;
+
+    free(copy);
+    free(values);
+    return used;
+}
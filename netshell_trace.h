@@ -0,0 +1,70 @@
+#ifndef NETSHELL_TRACE_H
+#define NETSHELL_TRACE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Per-connection latency tracing. Every connection is timed through its
+// phases with the monotonic clock; the finished record goes into a ring
+// of the most recent connections in shared memory (for TRACE_REPORT) and,
+// optionally, as one line into a trace file.
+//
+// Phases, each measured from the end of the previous one:
+//   queue       SYN handshake done until accept() (estimated from TCP_INFO)
+//   fork        accept() until the connection process runs
+//   handshake   until the protocol is decided (magic string or 2 s probe)
+//   spawn       basic mode: until the shell has been exec()ed
+//   first_byte  until the first byte goes to the client (the EXTENDED_ACK,
+//               or the shell's first output in basic mode)
+
+#define TRACE_QUEUE 0
+#define TRACE_FORK 1
+#define TRACE_HANDSHAKE 2
+#define TRACE_SPAWN 3
+#define TRACE_FIRST_BYTE 4
+#define TRACE_PHASES 5
+
+#define TRACE_MODE_BASIC 0
+#define TRACE_MODE_EXTENDED 1
+
+#define TRACE_RING 4096                  // Connections kept for the report
+#define TRACE_FIRST_BYTE_MAX_MS 30000    // Give up waiting for a silent shell
+
+struct trace_conn {
+    long long accepted_us;
+    long long mark_us;                   // End of the last phase recorded
+    long long phase_us[TRACE_PHASES];    // -1: not reached
+    long long started;                   // Unix time of the accept
+    int mode;
+    int done;
+};
+
+// Map the shared ring and open trace_file (NULL: none) for appending. Call
+// once in the server before forking. Returns 0, or -1 if the file cannot be
+// opened or only this process will see its records.
+int trace_init(const char *trace_file);
+
+// Start timing a connection right after accept()
+void trace_begin(struct trace_conn *trace, int client_fd);
+
+// Record that phase ended now
+void trace_mark(struct trace_conn *trace, int phase);
+
+// Publish the record (once; later calls do nothing)
+void trace_end(struct trace_conn *trace);
+
+// Wait until the shell sharing client_fd has written its first byte,
+// polling with a period that grows with the wait so the error stays under
+// a tenth. Gives up when the shell exits or after TRACE_FIRST_BYTE_MAX_MS.
+// sent_before is what the socket had sent when the shell started. Returns 1
+// if the byte was seen (Linux only; elsewhere 0 right away).
+int trace_wait_first_byte(struct trace_conn *trace, int client_fd, long long sent_before, pid_t shell_pid);
+
+const char *trace_phase_name(int phase);
+
+// One line per phase and mode over the connections in the ring:
+// "PHASE <phase> <mode> <count> <p50_us> <p90_us> <p99_us> <max_us>", then
+// "END <connections>". Returns the length written (truncated to size - 1).
+size_t trace_report(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "netshell_common.h"
+#include "netshell_walk.h"
+
+#ifdef NETSHELL_THREADS
+#include <pthread.h>
+#endif
+
+#define WALK_PATH_MAX 4096
+#define WALK_DEQUE_INITIAL 64
+
+struct walk_item {
+    char *path;     // Relative to the root ("" for the root itself)
+    int depth;
+};
+
+// items[head..tail) are queued; the owner works at the tail, thieves at the head
+struct walk_deque {
+#ifdef NETSHELL_THREADS
+    pthread_mutex_t lock;
+#endif
+    struct walk_item *items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+struct walker;
+
+struct walk_worker {
+    struct walker *walker;
+    int id;
+    struct walk_deque deque;
+    struct walk_totals totals;
+#ifdef NETSHELL_THREADS
+    pthread_t thread;
+#endif
+};
+
+struct walker {
+    const char *root;
+    const struct walk_filter *filter;
+    walk_emit_fn emit;
+    void *ctx;
+    struct walk_worker *workers;
+    int nworkers;
+#ifdef NETSHELL_THREADS
+    pthread_mutex_t lock;        // Guards pending, generation, idle and stop
+    pthread_cond_t cond;
+    pthread_mutex_t emit_lock;
+#endif
+    long pending;                // Directories queued or being read
+    unsigned long generation;    // Bumped on every push, so idle workers never miss one
+    int idle;
+    int stop;
+};
+
+static void walker_lock(struct walker *w) {
+#ifdef NETSHELL_THREADS
+    pthread_mutex_lock(&w->lock);
+#else
+    (void)w;
+#endif
+}
+
+static void walker_unlock(struct walker *w) {
+#ifdef NETSHELL_THREADS
+    pthread_mutex_unlock(&w->lock);
+#else
+    (void)w;
+#endif
+}
+
+static void walker_wake_all(struct walker *w) {
+#ifdef NETSHELL_THREADS
+    pthread_cond_broadcast(&w->cond);
+#else
+    (void)w;
+#endif
+}
+
+static void deque_lock(struct walk_deque *d) {
+#ifdef NETSHELL_THREADS
+    pthread_mutex_lock(&d->lock);
+#else
+    (void)d;
+#endif
+}
+
+static void deque_unlock(struct walk_deque *d) {
+#ifdef NETSHELL_THREADS
+    pthread_mutex_unlock(&d->lock);
+#else
+    (void)d;
+#endif
+}
+
+static int deque_push(struct walk_deque *d, char *path, int depth) {
+    deque_lock(d);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head, (d->tail - d->head) * sizeof(*d->items));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            size_t cap = d->cap ? d->cap * 2 : WALK_DEQUE_INITIAL;
+            struct walk_item *items = realloc(d->items, cap * sizeof(*items));
+            if (!items) {
+                deque_unlock(d);
+                return -1;
+            }
+            d->items = items;
+            d->cap = cap;
+        }
+    }
+    d->items[d->tail].path = path;
+    d->items[d->tail].depth = depth;
+    d->tail++;
+    deque_unlock(d);
+    return 0;
+}
+
+// Take the newest item (owner) or the oldest one (thief)
+static int deque_take(struct walk_deque *d, struct walk_item *item, int steal) {
+    int found = 0;
+
+    deque_lock(d);
+    if (d->tail > d->head) {
+        *item = steal ? d->items[d->head++] : d->items[--d->tail];
+        if (d->head == d->tail) d->head = d->tail = 0;
+        found = 1;
+    }
+    deque_unlock(d);
+    return found;
+}
+
+// Shell-style glob: '*', '?' and bracket classes such as [a-z] or [!0-9].
+// There is no backslash escaping, and '*' also matches a leading dot.
+static int glob_match(const char *pattern, const char *name) {
+    const char *star = NULL, *resume = NULL;
+
+    while (*name) {
+        if (*pattern == '*') {
+            star = ++pattern;
+            resume = name;
+            continue;
+        }
+        if (*pattern == '[') {
+            const char *p = pattern + 1;
+            int negate = (*p == '!' || *p == '^');
+            int matched = 0;
+            if (negate) p++;
+            do {
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    if ((unsigned char)*name >= (unsigned char)p[0] &&
+                        (unsigned char)*name <= (unsigned char)p[2]) matched = 1;
+                    p += 3;
+                } else {
+                    if (*p == *name) matched = 1;
+                    p++;
+                }
+            } while (*p && *p != ']');
+            if (*p == ']' && matched != negate) {
+                pattern = p + 1;
+                name++;
+                continue;
+            }
+        } else if (*pattern == '?' || (*pattern && *pattern == *name)) {
+            pattern++;
+            name++;
+            continue;
+        }
+        if (!star) return 0;
+        pattern = star;
+        name = ++resume;
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+static int walk_matches(const struct walk_filter *f, const char *name, const struct stat_record *r) {
+    if (f->type && (r->mode & S_IFMT) != f->type) return 0;
+    if (r->size < f->min_size) return 0;
+    if (f->max_size && r->size > f->max_size) return 0;
+    if (f->newer && r->mtime < f->newer) return 0;
+    if (f->older && r->mtime >= f->older) return 0;
+    if (f->name_glob && !glob_match(f->name_glob, name)) return 0;
+    return 1;
+}
+
+static void walker_push(struct walk_worker *me, char *path, int depth) {
+    struct walker *w = me->walker;
+
+    if (deque_push(&me->deque, path, depth) != 0) {
+        free(path);
+        me->totals.errors++;
+        return;
+    }
+    walker_lock(w);
+    w->pending++;
+    w->generation++;
+#ifdef NETSHELL_THREADS
+    if (w->idle) pthread_cond_signal(&w->cond);
+#endif
+    walker_unlock(w);
+}
+
+static void walker_stop(struct walker *w) {
+    walker_lock(w);
+    w->stop = 1;
+    walker_wake_all(w);
+    walker_unlock(w);
+}
+
+// Read one directory, report matching entries and queue its subdirectories
+static void walk_directory(struct walk_worker *me, const struct walk_item *item) {
+    struct walker *w = me->walker;
+    const struct walk_filter *filter = w->filter;
+    char full[WALK_PATH_MAX];
+    char relative[WALK_PATH_MAX];
+    struct dir_reader reader;
+    struct stat_record record;
+    const char *name;
+    uint32_t mode;
+    int result = 0, length;
+
+    if (item->path[0]) {
+        snprintf(full, sizeof(full), "%s/%s", w->root, item->path);
+    } else {
+        snprintf(full, sizeof(full), "%s", w->root);
+    }
+    if (dir_reader_open(&reader, full) != 0) {
+        me->totals.errors++;
+        return;
+    }
+    me->totals.dirs++;
+
+    while (!w->stop && (result = dir_reader_next(&reader, &name, &mode)) > 0) {
+        stat_record_fill(&record, &reader, name);
+        if (record.flags & STAT_MISSING) continue;   // Deleted while we walked
+
+        length = item->path[0] ? snprintf(relative, sizeof(relative), "%s/%s", item->path, name)
+                               : snprintf(relative, sizeof(relative), "%s", name);
+        if (length >= (int)sizeof(relative)) {
+            me->totals.errors++;
+            continue;
+        }
+
+        if (walk_matches(filter, name, &record)) {
+            me->totals.matched++;
+            me->totals.bytes += record.size;
+            if (w->emit) {
+                int stop;
+                record.name = relative;
+                record.name_len = length;
+#ifdef NETSHELL_THREADS
+                pthread_mutex_lock(&w->emit_lock);
+#endif
+                stop = w->emit(w->ctx, &record);
+#ifdef NETSHELL_THREADS
+                pthread_mutex_unlock(&w->emit_lock);
+#endif
+                if (stop) walker_stop(w);
+            }
+        }
+
+        if (S_ISDIR(record.mode) && (filter->max_depth < 0 || item->depth < filter->max_depth)) {
+            char *child = strdup(relative);
+            if (child) {
+                walker_push(me, child, item->depth + 1);
+            } else {
+                me->totals.errors++;
+            }
+        }
+    }
+    if (result < 0) me->totals.errors++;
+    dir_reader_close(&reader);
+}
+
+static void *walk_worker_main(void *arg) {
+    struct walk_worker *me = arg;
+    struct walker *w = me->walker;
+    struct walk_item item;
+    unsigned long seen;
+    int i, found;
+
+    for (;;) {
+        walker_lock(w);
+        seen = w->generation;
+        walker_unlock(w);
+        if (w->stop) break;
+
+        found = deque_take(&me->deque, &item, 0);
+        for (i = 1; !found && i < w->nworkers; i++) {
+            found = deque_take(&w->workers[(me->id + i) % w->nworkers].deque, &item, 1);
+        }
+
+        if (found) {
+            walk_directory(me, &item);
+            free(item.path);
+            walker_lock(w);
+            if (--w->pending == 0) walker_wake_all(w);
+            walker_unlock(w);
+            continue;
+        }
+
+        walker_lock(w);
+        if (w->pending == 0 || w->stop) {
+            walker_unlock(w);
+            break;
+        }
+#ifdef NETSHELL_THREADS
+        // Another worker is still reading a directory that may yield work
+        if (w->generation == seen) {
+            w->idle++;
+            pthread_cond_wait(&w->cond, &w->lock);
+            w->idle--;
+        }
+#else
+        (void)seen;
+#endif
+        walker_unlock(w);
+    }
+    return NULL;
+}
+
+int walk_default_threads(void) {
+#ifdef NETSHELL_THREADS
+    int threads = default_worker_threads() * 2;
+    if (threads < WALK_MIN_THREADS) threads = WALK_MIN_THREADS;
+    if (threads > MAX_WORKER_THREADS) threads = MAX_WORKER_THREADS;
+    return threads;
+#else
+    return 1;
+#endif
+}
+
+int walk_tree(const char *root, const struct walk_filter *filter, int threads,
+              walk_emit_fn emit, void *ctx, struct walk_totals *totals) {
+    struct walker w;
+    struct dir_reader reader;
+    struct walk_item item;
+    char *start;
+    int i;
+
+    memset(totals, 0, sizeof(*totals));
+    if (dir_reader_open(&reader, root) != 0) return -1;
+    dir_reader_close(&reader);
+
+#ifdef NETSHELL_THREADS
+    if (threads < 1) threads = 1;
+    if (threads > MAX_WORKER_THREADS) threads = MAX_WORKER_THREADS;
+#else
+    threads = 1;
+#endif
+
+    memset(&w, 0, sizeof(w));
+    w.root = root;
+    w.filter = filter;
+    w.emit = emit;
+    w.ctx = ctx;
+    w.nworkers = threads;
+    w.workers = calloc(threads, sizeof(*w.workers));
+    start = strdup("");
+    if (!w.workers || !start) {
+        free(w.workers);
+        free(start);
+        errno = ENOMEM;
+        return -1;
+    }
+
+#ifdef NETSHELL_THREADS
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    pthread_mutex_init(&w.emit_lock, NULL);
+#endif
+    for (i = 0; i < threads; i++) {
+        w.workers[i].walker = &w;
+        w.workers[i].id = i;
+#ifdef NETSHELL_THREADS
+        pthread_mutex_init(&w.workers[i].deque.lock, NULL);
+#endif
+    }
+    walker_push(&w.workers[0], start, 0);
+
+    // The calling thread is worker 0
+#ifdef NETSHELL_THREADS
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&w.workers[i].thread, NULL, walk_worker_main, &w.workers[i]) != 0) {
+            break;
+        }
+    }
+    threads = i;
+#endif
+    walk_worker_main(&w.workers[0]);
+#ifdef NETSHELL_THREADS
+    for (i = 1; i < threads; i++) {
+        pthread_join(w.workers[i].thread, NULL);
+    }
+#endif
+
+    // Sum the per-worker totals and free anything left by an early stop
+    for (i = 0; i < w.nworkers; i++) {
+        struct walk_worker *worker = &w.workers[i];
+        totals->matched += worker->totals.matched;
+        totals->bytes += worker->totals.bytes;
+        totals->dirs += worker->totals.dirs;
+        totals->errors += worker->totals.errors;
+        while (deque_take(&worker->deque, &item, 0)) free(item.path);
+        free(worker->deque.items);
+#ifdef NETSHELL_THREADS
+        pthread_mutex_destroy(&worker->deque.lock);
+#endif
+    }
+#ifdef NETSHELL_THREADS
+    pthread_mutex_destroy(&w.emit_lock);
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+#endif
+    free(w.workers);
+
+    if (w.stop) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
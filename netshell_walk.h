@@ -0,0 +1,49 @@
+#ifndef NETSHELL_WALK_H
+#define NETSHELL_WALK_H
+
+#include <stdint.h>
+
+#include "netshell_stat.h"
+
+// Parallel directory tree walker used by the WALK command.
+//
+// Directories are work items. Each worker thread keeps its own deque: it
+// pushes the subdirectories it finds and pops the newest one (depth first,
+// warm caches), and an idle worker steals the oldest item from another
+// worker's deque, which tends to be the root of a large untouched subtree.
+// Symlinks are never followed, so the walk cannot loop.
+
+#define WALK_MIN_THREADS 4   // Walking is stat-latency bound, not CPU bound
+
+struct walk_filter {
+    const char *name_glob;   // Glob for the entry name ('*', '?', [a-z], [!a-z]), or NULL
+    uint64_t min_size;
+    uint64_t max_size;       // 0: no upper bound
+    int64_t newer;           // mtime must be >= newer (0: any)
+    int64_t older;           // mtime must be < older (0: any)
+    uint32_t type;           // S_IFREG, S_IFDIR, ... or 0 for any
+    int max_depth;           // Levels below the root to descend (-1: unlimited)
+};
+
+struct walk_totals {
+    uint64_t matched;        // Entries that passed the filter
+    uint64_t bytes;          // Sum of their sizes
+    uint64_t dirs;           // Directories read
+    uint64_t errors;         // Directories that could not be read
+};
+
+// Called for every matching entry, serialised across threads. The record's
+// name is the path relative to the root. Return non-zero to stop the walk.
+typedef int (*walk_emit_fn)(void *ctx, const struct stat_record *record);
+
+// Walk the tree under root on threads workers, filling *totals.
+// emit may be NULL when only the totals are wanted.
+// Returns 0 when the walk completed, -1 if the root could not be opened
+// (errno is set) or emit stopped it.
+int walk_tree(const char *root, const struct walk_filter *filter, int threads,
+              walk_emit_fn emit, void *ctx, struct walk_totals *totals);
+
+// Default worker count for walk_tree()
+int walk_default_threads(void);
+
+#endif
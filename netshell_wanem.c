@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+// WAN emulator: a TCP proxy that delivers what it relays late, as a slow
+// long-distance link would. Every segment read from one side is scheduled
+// for the other side after
+//   - the time to serialise it at --rate, queued behind earlier segments
+//   - the one-way --delay, give or take up to --jitter
+//   - with --reorder, a hold-up for some segments
+// and nothing at all is delivered during periodic --stall windows.
+//
+// The relay is a byte stream, so bytes are never actually reordered: a
+// segment that arrives out of order over real TCP is held until the gap is
+// filled, and everything behind it waits. That head-of-line hold is what
+// --reorder produces. Jitter likewise never lets a segment overtake one
+// before it.
+
+#define WAN_SEGMENT 1448                 // Payload of one Ethernet-sized TCP segment
+#define WAN_READ_CHUNK (64 * 1024)
+#define WAN_QUEUE_MAX (4 * 1024 * 1024)  // Stop reading a side with this much in flight
+#define WAN_MAX_CONNECTIONS 1024
+
+struct wan_segment {
+    struct wan_segment *next;
+    long long due_us;
+    size_t len;
+    size_t sent;
+    char data[];
+};
+
+// One direction of a connection
+struct wan_pipe {
+    int from, to;
+    struct wan_segment *head, *tail;
+    size_t queued;
+    long long link_free_us;              // When the emulated link finishes its backlog
+    long long last_due_us;
+    int eof;                             // from has closed its side
+    int shut;                            // ... and we passed that on to to
+};
+
+struct wan_conn {
+    int fds[2];                          // Client, server
+    struct wan_pipe dirs[2];             // Client to server, server to client
+};
+
+struct wan_config {
+    long long delay_us;
+    long long jitter_us;
+    long long rate_bps;                  // 0: unlimited
+    int reorder_percent;
+    long long reorder_hold_us;
+    long long stall_every_us;            // 0: no stalls
+    long long stall_length_us;
+    unsigned int seed;
+};
+
+static struct wan_config config;
+static struct wan_conn *conns[WAN_MAX_CONNECTIONS];
+static volatile sig_atomic_t running = 1;
+static long long started_us;
+
+static long long now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void stop_signal(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+// End of the stall window around time t, or t if the link is up then
+static long long stall_end(long long t) {
+    long long phase;
+
+    if (config.stall_every_us <= 0 || config.stall_length_us <= 0) return t;
+    phase = (t - started_us) % config.stall_every_us;
+    if (phase < config.stall_every_us - config.stall_length_us) return t;
+    return t + config.stall_every_us - phase;
+}
+
+// Random value in [0, range)
+static long long random_below(long long range) {
+    if (range <= 0) return 0;
+    return (long long)((double)rand_r(&config.seed) / ((double)RAND_MAX + 1) * range);
+}
+
+static void pipe_schedule(struct wan_pipe *pipe, const char *data, size_t len) {
+    while (len > 0) {
+        size_t take = len < WAN_SEGMENT ? len : WAN_SEGMENT;
+        struct wan_segment *segment = malloc(sizeof(*segment) + take);
+        long long now = now_us();
+        long long due;
+
+        if (!segment) return;
+        memcpy(segment->data, data, take);
+        segment->len = take;
+        segment->sent = 0;
+        segment->next = NULL;
+
+        // Serialisation queues behind whatever the link is still sending
+        if (config.rate_bps > 0) {
+            if (pipe->link_free_us < now) pipe->link_free_us = now;
+            pipe->link_free_us += (long long)take * 8 * 1000000 / config.rate_bps;
+            due = pipe->link_free_us;
+        } else {
+            due = now;
+        }
+        due += config.delay_us;
+        if (config.jitter_us > 0) due += random_below(2 * config.jitter_us + 1) - config.jitter_us;
+        if (config.reorder_percent > 0 && random_below(100) < config.reorder_percent) due += config.reorder_hold_us;
+        if (due < now) due = now;
+        if (due < pipe->last_due_us) due = pipe->last_due_us;   // Stream order
+        pipe->last_due_us = due;
+        segment->due_us = due;
+
+        if (pipe->tail) {
+            pipe->tail->next = segment;
+        } else {
+            pipe->head = segment;
+        }
+        pipe->tail = segment;
+        pipe->queued += take;
+        data += take;
+        len -= take;
+    }
+}
+
+// Read what there is from the sending side. Returns -1 when the connection failed.
+static int pipe_read(struct wan_pipe *pipe) {
+    char buf[WAN_READ_CHUNK];
+    ssize_t n = read(pipe->from, buf, sizeof(buf));
+
+    if (n < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    if (n == 0) {
+        pipe->eof = 1;
+        return 0;
+    }
+    pipe_schedule(pipe, buf, n);
+    return 0;
+}
+
+// Deliver every segment that is due. Returns -1 when the connection failed.
+static int pipe_write(struct wan_pipe *pipe, long long now) {
+    if (stall_end(now) > now) return 0;
+    while (pipe->head && pipe->head->due_us <= now) {
+        struct wan_segment *segment = pipe->head;
+        ssize_t n = write(pipe->to, segment->data + segment->sent, segment->len - segment->sent);
+
+        if (n < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        segment->sent += n;
+        if (segment->sent < segment->len) return 0;
+        pipe->queued -= segment->len;
+        pipe->head = segment->next;
+        if (!pipe->head) pipe->tail = NULL;
+        free(segment);
+    }
+    if (pipe->eof && !pipe->head && !pipe->shut) {
+        shutdown(pipe->to, SHUT_WR);
+        pipe->shut = 1;
+    }
+    return 0;
+}
+
+// When this direction next needs attention, or -1 if it does not
+static long long pipe_next_due(const struct wan_pipe *pipe) {
+    if (!pipe->head) return -1;
+    return stall_end(pipe->head->due_us);
+}
+
+static void conn_close(int index) {
+    struct wan_conn *conn = conns[index];
+    int d;
+
+    for (d = 0; d < 2; d++) {
+        while (conn->dirs[d].head) {
+            struct wan_segment *next = conn->dirs[d].head->next;
+            free(conn->dirs[d].head);
+            conn->dirs[d].head = next;
+        }
+    }
+    close(conn->fds[0]);
+    close(conn->fds[1]);
+    free(conn);
+    conns[index] = NULL;
+}
+
+static int connect_target(const struct addrinfo *target) {
+    int fd = socket(target->ai_family, SOCK_STREAM, 0);
+
+    if (fd < 0) return -1;
+    if (connect(fd, target->ai_addr, target->ai_addrlen) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void conn_open(int client_fd, const struct addrinfo *target) {
+    struct wan_conn *conn;
+    int server_fd, i, on = 1;
+
+    for (i = 0; i < WAN_MAX_CONNECTIONS && conns[i]; i++) {
+    }
+    server_fd = i < WAN_MAX_CONNECTIONS ? connect_target(target) : -1;
+    conn = server_fd >= 0 ? calloc(1, sizeof(*conn)) : NULL;
+    if (!conn) {
+        if (server_fd >= 0) close(server_fd);
+        close(client_fd);
+        return;
+    }
+
+    // The emulator decides when bytes go out; Nagle would only add to it
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    conn->fds[0] = client_fd;
+    conn->fds[1] = server_fd;
+    conn->dirs[0].from = client_fd;
+    conn->dirs[0].to = server_fd;
+    conn->dirs[1].from = server_fd;
+    conn->dirs[1].to = client_fd;
+    conns[i] = conn;
+}
+
+static int listen_on(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void run(int listen_fd, const struct addrinfo *target) {
+    static struct pollfd fds[1 + 2 * WAN_MAX_CONNECTIONS];
+    static int slot[WAN_MAX_CONNECTIONS];   // Where each connection's two sockets are in fds
+
+    while (running) {
+        long long now = now_us();
+        long long next = -1;
+        int count = 1, timeout, i, d;
+
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < WAN_MAX_CONNECTIONS; i++) {
+            struct wan_conn *conn = conns[i];
+            if (!conn) continue;
+            slot[i] = count;
+            for (d = 0; d < 2; d++) {
+                // Socket d is read by direction d and written by the other one
+                struct wan_pipe *reader = &conn->dirs[d];
+                struct wan_pipe *writer = &conn->dirs[1 - d];
+                long long due = pipe_next_due(writer);
+
+                fds[count].fd = conn->fds[d];
+                fds[count].events = 0;
+                fds[count].revents = 0;
+                // Read while there is room in flight; write when something is due
+                if (!reader->eof && reader->queued < WAN_QUEUE_MAX) fds[count].events |= POLLIN;
+                if (due >= 0 && due <= now) fds[count].events |= POLLOUT;
+                if (due > now && (next < 0 || due < next)) next = due;
+                count++;
+            }
+        }
+
+        timeout = next < 0 ? 1000 : (int)((next - now + 999) / 1000);
+        if (poll(fds, count, timeout) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        now = now_us();
+        for (i = 0; i < WAN_MAX_CONNECTIONS; i++) {
+            struct wan_conn *conn = conns[i];
+            int failed = 0;
+
+            if (!conn) continue;
+            for (d = 0; d < 2 && !failed; d++) {
+                if ((fds[slot[i] + d].revents & (POLLIN | POLLHUP | POLLERR)) && pipe_read(&conn->dirs[d]) < 0) {
+                    failed = 1;
+                }
+            }
+            // Writing only makes system calls for segments that are due
+            for (d = 0; d < 2 && !failed; d++) {
+                if (pipe_write(&conn->dirs[d], now) < 0) failed = 1;
+            }
+            if (failed || (conn->dirs[0].shut && conn->dirs[1].shut)) conn_close(i);
+        }
+
+        // New connections last, so their slots are not looked at until the next round
+        if (fds[0].revents & POLLIN) {
+            int client_fd;
+            while ((client_fd = accept(listen_fd, NULL, NULL)) >= 0) conn_open(client_fd, target);
+        }
+    }
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <listen_port> <target_host> <target_port>\n", program);
+    fprintf(stderr, "  --delay <ms>            One-way delay, each direction\n");
+    fprintf(stderr, "  --jitter <ms>           Vary the delay by up to this much\n");
+    fprintf(stderr, "  --rate <kbit/s>         Bandwidth of each direction\n");
+    fprintf(stderr, "  --reorder <pct>[:<ms>]  Hold this share of segments back (default 2 x delay)\n");
+    fprintf(stderr, "  --stall <every>:<ms>    Deliver nothing for <ms> out of every <every> ms\n");
+    fprintf(stderr, "  --seed <n>              Seed for jitter and reordering\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct addrinfo hints, *target;
+    struct sigaction action;
+    const char *positional[3];
+    int positional_count = 0;
+    int listen_fd, i;
+    long long hold_ms = -1;
+
+    config.seed = 1;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {
+            config.delay_us = atoll(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--jitter") == 0 && i + 1 < argc) {
+            config.jitter_us = atoll(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            config.rate_bps = atoll(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d:%lld", &config.reorder_percent, &hold_ms) < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stall") == 0 && i + 1 < argc) {
+            long long every, length;
+            if (sscanf(argv[++i], "%lld:%lld", &every, &length) != 2 || every <= 0 || length < 0 || length > every) {
+                usage(argv[0]);
+                return 1;
+            }
+            config.stall_every_us = every * 1000;
+            config.stall_length_us = length * 1000;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            config.seed = (unsigned int)atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && positional_count < 3) {
+            positional[positional_count++] = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (positional_count != 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (config.jitter_us > config.delay_us) config.jitter_us = config.delay_us;
+    if (config.reorder_percent > 0) {
+        // A reordered segment waits about a round trip for the gap to fill
+        config.reorder_hold_us = hold_ms >= 0 ? hold_ms * 1000 : 2 * config.delay_us;
+        if (config.reorder_hold_us < 10000) config.reorder_hold_us = 10000;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(positional[1], positional[2], &hints, &target) != 0) {
+        fprintf(stderr, "Cannot resolve %s:%s\n", positional[1], positional[2]);
+        return 1;
+    }
+    listen_fd = listen_on(atoi(positional[0]));
+    if (listen_fd < 0) {
+        perror("listen");
+        return 1;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_signal;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    started_us = now_us();
+
+    fprintf(stderr, "Relaying 127.0.0.1:%s to %s:%s, delay %lld ms, jitter %lld ms, rate %lld kbit/s\n",
+            positional[0], positional[1], positional[2], config.delay_us / 1000, config.jitter_us / 1000,
+            config.rate_bps / 1000);
+    run(listen_fd, target);
+
+    for (i = 0; i < WAN_MAX_CONNECTIONS; i++) {
+        if (conns[i]) conn_close(i);
+    }
+    close(listen_fd);
+    freeaddrinfo(target);
+    return 0;
+}
@@ -0,0 +1,491 @@
+#define _GNU_SOURCE   // memmem()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "netshell_common.h"
+#include "netshell_exec.h"
+#include "netshell_metrics.h"
+#include "netshell_warm.h"
+
+void warm_init(struct warm_shell *w) {
+    w->pid = -1;
+    w->in_fd = w->out_fd = -1;
+    w->running = 0;
+    w->sentinel_len = 0;
+    w->used = 0;
+}
+
+// A sentinel no command prints by accident
+static void warm_make_sentinel(struct warm_shell *w) {
+    unsigned char random[8];
+    int fd = open("/dev/urandom", O_RDONLY);
+    int i;
+
+    if (fd < 0 || read(fd, random, sizeof(random)) != (ssize_t)sizeof(random)) {
+        unsigned long long seed = (unsigned long long)time(NULL) * 2654435761u ^ (unsigned long long)getpid();
+        for (i = 0; i < (int)sizeof(random); i++) random[i] = (unsigned char)(seed >> (i * 8));
+    }
+    if (fd >= 0) close(fd);
+    w->sentinel_len = snprintf(w->sentinel, sizeof(w->sentinel), "\nNETSHELL_DONE_%02x%02x%02x%02x%02x%02x%02x%02x ",
+                               random[0], random[1], random[2], random[3],
+                               random[4], random[5], random[6], random[7]);
+}
+
+static int warm_start(struct warm_shell *w, int close_fd) {
+    char* argv[] = { SHELL_NAME, NULL };
+    struct spawn_setup setup;
+    long long started = metrics_now_us();
+    int in_fds[2], out_fds[2];
+
+    if (pipe(in_fds) != 0) return -1;
+    if (pipe(out_fds) != 0) {
+        close(in_fds[0]);
+        close(in_fds[1]);
+        return -1;
+    }
+    spawn_setup_init(&setup);
+    setup.fds[0] = in_fds[0];
+    setup.fds[1] = setup.fds[2] = out_fds[1];
+    setup.close_fds[0] = in_fds[1];
+    setup.close_fds[1] = out_fds[0];
+    setup.close_fds[2] = in_fds[0];
+    setup.close_fds[3] = out_fds[1];
+    setup.close_fds[4] = close_fd;
+    setup.new_group = 1;
+    setup.default_signals = 1;   // A named shell's holder ignores SIGHUP and SIGPIPE; the shell must not
+    w->pid = spawn_process(SHELL_PATH, argv, &setup);
+    close(in_fds[0]);
+    close(out_fds[1]);
+    if (w->pid < 0) {
+        close(in_fds[1]);
+        close(out_fds[0]);
+        metrics_add(METRIC_SPAWN_FAILURES, 1);
+        return -1;
+    }
+#ifndef MORPHOS
+    setpgid(w->pid, w->pid);
+#endif
+    metrics_add(METRIC_SPAWNS, 1);
+    metrics_observe_since(METRIC_SPAWN_TIME, started);
+    w->in_fd = in_fds[1];
+    w->out_fd = out_fds[0];
+    fcntl(w->in_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(w->out_fd, F_SETFD, FD_CLOEXEC);
+    w->running = 0;
+    w->used = 0;
+    warm_make_sentinel(w);
+    return 0;
+}
+
+// The command in single quotes for eval, then the sentinel line
+static char* warm_script(const struct warm_shell *w, const char* command, size_t *length) {
+    size_t quotes = 0, used = 0;
+    const char* p;
+    char* script;
+
+    for (p = command; *p; p++) {
+        if (*p == '\'') quotes++;
+    }
+    script = malloc(strlen(command) + quotes * 3 + w->sentinel_len + 64);
+    if (!script) return NULL;
+    used += sprintf(script, "eval '");
+    for (p = command; *p; p++) {
+        if (*p == '\'') {
+            memcpy(script + used, "'\\''", 4);
+            used += 4;
+        } else {
+            script[used++] = *p;
+        }
+    }
+    // The sentinel as printf writes it: "\n" + word + " " + code + "\n"
+    used += sprintf(script + used, "' </dev/null\nprintf '\\n%.*s %%d\\n' \"$?\"\n",
+                    (int)w->sentinel_len - 2, w->sentinel + 1);
+    *length = used;
+    return script;
+}
+
+static int warm_write(int fd, const char* data, size_t length) {
+    void (*previous)(int) = signal(SIGPIPE, SIG_IGN);   // A shell that has gone is an error, not a signal
+    int result = 0;
+
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            result = -1;
+            break;
+        }
+        data += n;
+        length -= n;
+    }
+    signal(SIGPIPE, previous);
+    return result;
+}
+
+int warm_run(struct warm_shell *w, int close_fd, const char* command) {
+    char* script;
+    size_t length;
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        // A shell that died between commands is replaced once
+        if (w->pid < 0 && warm_start(w, close_fd) < 0) return -1;
+        script = warm_script(w, command, &length);
+        if (!script) return -1;
+        if (warm_write(w->in_fd, script, length) == 0) {
+            free(script);
+            w->running = 1;
+            w->used = 0;
+            return 0;
+        }
+        free(script);
+        warm_stop(w);
+    }
+    return -1;
+}
+
+// Hand out up to size bytes from the front of the buffer
+static ssize_t warm_take(struct warm_shell *w, char* buf, size_t size, size_t available) {
+    if (available > size) available = size;
+    memcpy(buf, w->buffer, available);
+    memmove(w->buffer, w->buffer + available, w->used - available);
+    w->used -= available;
+    return available;
+}
+
+ssize_t warm_read(struct warm_shell *w, char* buf, size_t size, int *exit_code, int *status) {
+    for (;;) {
+        char *mark = memmem(w->buffer, w->used, w->sentinel, w->sentinel_len);
+        ssize_t n;
+
+        if (mark) {
+            char *code = mark + w->sentinel_len;
+            char *end = memchr(code, '\n', w->buffer + w->used - code);
+            if (mark > w->buffer) return warm_take(w, buf, size, mark - w->buffer);
+            if (end) {
+                *exit_code = atoi(code);
+                w->used = 0;   // A background job's stray output would land here
+                w->running = 0;
+                return 0;
+            }
+        } else if (w->used >= w->sentinel_len) {
+            // All but what could be the start of the sentinel
+            return warm_take(w, buf, size, w->used - (w->sentinel_len - 1));
+        }
+
+        n = read(w->out_fd, w->buffer + w->used, sizeof(w->buffer) - w->used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) {
+            w->used += n;
+            continue;
+        }
+        // The shell is gone: what it wrote last is still the command's
+        if (w->used > 0) return warm_take(w, buf, size, w->used);
+        close(w->in_fd);
+        close(w->out_fd);
+        w->in_fd = w->out_fd = -1;
+        while (waitpid(w->pid, status, 0) < 0 && errno == EINTR) {
+        }
+        w->pid = -1;
+        w->running = 0;
+        return -1;
+    }
+}
+
+void warm_stop(struct warm_shell *w) {
+    if (w->pid < 0) return;
+    stop_command(w->pid, SIGKILL);
+    close(w->in_fd);
+    close(w->out_fd);
+    while (waitpid(w->pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    warm_init(w);
+}
+
+int warm_name_valid(const char* name) {
+    size_t length = strlen(name);
+
+    if (length == 0 || length > WARM_NAME_MAX || name[0] == '.') return 0;
+    return strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-") == length;
+}
+
+#ifdef NETSHELL_WARM_HOLDERS
+
+#define WARM_LINE_MAX 128
+#define WARM_COMMAND_MAX (1024 * 1024)   // As EXEC script=
+#define WARM_FD_LIMIT 1024
+
+static void warm_socket_path(struct sockaddr_un *addr, const char* dir, const char* name) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/warm-%s.sock", dir, name);
+}
+
+// Connect to the holder of a named shell. Returns the socket, or -1.
+static int warm_connect(const char* dir, const char* name) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) return -1;
+    warm_socket_path(&addr, dir, name);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        // A holder that died without cleaning up leaves its socket behind
+        if (errno == ECONNREFUSED) unlink(addr.sun_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Run one connection's command: read its request, then relay the output
+static void warm_holder_serve(struct warm_shell *w, int fd, char* chunk) {
+    struct timeval timeout;
+    char line[WARM_LINE_MAX];
+    char* command;
+    int reset, code = -1, status = 0;
+    long length;
+    ssize_t n;
+
+    // A local client that connects and says nothing must not hold up the others
+    timeout.tv_sec = WARM_REQUEST_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (WARM_REQUEST_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (recv_line(fd, line, sizeof(line)) < 0 ||
+        sscanf(line, "RUN %d %ld", &reset, &length) != 2 || length <= 0 || length > WARM_COMMAND_MAX) {
+        return;
+    }
+    command = malloc(length + 1);
+    if (!command || recv_all(fd, command, length) != length) {
+        free(command);
+        return;
+    }
+    command[length] = '\0';
+
+    // A connection that gave up waiting for the shell has closed its end
+    if (recv(fd, line, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+        free(command);
+        return;
+    }
+    if (reset) warm_stop(w);
+    if (warm_run(w, fd, command) < 0) {
+        free(command);
+        send_all(fd, "ERROR\n", 6);
+        return;
+    }
+    free(command);
+    snprintf(line, sizeof(line), "STARTED %ld\n", (long)w->pid);
+    send_all(fd, line, strlen(line));
+
+    while ((n = warm_read(w, chunk, WARM_BUFFER_SIZE, &code, &status)) > 0) {
+        snprintf(line, sizeof(line), "OUTPUT %ld\n", (long)n);
+        if (send_all(fd, line, strlen(line)) < 0 || send_all(fd, chunk, n) < 0) {
+            // Nobody takes the rest: stop it, as the connection's own shell would be
+            warm_stop(w);
+            return;
+        }
+    }
+    if (n == 0) {
+        snprintf(line, sizeof(line), "DONE %d\n", code);
+    } else {
+        snprintf(line, sizeof(line), "ENDED %d\n", status);
+    }
+    send_all(fd, line, strlen(line));
+}
+
+static void warm_holder_run(const char* dir, const char* name, int listen_fd) {
+    struct sockaddr_un addr;
+    struct warm_shell *w = malloc(sizeof(*w));
+    char* chunk = malloc(WARM_BUFFER_SIZE);
+    time_t active = time(NULL);
+
+    if (w) warm_init(w);
+    while (w && chunk && time(NULL) - active < WARM_IDLE) {
+        struct timeval timeout;
+        fd_set read_fds;
+        int fd;
+
+        FD_ZERO(&read_fds);
+        FD_SET(listen_fd, &read_fds);
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        if (select(listen_fd + 1, &read_fds, NULL, NULL, &timeout) <= 0) continue;
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        warm_holder_serve(w, fd, chunk);
+        close(fd);
+        active = time(NULL);
+    }
+
+    warm_socket_path(&addr, dir, name);
+    unlink(addr.sun_path);
+    close(listen_fd);
+    if (w) warm_stop(w);
+    free(w);
+    free(chunk);
+}
+
+// Listen on the named shell's socket and leave a detached holder on it.
+// Returns 0, or -1; losing the race to another connection starting the
+// same holder counts as success.
+static int warm_holder_create(const char* dir, const char* name) {
+    struct sockaddr_un addr;
+    int listen_fd;
+    pid_t pid;
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return -1;
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) return -1;
+    warm_socket_path(&addr, dir, name);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(listen_fd);
+        return errno == EADDRINUSE ? 0 : -1;
+    }
+    if (listen(listen_fd, 8) != 0) {
+        unlink(addr.sun_path);
+        close(listen_fd);
+        return -1;
+    }
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+    pid = fork();
+    if (pid == 0) {
+        // Detach from the connection (and the server's terminal) so the
+        // shell outlives both
+        int fd;
+        for (fd = 3; fd < WARM_FD_LIMIT; fd++) {
+            if (fd != listen_fd) close(fd);   // Not the client socket or anything else of ours
+        }
+        setsid();
+        fd = open("/dev/null", O_RDWR);
+        if (fd >= 0) {
+            dup2(fd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            if (fd > STDERR_FILENO) close(fd);
+        }
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        if (fork() == 0) {
+            warm_holder_run(dir, name, listen_fd);
+        }
+        _exit(0);
+    }
+    close(listen_fd);
+    if (pid < 0) {
+        unlink(addr.sun_path);
+        return -1;
+    }
+    waitpid(pid, NULL, 0);
+    return 0;
+}
+
+int warm_remote_run(struct warm_link *link, const char* dir, const char* name, int reset, const char* command) {
+    struct timeval timeout;
+    char line[WARM_LINE_MAX];
+    size_t length = strlen(command);
+    long pid;
+
+    link->fd = warm_connect(dir, name);
+    if (link->fd < 0 && warm_holder_create(dir, name) == 0) link->fd = warm_connect(dir, name);
+    if (link->fd < 0) return -1;
+    link->pid = -1;
+    link->remaining = 0;
+
+    // The holder answers once the shell is free; a stuck one must not hold
+    // up this connection for good
+    timeout.tv_sec = WARM_START_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(link->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    snprintf(line, sizeof(line), "RUN %d %lu\n", reset ? 1 : 0, (unsigned long)length);
+    if (send_all(link->fd, line, strlen(line)) < 0 || send_all(link->fd, command, length) < 0 ||
+        recv_line(link->fd, line, sizeof(line)) < 0 || sscanf(line, "STARTED %ld", &pid) != 1) {
+        close(link->fd);
+        link->fd = -1;
+        return -1;
+    }
+    link->pid = (pid_t)pid;
+
+    // The command's output may be quiet for as long as it runs
+    timeout.tv_sec = 0;
+    setsockopt(link->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return 0;
+}
+
+ssize_t warm_remote_read(struct warm_link *link, char* buf, size_t size, int *exit_code, int *status) {
+    char line[WARM_LINE_MAX];
+    ssize_t n;
+
+    while (link->remaining == 0) {
+        if (recv_line(link->fd, line, sizeof(line)) < 0) break;
+        if (sscanf(line, "OUTPUT %ld", &link->remaining) == 1 && link->remaining > 0) continue;
+        if (sscanf(line, "DONE %d", exit_code) == 1) return 0;
+        if (sscanf(line, "ENDED %d", status) == 1) return -1;
+        break;
+    }
+    if (link->remaining == 0) {
+        *status = SIGKILL;   // As waitpid() reports a shell killed by it
+        return -1;
+    }
+    if ((long)size > link->remaining) size = link->remaining;
+    n = recv(link->fd, buf, size, 0);
+    while (n < 0 && errno == EINTR) n = recv(link->fd, buf, size, 0);
+    if (n <= 0) {
+        link->remaining = 0;
+        *status = SIGKILL;
+        return -1;
+    }
+    link->remaining -= n;
+    return n;
+}
+
+void warm_remote_close(struct warm_link *link, int stop) {
+    if (link->fd < 0) return;
+    if (stop && link->pid > 0) stop_command(link->pid, SIGKILL);
+    close(link->fd);
+    link->fd = -1;
+}
+
+#else
+
+int warm_remote_run(struct warm_link *link, const char* dir, const char* name, int reset, const char* command) {
+    (void)dir;
+    (void)name;
+    (void)reset;
+    (void)command;
+    link->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t warm_remote_read(struct warm_link *link, char* buf, size_t size, int *exit_code, int *status) {
+    (void)link;
+    (void)buf;
+    (void)size;
+    (void)exit_code;
+    *status = 0;
+    return -1;
+}
+
+void warm_remote_close(struct warm_link *link, int stop) {
+    (void)link;
+    (void)stop;
+}
+
+#endif
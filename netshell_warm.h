@@ -0,0 +1,93 @@
+#ifndef NETSHELL_WARM_H
+#define NETSHELL_WARM_H
+
+#include <sys/types.h>
+
+// Warm shell for EXEC warm: one long-lived shell per connection that runs
+// the connection's commands one after another, so each costs what the
+// command costs and not a shell start.
+//
+// A command goes to the shell's stdin as
+//     eval '<command>' </dev/null
+//     printf '\n<sentinel> %d\n' "$?"
+// and its output (stdout and stderr, on one pipe) ends where the sentinel
+// line starts. The sentinel is random per shell. State the command leaves
+// behind (directory, variables, functions) is there for the next one; a
+// reset starts a fresh shell. A command that ends the shell (exit, exec, a
+// syntax error) gets the shell's exit status, and the next command starts
+// a new one.
+//
+// A named warm shell (EXEC warm=<name>) is the same shell kept by a holder
+// process instead of the connection, so it outlives the connection and the
+// next one to name it, such as the next `netshell_client -e`, runs on it
+// too. The holder listens on a UNIX socket named after the shell in the
+// session directory, is started by the first connection that finds no
+// holder there, runs its connections' commands one at a time and exits
+// with its shell after WARM_IDLE seconds without one.
+//
+// Connection to holder: "RUN <reset> <n>" plus the n byte command.
+// Holder to connection: "STARTED <pid>" (the shell), then "OUTPUT <n>" plus
+// n bytes, ending with "DONE <code>", or "ENDED <status>" when the shell
+// ended instead; "ERROR" if it could not be run.
+
+#ifndef MORPHOS
+#define NETSHELL_WARM_HOLDERS 1   // Needs fork() and UNIX sockets
+#endif
+
+#define WARM_SENTINEL_MAX 48
+#define WARM_BUFFER_SIZE 65536
+#define WARM_NAME_MAX 32
+#define WARM_IDLE 600                  // Seconds a named shell waits for its next command
+#define WARM_REQUEST_TIMEOUT_MS 2000   // A request that is not sent by then is dropped
+#define WARM_START_TIMEOUT 30          // Seconds to wait while another connection uses the shell
+
+struct warm_shell {
+    pid_t pid;                          // -1: not running
+    int in_fd;
+    int out_fd;
+    int running;                        // A command's output is still coming
+    char sentinel[WARM_SENTINEL_MAX];   // "\n<sentinel> "
+    size_t sentinel_len;
+    char buffer[WARM_BUFFER_SIZE];      // Output not yet known to be the command's
+    size_t used;
+};
+
+void warm_init(struct warm_shell *w);
+
+// Send command to the shell, starting one if needed; close_fd (e.g. the
+// client socket) is closed in a new shell. Returns 0, or -1.
+int warm_run(struct warm_shell *w, int close_fd, const char* command);
+
+// Next piece of the running command's output, into buf. Returns its length;
+// 0 when the command is done, with its exit code in *exit_code; -1 when
+// the shell ended instead, with *status from waitpid().
+ssize_t warm_read(struct warm_shell *w, char* buf, size_t size, int *exit_code, int *status);
+
+// Stop the shell and everything it started
+void warm_stop(struct warm_shell *w);
+
+// A connection's command on a named warm shell
+struct warm_link {
+    int fd;                             // To the holder
+    pid_t pid;                          // The shell
+    long remaining;                     // Bytes left in the current OUTPUT frame
+};
+
+// Is name usable for a named shell: letters, digits, '.', '_' and '-', not
+// starting with '.'
+int warm_name_valid(const char* name);
+
+// Send command to the named shell whose holder listens in dir, starting the
+// holder if there is none; reset replaces the shell first. Waits while the
+// shell runs another connection's command, up to WARM_START_TIMEOUT seconds.
+// Returns 0, or -1.
+int warm_remote_run(struct warm_link *link, const char* dir, const char* name, int reset, const char* command);
+
+// As warm_read(), for a command sent with warm_remote_run(). A holder that
+// went away counts as the shell killed.
+ssize_t warm_remote_read(struct warm_link *link, char* buf, size_t size, int *exit_code, int *status);
+
+// Done with the command; with stop, kill the shell first, as warm_stop()
+void warm_remote_close(struct warm_link *link, int stop);
+
+#endif
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define WATCH_INOTIFY 1
+#define WATCH_EVENT_BUFFER (64 * 1024)
+#define WATCH_INOTIFY_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                            IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+#include "netshell_watch.h"
+
+// Poll fallback: snapshot one path
+static void watch_snapshot(struct watch_entry *entry) {
+    struct stat st;
+
+    entry->exists = stat(entry->path, &st) == 0;
+    if (entry->exists) {
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtime;
+#ifdef __linux__
+        entry->mtime_nsec = st.st_mtim.tv_nsec;
+#else
+        entry->mtime_nsec = 0;
+#endif
+    }
+}
+
+int watch_init(struct watch_set *set) {
+    memset(set, 0, sizeof(*set));
+    set->fd = -1;
+#ifdef WATCH_INOTIFY
+    set->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    // Without inotify (e.g. exhausted instances) fall back to polling
+#endif
+    return 0;
+}
+
+int watch_add(struct watch_set *set, const char *path) {
+    struct watch_entry *entry;
+    struct stat st;
+
+    if (set->count >= WATCH_MAX_PATHS) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (stat(path, &st) != 0) return -1;
+
+    entry = &set->entries[set->count];
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->wd = -1;
+#ifdef WATCH_INOTIFY
+    if (set->fd >= 0) {
+        entry->wd = inotify_add_watch(set->fd, path, WATCH_INOTIFY_MASK);
+        if (entry->wd < 0) return -1;
+    }
+#endif
+    watch_snapshot(entry);
+    return set->count++;
+}
+
+int watch_fd(const struct watch_set *set) {
+    return set->fd;
+}
+
+int watch_timeout_ms(const struct watch_set *set) {
+    return set->fd >= 0 ? -1 : WATCH_POLL_INTERVAL_MS;
+}
+
+#ifdef WATCH_INOTIFY
+static unsigned int watch_event_from_mask(uint32_t mask) {
+    if (mask & IN_CLOSE_WRITE) return WATCH_CLOSE_WRITE;
+    if (mask & IN_MODIFY) return WATCH_MODIFY;
+    if (mask & IN_ATTRIB) return WATCH_ATTRIB;
+    if (mask & IN_CREATE) return WATCH_CREATE;
+    if (mask & IN_DELETE) return WATCH_DELETE;
+    if (mask & (IN_MOVED_FROM | IN_MOVED_TO)) return WATCH_MOVE;
+    if (mask & (IN_DELETE_SELF | IN_MOVE_SELF)) return WATCH_GONE;
+    return 0;
+}
+
+static int watch_index_of(const struct watch_set *set, int wd) {
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+        if (set->entries[i].wd == wd) return i;
+    }
+    return -1;
+}
+
+static int watch_process_inotify(struct watch_set *set, watch_event_fn fn, void *ctx) {
+    char *buffer = malloc(WATCH_EVENT_BUFFER);
+    int reported = 0;
+    int last_index = -1;
+    unsigned int last_event = 0;
+    const char *last_name = NULL;
+    ssize_t len;
+
+    if (!buffer) return -1;
+    for (;;) {
+        char *p;
+
+        len = read(set->fd, buffer, WATCH_EVENT_BUFFER);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+
+        last_index = -1;
+        for (p = buffer; p < buffer + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            const char *name = ev->len ? ev->name : "";
+            int index = watch_index_of(set, ev->wd);
+            unsigned int event = watch_event_from_mask(ev->mask);
+
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_IGNORED) {
+                if (index >= 0) set->entries[index].wd = -1;
+                continue;
+            }
+            if (index < 0 || !event) continue;
+
+            // A burst of writes queues one IN_MODIFY per write; report it once
+            if (index == last_index && event == last_event && strcmp(name, last_name) == 0) {
+                continue;
+            }
+            fn(ctx, index, event, name);
+            reported++;
+            last_index = index;
+            last_event = event;
+            last_name = name;
+        }
+    }
+    free(buffer);
+    if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    return reported;
+}
+#endif
+
+// Poll fallback: compare each path with its last snapshot
+static int watch_process_poll(struct watch_set *set, watch_event_fn fn, void *ctx) {
+    int reported = 0;
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+        struct watch_entry *entry = &set->entries[i];
+        struct watch_entry before = *entry;
+
+        watch_snapshot(entry);
+        if (before.exists && !entry->exists) {
+            fn(ctx, i, WATCH_GONE, "");
+        } else if (!before.exists && entry->exists) {
+            fn(ctx, i, WATCH_CREATE, "");
+        } else if (entry->exists && (entry->mtime != before.mtime || entry->mtime_nsec != before.mtime_nsec ||
+                                     entry->size != before.size)) {
+            fn(ctx, i, WATCH_MODIFY, "");
+        } else {
+            continue;
+        }
+        reported++;
+    }
+    return reported;
+}
+
+int watch_process(struct watch_set *set, watch_event_fn fn, void *ctx) {
+#ifdef WATCH_INOTIFY
+    if (set->fd >= 0) return watch_process_inotify(set, fn, ctx);
+#endif
+    return watch_process_poll(set, fn, ctx);
+}
+
+const char *watch_event_name(unsigned int event) {
+    switch (event) {
+    case WATCH_MODIFY: return "MODIFY";
+    case WATCH_ATTRIB: return "ATTRIB";
+    case WATCH_CLOSE_WRITE: return "CLOSE_WRITE";
+    case WATCH_CREATE: return "CREATE";
+    case WATCH_DELETE: return "DELETE";
+    case WATCH_MOVE: return "MOVE";
+    case WATCH_GONE: return "GONE";
+    default: return "UNKNOWN";
+    }
+}
+
+void watch_close(struct watch_set *set) {
+    if (set->fd >= 0) close(set->fd);
+    set->fd = -1;
+    set->count = 0;
+}
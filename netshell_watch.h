@@ -0,0 +1,64 @@
+#ifndef NETSHELL_WATCH_H
+#define NETSHELL_WATCH_H
+
+#include <stdint.h>
+
+// File change notification used by WATCH.
+//
+// On Linux the paths are registered with inotify and the kernel queues
+// events on a descriptor the caller poll()s. Elsewhere (MorphOS) each path
+// is stat'ed every WATCH_POLL_INTERVAL_MS and changes in existence, size or
+// mtime are reported, so callers see the same events either way.
+
+#define WATCH_MAX_PATHS 64
+#define WATCH_PATH_MAX 512
+#define WATCH_POLL_INTERVAL_MS 500
+
+// Event types
+#define WATCH_MODIFY      0x01   // Contents changed
+#define WATCH_ATTRIB      0x02   // Metadata changed
+#define WATCH_CLOSE_WRITE 0x04   // File opened for writing was closed
+#define WATCH_CREATE      0x08   // Entry created in a watched directory
+#define WATCH_DELETE      0x10   // Entry removed from a watched directory
+#define WATCH_MOVE        0x20   // Entry renamed into or out of a watched directory
+#define WATCH_GONE        0x40   // The watched path itself was removed or moved away
+
+struct watch_entry {
+    char path[WATCH_PATH_MAX];
+    int wd;             // inotify watch descriptor, -1 once gone
+    int exists;         // Polling state
+    int64_t mtime;
+    long mtime_nsec;
+    uint64_t size;
+};
+
+struct watch_set {
+    int fd;             // inotify descriptor, -1 when polling
+    int count;
+    struct watch_entry entries[WATCH_MAX_PATHS];
+};
+
+// Called once per event. index is the watch_add() index of the path and
+// name is the entry inside a watched directory ("" for the path itself).
+typedef void (*watch_event_fn)(void *ctx, int index, unsigned int event, const char *name);
+
+int watch_init(struct watch_set *set);
+
+// Start watching path. Returns its index, or -1 (errno set).
+int watch_add(struct watch_set *set, const char *path);
+
+// Descriptor to poll() for readability, or -1 if the set is polled on a timer
+int watch_fd(const struct watch_set *set);
+
+// poll() timeout to use between watch_process() calls (-1: wait for watch_fd)
+int watch_timeout_ms(const struct watch_set *set);
+
+// Collect pending changes and report them. Repeats of the same event within
+// one batch are coalesced. Returns the number reported, or -1 on error.
+int watch_process(struct watch_set *set, watch_event_fn fn, void *ctx);
+
+const char *watch_event_name(unsigned int event);
+
+void watch_close(struct watch_set *set);
+
+#endif